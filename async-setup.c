@@ -34,13 +34,16 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <sys/mount.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <glob.h>
 
 #include "wormhole.h"
 #include "tracing.h"
+#include "cgroup.h"
 #include "profiles.h"
 #include "config.h"
 #include "runtime.h"
@@ -48,18 +51,94 @@
 #include "socket.h"
 #include "util.h"
 
+typedef struct wormhole_async_env_waiter wormhole_async_env_waiter_t;
+struct wormhole_async_env_waiter {
+	wormhole_async_env_waiter_t *	next;
+
+	wormhole_environment_async_callback_fn_t *callback;
+	void *				closure;
+};
+
 typedef struct wormhole_async_env_ctx	wormhole_async_env_ctx_t;
+typedef struct wormhole_setup_worker	wormhole_setup_worker_t;
+
 struct wormhole_async_env_ctx {
 	wormhole_async_env_ctx_t **	prev;
 	wormhole_async_env_ctx_t *	next;
 
-	pid_t				child_pid;
+	/* The worker running the setup, until it has reported the exit status */
+	wormhole_setup_worker_t *	worker;
 	int				sock_id;
 
+	unsigned long long		started;
+
+	wormhole_environment_t *	env;
+
+	/* Container mounts we lent to the setup process */
+	unsigned int			images_lent;
+
+	/* Set when we know that the setup will not deliver a namespace */
+	bool				failed;
+
+	/* Waiting for wormhole_environment_async_finish() */
+	bool				completed;
+
+	/* Everyone who is waiting for this setup to complete */
+	wormhole_async_env_waiter_t *	waiters;
+};
+
+/*
+ * Setups are not forked off the daemon itself, which may have grown
+ * quite a bit by the time it sets up an environment. Instead, we start
+ * a pool of worker processes (wormholed --setup-worker) at launch, and
+ * hand each job to an idle worker, along with one end of a fresh
+ * socketpair. The worker forks a process that does the actual setup
+ * and passes the namespace fd back over that socket, then reports its
+ * exit status to us.
+ *
+ * Job records are tab separated: cgroup, owner uid, owner gid, the
+ * profile key to look up, and the environment name. If the key is
+ * empty, the environment comes from the global config file. These may
+ * be followed by <layer>=<path> fields for the container mounts we
+ * lend to the setup (see wormhole_environment_lend_images()).
+ * Status records are the decimal wait status, NUL terminated.
+ */
+struct wormhole_setup_worker {
+	pid_t				pid;
+	unsigned int			sock_id;
+	unsigned long long		started;
+
+	/* The job this worker is busy with, if any */
+	wormhole_async_env_ctx_t *	ctx;
+
+	/* Shut the worker down once it's done with its job */
+	bool				retire;
+};
+
+#define WORMHOLE_SETUP_JOB_MAX		(2 * PATH_MAX)
+
+/* Do not respawn a worker that died sooner than this (in seconds) until
+ * someone needs it */
+#define WORMHOLE_SETUP_WORKER_MIN_LIFETIME 10
+
+static struct {
+	unsigned int			size;
+	wormhole_setup_worker_t *	worker;
+	char **				argv;
+} wormhole_setup_pool;
+
+/* Environments whose setup completed, for wormhole_environment_async_complete() */
+struct wormhole_async_env_done {
+	struct wormhole_async_env_done *next;
 	wormhole_environment_t *	env;
 };
 
 static wormhole_async_env_ctx_t *	wormhole_async_env_ctx_list = NULL;
+static struct wormhole_async_env_done *	wormhole_async_env_done_list;
+static struct wormhole_async_env_done **wormhole_async_env_done_tail = &wormhole_async_env_done_list;
+static struct wormhole_async_setup_stats wormhole_async_setup_stats;
+
+static bool				wormhole_setup_worker_spawn(wormhole_setup_worker_t *);
 
 static inline void
 wormhole_async_env_ctx_insert(wormhole_async_env_ctx_t **pos, wormhole_async_env_ctx_t *ctx)
@@ -98,32 +177,65 @@ wormhole_async_env_ctx_new(wormhole_environment_t *env)
 	ctx = calloc(1, sizeof(*ctx));
 	ctx->env = env;
 
-	ctx->next = wormhole_async_env_ctx_list;
-	wormhole_async_env_ctx_list = ctx;
-
+	wormhole_async_env_ctx_insert(&wormhole_async_env_ctx_list, ctx);
 	return ctx;
 }
 
+/*
+ * Notify everyone waiting for this environment. We do this once our
+ * caller is done with a completed setup, or when we know that setup has
+ * failed.
+ */
 static void
-wormhole_async_env_ctx_release(wormhole_async_env_ctx_t *ctx)
+wormhole_async_env_ctx_wake(wormhole_async_env_ctx_t *ctx)
 {
-	if (ctx->child_pid == 0 && ctx->sock_id == 0) {
-		wormhole_async_env_ctx_unlink(ctx);
-		free(ctx);
+	wormhole_async_env_waiter_t *w;
+	unsigned int count = 0;
+
+	while ((w = ctx->waiters) != NULL) {
+		ctx->waiters = w->next;
+
+		w->callback(ctx->env, w->closure);
+		free(w);
+		count++;
 	}
+
+	if (count)
+		trace("Environment \"%s\": woke up %u waiter(s)", ctx->env->name, count);
 }
 
-static wormhole_async_env_ctx_t *
-wormhole_async_env_ctx_for_pid(pid_t pid)
+static void
+wormhole_async_env_ctx_free(wormhole_async_env_ctx_t *ctx)
 {
-	wormhole_async_env_ctx_t **pos, *ctx;
+	/* Make sure nobody is left hanging */
+	wormhole_async_env_ctx_wake(ctx);
 
-	for (pos = &wormhole_async_env_ctx_list; (ctx = *pos) != NULL; pos = &ctx->next) {
-		if (ctx->child_pid == pid)
-			return ctx;
+	wormhole_async_env_ctx_unlink(ctx);
+	free(ctx);
+}
+
+static void
+wormhole_async_env_ctx_release(wormhole_async_env_ctx_t *ctx)
+{
+	struct wormhole_async_env_done *done;
+
+	if (ctx->worker != NULL || ctx->sock_id != 0 || ctx->completed)
+		return;
+
+	/* Only report setups that actually got started */
+	if (!ctx->started) {
+		wormhole_async_env_ctx_free(ctx);
+		return;
 	}
 
-	return NULL;
+	/* Keep the context, and anyone waiting on it, until our caller
+	 * has picked up the environment. */
+	ctx->completed = true;
+
+	done = calloc(1, sizeof(*done));
+	done->env = ctx->env;
+	*wormhole_async_env_done_tail = done;
+	wormhole_async_env_done_tail = &done->next;
 }
 
 static wormhole_async_env_ctx_t *
@@ -139,6 +251,12 @@ wormhole_async_env_ctx_for_socket(const wormhole_socket_t *sock)
 	return NULL;
 }
 
+/*
+ * Environments are matched by name rather than by object. There may be
+ * several objects for the same environment (eg after a config file was
+ * reloaded), but there should only ever be one setup process (and one
+ * sub-daemon, whose socket name is derived from the environment name).
+ */
 static wormhole_async_env_ctx_t *
 wormhole_async_env_ctx_for_environment(wormhole_environment_t *env, bool create)
 {
@@ -147,6 +265,8 @@ wormhole_async_env_ctx_for_environment(wormhole_environment_t *env, bool create)
 	for (ctx = wormhole_async_env_ctx_list; ctx; ctx = ctx->next) {
 		if (ctx->env == env)
 			return ctx;
+		if (strutil_equal(ctx->env->name, env->name) && ctx->env->owner_uid == env->owner_uid)
+			return ctx;
 	}
 
 	if (create)
@@ -157,14 +277,45 @@ wormhole_async_env_ctx_for_environment(wormhole_environment_t *env, bool create)
 
 /*
  * Server side socket handler for receiving namespace fds passed back to us by
- * the async profile setup code.
+ * the async profile setup code. Along with the fd, the setup process sends
+ * a list of NUL terminated strings: the root directory of the environment,
+ * a <layer>=<path> string for each container it mounted itself, and an
+ * empty string to terminate the list.
  */
 static bool
 wormhole_environment_fd_received(wormhole_socket_t *s, struct buf *bp, int fd)
 {
+	char *image_mount[WORMHOLE_ENVIRONMENT_LAYER_MAX] = { NULL };
 	wormhole_async_env_ctx_t *ctx;
+	char msg[2 * PATH_MAX], *root_dir, *str, *end;
+	unsigned long len;
 
 	trace("%s(sock_id=%d)", __func__, s->id);
+
+	len = buf_get(bp, msg, sizeof(msg));
+	for (root_dir = str = msg; true; str = end + 1) {
+		if ((end = memchr(str, '\0', msg + len - str)) == NULL) {
+			if (len == sizeof(msg)) {
+				log_error("%s: bad message from setup process", __func__);
+				wormhole_socket_fail(s);
+			}
+
+			/* Incomplete, wait for more */
+			return false;
+		}
+
+		if (str != root_dir) {
+			unsigned int layer;
+
+			if (str == end)
+				break;
+
+			layer = strtoul(str, &str, 10);
+			if (*str++ == '=' && layer < WORMHOLE_ENVIRONMENT_LAYER_MAX)
+				image_mount[layer] = str;
+		}
+	}
+
 	if (fd < 0) {
 		log_error("%s: missing file descriptor from client", __func__);
 		return false;
@@ -174,12 +325,26 @@ wormhole_environment_fd_received(wormhole_socket_t *s, struct buf *bp, int fd)
 	if (ctx == NULL)
 		return false;
 
+	if (root_dir[0])
+		wormhole_environment_set_root_directory(ctx->env, root_dir);
+
+	wormhole_environment_adopt_images(ctx->env, ctx->images_lent, image_mount);
+	ctx->images_lent = 0;
+
+	ctx->env->setup_usec = timeutil_monotonic_usec() - ctx->started;
+	timeutil_histogram_add(&wormhole_async_setup_stats.duration, ctx->env->setup_usec);
+	trace("Environment \"%s\": setup took %llu usec", ctx->env->name, ctx->env->setup_usec);
+
 	/* We need to dup the file descriptor, as our caller will close it */
 	wormhole_environment_set_fd(ctx->env, dup(fd));
-	buf_zap(bp);
+	buf_chain_advance(bp, buf_chain_available(bp));
 
 	ctx->sock_id = 0;
 
+	/* Do not wake up anyone yet. The namespace is there, but our caller
+	 * may still have to start serving it (see
+	 * wormhole_environment_async_finish()). */
+
 	/* If we've collected both the child exit status and the response from the
 	 * socket, we can release this context. */
 	wormhole_async_env_ctx_release(ctx);
@@ -187,16 +352,48 @@ wormhole_environment_fd_received(wormhole_socket_t *s, struct buf *bp, int fd)
 	return true;
 }
 
+/*
+ * The setup process went away without sending us a namespace fd.
+ * Do not wait for the worker to report its exit status; it may take
+ * a while, and its status may not even tell us that something went wrong.
+ */
+static void
+wormhole_environment_fd_closed(wormhole_socket_t *s)
+{
+	wormhole_async_env_ctx_t *ctx;
+
+	/* Nothing to do if we received the fd already */
+	if ((ctx = wormhole_async_env_ctx_for_socket(s)) == NULL)
+		return;
+
+	log_error("Environment \"%s\": setup process closed its socket without sending a namespace fd",
+			ctx->env->name);
+	ctx->sock_id = 0;
+	ctx->failed = true;
+	ctx->env->failed = true;
+
+	wormhole_environment_release_images(ctx->env, ctx->images_lent);
+	ctx->images_lent = 0;
+
+	wormhole_async_env_ctx_wake(ctx);
+	wormhole_async_env_ctx_release(ctx);
+}
+
 static wormhole_socket_t *
 wormhole_environment_create_fd_receiver(int fd)
 {
 	static struct wormhole_app_ops app_ops = {
 		.received = wormhole_environment_fd_received,
-		// .closed = wormhole_environment_fd_closed,
+		.closed = wormhole_environment_fd_closed,
 	};
 	wormhole_socket_t *sock;
 
 	sock = wormhole_connected_socket_new(fd, 0, 0);
+	if (sock == NULL) {
+		close(fd);
+		return NULL;
+	}
+
 	sock->app_ops = &app_ops;
 
 	return sock;
@@ -215,44 +412,113 @@ wormhole_environment_async_check(wormhole_environment_t *env)
 }
 
 /*
- * Start async setup for this environment
+ * Wait for the async setup of this environment to complete. The callback
+ * is invoked when the namespace fd has been received, or when setup failed.
+ * Returns false if no setup is in progress.
  */
-wormhole_socket_t *
-wormhole_environment_async_setup(wormhole_environment_t *env, wormhole_profile_t *profile)
+bool
+wormhole_environment_async_wait(wormhole_environment_t *env, wormhole_environment_async_callback_fn_t *callback, void *closure)
 {
 	wormhole_async_env_ctx_t *ctx;
-	pid_t pid;
-	int nsfd, sock_fd;
+	wormhole_async_env_waiter_t *w;
 
-	ctx = wormhole_async_env_ctx_for_environment(env, true);
-	if (ctx->child_pid || ctx->sock_id) {
-		log_error("Async setup for env %s already in progress", env->name);
-		return NULL;
+	if (!(ctx = wormhole_async_env_ctx_for_environment(env, false)))
+		return false;
+
+	w = calloc(1, sizeof(*w));
+	w->callback = callback;
+	w->closure = closure;
+
+	w->next = ctx->waiters;
+	ctx->waiters = w;
+	return true;
+}
+
+/*
+ * Stop waiting, eg because the client went away.
+ */
+void
+wormhole_environment_async_cancel_wait(wormhole_environment_t *env, void *closure)
+{
+	wormhole_async_env_waiter_t **pos, *w;
+	wormhole_async_env_ctx_t *ctx;
+
+	if (!(ctx = wormhole_async_env_ctx_for_environment(env, false)))
+		return;
+
+	for (pos = &ctx->waiters; (w = *pos) != NULL; ) {
+		if (w->closure == closure) {
+			*pos = w->next;
+			free(w);
+		} else {
+			pos = &w->next;
+		}
 	}
+}
 
-	pid = procutil_fork_with_socket(&sock_fd);
-	if (pid < 0)
-		return NULL;
+/*
+ * Runs in the process forked by the setup worker. This never returns.
+ */
+static void
+wormhole_setup_worker_child(wormhole_environment_t *env, wormhole_profile_t *profile, const char *cgroup,
+			char *lent, int sock_fd)
+{
+	char msg[2 * PATH_MAX];
+	unsigned int i, len, borrowed = 0;
+	bool userns = false;
+	int nsfd;
 
-	if (pid > 0) {
-		wormhole_socket_t *sock;
+	/* Use the container mounts the daemon already has */
+	while (lent && *lent) {
+		char *next = strchr(lent, '\t');
 
-		sock = wormhole_environment_create_fd_receiver(sock_fd);
+		if (next)
+			*next++ = '\0';
 
-		ctx->child_pid = pid;
-		ctx->sock_id = sock->id;
+		i = strtoul(lent, &lent, 10);
+		if (*lent++ == '=' && wormhole_environment_borrow_image(env, i, lent))
+			borrowed |= 1U << i;
+		lent = next;
+	}
+
+	/* Join the cgroup while we're still root, and before starting any
+	 * processes that should be accounted to the environment. If this
+	 * fails, we just stay in the daemon's cgroup. */
+	if (cgroup)
+		wormhole_cgroup_attach(cgroup);
 
-		return sock;
+	/* For unprivileged users, we set up the environment inside a user
+	 * namespace owned by them, exactly like the wormhole client would
+	 * do. Otherwise, they would not be able to join it. */
+	if (env->owner_uid != 0) {
+		if (!procutil_drop_privileges(env->owner_uid, env->owner_gid))
+			log_fatal("Failed to set up environment for %s", profile->name);
+		userns = true;
 	}
 
-	if (wormhole_profile_setup(profile, false) < 0)
+	if (wormhole_profile_setup(profile, userns) < 0)
                 log_fatal("Failed to set up environment for %s", profile->name);
 
         nsfd = open("/proc/self/ns/mnt", O_RDONLY);
         if (nsfd < 0)
                 log_fatal("Cannot open /proc/self/ns/mnt: %m");
 
-	if (wormhole_socket_sendmsg(sock_fd, "", 1, nsfd) < 0)
+	len = snprintf(msg, sizeof(msg), "%s", env->root_directory?: "") + 1;
+
+	/* Hand the container mounts we made over to the daemon */
+	for (i = 0; i < env->nlayers && len < sizeof(msg); ++i) {
+		const char *mount_point;
+
+		if ((borrowed & (1U << i)) || !(mount_point = wormhole_environment_image_mount_point(env, i)))
+			continue;
+		len += snprintf(msg + len, sizeof(msg) - len, "%u=%s", i, mount_point) + 1;
+	}
+
+	if (len >= sizeof(msg))
+		log_fatal("unable to send namespace fd to parent: message too long");
+	msg[len++] = '\0';
+
+	if (wormhole_socket_sendmsg(sock_fd, msg, len, nsfd) < 0)
 		log_fatal("unable to send namespace fd to parent: %m");
 
 	trace("Successfully set up environment \"%s\"", env->name);
@@ -260,27 +526,144 @@ wormhole_environment_async_setup(wormhole_environment_t *env, wormhole_profile_t
 }
 
 /*
- * Async setup: the child process exited.
+ * Runs in the setup worker: find the environment, and set it up in a
+ * child process. Returns the wait status of that process.
  */
-wormhole_environment_t *
-wormhole_environment_async_complete(pid_t pid, int status)
+static int
+wormhole_setup_worker_job(char *record, int sock_fd)
 {
+	char *field[5], *lent = NULL, *s = record;
+	wormhole_profile_t tmp_profile, *profile;
 	wormhole_environment_t *env;
-	wormhole_async_env_ctx_t *ctx;
+	unsigned int i;
+	int status;
+	pid_t pid;
 
-	if (!(ctx = wormhole_async_env_ctx_for_pid(pid)))
-		return NULL;
+	for (i = 0; i < 5; ++i) {
+		field[i] = s;
+		if ((s = strchr(s, '\t')) == NULL)
+			break;
+		*s++ = '\0';
+	}
+
+	/* Anything after the environment name is lent container mounts */
+	if (i == 5)
+		lent = s;
+	else if (i == 4)
+		i++;
+
+	if (i < 5 || sock_fd < 0) {
+		log_error("Bad job record from daemon");
+		return W_EXITCODE(2, 0);
+	}
 
-	ctx->child_pid = 0;
-	env = ctx->env;
+	if (field[3][0]) {
+		profile = wormhole_profile_find_for_user(field[3], strtoul(field[1], NULL, 10), strtoul(field[2], NULL, 10));
+		if (profile == NULL || profile->environment == NULL
+		 || !strutil_equal(profile->environment->name, field[4])) {
+			log_error("%s: no environment \"%s\"", field[3], field[4]);
+			return W_EXITCODE(1, 0);
+		}
+		env = profile->environment;
+	} else {
+		if (!(env = wormhole_environment_find(field[4]))) {
+			log_error("No environment \"%s\"", field[4]);
+			return W_EXITCODE(1, 0);
+		}
+
+		memset(&tmp_profile, 0, sizeof(tmp_profile));
+		tmp_profile.name = env->name;
+		tmp_profile.environment = env;
+		profile = &tmp_profile;
+	}
+
+	if ((pid = fork()) < 0) {
+		log_error("Unable to fork setup process: %m");
+		return W_EXITCODE(1, 0);
+	}
+
+	if (pid == 0) {
+		wormhole_setup_worker_child(env, profile, field[0][0]? field[0] : NULL, lent, sock_fd);
+		/* NOTREACHED */
+	}
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			log_error("waitpid: %m");
+			return W_EXITCODE(1, 0);
+		}
+	}
+
+	return status;
+}
+
+/*
+ * wormholed --setup-worker <fd>: run the jobs the daemon sends us, one
+ * at a time, until it goes away.
+ */
+int
+wormhole_setup_worker_main(int control_fd)
+{
+	char record[WORMHOLE_SETUP_JOB_MAX];
+	int len;
+
+	/* Do not leak the control socket to podman and friends */
+	fcntl(control_fd, F_SETFD, FD_CLOEXEC);
+
+	while (true) {
+		char reply[16];
+		int sock_fd = -1, status;
+
+		len = wormhole_socket_recvmsg(control_fd, record, sizeof(record) - 1, &sock_fd);
+		if (len <= 0) {
+			if (len < 0)
+				log_error("Setup worker: unable to receive job: %m");
+			break;
+		}
+
+		record[len] = '\0';
+		status = wormhole_setup_worker_job(record, sock_fd);
+		if (sock_fd >= 0)
+			close(sock_fd);
+
+		len = snprintf(reply, sizeof(reply), "%d", status) + 1;
+		if (wormhole_socket_sendmsg(control_fd, reply, len, -1) != len) {
+			log_error("Setup worker: unable to talk to daemon: %m");
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Setup is done, or failed. If the environment is ready, it's up to
+ * our caller to pick it up via wormhole_environment_async_complete().
+ */
+static void
+__wormhole_environment_async_complete(wormhole_async_env_ctx_t *ctx, int status)
+{
+	wormhole_environment_t *env = ctx->env;
+
+	ctx->worker = NULL;
 
 	if (!procutil_child_status_okay(status)) {
 		log_error("Environment \"%s\": setup process failed (%s)", env->name,
 				procutil_child_status_describe(status));
+		ctx->failed = true;
+	}
+
+	if (ctx->failed) {
 		env->failed = true;
+		wormhole_async_setup_stats.failed++;
 
 		/* Setup failed, don't bother waiting for anything on this socket */
 		ctx->sock_id = 0;
+
+		wormhole_environment_release_images(env, ctx->images_lent);
+		ctx->images_lent = 0;
+
+		wormhole_async_env_ctx_wake(ctx);
 	} else {
 		trace("Environment \"%s\": setup process complete", env->name);
 		env->failed = false;
@@ -289,7 +672,404 @@ wormhole_environment_async_complete(pid_t pid, int status)
 	/* If we've collected both the child exit status and the response from the
 	 * socket, we can release this context. */
 	wormhole_async_env_ctx_release(ctx);
+}
+
+static wormhole_setup_worker_t *
+wormhole_setup_worker_for_socket(const wormhole_socket_t *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < wormhole_setup_pool.size; ++i) {
+		wormhole_setup_worker_t *w = &wormhole_setup_pool.worker[i];
+
+		if (w->pid && w->sock_id == s->id)
+			return w;
+	}
+	return NULL;
+}
+
+/*
+ * Stop using this worker. Once we shut down the control socket, the
+ * worker exits, and the socket code cleans up our end. We may be
+ * called from the socket's own callback, so we must not free it here.
+ */
+static void
+wormhole_setup_worker_forget(wormhole_setup_worker_t *w)
+{
+	wormhole_socket_t *s;
+
+	if (w->sock_id && (s = wormhole_socket_find(w->sock_id)) != NULL)
+		shutdown(s->fd, SHUT_RDWR);
+
+	memset(w, 0, sizeof(*w));
+}
+
+static bool
+wormhole_setup_worker_status(wormhole_socket_t *s, struct buf *bp, int fd)
+{
+	char record[16], *end;
+	wormhole_setup_worker_t *w;
+	bool consumed = false;
+	unsigned long len;
+
+	while ((len = buf_get(bp, record, sizeof(record))) != 0) {
+		wormhole_async_env_ctx_t *ctx;
+
+		if ((end = memchr(record, '\0', len)) == NULL) {
+			if (len == sizeof(record)) {
+				log_error("%s: bad record from setup worker", __func__);
+				wormhole_socket_fail(s);
+			}
+			break;
+		}
+
+		buf_chain_advance(bp, end - record + 1);
+		consumed = true;
+
+		/* A worker we have retired */
+		if (!(w = wormhole_setup_worker_for_socket(s)))
+			continue;
+
+		if ((ctx = w->ctx) != NULL) {
+			w->ctx = NULL;
+			__wormhole_environment_async_complete(ctx, strtol(record, NULL, 10));
+		}
+
+		if (w->retire) {
+			trace("Retiring setup worker %d", w->pid);
+			wormhole_setup_worker_forget(w);
+			wormhole_setup_worker_spawn(w);
+		}
+	}
+
+	return consumed;
+}
+
+static bool
+wormhole_setup_worker_spawn(wormhole_setup_worker_t *w)
+{
+	static struct wormhole_app_ops worker_ops = {
+		.received = wormhole_setup_worker_status,
+	};
+	wormhole_socket_t *sock;
+	char fdbuf[16];
+	unsigned int argc;
+	pid_t pid;
+	int fd;
+
+	pid = procutil_fork_with_socket(&fd);
+	if (pid < 0) {
+		log_error("Failed to start setup worker");
+		return false;
+	}
+
+	if (pid == 0) {
+		char *argv[64];
+
+		/* Workers live long, and are restarted at any time; do not let
+		 * them hold on to client connections or other jobs' sockets. */
+		procutil_close_fds_except(fd);
+
+		snprintf(fdbuf, sizeof(fdbuf), "%d", fd);
+		for (argc = 0; wormhole_setup_pool.argv[argc] && argc < 60; ++argc)
+			argv[argc] = wormhole_setup_pool.argv[argc];
+		argv[argc++] = "--setup-worker";
+		argv[argc++] = fdbuf;
+		argv[argc] = NULL;
+
+		execv(argv[0], argv);
+		log_error("Failed to start %s: %m", argv[0]);
+		exit(22);
+	}
+
+	/* Do not leak the control socket to the other workers */
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	if (!(sock = wormhole_connected_socket_new(fd, 0, 0))) {
+		/* The worker will exit right away */
+		close(fd);
+		return false;
+	}
+
+	sock->app_ops = &worker_ops;
+	wormhole_install_socket(sock);
+
+	w->pid = pid;
+	w->sock_id = sock->id;
+	w->started = timeutil_monotonic_usec();
+	trace("Started setup worker %d", pid);
+	return true;
+}
+
+/*
+ * Start the worker pool. argv is the command to run, minus the
+ * --setup-worker argument.
+ */
+bool
+wormhole_environment_async_pool_init(unsigned int size, char **argv)
+{
+	unsigned int i, count = 0;
+
+	wormhole_setup_pool.size = size;
+	wormhole_setup_pool.worker = calloc(size, sizeof(wormhole_setup_worker_t));
+	wormhole_setup_pool.argv = argv;
+
+	for (i = 0; i < size; ++i) {
+		if (wormhole_setup_worker_spawn(&wormhole_setup_pool.worker[i]))
+			count++;
+	}
+
+	return count != 0;
+}
+
+/*
+ * Replace all workers, eg because the global config changed and they
+ * would still use the old one.
+ */
+void
+wormhole_environment_async_pool_restart(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < wormhole_setup_pool.size; ++i) {
+		wormhole_setup_worker_t *w = &wormhole_setup_pool.worker[i];
+
+		if (w->pid == 0)
+			continue;
+
+		if (w->ctx) {
+			w->retire = true;
+		} else {
+			wormhole_setup_worker_forget(w);
+			wormhole_setup_worker_spawn(w);
+		}
+	}
+}
+
+/*
+ * Find an idle worker, starting one if a slot is free.
+ */
+static wormhole_setup_worker_t *
+wormhole_setup_worker_get(bool spawn)
+{
+	wormhole_setup_worker_t *empty = NULL;
+	unsigned int i;
+
+	for (i = 0; i < wormhole_setup_pool.size; ++i) {
+		wormhole_setup_worker_t *w = &wormhole_setup_pool.worker[i];
+
+		if (w->pid == 0) {
+			if (empty == NULL)
+				empty = w;
+		} else if (w->ctx == NULL && !w->retire) {
+			return w;
+		}
+	}
+
+	if (empty && spawn && !wormhole_setup_worker_spawn(empty))
+		return NULL;
+
+	return empty;
+}
+
+/*
+ * The setup pool limits the number of setups running at the same time.
+ */
+bool
+wormhole_environment_async_available(void)
+{
+	return wormhole_setup_worker_get(false) != NULL;
+}
 
+/*
+ * A child process exited. Returns true if it was one of our workers.
+ */
+bool
+wormhole_environment_async_child_exited(pid_t pid, int status)
+{
+	wormhole_async_env_ctx_t *ctx;
+	wormhole_setup_worker_t *w = NULL;
+	unsigned long long lifetime;
+	unsigned int i;
+
+	for (i = 0; i < wormhole_setup_pool.size && w == NULL; ++i) {
+		if (wormhole_setup_pool.worker[i].pid == pid)
+			w = &wormhole_setup_pool.worker[i];
+	}
+
+	if (w == NULL)
+		return false;
+
+	log_warning("Setup worker %d %s", pid, procutil_child_status_describe(status));
+	wormhole_async_setup_stats.worker_deaths++;
+
+	lifetime = timeutil_monotonic_usec() - w->started;
+	if ((ctx = w->ctx) != NULL) {
+		w->ctx = NULL;
+		__wormhole_environment_async_complete(ctx, procutil_child_status_okay(status)? W_EXITCODE(1, 0) : status);
+	}
+
+	wormhole_setup_worker_forget(w);
+
+	/* If it died right away, something is wrong; wait until we need it */
+	if (lifetime >= WORMHOLE_SETUP_WORKER_MIN_LIFETIME * 1000000ULL)
+		wormhole_setup_worker_spawn(w);
+
+	return true;
+}
+
+/*
+ * Pick up the next environment whose setup has completed, successfully
+ * or not. Requests waiting for it are answered once the caller passes it
+ * to wormhole_environment_async_finish().
+ */
+wormhole_environment_t *
+wormhole_environment_async_complete(void)
+{
+	struct wormhole_async_env_done *done;
+	wormhole_environment_t *env;
+
+	if ((done = wormhole_async_env_done_list) == NULL)
+		return NULL;
+
+	if ((wormhole_async_env_done_list = done->next) == NULL)
+		wormhole_async_env_done_tail = &wormhole_async_env_done_list;
+
+	env = done->env;
+	free(done);
 	return env;
 }
 
+/*
+ * Our caller is done with an environment it got from
+ * wormhole_environment_async_complete(). Answer everyone who's been
+ * waiting for it in one go.
+ */
+void
+wormhole_environment_async_finish(wormhole_environment_t *env)
+{
+	wormhole_async_env_ctx_t *ctx;
+
+	for (ctx = wormhole_async_env_ctx_list; ctx; ctx = ctx->next) {
+		if (ctx->env == env && ctx->completed) {
+			wormhole_async_env_ctx_free(ctx);
+			return;
+		}
+	}
+}
+
+/*
+ * Start async setup for this environment
+ */
+wormhole_socket_t *
+wormhole_environment_async_setup(wormhole_environment_t *env, wormhole_profile_t *profile)
+{
+	const char *image_mount[WORMHOLE_ENVIRONMENT_LAYER_MAX];
+	char record[WORMHOLE_SETUP_JOB_MAX];
+	const char *key = NULL;
+	wormhole_async_env_ctx_t *ctx;
+	wormhole_setup_worker_t *w;
+	wormhole_socket_t *sock, *control;
+	unsigned int i, lent;
+	int fdpair[2], len;
+
+	ctx = wormhole_async_env_ctx_for_environment(env, true);
+	if (ctx->worker || ctx->sock_id || ctx->completed) {
+		log_error("Async setup for env %s already in progress", env->name);
+		return NULL;
+	}
+
+	if (!(w = wormhole_setup_worker_get(true)) || !(control = wormhole_socket_find(w->sock_id))) {
+		log_error("No setup worker available for env %s", env->name);
+		wormhole_async_env_ctx_release(ctx);
+		return NULL;
+	}
+
+	if (env->cgroup == NULL && wormhole_cgroup_enabled()) {
+		char namebuf[256];
+
+		if (env->owner_uid)
+			snprintf(namebuf, sizeof(namebuf), "env.%s@%d", env->name, env->owner_uid);
+		else
+			snprintf(namebuf, sizeof(namebuf), "env.%s", env->name);
+		env->cgroup = wormhole_cgroup_create(namebuf);
+	}
+
+	/* The worker looks up the profile the same way we did */
+	if (profile->config)
+		key = profile->config->wrapper?: profile->config->name;
+
+	len = snprintf(record, sizeof(record), "%s\t%d\t%d\t%s\t%s",
+			env->cgroup?: "", env->owner_uid, env->owner_gid, key?: "", env->name);
+
+	lent = wormhole_environment_lend_images(env, image_mount);
+	for (i = 0; i < env->nlayers && len < sizeof(record); ++i) {
+		if (lent & (1U << i))
+			len += snprintf(record + len, sizeof(record) - len, "\t%u=%s", i, image_mount[i]);
+	}
+	len++;
+
+	if (len > sizeof(record)) {
+		log_error("Environment %s: job record too long", env->name);
+		goto failed;
+	}
+
+	if (socketpair(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, fdpair) < 0) {
+		log_error("%s: socketpair failed: %m", __func__);
+		goto failed;
+	}
+
+	/* Once the worker has the job, there's no taking it back; so make
+	 * sure we are able to receive the result before sending it. */
+	if (!(sock = wormhole_environment_create_fd_receiver(fdpair[0]))) {
+		log_error("Environment %s: unable to create socket for setup process", env->name);
+		close(fdpair[1]);
+		goto failed;
+	}
+
+	if (wormhole_socket_sendmsg(control->fd, record, len, fdpair[1]) != len) {
+		log_error("Unable to send job to setup worker %d: %m", w->pid);
+		close(fdpair[1]);
+		wormhole_socket_free(sock);
+		goto failed;
+	}
+	close(fdpair[1]);
+
+	w->ctx = ctx;
+	ctx->worker = w;
+	ctx->sock_id = sock->id;
+	ctx->failed = false;
+	ctx->started = timeutil_monotonic_usec();
+	ctx->images_lent = lent;
+
+	wormhole_async_setup_stats.started++;
+	trace("Environment \"%s\": setup handed to worker %d", env->name, w->pid);
+
+	return sock;
+
+failed:
+	wormhole_environment_release_images(env, lent);
+	wormhole_async_env_ctx_release(ctx);
+	return NULL;
+}
+
+void
+wormhole_environment_async_get_stats(struct wormhole_async_setup_stats *stats)
+{
+	wormhole_async_env_ctx_t *ctx;
+	unsigned int i;
+
+	*stats = wormhole_async_setup_stats;
+
+	stats->in_progress = 0;
+	for (ctx = wormhole_async_env_ctx_list; ctx; ctx = ctx->next) {
+		if (ctx->worker)
+			stats->in_progress++;
+	}
+
+	stats->workers = 0;
+	for (i = 0; i < wormhole_setup_pool.size; ++i) {
+		if (wormhole_setup_pool.worker[i].pid)
+			stats->workers++;
+	}
+}
@@ -19,6 +19,7 @@
  */
 
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
@@ -84,8 +85,11 @@ struct strutil_array	opt_requires;
 static int		wormhole_auto_profile(const char *);
 static void		usage(int exval);
 
+struct tree_index;
+
 struct autoprofile_state {
 	wormhole_tree_state_t *		tree;
+	struct tree_index *		index;
 
 	struct wormhole_config *	config;
 	struct wormhole_layer_config *	_layer;
@@ -419,6 +423,267 @@ __build_path(wormhole_tree_state_t *tree, const char *path)
 	return __make_path(wormhole_tree_state_get_root(tree), path);
 }
 
+/*
+ * We scan the image tree once, and have all actions as well as the check
+ * for stray files work on this in-memory copy.
+ * Directories that live on a different file system, or that we cannot
+ * read, are recorded as opaque; when an action needs to look at anything
+ * at or below them, or needs to follow a symlink, we fall back to asking
+ * the file system.
+ */
+struct tree_index_node {
+	struct tree_index_node *parent;
+	struct tree_index_node *next;
+	struct tree_index_node *children;
+	struct tree_index_node **tail;
+	unsigned int		nchildren;
+
+	unsigned char		d_type;
+	bool			other_fs;
+	bool			unreadable;
+
+	char			name[];
+};
+
+struct tree_index {
+	struct tree_index_node *root;
+	unsigned int		count;
+};
+
+static inline bool
+tree_index_node_is_opaque(const struct tree_index_node *node)
+{
+	return node->other_fs || node->unreadable;
+}
+
+static struct tree_index_node *
+tree_index_node_new(struct tree_index_node *parent, const char *name, unsigned char d_type)
+{
+	struct tree_index_node *node;
+	size_t len = strlen(name);
+
+	node = calloc(1, sizeof(*node) + len + 1);
+	memcpy(node->name, name, len + 1);
+	node->d_type = d_type;
+	node->tail = &node->children;
+
+	if (parent) {
+		node->parent = parent;
+		*(parent->tail) = node;
+		parent->tail = &node->next;
+		parent->nchildren += 1;
+	}
+
+	return node;
+}
+
+static void
+tree_index_node_free(struct tree_index_node *node)
+{
+	struct tree_index_node *child;
+
+	while ((child = node->children) != NULL) {
+		node->children = child->next;
+		tree_index_node_free(child);
+	}
+	free(node);
+}
+
+static void
+__tree_index_scan(struct tree_index *index, struct tree_index_node *dir, int dirfd, dev_t dev, char *path, size_t path_len)
+{
+	struct dirent *d;
+	DIR *dp;
+
+	if (!(dp = fdopendir(dirfd))) {
+		trace("%s: cannot read directory: %m", path);
+		dir->unreadable = true;
+		close(dirfd);
+		return;
+	}
+
+	while ((d = readdir(dp)) != NULL) {
+		struct tree_index_node *node;
+		unsigned char d_type = d->d_type;
+		struct stat stb;
+		int childfd;
+
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+
+		if (d_type == DT_UNKNOWN) {
+			if (fstatat(dirfd, d->d_name, &stb, AT_SYMLINK_NOFOLLOW) < 0)
+				continue;
+			d_type = IFTODT(stb.st_mode);
+		}
+
+		node = tree_index_node_new(dir, d->d_name, d_type);
+		index->count += 1;
+
+		if (d_type != DT_DIR)
+			continue;
+
+		childfd = openat(dirfd, d->d_name, O_RDONLY|O_NOCTTY|O_NONBLOCK|O_NOFOLLOW|O_DIRECTORY);
+		if (childfd < 0 || fstat(childfd, &stb) < 0) {
+			trace("%s/%s: unable to open directory: %m", path, d->d_name);
+			node->unreadable = true;
+		} else if (stb.st_dev != dev) {
+			node->other_fs = true;
+		} else {
+			size_t name_len = strlen(d->d_name);
+
+			if (path_len + name_len + 2 > PATH_MAX) {
+				log_error("%s/%s: path name too long", path, d->d_name);
+				node->unreadable = true;
+				close(childfd);
+				continue;
+			}
+
+			path[path_len] = '/';
+			memcpy(path + path_len + 1, d->d_name, name_len + 1);
+			__tree_index_scan(index, node, childfd, dev, path, path_len + 1 + name_len);
+			path[path_len] = '\0';
+			continue;
+		}
+
+		if (childfd >= 0)
+			close(childfd);
+	}
+
+	closedir(dp);
+}
+
+static struct tree_index *
+tree_index_build(const char *tree_root)
+{
+	char path[PATH_MAX];
+	struct tree_index *index;
+	struct stat stb;
+	int dirfd;
+
+	dirfd = open(tree_root, O_RDONLY|O_NOCTTY|O_DIRECTORY);
+	if (dirfd < 0 || fstat(dirfd, &stb) < 0) {
+		log_error("Unable to open %s: %m", tree_root);
+		if (dirfd >= 0)
+			close(dirfd);
+		return NULL;
+	}
+
+	index = calloc(1, sizeof(*index));
+	index->root = tree_index_node_new(NULL, "", DT_DIR);
+
+	strncpy(path, tree_root, sizeof(path) - 1);
+	path[sizeof(path) - 1] = '\0';
+	__tree_index_scan(index, index->root, dirfd, stb.st_dev, path, strlen(path));
+
+	trace("Indexed %u entries below %s", index->count, tree_root);
+	return index;
+}
+
+static void
+tree_index_free(struct tree_index *index)
+{
+	tree_index_node_free(index->root);
+	free(index);
+}
+
+/*
+ * Look up a path relative to the tree root. Returns NULL if the path
+ * does not exist. If the answer cannot be found in the index (because
+ * the path goes through a symlink or an opaque directory), *unknown is
+ * set to true.
+ */
+static struct tree_index_node *
+tree_index_lookup(const struct tree_index *index, const char *path, bool *unknown)
+{
+	struct tree_index_node *node = index->root;
+
+	*unknown = false;
+	while (true) {
+		struct tree_index_node *child;
+		size_t len;
+
+		while (*path == '/')
+			++path;
+		if (*path == '\0')
+			return node;
+
+		if (node->d_type != DT_DIR || tree_index_node_is_opaque(node)) {
+			*unknown = true;
+			return NULL;
+		}
+
+		len = strcspn(path, "/");
+		if (len == 1 && path[0] == '.') {
+			path += len;
+			continue;
+		}
+		if (len == 2 && path[0] == '.' && path[1] == '.') {
+			*unknown = true;
+			return NULL;
+		}
+
+		for (child = node->children; child; child = child->next) {
+			if (!strncmp(child->name, path, len) && child->name[len] == '\0')
+				break;
+		}
+
+		if (child == NULL)
+			return NULL;
+
+		node = child;
+		path += len;
+	}
+}
+
+static bool
+__tree_isdir(const struct autoprofile_state *state, const char *arg)
+{
+	const struct tree_index_node *node;
+	bool unknown;
+
+	node = tree_index_lookup(state->index, arg, &unknown);
+	if (unknown)
+		return fsutil_isdir(__build_path(state->tree, arg));
+	return node && node->d_type == DT_DIR;
+}
+
+static bool
+__tree_exists_nofollow(const struct autoprofile_state *state, const char *arg)
+{
+	const struct tree_index_node *node;
+	bool unknown;
+
+	node = tree_index_lookup(state->index, arg, &unknown);
+	if (unknown)
+		return fsutil_exists_nofollow(__build_path(state->tree, arg));
+	return node != NULL;
+}
+
+static bool
+__tree_exists(const struct autoprofile_state *state, const char *arg)
+{
+	const struct tree_index_node *node;
+	bool unknown;
+
+	node = tree_index_lookup(state->index, arg, &unknown);
+	if (unknown || (node && node->d_type == DT_LNK))
+		return fsutil_exists(__build_path(state->tree, arg));
+	return node != NULL;
+}
+
+static bool
+__tree_dir_is_empty(const struct autoprofile_state *state, const char *arg)
+{
+	const struct tree_index_node *node;
+	bool unknown;
+
+	node = tree_index_lookup(state->index, arg, &unknown);
+	if (unknown || (node && (node->d_type == DT_LNK || tree_index_node_is_opaque(node))))
+		return fsutil_dir_is_empty(__build_path(state->tree, arg));
+	return node && node->d_type == DT_DIR && node->nchildren == 0;
+}
+
 struct dir_disposition {
 	bool			ignore_empty;
 	bool			ignore_empty_descendants;
@@ -446,9 +711,8 @@ static bool
 perform_ignore(struct autoprofile_state *state, const char *arg)
 {
 	wormhole_tree_state_t *tree = state->tree;
-	const char *path = __build_path(tree, arg);
 
-	if (fsutil_exists_nofollow(path)) {
+	if (__tree_exists_nofollow(state, arg)) {
 		if (!opt_quiet)
 			log_info("Actively ignoring %s", arg);
 		wormhole_tree_state_set_ignore(tree, arg);
@@ -514,7 +778,7 @@ perform_overlay(struct autoprofile_state *state, const char *arg)
 	wormhole_tree_state_t *tree = state->tree;
 	const char *path = __build_path(tree, arg);
 
-	if (!fsutil_isdir(path)) {
+	if (!__tree_isdir(state, arg)) {
 		log_error("Asked to overlay %s, but it does not exist", arg);
 		return false;
 	}
@@ -530,7 +794,7 @@ perform_bind(struct autoprofile_state *state, const char *arg)
 	wormhole_tree_state_t *tree = state->tree;
 	const char *path = __build_path(tree, arg);
 
-	if (!fsutil_isdir(path)) {
+	if (!__tree_isdir(state, arg)) {
 		log_error("Asked to bind %s, but it does not exist", arg);
 		return false;
 	}
@@ -540,15 +804,15 @@ perform_bind(struct autoprofile_state *state, const char *arg)
 }
 
 static inline bool
-__is_empty(wormhole_tree_state_t *tree, const char *arg, const char *path)
+__is_empty(struct autoprofile_state *state, const char *arg)
 {
-	if (!fsutil_isdir(path))
+	if (!__tree_isdir(state, arg))
 		return true;
 
-	if (fsutil_dir_is_empty(path)) {
+	if (__tree_dir_is_empty(state, arg)) {
 		if (!opt_quiet)
 			log_info("Ignoring empty directory %s", arg);
-		wormhole_tree_state_set_ignore(tree, arg);
+		wormhole_tree_state_set_ignore(state->tree, arg);
 		return true;
 	}
 
@@ -562,7 +826,7 @@ perform_overlay_unless_empty(struct autoprofile_state *state, const char *arg)
 	wormhole_tree_state_t *tree = state->tree;
 	const char *path = __build_path(tree, arg);
 
-	if (!__is_empty(tree, arg, path))
+	if (!__is_empty(state, arg))
 		__perform_overlay(tree, arg, layer, path);
 
 	return true;
@@ -575,7 +839,7 @@ perform_bind_unless_empty(struct autoprofile_state *state, const char *arg)
 	wormhole_tree_state_t *tree = state->tree;
 	const char *path = __build_path(tree, arg);
 
-	if (!__is_empty(tree, arg, path))
+	if (!__is_empty(state, arg))
 		__perform_bind(tree, arg, layer, path);
 
 	return true;
@@ -585,12 +849,11 @@ static bool
 perform_must_be_empty(struct autoprofile_state *state, const char *arg)
 {
 	wormhole_tree_state_t *tree = state->tree;
-	const char *path = __build_path(tree, arg);
 
-	if (!fsutil_isdir(path))
+	if (!__tree_isdir(state, arg))
 		return true;
 
-	if (fsutil_dir_is_empty(path)) {
+	if (__tree_dir_is_empty(state, arg)) {
 		if (!opt_quiet)
 			log_info("Ignoring empty directory %s", arg);
 		wormhole_tree_state_set_ignore(tree, arg);
@@ -607,13 +870,11 @@ perform_check_ldconfig(struct autoprofile_state *state, const char *arg)
 {
 	struct wormhole_layer_config *layer = autoprofile_state_get_layer(state);
 	wormhole_tree_state_t *tree = state->tree;
-	const char *path;
 
 	if (arg == NULL)
 		arg = "/etc/ld.so.cache";
-	path = __build_path(tree, arg);
 
-	if (fsutil_exists(path)) {
+	if (__tree_exists(state, arg)) {
 		if (!opt_quiet)
 			log_info("Found %s, configuring layer to use ldconfig", arg);
 		wormhole_tree_state_set_ignore(tree, arg);
@@ -627,10 +888,9 @@ perform_mount_tmpfs(struct autoprofile_state *state, const char *arg)
 {
 	struct wormhole_layer_config *layer = autoprofile_state_get_layer(state);
 	wormhole_tree_state_t *tree = state->tree;
-	const char *path = __build_path(tree, arg);
 	wormhole_path_info_t *pi;
 
-	if (!fsutil_isdir(path))
+	if (!__tree_isdir(state, arg))
 		return true;
 
 	if (!opt_quiet)
@@ -643,43 +903,65 @@ perform_mount_tmpfs(struct autoprofile_state *state, const char *arg)
 	return true;
 }
 
+static void
+__check_binary(struct autoprofile_state *state, const char *arg, const char *name)
+{
+	wormhole_tree_state_t *tree = state->tree;
+	struct wormhole_profile_config *profile;
+	char entry_path[PATH_MAX];
+
+	if (name[0] == '.')
+		return;
+
+	snprintf(entry_path, sizeof(entry_path), "%s/%s", arg, name);
+	if (!fsutil_is_executable(__build_path(tree, entry_path)))
+		return;
+
+	trace("Found binary %s", entry_path);
+
+	profile = calloc(1, sizeof(*profile));
+	strutil_set(&profile->name, name);
+	strutil_set(&profile->command, entry_path);
+	strutil_set(&profile->environment, autoprofile_state_environment_name(state));
+	strutil_set(&profile->wrapper, __make_path(opt_wrapper_directory, name));
+
+	profile->next = state->config->profiles;
+	state->config->profiles = profile;
+}
+
 static bool
 perform_check_binaries(struct autoprofile_state *state, const char *arg)
 {
-	wormhole_tree_state_t *tree = state->tree;
-	const char *path = __build_path(tree, arg);
+	const struct tree_index_node *node, *child;
 	DIR *dir;
 	struct dirent *d;
+	bool unknown;
 
 	if (!opt_wrapper_directory)
 		return true;
 
-	if (!(dir = opendir(path)))
+	node = tree_index_lookup(state->index, arg, &unknown);
+	if (node && node->d_type == DT_DIR && !tree_index_node_is_opaque(node)) {
+		__make_path_push();
+		/* Only regular files and symlinks can be executables, so
+		 * we need to stat those, but nothing else. */
+		for (child = node->children; child; child = child->next) {
+			if (child->d_type == DT_REG || child->d_type == DT_LNK)
+				__check_binary(state, arg, child->name);
+		}
+		__make_path_pop();
 		return true;
+	}
 
-	__make_path_push();
-	while ((d = readdir(dir)) != NULL) {
-		struct wormhole_profile_config *profile;
-		char entry_path[PATH_MAX];
-
-		if (d->d_name[0] == '.')
-			continue;
-
-		snprintf(entry_path, sizeof(entry_path), "%s/%s", arg, d->d_name);
-		if (!fsutil_is_executable(__build_path(tree, entry_path)))
-			continue;
-
-		trace("Found binary %s", entry_path);
+	if (!unknown && !(node && (node->d_type == DT_LNK || tree_index_node_is_opaque(node))))
+		return true;
 
-		profile = calloc(1, sizeof(*profile));
-		strutil_set(&profile->name, d->d_name);
-		strutil_set(&profile->command, entry_path);
-		strutil_set(&profile->environment, autoprofile_state_environment_name(state));
-		strutil_set(&profile->wrapper, __make_path(opt_wrapper_directory, d->d_name));
+	if (!(dir = opendir(__build_path(state->tree, arg))))
+		return true;
 
-		profile->next = state->config->profiles;
-		state->config->profiles = profile;
-	}
+	__make_path_push();
+	while ((d = readdir(dir)) != NULL)
+		__check_binary(state, arg, d->d_name);
 	__make_path_pop();
 
 	closedir(dir);
@@ -907,8 +1189,6 @@ struct stray_dir_level {
 };
 
 struct stray_state {
-	const char *		tree_root;
-	unsigned int		tree_root_len;
 	wormhole_tree_state_t *	tree;
 
 	struct stray_dir_level *current;
@@ -975,80 +1255,94 @@ __stray_leave_directory(struct stray_state *state)
 	return &ret_dir;
 }
 
-static int
-__check_for_stray_files_visitor(const char *dir_path, const struct dirent *d, int cbflags, void *closure)
+static bool
+__check_for_stray_files_dir(struct stray_state *state, const struct tree_index_node *dir, char *path, size_t path_len)
 {
-	struct stray_state *state = (struct stray_state *) closure;
-	const wormhole_path_state_t *path_state;
-	const char *d_path;
+	const struct tree_index_node *node;
+	bool ok = true;
 
-	d_path = __make_path(dir_path, d->d_name);
-	d_path += state->tree_root_len;
+	for (node = dir->children; node && ok; node = node->next) {
+		const wormhole_path_state_t *path_state;
+		size_t name_len = strlen(node->name);
+		const char *d_path = path;
 
-	path_state = wormhole_path_tree_get(state->tree, d_path);
+		if (path_len + name_len + 2 > PATH_MAX) {
+			log_error("%s/%s: path name too long", path, node->name);
+			return false;
+		}
+		path[path_len] = '/';
+		memcpy(path + path_len + 1, node->name, name_len + 1);
 
-	if (path_state && path_state->state != WORMHOLE_PATH_STATE_UNCHANGED)
-		return FTW_SKIP;
+		path_state = wormhole_path_tree_get(state->tree, d_path);
+		if (path_state && path_state->state != WORMHOLE_PATH_STATE_UNCHANGED)
+			goto next;
 
-	if (cbflags & FSUTIL_FTW_PRE_DESCENT) {
-		struct stray_dir_level *dir;
+		if (node->d_type == DT_DIR) {
+			struct stray_dir_level *level;
 
-		dir = __stray_enter_directory(state);
-		if (path_state && path_state->user_data) {
-			struct dir_disposition *disp = path_state->user_data;
+			/* Directories on other file systems are not our business */
+			if (node->other_fs)
+				goto next;
 
-			/* stick it into state->current */
-			if (disp->ignore_empty)
-				dir->disposition.ignore_empty = true;
-			if (disp->ignore_empty_descendants) {
-				dir->disposition.ignore_empty = true;
-				dir->disposition.ignore_empty_descendants = true;
+			if (node->unreadable) {
+				log_error("%s: unable to read directory", d_path);
+				ok = false;
+				goto next;
 			}
-		}
-		return FTW_CONTINUE;
-	}
 
-	if (d->d_type != DT_DIR) {
-		__stray_count(state, d_path, d->d_type);
-		return FTW_CONTINUE;
-	}
+			level = __stray_enter_directory(state);
+			if (path_state && path_state->user_data) {
+				struct dir_disposition *disp = path_state->user_data;
+
+				/* stick it into state->current */
+				if (disp->ignore_empty)
+					level->disposition.ignore_empty = true;
+				if (disp->ignore_empty_descendants) {
+					level->disposition.ignore_empty = true;
+					level->disposition.ignore_empty_descendants = true;
+				}
+			}
 
-	if (cbflags & FSUTIL_FTW_POST_DESCENT) {
-		struct stray_dir_level *dir = __stray_leave_directory(state);
+			ok = __check_for_stray_files_dir(state, node, path, path_len + 1 + name_len);
 
-		if (dir->stray_count == 0 && dir->disposition.ignore_empty_descendants) {
-			if (!opt_quiet)
-				log_info("Ignoring empty directory %s", d_path);
-			wormhole_tree_state_set_ignore(state->tree, d_path);
-			return FTW_CONTINUE;
-		}
-		if (dir->stray_children == 0 && dir->disposition.ignore_empty) {
-			if (!opt_quiet)
-				log_info("Ignoring empty directory %s", d_path);
-			wormhole_tree_state_set_ignore(state->tree, d_path);
-			return FTW_CONTINUE;
+			level = __stray_leave_directory(state);
+			if (level->stray_count == 0 && level->disposition.ignore_empty_descendants) {
+				if (!opt_quiet)
+					log_info("Ignoring empty directory %s", d_path);
+				wormhole_tree_state_set_ignore(state->tree, d_path);
+				goto next;
+			}
+			if (level->stray_children == 0 && level->disposition.ignore_empty) {
+				if (!opt_quiet)
+					log_info("Ignoring empty directory %s", d_path);
+				wormhole_tree_state_set_ignore(state->tree, d_path);
+				goto next;
+			}
+			if (level->stray_children + level->stray_count)
+				if (!opt_quiet)
+					log_info("%s has %u children, %u descendants total", d_path, level->stray_children, level->stray_count);
 		}
-		if (dir->stray_children + dir->stray_count)
-			if (!opt_quiet)
-				log_info("%s has %u children, %u descendants total", d_path, dir->stray_children, dir->stray_count);
+
+		__stray_count(state, d_path, node->d_type);
+
+next:
+		path[path_len] = '\0';
 	}
 
-	__stray_count(state, d_path, d->d_type);
-	return FTW_CONTINUE;
+	return ok;
 }
 
 static bool
-check_for_stray_files(wormhole_tree_state_t *tree)
+check_for_stray_files(struct autoprofile_state *ap_state)
 {
-	struct stray_state state = { NULL, };
-	const char *tree_root = wormhole_tree_state_get_root(tree);
+	struct stray_state state;
+	char path[PATH_MAX];
 
 	memset(&state, 0, sizeof(state));
-	state.tree_root = tree_root;
-	state.tree_root_len = strlen(tree_root);
-	state.tree = tree;
+	state.tree = ap_state->tree;
 
-	if (!fsutil_ftw(tree_root, __check_for_stray_files_visitor, &state, FSUTIL_FTW_PRE_POST_CALLBACK | FSUTIL_FTW_ONE_FILESYSTEM))
+	path[0] = '\0';
+	if (!__check_for_stray_files_dir(&state, ap_state->index->root, path, 0))
 		return false;
 
 	if (state.stray_count != 0) {
@@ -1105,6 +1399,10 @@ wormhole_auto_profile(const char *root_path)
 	if (config == NULL)
 		return 1;
 
+	state.index = tree_index_build(wormhole_tree_state_get_root(state.tree));
+	if (state.index == NULL)
+		return 1;
+
 	if (opt_environment_name)
 		autoprofile_state_set_environment(&state, opt_environment_name);
 
@@ -1115,10 +1413,13 @@ wormhole_auto_profile(const char *root_path)
 		return 1;
 
 	if (!config->ignore_stray_files) {
-		if (!check_for_stray_files(state.tree))
+		if (!check_for_stray_files(&state))
 			return 1;
 	}
 
+	tree_index_free(state.index);
+	state.index = NULL;
+
 	if (!opt_quiet && state.config->path)
 		log_info("Writing configuration file to %s", state.config->path);
 	if (!wormhole_config_write(state.config, state.config->path))
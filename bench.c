@@ -0,0 +1,779 @@
+/*
+ * wormhole-bench - micro and macro benchmarks
+ *
+ *   Copyright (C) 2020-2021 Olaf Kirch <okir@suse.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Results are written to stdout as one JSON object per line, for example
+ *   {"benchmark":"protocol.namespace_roundtrip","ops":524288,"ns_per_op":402.7}
+ * Benchmarks that measure individual latencies also report percentiles.
+ */
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "tracing.h"
+#include "wormhole.h"
+#include "environment.h"
+#include "protocol.h"
+#include "buffer.h"
+#include "util.h"
+
+enum {
+	OPT_CLIENT,
+	OPT_CLIENTS,
+	OPT_REQUESTS,
+	OPT_MIN_TIME,
+};
+
+struct option wormhole_options[] = {
+	{ "help",		no_argument,		NULL,	'h' },
+	{ "debug",		no_argument,		NULL,	'd' },
+	{ "filter",		required_argument,	NULL,	'f' },
+	{ "min-time",		required_argument,	NULL,	OPT_MIN_TIME },
+	{ "client",		required_argument,	NULL,	OPT_CLIENT },
+	{ "clients",		required_argument,	NULL,	OPT_CLIENTS },
+	{ "requests",		required_argument,	NULL,	OPT_REQUESTS },
+	{ NULL }
+};
+
+const char *		opt_filter = NULL;
+const char *		opt_client_environment = NULL;
+unsigned int		opt_clients = 1;
+unsigned int		opt_requests = 100;
+uint64_t		opt_min_time_ns = 200 * 1000 * 1000ULL;
+
+static char		bench_root[PATH_MAX / 2];
+
+static void		usage(int exval);
+static void		bench_protocol(void);
+static void		bench_registry(void);
+static void		bench_pathstate(void);
+static void		bench_ftw(void);
+static bool		bench_client(const char *environment);
+
+int
+main(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt_long(argc, argv, "df:h", wormhole_options, NULL)) != EOF) {
+		switch (c) {
+		case 'h':
+			usage(0);
+
+		case 'd':
+			tracing_increment_level();
+			break;
+
+		case 'f':
+			opt_filter = optarg;
+			break;
+
+		case OPT_MIN_TIME:
+			opt_min_time_ns = strtoull(optarg, NULL, 0) * 1000 * 1000ULL;
+			break;
+
+		case OPT_CLIENT:
+			opt_client_environment = optarg;
+			break;
+
+		case OPT_CLIENTS:
+			opt_clients = strtoul(optarg, NULL, 0);
+			if (opt_clients == 0)
+				opt_clients = 1;
+			break;
+
+		case OPT_REQUESTS:
+			opt_requests = strtoul(optarg, NULL, 0);
+			if (opt_requests == 0)
+				opt_requests = 1;
+			break;
+
+		default:
+			log_error("Error parsing command line");
+			usage(2);
+		}
+	}
+
+	snprintf(bench_root, sizeof(bench_root), "%s/wormhole-bench.XXXXXX",
+			getenv("TMPDIR")? getenv("TMPDIR") : "/tmp");
+	if (mkdtemp(bench_root) == NULL)
+		log_fatal("Unable to create %s: %m", bench_root);
+
+	bench_protocol();
+	bench_registry();
+	bench_pathstate();
+	bench_ftw();
+
+	fsutil_remove_recursively(bench_root);
+
+	if (opt_client_environment && !bench_client(opt_client_environment))
+		return 1;
+
+	return 0;
+}
+
+void
+usage(int exval)
+{
+	FILE *f = exval? stderr : stdout;
+
+	fprintf(f,
+		"Usage:\n"
+		"wormhole-bench [options]\n"
+		"  --help, -h\n"
+		"     Display this help message\n"
+		"  --debug, -d\n"
+		"     Increase debugging verbosity\n"
+		"  --filter <string>, -f <string>\n"
+		"     Only run benchmarks whose name contains <string>\n"
+		"  --min-time <msec>\n"
+		"     Run each micro benchmark for at least this long (default 200)\n"
+		"  --client <environment>\n"
+		"     Also measure namespace requests for <environment> against the running daemon\n"
+		"  --clients <count>\n"
+		"     Number of concurrent clients (default 1). Their first requests race\n"
+		"     the setup of the environment, and must all get the same response\n"
+		"  --requests <count>\n"
+		"     Number of requests per client (default 100)\n"
+	);
+	exit(exval);
+}
+
+static inline uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool
+bench_selected(const char *name)
+{
+	return opt_filter == NULL || strstr(name, opt_filter) != NULL;
+}
+
+static int
+__bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * params is a (possibly empty) list of JSON members, each followed by
+ * a comma, eg "\"entries\":100,"
+ */
+static void
+bench_report(const char *name, const char *params, unsigned long ops, uint64_t elapsed,
+		uint64_t *samples, unsigned int nsamples)
+{
+	printf("{\"benchmark\":\"%s\",%s\"ops\":%lu,\"ns_per_op\":%.1f",
+			name, params? params : "", ops, ops? (double) elapsed / ops : 0.0);
+
+	if (nsamples) {
+		qsort(samples, nsamples, sizeof(samples[0]), __bench_cmp_u64);
+		printf(",\"min_ns\":%llu,\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu",
+				(unsigned long long) samples[0],
+				(unsigned long long) samples[nsamples / 2],
+				(unsigned long long) samples[nsamples * 90 / 100],
+				(unsigned long long) samples[nsamples * 99 / 100],
+				(unsigned long long) samples[nsamples - 1]);
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
+/*
+ * Run fn with an increasing number of iterations until a single run
+ * takes at least opt_min_time_ns, and report that run.
+ */
+typedef void		bench_fn_t(void *closure, unsigned long count);
+
+static void
+bench_run(const char *name, const char *params, bench_fn_t *fn, void *closure)
+{
+	unsigned long count = 1;
+	uint64_t elapsed;
+
+	if (!bench_selected(name))
+		return;
+
+	while (true) {
+		uint64_t start = bench_now();
+
+		fn(closure, count);
+		elapsed = bench_now() - start;
+
+		if (elapsed >= opt_min_time_ns || count >= (1UL << 30))
+			break;
+
+		/* Aim a bit beyond the target, but never grow by more than 100x */
+		if (elapsed < opt_min_time_ns / 100)
+			count *= 100;
+		else
+			count = count * 1.2 * opt_min_time_ns / elapsed + 1;
+	}
+
+	bench_report(name, params, count, elapsed, NULL, 0);
+}
+
+/*
+ * Protocol: build a namespace request and parse it again
+ */
+static void
+__bench_protocol_roundtrip(void *closure, unsigned long count)
+{
+	const char *name = closure;
+
+	while (count--) {
+		struct wormhole_message_parsed *pmsg;
+		struct buf *bp;
+
+		bp = wormhole_message_build_namespace_request(name);
+		wormhole_message_set_xid(bp, count);
+		if (!wormhole_message_complete(bp))
+			log_fatal("%s: incomplete message", __func__);
+		if (!(pmsg = wormhole_message_parse(bp, 0)))
+			log_fatal("%s: unable to parse message", __func__);
+
+		wormhole_message_free_parsed(pmsg);
+		buf_chain_free(bp);
+	}
+}
+
+static void
+__bench_protocol_response_roundtrip(void *closure, unsigned long count)
+{
+	const char **env = closure;
+
+	while (count--) {
+		struct wormhole_message_parsed *pmsg;
+		struct buf *bp;
+
+		bp = wormhole_message_build_namespace_response(WORMHOLE_STATUS_OK, "/usr/bin/python3", env,
+				"/var/run/wormhole/python3.sock", "/");
+		wormhole_message_set_xid(bp, count);
+		if (!wormhole_message_complete(bp))
+			log_fatal("%s: incomplete message", __func__);
+		if (!(pmsg = wormhole_message_parse(bp, 0)))
+			log_fatal("%s: unable to parse message", __func__);
+
+		wormhole_message_free_parsed(pmsg);
+		buf_chain_free(bp);
+	}
+}
+
+void
+bench_protocol(void)
+{
+	static const char *env[] = {
+		"PATH=/usr/local/bin:/usr/bin:/bin",
+		"PYTHONPATH=/usr/lib/python3/site-packages",
+		"LD_LIBRARY_PATH=/usr/lib64/python3",
+		"WORMHOLE_ENVIRONMENT=python3-devel",
+		"LANG=C.UTF-8",
+		"TERM=xterm",
+		NULL
+	};
+
+	bench_run("protocol.namespace_roundtrip", NULL, __bench_protocol_roundtrip, "python3-devel-1.2");
+	bench_run("protocol.namespace_response_roundtrip", NULL, __bench_protocol_response_roundtrip, env);
+}
+
+/*
+ * Registry: best match lookups in synthetic registries, with and without
+ * an index. Each capability name comes in 4 versions.
+ */
+#define BENCH_REGISTRY_VERSIONS	4
+
+struct bench_registry {
+	char			dir_path[PATH_MAX];
+	unsigned int		entries;
+	unsigned int		next;
+};
+
+static void
+__bench_registry_lookup(void *closure, unsigned long count)
+{
+	struct bench_registry *reg = closure;
+	unsigned int names = (reg->entries + BENCH_REGISTRY_VERSIONS - 1) / BENCH_REGISTRY_VERSIONS;
+
+	while (count--) {
+		char id[64], *id_ptr = id, *path = NULL;
+		struct strutil_array ids = { .count = 1, .data = &id_ptr };
+
+		/* Step through names in a different order than they were created */
+		reg->next = (reg->next + 7919) % names;
+		snprintf(id, sizeof(id), "benchcap%u-1.1", reg->next);
+
+		if (__wormhole_capability_get_best_matches(reg->dir_path, &ids, &path) != 1)
+			log_fatal("%s: no match for %s in %s", __func__, id, reg->dir_path);
+		free(path);
+	}
+}
+
+static bool
+bench_registry_create(struct bench_registry *reg, unsigned int entries, bool indexed)
+{
+	struct strutil_array provides;
+	unsigned int i;
+	bool ok = true;
+
+	memset(reg, 0, sizeof(*reg));
+	reg->entries = entries;
+	snprintf(reg->dir_path, sizeof(reg->dir_path), "%s/registry-%s-%u", bench_root,
+			indexed? "indexed" : "scan", entries);
+	if (!fsutil_makedirs(reg->dir_path, 0755))
+		return false;
+
+	strutil_array_init(&provides);
+	for (i = 0; i < entries; ++i) {
+		char id[64];
+
+		snprintf(id, sizeof(id), "benchcap%u-1.%u", i / BENCH_REGISTRY_VERSIONS, i % BENCH_REGISTRY_VERSIONS);
+		strutil_array_append(&provides, id);
+	}
+
+	/* Registering also writes the index. For the other case, we just
+	 * create the links ourselves. */
+	if (indexed) {
+		ok = __wormhole_capability_register(reg->dir_path, &provides, bench_root);
+	} else {
+		for (i = 0; ok && i < provides.count; ++i) {
+			char link_path[PATH_MAX + 64];
+
+			snprintf(link_path, sizeof(link_path), "%s/%s", reg->dir_path, provides.data[i]);
+			if (symlink(bench_root, link_path) < 0) {
+				log_error("Cannot create %s: %m", link_path);
+				ok = false;
+			}
+		}
+	}
+
+	strutil_array_destroy(&provides);
+	return ok;
+}
+
+void
+bench_registry(void)
+{
+	static const unsigned int sizes[] = { 10, 100, 1000, 10000 };
+	unsigned int i, mode;
+
+	for (mode = 0; mode < 2; ++mode) {
+		const char *name = mode? "registry.best_match.indexed" : "registry.best_match.scan";
+
+		if (!bench_selected(name))
+			continue;
+
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+			struct bench_registry reg;
+			char params[64];
+
+			if (!bench_registry_create(&reg, sizes[i], mode))
+				log_fatal("Unable to create synthetic registry");
+
+			snprintf(params, sizeof(params), "\"entries\":%u,", sizes[i]);
+			bench_run(name, params, __bench_registry_lookup, &reg);
+		}
+	}
+}
+
+/*
+ * Path state: lookups in a tree with the given fanout and depth.
+ * Every leaf has its state set.
+ */
+struct bench_pathstate {
+	wormhole_tree_state_t *	tree;
+	unsigned int		fanout;
+	unsigned int		depth;
+	unsigned long		leaves;
+	unsigned long		next;
+};
+
+static const char *
+__bench_pathstate_leaf(const struct bench_pathstate *ps, unsigned long leaf)
+{
+	static char path[PATH_MAX];
+	unsigned int level, len = 0;
+
+	for (level = 0; level < ps->depth; ++level) {
+		len += snprintf(path + len, sizeof(path) - len, "/dir%lu", leaf % ps->fanout);
+		leaf /= ps->fanout;
+	}
+	return path;
+}
+
+static void
+__bench_pathstate_lookup(void *closure, unsigned long count)
+{
+	struct bench_pathstate *ps = closure;
+
+	while (count--) {
+		ps->next = (ps->next + 7919) % ps->leaves;
+		if (wormhole_path_tree_get(ps->tree, __bench_pathstate_leaf(ps, ps->next)) == NULL)
+			log_fatal("%s: leaf %lu not found", __func__, ps->next);
+	}
+}
+
+void
+bench_pathstate(void)
+{
+	static const struct {
+		unsigned int	fanout, depth;
+	} shapes[] = {
+		{ 4,	8 },
+		{ 2,	16 },
+		{ 1,	256 },
+	};
+	const char *name = "pathstate.lookup";
+	unsigned int i;
+
+	if (!bench_selected(name))
+		return;
+
+	for (i = 0; i < sizeof(shapes) / sizeof(shapes[0]); ++i) {
+		struct bench_pathstate ps;
+		char params[64];
+		unsigned long leaf;
+
+		memset(&ps, 0, sizeof(ps));
+		ps.fanout = shapes[i].fanout;
+		ps.depth = shapes[i].depth;
+		for (ps.leaves = 1, leaf = 0; leaf < ps.depth; ++leaf)
+			ps.leaves *= ps.fanout;
+
+		ps.tree = wormhole_tree_state_new();
+		for (leaf = 0; leaf < ps.leaves; ++leaf)
+			wormhole_tree_state_set_bind_mounted(ps.tree, __bench_pathstate_leaf(&ps, leaf));
+
+		snprintf(params, sizeof(params), "\"fanout\":%u,\"depth\":%u,\"leaves\":%lu,",
+				ps.fanout, ps.depth, ps.leaves);
+		bench_run(name, params, __bench_pathstate_lookup, &ps);
+
+		wormhole_tree_state_free(ps.tree);
+	}
+}
+
+/*
+ * Directory walker, on a generated tree of 10 x 10 directories
+ * with 100 files each.
+ */
+struct bench_ftw {
+	char			dir_path[PATH_MAX];
+	int			flags;
+	unsigned long		entries;
+};
+
+static int
+__bench_ftw_visitor(const char *dir_path, const struct dirent *d, int flags, void *closure)
+{
+	struct bench_ftw *ftw = closure;
+
+	/* With FSUTIL_FTW_PARALLEL, we may be called concurrently */
+	__atomic_add_fetch(&ftw->entries, 1, __ATOMIC_RELAXED);
+	return FTW_CONTINUE;
+}
+
+static void
+__bench_ftw_walk(void *closure, unsigned long count)
+{
+	struct bench_ftw *ftw = closure;
+
+	while (count--) {
+		if (!fsutil_ftw(ftw->dir_path, __bench_ftw_visitor, ftw, ftw->flags))
+			log_fatal("%s: walk of %s failed", __func__, ftw->dir_path);
+	}
+}
+
+static bool
+bench_ftw_create(const char *dir_path, unsigned int fanout, unsigned int depth, unsigned int files)
+{
+	char path[PATH_MAX];
+	unsigned int i;
+
+	if (!fsutil_makedirs(dir_path, 0755))
+		return false;
+
+	if (depth == 0) {
+		for (i = 0; i < files; ++i) {
+			snprintf(path, sizeof(path), "%s/file%u", dir_path, i);
+			if (!fsutil_create_empty(path))
+				return false;
+		}
+		return true;
+	}
+
+	for (i = 0; i < fanout; ++i) {
+		snprintf(path, sizeof(path), "%s/dir%u", dir_path, i);
+		if (!bench_ftw_create(path, fanout, depth - 1, files))
+			return false;
+	}
+	return true;
+}
+
+void
+bench_ftw(void)
+{
+	struct bench_ftw ftw;
+	char params[64];
+
+	if (!bench_selected("ftw."))
+		return;
+
+	memset(&ftw, 0, sizeof(ftw));
+	snprintf(ftw.dir_path, sizeof(ftw.dir_path), "%s/ftw", bench_root);
+	if (!bench_ftw_create(ftw.dir_path, 10, 2, 100))
+		log_fatal("Unable to create tree for ftw benchmark");
+
+	/* Count entries once, for the params */
+	fsutil_ftw(ftw.dir_path, __bench_ftw_visitor, &ftw, 0);
+	snprintf(params, sizeof(params), "\"entries\":%lu,", ftw.entries);
+
+	ftw.flags = FSUTIL_FTW_ONE_FILESYSTEM;
+	bench_run("ftw.sequential", params, __bench_ftw_walk, &ftw);
+
+	ftw.flags = FSUTIL_FTW_ONE_FILESYSTEM | FSUTIL_FTW_PARALLEL;
+	bench_run("ftw.parallel", params, __bench_ftw_walk, &ftw);
+}
+
+/*
+ * End to end: namespace requests against the running daemon.
+ * First, all clients send one request at the same time. These are reported
+ * as "cold" - if nobody used the environment before, this includes setting
+ * it up, and all but one of the requests race that setup. Every client must
+ * get the same response as a request sent after setup is complete; we check
+ * the subspace daemon socket, which the daemon only knows once it's done.
+ * After that, each of the clients sends its requests back to back.
+ */
+struct bench_client_result {
+	uint64_t		latency;
+	char			server_socket[128];
+};
+
+static bool
+__bench_client_callback(struct wormhole_message_namespace_response *msg, int nsfd, void *closure)
+{
+	struct bench_client_result *res = closure;
+
+	snprintf(res->server_socket, sizeof(res->server_socket), "%s", msg->server_socket?: "");
+	return true;
+}
+
+static bool
+__bench_client_request(const char *environment, struct bench_client_result *res)
+{
+	uint64_t start = bench_now();
+	int rv;
+
+	memset(res, 0, sizeof(*res));
+	rv = wormhole_client_namespace_request(environment, __bench_client_callback, res);
+	res->latency = bench_now() - start;
+
+	if (rv == WORMHOLE_CLIENT_UNAVAILABLE) {
+		log_error("Unable to contact wormhole daemon");
+		return false;
+	}
+	if (rv != WORMHOLE_CLIENT_OK) {
+		log_error("Namespace request for %s failed", environment);
+		return false;
+	}
+	return true;
+}
+
+static bool
+__bench_client_run(const char *environment, int fd)
+{
+	struct bench_client_result res;
+	unsigned int i;
+
+	for (i = 0; i < opt_requests; ++i) {
+		if (!__bench_client_request(environment, &res))
+			return false;
+		if (write(fd, &res.latency, sizeof(res.latency)) != sizeof(res.latency))
+			return false;
+	}
+	return true;
+}
+
+static bool
+__bench_client_race(const char *environment, int fd)
+{
+	struct bench_client_result res;
+
+	if (!__bench_client_request(environment, &res))
+		return false;
+
+	/* Small enough to be written atomically */
+	return write(fd, &res, sizeof(res)) == sizeof(res);
+}
+
+/*
+ * Start a client process for each of opt_clients, and return the read end
+ * of a pipe they write their results to.
+ */
+static int
+bench_client_start(const char *environment, bool (*fn)(const char *, int))
+{
+	unsigned int i;
+	int pfd[2];
+
+	if (pipe(pfd) < 0) {
+		log_error("pipe: %m");
+		return -1;
+	}
+
+	for (i = 0; i < opt_clients; ++i) {
+		pid_t pid;
+
+		if ((pid = fork()) < 0) {
+			log_error("fork: %m");
+			break;
+		}
+		if (pid == 0) {
+			close(pfd[0]);
+			_exit(fn(environment, pfd[1])? 0 : 1);
+		}
+	}
+	close(pfd[1]);
+
+	return pfd[0];
+}
+
+static bool
+bench_client_wait(void)
+{
+	bool ok = true;
+
+	while (true) {
+		int status;
+
+		if (wait(&status) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (!procutil_child_status_okay(status))
+			ok = false;
+	}
+	return ok;
+}
+
+static bool
+bench_client_cold(const char *environment)
+{
+	struct bench_client_result *results, warm;
+	uint64_t *samples, total = 0;
+	unsigned int i, nresults = 0;
+	char params[128];
+	bool ok;
+	int fd;
+
+	if ((fd = bench_client_start(environment, __bench_client_race)) < 0)
+		return false;
+
+	results = calloc(opt_clients, sizeof(results[0]));
+	while (nresults < opt_clients
+	    && read(fd, &results[nresults], sizeof(results[0])) == sizeof(results[0]))
+		nresults++;
+	close(fd);
+
+	ok = bench_client_wait() && nresults == opt_clients;
+
+	if (ok && !__bench_client_request(environment, &warm))
+		ok = false;
+
+	for (i = 0; ok && i < nresults; ++i) {
+		if (strcmp(results[i].server_socket, warm.server_socket)) {
+			log_error("Cold request for %s returned server socket \"%s\", expected \"%s\"",
+					environment, results[i].server_socket, warm.server_socket);
+			ok = false;
+		}
+	}
+
+	if (nresults) {
+		samples = calloc(nresults, sizeof(samples[0]));
+		for (i = 0; i < nresults; ++i) {
+			samples[i] = results[i].latency;
+			total += samples[i];
+		}
+
+		snprintf(params, sizeof(params), "\"environment\":\"%s\",\"clients\":%u,", environment, opt_clients);
+		bench_report("client.namespace_request.cold", params, nresults, total, samples, nresults);
+		free(samples);
+	}
+
+	free(results);
+	return ok;
+}
+
+bool
+bench_client(const char *environment)
+{
+	unsigned int i, nsamples = 0, max_samples = opt_clients * opt_requests;
+	uint64_t start, elapsed, *samples;
+	char params[128];
+	bool ok;
+	int fd;
+	ssize_t n;
+
+	if (!bench_client_cold(environment))
+		return false;
+
+	start = bench_now();
+	if ((fd = bench_client_start(environment, __bench_client_run)) < 0)
+		return false;
+
+	samples = calloc(max_samples, sizeof(samples[0]));
+	while (nsamples < max_samples
+	    && (n = read(fd, &samples[nsamples], sizeof(samples[0]))) == sizeof(samples[0]))
+		nsamples++;
+	close(fd);
+	elapsed = bench_now() - start;
+
+	ok = bench_client_wait();
+
+	snprintf(params, sizeof(params), "\"environment\":\"%s\",\"clients\":%u,\"requests_per_sec\":%.1f,",
+			environment, opt_clients, elapsed? nsamples * 1e9 / elapsed : 0.0);
+	if (nsamples) {
+		uint64_t total = 0;
+
+		for (i = 0; i < nsamples; ++i)
+			total += samples[i];
+		bench_report("client.namespace_request.warm", params, nsamples, total, samples, nsamples);
+	}
+
+	free(samples);
+	return ok && nsamples == max_samples;
+}
@@ -26,23 +26,61 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <sys/uio.h>
 
 #include "buffer.h"
 
+/*
+ * Buffer pool. Freed buffers are kept on a bounded free list and handed
+ * out again by buf_alloc(). We do not clear the data area of a buffer;
+ * only head, tail and next are reset.
+ * Poisoning of freed buffers is available as a debugging aid
+ * (build with -DBUF_DEBUG).
+ */
+static struct buf *		buf_pool;
+static struct buf_pool_stats	buf_pool_stats;
+
 struct buf *
 buf_alloc(void)
 {
 	struct buf *bp;
 
-	bp = calloc(1, sizeof(*bp));
+	if ((bp = buf_pool) != NULL) {
+		buf_pool = bp->next;
+		buf_pool_stats.cached--;
+		buf_pool_stats.hits++;
+	} else {
+		if (!(bp = malloc(sizeof(*bp))))
+			return NULL;
+		buf_pool_stats.misses++;
+	}
+
+	bp->next = NULL;
+	bp->head = bp->tail = 0;
 	return bp;
 }
 
 void
 buf_free(struct buf *bp)
 {
+#ifdef BUF_DEBUG
 	memset(bp, 0xaa, sizeof(*bp));
-	free(bp);
+#endif
+	if (buf_pool_stats.cached >= BUF_POOL_MAX) {
+		buf_pool_stats.released++;
+		free(bp);
+		return;
+	}
+
+	bp->next = buf_pool;
+	buf_pool = bp;
+	buf_pool_stats.cached++;
+}
+
+void
+buf_pool_get_stats(struct buf_pool_stats *stats)
+{
+	*stats = buf_pool_stats;
 }
 
 unsigned int
@@ -81,8 +119,6 @@ buf_get(struct buf *bp, void *p, unsigned long size)
 		memcpy(p + total, buf_head(bp), avail);
 
 		total += avail;
-		size -= avail;
-
 		bp = next;
 	}
 
@@ -107,7 +143,118 @@ buf_consumed(struct buf **list, unsigned long amount)
 		}
 
 		amount -= avail;
-		*list = bp;
+		*list = bp->next;
+		buf_free(bp);
+	}
+}
+
+/*
+ * Buffer chains.
+ * Messages that do not fit into a single buffer are represented as a list
+ * of buffers linked through their next pointer.
+ */
+void
+buf_chain_free(struct buf *bp)
+{
+	struct buf *next;
+
+	for (; bp; bp = next) {
+		next = bp->next;
+		buf_free(bp);
+	}
+}
+
+unsigned long
+buf_chain_available(const struct buf *bp)
+{
+	unsigned long total = 0;
+
+	for (; bp; bp = bp->next)
+		total += buf_available(bp);
+	return total;
+}
+
+struct buf *
+buf_chain_tail(struct buf *bp)
+{
+	while (bp && bp->next)
+		bp = bp->next;
+	return bp;
+}
+
+/*
+ * Append data to a chain, adding buffers as needed.
+ */
+unsigned long
+buf_chain_put(struct buf *bp, const void *p, unsigned long len)
+{
+	unsigned long total = 0;
+
+	bp = buf_chain_tail(bp);
+	while (total < len) {
+		if (buf_tailroom(bp) == 0) {
+			if (!(bp->next = buf_alloc()))
+				break;
+			bp = bp->next;
+		}
+
+		total += buf_put(bp, p + total, len - total);
+	}
+
+	return total;
+}
+
+/*
+ * Consume data from the front of a chain, without freeing any buffers.
+ */
+void
+buf_chain_advance(struct buf *bp, unsigned long amount)
+{
+	while (amount) {
+		unsigned int avail;
+
+		assert(bp);
+		avail = buf_available(bp);
+		if (avail > amount)
+			avail = amount;
+
+		__buf_advance_head(bp, avail);
+		amount -= avail;
+
+		bp = bp->next;
+	}
+}
+
+/*
+ * Free any buffers at the front of the chain that have been consumed completely.
+ */
+void
+buf_chain_trim(struct buf **list)
+{
+	struct buf *bp;
+
+	while ((bp = *list) != NULL && buf_available(bp) == 0) {
+		*list = bp->next;
 		buf_free(bp);
 	}
 }
+
+/*
+ * Describe the data in a chain by an iovec array, for use with sendmsg.
+ */
+unsigned int
+buf_chain_iovec(const struct buf *bp, struct iovec *iov, unsigned int max)
+{
+	unsigned int n = 0;
+
+	for (; bp && n < max; bp = bp->next) {
+		if (buf_available(bp) == 0)
+			continue;
+
+		iov[n].iov_base = (void *) buf_head(bp);
+		iov[n].iov_len = buf_available(bp);
+		n++;
+	}
+
+	return n;
+}
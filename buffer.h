@@ -24,6 +24,7 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <assert.h>
 
 #define BUF_SZ		1024
@@ -35,6 +36,16 @@ struct buf {
 	unsigned int	head, tail;
 };
 
+/* Max number of free buffers kept around for reuse */
+#define BUF_POOL_MAX	128
+
+struct buf_pool_stats {
+	unsigned long	hits;		/* buf_alloc served from the pool */
+	unsigned long	misses;		/* buf_alloc had to call malloc */
+	unsigned long	released;	/* buf_free found the pool full */
+	unsigned int	cached;		/* buffers currently in the pool */
+};
+
 struct queue {
 	unsigned long	size;
 	struct buf *	head;
@@ -42,10 +53,21 @@ struct queue {
 
 extern struct buf *	buf_alloc(void);
 extern void		buf_free(struct buf *bp);
+extern void		buf_pool_get_stats(struct buf_pool_stats *);
 extern unsigned int	buf_put(struct buf *bp, const void *p, unsigned int len);
 extern unsigned long	buf_get(struct buf *bp, void *p, unsigned long size);
 extern void		buf_consumed(struct buf **list, unsigned long amount);
 
+extern void		buf_chain_free(struct buf *bp);
+extern unsigned long	buf_chain_available(const struct buf *bp);
+extern struct buf *	buf_chain_tail(struct buf *bp);
+extern unsigned long	buf_chain_put(struct buf *bp, const void *p, unsigned long len);
+extern void		buf_chain_advance(struct buf *bp, unsigned long amount);
+extern void		buf_chain_trim(struct buf **list);
+
+struct iovec;
+extern unsigned int	buf_chain_iovec(const struct buf *bp, struct iovec *iov, unsigned int max);
+
 extern void		queue_init(struct queue *);
 extern void		queue_destroy(struct queue *);
 extern unsigned long	queue_available(const struct queue *);
@@ -101,6 +123,28 @@ __buf_advance_tail(struct buf *bp, unsigned int len)
 	bp->tail += len;
 }
 
+/*
+ * Leave room for a header in front of the data. Must be called before
+ * anything is put into the buffer.
+ */
+static inline void
+buf_reserve_head(struct buf *bp, unsigned int len)
+{
+	assert(bp->head == bp->tail && len <= BUF_SZ);
+	bp->head = bp->tail = len;
+}
+
+static inline bool
+buf_prepend(struct buf *bp, const void *p, unsigned int len)
+{
+	if (bp->head < len)
+		return false;
+
+	bp->head -= len;
+	memcpy(bp->data + bp->head, p, len);
+	return true;
+}
+
 static inline void
 buf_zap(struct buf *bp)
 {
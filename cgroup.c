@@ -0,0 +1,391 @@
+/*
+ * wormhole - per-environment cgroups
+ *
+ *   Copyright (C) 2020-2021 Olaf Kirch <okir@suse.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <mntent.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "cgroup.h"
+#include "tracing.h"
+#include "util.h"
+
+/*
+ * The daemon uses the cgroup v2 subtree it was started in (with systemd,
+ * this requires Delegate=yes). A cgroup that has processes of its own
+ * cannot enable controllers for its children, so the daemon first moves
+ * itself into a leaf named "daemon". Environments get a sibling each,
+ * which their setup process joins before doing anything else.
+ *
+ * There is no point in failing hard if any of this does not work; we
+ * just run without cgroups, like we did before.
+ */
+#define WORMHOLE_CGROUP_DAEMON		"daemon"
+
+static struct {
+	bool			enabled;
+
+	/* Our subtree is the root of the hierarchy. Pressure for the root
+	 * lives in /proc/pressure rather than in the cgroup directory. */
+	bool			is_root;
+	char *			base;
+} wormhole_cgroup;
+
+static const char *	wormhole_cgroup_controllers[] = {
+	"cpu", "memory", "io", "pids", NULL
+};
+
+static bool
+wormhole_cgroup_write(const char *dir, const char *file, const char *value)
+{
+	char path[PATH_MAX];
+	int fd, saved_errno;
+	ssize_t n;
+
+	if ((size_t) snprintf(path, sizeof(path), "%s/%s", dir, file) >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+		return false;
+
+	n = write(fd, value, strlen(value));
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+
+	return n == (ssize_t) strlen(value);
+}
+
+static bool
+wormhole_cgroup_read(const char *path, char *buf, size_t size)
+{
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return false;
+
+	n = read(fd, buf, size - 1);
+	close(fd);
+
+	if (n < 0)
+		return false;
+
+	buf[n] = '\0';
+	return true;
+}
+
+static char *
+wormhole_cgroup_find_mount(void)
+{
+	struct mntent *m;
+	char *result = NULL;
+	FILE *fp;
+
+	if (!(fp = setmntent("/proc/self/mounts", "r")))
+		return NULL;
+
+	while (result == NULL && (m = getmntent(fp)) != NULL) {
+		if (!strcmp(m->mnt_type, "cgroup2"))
+			result = strdup(m->mnt_dir);
+	}
+
+	endmntent(fp);
+	return result;
+}
+
+/*
+ * Our position in the unified hierarchy is the "0::" line.
+ */
+static char *
+wormhole_cgroup_self(void)
+{
+	char line[PATH_MAX + 16];
+	char *result = NULL;
+	FILE *fp;
+
+	if (!(fp = fopen("/proc/self/cgroup", "re")))
+		return NULL;
+
+	while (result == NULL && fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, "0::", 3))
+			continue;
+
+		line[strcspn(line, "\n")] = '\0';
+		result = strdup(line + 3);
+	}
+
+	fclose(fp);
+	return result;
+}
+
+static bool
+wormhole_cgroup_controller_available(const char *name, const char *list)
+{
+	size_t len = strlen(name);
+
+	while (*list) {
+		size_t n = strcspn(list, " \n");
+
+		if (n == len && !strncmp(list, name, len))
+			return true;
+		list += n;
+		list += strspn(list, " \n");
+	}
+	return false;
+}
+
+static void
+wormhole_cgroup_enable_controllers(const char *base)
+{
+	char path[PATH_MAX], available[256];
+	const char **ctl;
+
+	snprintf(path, sizeof(path), "%s/cgroup.controllers", base);
+	if (!wormhole_cgroup_read(path, available, sizeof(available)))
+		return;
+
+	for (ctl = wormhole_cgroup_controllers; *ctl; ++ctl) {
+		char word[32];
+
+		if (!wormhole_cgroup_controller_available(*ctl, available)) {
+			trace("cgroup controller %s not available", *ctl);
+			continue;
+		}
+
+		snprintf(word, sizeof(word), "+%s", *ctl);
+		if (!wormhole_cgroup_write(base, "cgroup.subtree_control", word))
+			trace("Unable to enable cgroup controller %s: %m", *ctl);
+	}
+}
+
+bool
+wormhole_cgroup_init(void)
+{
+	char base[PATH_MAX], leaf[PATH_MAX];
+	char *mount_point, *self;
+	bool is_root;
+
+	if (!(mount_point = wormhole_cgroup_find_mount())) {
+		log_info("cgroup v2 hierarchy not mounted, not using cgroups");
+		return false;
+	}
+
+	if (!(self = wormhole_cgroup_self())) {
+		log_info("Unable to determine our cgroup, not using cgroups");
+		free(mount_point);
+		return false;
+	}
+
+	is_root = !strcmp(self, "/");
+	snprintf(base, sizeof(base), "%s%s", mount_point, is_root? "" : self);
+	free(mount_point);
+	free(self);
+
+	if ((size_t) snprintf(leaf, sizeof(leaf), "%s/%s", base, WORMHOLE_CGROUP_DAEMON) >= sizeof(leaf)) {
+		log_info("cgroup path %s too long, not using cgroups", base);
+		return false;
+	}
+
+	if ((mkdir(leaf, 0755) < 0 && errno != EEXIST)
+	 || !wormhole_cgroup_write(leaf, "cgroup.procs", "0")) {
+		log_warning("Unable to set up cgroups below %s: %m; not using cgroups", base);
+		rmdir(leaf);
+		return false;
+	}
+
+	/* This fails if other processes share our original cgroup, in which
+	 * case we get neither memory accounting nor resource control. We
+	 * can still kill environments, and PSI does not need a controller. */
+	wormhole_cgroup_enable_controllers(base);
+
+	wormhole_cgroup.base = strdup(base);
+	wormhole_cgroup.is_root = is_root;
+	wormhole_cgroup.enabled = true;
+
+	log_info("Using cgroups below %s", base);
+	return true;
+}
+
+bool
+wormhole_cgroup_enabled(void)
+{
+	return wormhole_cgroup.enabled;
+}
+
+/*
+ * Create a cgroup below ours, or reuse one left over from an earlier
+ * incarnation. Returns its path.
+ */
+char *
+wormhole_cgroup_create(const char *name)
+{
+	char path[PATH_MAX], *s;
+
+	if (!wormhole_cgroup.enabled)
+		return NULL;
+
+	if ((size_t) snprintf(path, sizeof(path), "%s/", wormhole_cgroup.base) >= sizeof(path)
+	 || strlen(path) + strlen(name) >= sizeof(path)) {
+		log_error("cgroup name %s too long", name);
+		return NULL;
+	}
+
+	/* Names come from the config file, and must not create a hierarchy */
+	s = path + strlen(path);
+	strcpy(s, name);
+	for (; *s; ++s) {
+		if (*s == '/')
+			*s = '_';
+	}
+
+	if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+		log_error("Unable to create cgroup %s: %m", path);
+		return NULL;
+	}
+
+	return strdup(path);
+}
+
+/*
+ * Move the calling process into the given cgroup.
+ */
+bool
+wormhole_cgroup_attach(const char *path)
+{
+	if (!wormhole_cgroup_write(path, "cgroup.procs", "0")) {
+		log_error("Unable to join cgroup %s: %m", path);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Without cgroup.kill, processes may fork while we kill them, so we
+ * make a few passes.
+ */
+static void
+wormhole_cgroup_kill_procs(const char *path)
+{
+	char procs[PATH_MAX];
+	unsigned int pass;
+	bool killed = true;
+
+	snprintf(procs, sizeof(procs), "%s/cgroup.procs", path);
+	for (pass = 0; killed && pass < 4; ++pass) {
+		FILE *fp;
+		int pid;
+
+		if (!(fp = fopen(procs, "re")))
+			return;
+
+		killed = false;
+		while (fscanf(fp, "%d", &pid) == 1) {
+			if (kill(pid, SIGKILL) == 0)
+				killed = true;
+		}
+		fclose(fp);
+	}
+}
+
+/*
+ * Kill everything left in the cgroup and remove it. As the processes
+ * take a moment to exit, the rmdir usually fails; that's fine, we'll
+ * reuse the cgroup when setting up the environment again.
+ */
+void
+wormhole_cgroup_kill(const char *path)
+{
+	if (!wormhole_cgroup_write(path, "cgroup.kill", "1")) {
+		/* cgroup.kill was added in Linux 5.14 */
+		if (errno != ENOENT) {
+			log_warning("Unable to kill cgroup %s: %m", path);
+			return;
+		}
+		wormhole_cgroup_kill_procs(path);
+	}
+
+	if (rmdir(path) == 0)
+		trace("Removed cgroup %s", path);
+	else
+		trace2("Cannot remove cgroup %s yet: %m", path);
+}
+
+static bool
+wormhole_cgroup_read_pressure(const char *path, const char *resource, double *ret)
+{
+	char filename[PATH_MAX], buf[256];
+
+	if (path)
+		snprintf(filename, sizeof(filename), "%s/%s.pressure", path, resource);
+	else
+		snprintf(filename, sizeof(filename), "/proc/pressure/%s", resource);
+
+	/* some avg10=0.00 avg60=0.00 avg300=0.00 total=0 */
+	if (!wormhole_cgroup_read(filename, buf, sizeof(buf))
+	 || sscanf(buf, "some avg10=%lf", ret) != 1)
+		return false;
+
+	return true;
+}
+
+/*
+ * Get memory usage and pressure of a cgroup; path NULL refers to the
+ * whole subtree the daemon manages.
+ */
+bool
+wormhole_cgroup_get_stats(const char *path, struct wormhole_cgroup_stats *stats)
+{
+	char filename[PATH_MAX], buf[64];
+	const char *psi_path;
+	bool ok = false;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!wormhole_cgroup.enabled)
+		return false;
+
+	if (path == NULL)
+		path = wormhole_cgroup.base;
+
+	/* The root cgroup has neither memory.current nor pressure files */
+	psi_path = path;
+	if (wormhole_cgroup.is_root && !strcmp(path, wormhole_cgroup.base))
+		psi_path = NULL;
+
+	snprintf(filename, sizeof(filename), "%s/memory.current", path);
+	if (wormhole_cgroup_read(filename, buf, sizeof(buf)))
+		stats->memory_current = strtoull(buf, NULL, 10);
+
+	ok |= wormhole_cgroup_read_pressure(psi_path, "cpu", &stats->cpu_pressure);
+	ok |= wormhole_cgroup_read_pressure(psi_path, "memory", &stats->memory_pressure);
+	ok |= wormhole_cgroup_read_pressure(psi_path, "io", &stats->io_pressure);
+
+	return ok;
+}
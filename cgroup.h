@@ -0,0 +1,44 @@
+/*
+ * wormhole - per-environment cgroups
+ *
+ *   Copyright (C) 2020-2021 Olaf Kirch <okir@suse.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _WORMHOLE_CGROUP_H
+#define _WORMHOLE_CGROUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct wormhole_cgroup_stats {
+	/* 0 if the memory controller is not available */
+	uint64_t		memory_current;
+
+	/* The "some" avg10 line of the PSI files, in percent */
+	double			cpu_pressure;
+	double			memory_pressure;
+	double			io_pressure;
+};
+
+extern bool			wormhole_cgroup_init(void);
+extern bool			wormhole_cgroup_enabled(void);
+extern char *			wormhole_cgroup_create(const char *name);
+extern bool			wormhole_cgroup_attach(const char *path);
+extern void			wormhole_cgroup_kill(const char *path);
+extern bool			wormhole_cgroup_get_stats(const char *path, struct wormhole_cgroup_stats *);
+
+#endif // _WORMHOLE_CGROUP_H
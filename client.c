@@ -39,31 +39,83 @@
  * it harder to audit this stuff, so I may end up doing just that...
  */
 
+static unsigned int
+wormhole_client_next_xid(void)
+{
+	static unsigned int xid;
+
+	if (xid == 0)
+		xid = getpid();
+
+	/* Never use 0 */
+	if ((++xid & 0xFFFF) == 0)
+		++xid;
+	return xid & 0xFFFF;
+}
+
 static int
-wormhole_send_namespace_request(wormhole_socket_t *s, const char *cmd)
+wormhole_send_request(wormhole_socket_t *s, struct buf *bp, unsigned int xid)
 {
-	struct buf *bp;
 	int rv = 0;
 
-	bp = wormhole_message_build_namespace_request(cmd);
-	rv = send(s->fd, buf_head(bp), buf_available(bp), 0);
-	if (rv < 0)
-		log_error("send: %m");
+	if (bp == NULL)
+		return -1;
+
+	wormhole_message_set_xid(bp, xid);
+
+	while (bp != NULL) {
+		rv = wormhole_socket_send_chain(s->fd, &bp, -1);
+		if (rv < 0) {
+			log_error("send: %m");
+			break;
+		}
+	}
 
-	buf_free(bp);
+	buf_chain_free(bp);
 	return rv;
 }
 
-static struct buf *
-wormhole_recv_response(wormhole_socket_t *s, int *resp_fd)
+/*
+ * Receive the server's reply to the request with the given transaction ID.
+ * Replies to other requests are discarded.
+ */
+static struct wormhole_message_parsed *
+wormhole_recv_response(wormhole_socket_t *s, unsigned int xid, int *resp_fd)
 {
-	struct buf *bp = buf_alloc();
+	struct wormhole_message_parsed *pmsg = NULL;
+	struct buf *bp = buf_alloc(), *tail = bp;
 
 	*resp_fd = -1;
-	while (!wormhole_message_complete(bp)) {
+	while (pmsg == NULL) {
 		int received, fd;
 
-		received = wormhole_socket_recvmsg(s->fd, buf_tail(bp), buf_tailroom(bp), &fd);
+		if (wormhole_message_complete(bp)) {
+			pmsg = wormhole_message_parse(bp, 0);
+			if (pmsg == NULL) {
+				log_error("Unable to parse server response!");
+				goto failed;
+			}
+
+			if (pmsg->hdr.xid != xid) {
+				trace("Ignoring server response with xid %u (expected %u)", pmsg->hdr.xid, xid);
+				wormhole_message_free_parsed(pmsg);
+				pmsg = NULL;
+
+				if (*resp_fd >= 0) {
+					close(*resp_fd);
+					*resp_fd = -1;
+				}
+			}
+			continue;
+		}
+
+		/* Responses may span several buffers */
+		if (buf_tailroom(tail) == 0) {
+			tail->next = buf_alloc();
+			tail = tail->next;
+		}
+
+		received = wormhole_socket_recvmsg(s->fd, buf_tail(tail), buf_tailroom(tail), &fd);
 		if (received < 0) {
 			log_error("recvmsg: %m");
 			goto failed;
@@ -74,52 +126,56 @@ wormhole_recv_response(wormhole_socket_t *s, int *resp_fd)
 			goto failed;
 		}
 
-		__buf_advance_tail(bp, received);
-		if (fd >= 0)
+		__buf_advance_tail(tail, received);
+		if (fd >= 0) {
+			if (*resp_fd >= 0)
+				close(*resp_fd);
 			*resp_fd = fd;
+		}
 	}
 
-	return bp;
+	buf_chain_free(bp);
+	return pmsg;
 
 failed:
 	if (*resp_fd >= 0) {
 		close(*resp_fd);
 		*resp_fd = -1;
 	}
-	buf_free(bp);
+	buf_chain_free(bp);
 	return NULL;
 }
 
-bool
+int
 wormhole_client_namespace_request(const char *query_string,
 		wormhole_namespace_response_callback_fn_t *callback, void *closure)
 {
 	wormhole_socket_t *s = NULL;
 	struct wormhole_message_parsed *pmsg = NULL;
-	struct buf *bp = NULL;
+	unsigned int xid;
 	int nsfd = -1;
-	bool rv = false;
+	int rv = WORMHOLE_CLIENT_FAILED;
 
 	s = wormhole_connect(WORMHOLE_SOCKET_PATH, NULL);
 	if (s == NULL) {
-		log_error("Unable to connect to wormhole daemon");
-		goto failed;
+		trace("Unable to connect to wormhole daemon");
+		return WORMHOLE_CLIENT_UNAVAILABLE;
 	}
 
-	if (wormhole_send_namespace_request(s, query_string) < 0)
-		goto failed;
-
-	if (!(bp = wormhole_recv_response(s, &nsfd)))
+	xid = wormhole_client_next_xid();
+	if (wormhole_send_request(s, wormhole_message_build_namespace_request(query_string), xid) < 0)
 		goto failed;
 
-	pmsg = wormhole_message_parse(bp, 0);
-	if (pmsg == NULL) {
-		log_error("Unable to parse server response!");
+	if (!(pmsg = wormhole_recv_response(s, xid, &nsfd)))
 		goto failed;
-	}
 
 	switch (pmsg->hdr.opcode) {
 	case WORMHOLE_OPCODE_STATUS:
+		if (pmsg->payload.status.status == WORMHOLE_STATUS_NO_PROFILE) {
+			trace("Server does not know about \"%s\"", query_string);
+			rv = WORMHOLE_CLIENT_NO_PROFILE;
+			goto failed;
+		}
 		if (pmsg->payload.status.status != WORMHOLE_STATUS_OK) {
 			log_error("Server returns error status %d!", pmsg->payload.status.status);
 			goto failed;
@@ -137,7 +193,8 @@ wormhole_client_namespace_request(const char *query_string,
 			goto failed;
 		}
 
-		rv = callback(&pmsg->payload.namespace_response, nsfd, closure);
+		if (callback(&pmsg->payload.namespace_response, nsfd, closure))
+			rv = WORMHOLE_CLIENT_OK;
 		break;
 
 	default:
@@ -148,9 +205,62 @@ wormhole_client_namespace_request(const char *query_string,
 failed:
 	if (pmsg)
 		wormhole_message_free_parsed(pmsg);
-	if (bp)
-		buf_free(bp);
 	if (nsfd >= 0)
 		close(nsfd);
+	if (s)
+		wormhole_socket_free(s);
+	return rv;
+}
+
+int
+wormhole_client_stats_request(const char *socket_path,
+		wormhole_stats_response_callback_fn_t *callback, void *closure)
+{
+	wormhole_socket_t *s = NULL;
+	struct wormhole_message_parsed *pmsg = NULL;
+	unsigned int xid;
+	int fd = -1;
+	int rv = WORMHOLE_CLIENT_FAILED;
+
+	s = wormhole_connect(socket_path, NULL);
+	if (s == NULL) {
+		trace("Unable to connect to wormhole daemon");
+		return WORMHOLE_CLIENT_UNAVAILABLE;
+	}
+
+	xid = wormhole_client_next_xid();
+	if (wormhole_send_request(s, wormhole_message_build_stats_request(), xid) < 0)
+		goto failed;
+
+	if (!(pmsg = wormhole_recv_response(s, xid, &fd)))
+		goto failed;
+
+	switch (pmsg->hdr.opcode) {
+	case WORMHOLE_OPCODE_STATUS:
+		log_error("Server returns status %d; maybe it does not support stats?", pmsg->payload.status.status);
+		goto failed;
+
+	case WORMHOLE_OPCODE_STATS_RESPONSE:
+		if (pmsg->payload.stats_response.status != WORMHOLE_STATUS_OK) {
+			log_error("Server returns error status %d!", pmsg->payload.stats_response.status);
+			goto failed;
+		}
+
+		if (callback(&pmsg->payload.stats_response, closure))
+			rv = WORMHOLE_CLIENT_OK;
+		break;
+
+	default:
+		log_error("Unexpected opcode %d in server response!", pmsg->hdr.opcode);
+		goto failed;
+	}
+
+failed:
+	if (pmsg)
+		wormhole_message_free_parsed(pmsg);
+	if (fd >= 0)
+		close(fd);
+	if (s)
+		wormhole_socket_free(s);
 	return rv;
 }
@@ -42,7 +42,7 @@ __wormhole_common_load_config(const char *config_path, bool must_exist)
 		return;
 	}
 
-	if (!(config = wormhole_config_load(config_path)))
+	if (!(config = wormhole_config_load_cached(config_path)))
                 log_fatal("Unable to load configuration file %s", config_path);
 
 	if (!wormhole_profiles_configure(config))
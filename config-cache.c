@@ -0,0 +1,655 @@
+/*
+ * wormhole - compiled config file cache
+ *
+ *   Copyright (C) 2020-2021 Olaf Kirch <okir@suse.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "wormhole.h"
+#include "environment.h"
+#include "config.h"
+#include "util.h"
+#include "tracing.h"
+
+/*
+ * Parsing a config file means tokenizing it line by line, which is a
+ * noticeable part of the startup time of the wormhole client. So we keep
+ * a compiled copy of each config file, stored next to it as
+ * .<name>.cache. This is a flat image in which all references are
+ * offsets from the start of the file, so that we can simply mmap it.
+ *
+ * The cache records the identity of the file it was compiled from
+ * (device, inode, size and mtime), and is ignored if any of these
+ * do not match.
+ *
+ * When loading from the cache, all strings point into the mapped image;
+ * all other objects are carved out of a single allocation.
+ */
+#define WORMHOLE_CONFIG_CACHE_MAGIC	"WHCC"
+#define WORMHOLE_CONFIG_CACHE_VERSION	1
+#define WORMHOLE_CONFIG_CACHE_MAX	(16 * 1024 * 1024)
+
+struct wormhole_cc_header {
+	char			magic[4];
+	uint32_t		version;
+	uint32_t		total_size;
+
+	uint64_t		src_dev;
+	uint64_t		src_ino;
+	uint64_t		src_size;
+	int64_t			src_mtime_sec;
+	uint32_t		src_mtime_nsec;
+
+	/* These help us size the arena when loading */
+	uint32_t		nlayers;
+	uint32_t		npaths;
+	uint32_t		nstrings;
+
+	uint32_t		client_path;
+	uint32_t		nprofiles, profiles;
+	uint32_t		nenvs, envs;
+};
+
+struct wormhole_cc_profile {
+	uint32_t		name;
+	uint32_t		wrapper;
+	uint32_t		command;
+	uint32_t		environment;
+};
+
+struct wormhole_cc_env {
+	uint32_t		name;
+	uint32_t		nprovides, provides;
+	uint32_t		nrequires, requires;
+	uint32_t		nlayers, layers;
+};
+
+struct wormhole_cc_layer {
+	uint32_t		type;
+	uint32_t		use_ldconfig;
+	uint32_t		directory;
+	uint32_t		image;
+	uint32_t		lower_layer_name;
+	uint32_t		npaths, paths;
+};
+
+struct wormhole_cc_path {
+	uint32_t		type;
+	uint32_t		path;
+	uint32_t		fstype;
+	uint32_t		device;
+	uint32_t		options;
+};
+
+struct wormhole_cc_writer {
+	unsigned char *		data;
+	size_t			len;
+	size_t			size;
+	bool			failed;
+};
+
+#define CC_ALIGN(n)		(((n) + 7) & ~7UL)
+#define CC_PTR(w, type, off)	((type *) ((w)->data + (off)))
+
+static char *
+__wormhole_config_cache_path(const char *filename)
+{
+	char pathbuf[PATH_MAX];
+	const char *base;
+
+	base = pathutil_const_basename(filename);
+	if (base == NULL || *base == '\0')
+		return NULL;
+
+	if ((size_t) snprintf(pathbuf, sizeof(pathbuf), "%.*s.%s.cache",
+				(int) (base - filename), filename, base) >= sizeof(pathbuf))
+		return NULL;
+
+	return strdup(pathbuf);
+}
+
+/*
+ * Writing the cache
+ */
+static uint32_t
+wormhole_cc_alloc(struct wormhole_cc_writer *w, size_t size)
+{
+	size_t offset = CC_ALIGN(w->len);
+
+	if (offset + size > WORMHOLE_CONFIG_CACHE_MAX) {
+		w->failed = true;
+		return 0;
+	}
+
+	if (offset + size > w->size) {
+		size_t new_size = w->size? 2 * w->size : 4096;
+
+		while (new_size < offset + size)
+			new_size *= 2;
+
+		w->data = realloc(w->data, new_size);
+		if (w->data == NULL)
+			log_fatal("%s: out of memory", __func__);
+		memset(w->data + w->size, 0, new_size - w->size);
+		w->size = new_size;
+	}
+
+	w->len = offset + size;
+	return offset;
+}
+
+static uint32_t
+wormhole_cc_string(struct wormhole_cc_writer *w, const char *s)
+{
+	uint32_t offset;
+
+	if (s == NULL)
+		return 0;
+
+	offset = wormhole_cc_alloc(w, strlen(s) + 1);
+	if (!w->failed)
+		strcpy(CC_PTR(w, char, offset), s);
+	return offset;
+}
+
+static uint32_t
+wormhole_cc_string_array(struct wormhole_cc_writer *w, const struct strutil_array *array)
+{
+	uint32_t offset;
+	unsigned int i;
+
+	if (array->count == 0)
+		return 0;
+
+	offset = wormhole_cc_alloc(w, array->count * sizeof(uint32_t));
+	for (i = 0; i < array->count && !w->failed; ++i) {
+		uint32_t s = wormhole_cc_string(w, array->data[i]);
+
+		CC_PTR(w, uint32_t, offset)[i] = s;
+	}
+
+	CC_PTR(w, struct wormhole_cc_header, 0)->nstrings += array->count;
+	return offset;
+}
+
+static uint32_t
+wormhole_cc_paths(struct wormhole_cc_writer *w, const struct wormhole_layer_config *layer)
+{
+	uint32_t offset;
+	unsigned int i;
+
+	if (layer->npaths == 0)
+		return 0;
+
+	offset = wormhole_cc_alloc(w, layer->npaths * sizeof(struct wormhole_cc_path));
+	for (i = 0; i < layer->npaths && !w->failed; ++i) {
+		const wormhole_path_info_t *pi = &layer->path[i];
+		struct wormhole_cc_path cp = { .type = pi->type };
+
+		cp.path = wormhole_cc_string(w, pi->path);
+		if (pi->type == WORMHOLE_PATH_TYPE_MOUNT) {
+			cp.fstype = wormhole_cc_string(w, pi->mount.fstype);
+			cp.device = wormhole_cc_string(w, pi->mount.device);
+			cp.options = wormhole_cc_string(w, pi->mount.options);
+		}
+
+		CC_PTR(w, struct wormhole_cc_path, offset)[i] = cp;
+	}
+
+	CC_PTR(w, struct wormhole_cc_header, 0)->npaths += layer->npaths;
+	return offset;
+}
+
+static uint32_t
+wormhole_cc_layers(struct wormhole_cc_writer *w, const struct wormhole_environment_config *env, uint32_t *count_p)
+{
+	const struct wormhole_layer_config *layer;
+	unsigned int i, count = 0;
+	uint32_t offset;
+
+	for (layer = env->layers; layer; layer = layer->next)
+		count++;
+
+	*count_p = count;
+	if (count == 0)
+		return 0;
+
+	offset = wormhole_cc_alloc(w, count * sizeof(struct wormhole_cc_layer));
+	for (layer = env->layers, i = 0; layer && !w->failed; layer = layer->next, ++i) {
+		struct wormhole_cc_layer cl = { .type = layer->type, .use_ldconfig = layer->use_ldconfig };
+
+		cl.directory = wormhole_cc_string(w, layer->directory);
+		cl.image = wormhole_cc_string(w, layer->image);
+		cl.lower_layer_name = wormhole_cc_string(w, layer->lower_layer_name);
+		cl.npaths = layer->npaths;
+		cl.paths = wormhole_cc_paths(w, layer);
+
+		CC_PTR(w, struct wormhole_cc_layer, offset)[i] = cl;
+	}
+
+	CC_PTR(w, struct wormhole_cc_header, 0)->nlayers += count;
+	return offset;
+}
+
+static bool
+__wormhole_config_cache_compile(struct wormhole_cc_writer *w, const struct wormhole_config *cfg, const struct stat *src)
+{
+	const struct wormhole_profile_config *profile;
+	const struct wormhole_environment_config *env;
+	struct wormhole_cc_header *hdr;
+	uint32_t offset, value;
+	unsigned int i, count;
+
+	wormhole_cc_alloc(w, sizeof(*hdr));
+	hdr = CC_PTR(w, struct wormhole_cc_header, 0);
+	memcpy(hdr->magic, WORMHOLE_CONFIG_CACHE_MAGIC, 4);
+	hdr->version = WORMHOLE_CONFIG_CACHE_VERSION;
+	hdr->src_dev = src->st_dev;
+	hdr->src_ino = src->st_ino;
+	hdr->src_size = src->st_size;
+	hdr->src_mtime_sec = src->st_mtim.tv_sec;
+	hdr->src_mtime_nsec = src->st_mtim.tv_nsec;
+
+	value = wormhole_cc_string(w, cfg->client_path);
+	CC_PTR(w, struct wormhole_cc_header, 0)->client_path = value;
+
+	for (count = 0, profile = cfg->profiles; profile; profile = profile->next)
+		count++;
+
+	offset = count? wormhole_cc_alloc(w, count * sizeof(struct wormhole_cc_profile)) : 0;
+	for (i = 0, profile = cfg->profiles; profile && !w->failed; profile = profile->next, ++i) {
+		struct wormhole_cc_profile cp;
+
+		cp.name = wormhole_cc_string(w, profile->name);
+		cp.wrapper = wormhole_cc_string(w, profile->wrapper);
+		cp.command = wormhole_cc_string(w, profile->command);
+		cp.environment = wormhole_cc_string(w, profile->environment);
+		CC_PTR(w, struct wormhole_cc_profile, offset)[i] = cp;
+	}
+	hdr = CC_PTR(w, struct wormhole_cc_header, 0);
+	hdr->nprofiles = count;
+	hdr->profiles = offset;
+
+	for (count = 0, env = cfg->environments; env; env = env->next)
+		count++;
+
+	offset = count? wormhole_cc_alloc(w, count * sizeof(struct wormhole_cc_env)) : 0;
+	for (i = 0, env = cfg->environments; env && !w->failed; env = env->next, ++i) {
+		struct wormhole_cc_env ce;
+
+		ce.name = wormhole_cc_string(w, env->name);
+		ce.nprovides = env->provides.count;
+		ce.provides = wormhole_cc_string_array(w, &env->provides);
+		ce.nrequires = env->requires.count;
+		ce.requires = wormhole_cc_string_array(w, &env->requires);
+		ce.layers = wormhole_cc_layers(w, env, &ce.nlayers);
+		CC_PTR(w, struct wormhole_cc_env, offset)[i] = ce;
+	}
+	hdr = CC_PTR(w, struct wormhole_cc_header, 0);
+	hdr->nenvs = count;
+	hdr->envs = offset;
+
+	hdr->total_size = w->len;
+	return !w->failed;
+}
+
+bool
+wormhole_config_cache_write(const struct wormhole_config *cfg)
+{
+	struct wormhole_cc_writer writer = { .data = NULL };
+	char *cache_path = NULL, temp_path[PATH_MAX];
+	struct stat stb;
+	bool ok = false;
+	int fd = -1;
+
+	/* We do not track the identity of included files */
+	if (cfg->has_includes)
+		return false;
+
+	/* Don't let a setuid client create files owned by root in
+	 * the user's home directory. */
+	if (getuid() != geteuid())
+		return false;
+
+	if (stat(cfg->path, &stb) < 0)
+		return false;
+
+	/* The file changed after we parsed it */
+	if (stb.st_ino != cfg->file_ino || stb.st_size != cfg->file_size
+	 || stb.st_mtim.tv_sec != cfg->file_mtime.tv_sec || stb.st_mtim.tv_nsec != cfg->file_mtime.tv_nsec)
+		return false;
+
+	if (!(cache_path = __wormhole_config_cache_path(cfg->path)))
+		return false;
+
+	if (!__wormhole_config_cache_compile(&writer, cfg, &stb)) {
+		trace("%s: unable to compile config", cfg->path);
+		goto out;
+	}
+
+	snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", cache_path);
+	if ((fd = mkstemp(temp_path)) < 0) {
+		/* Most likely, we're not allowed to write to this directory */
+		trace2("Cannot create %s: %m", temp_path);
+		goto out;
+	}
+
+	if (write(fd, writer.data, writer.len) != (ssize_t) writer.len || fchmod(fd, 0644) < 0) {
+		trace("Cannot write %s: %m", temp_path);
+		unlink(temp_path);
+		goto out;
+	}
+
+	if (rename(temp_path, cache_path) < 0) {
+		trace("Cannot rename %s to %s: %m", temp_path, cache_path);
+		unlink(temp_path);
+		goto out;
+	}
+
+	trace("Wrote compiled config %s (%lu bytes)", cache_path, (unsigned long) writer.len);
+	ok = true;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	free(writer.data);
+	free(cache_path);
+	return ok;
+}
+
+/*
+ * Loading the cache. We do not trust the image any more than the config
+ * file itself, but every offset gets checked so that a truncated or
+ * corrupted file does not make us crash.
+ */
+struct wormhole_cc_reader {
+	const unsigned char *	data;
+	size_t			size;
+
+	/* Objects are allocated from here */
+	unsigned char *		arena;
+	size_t			arena_used;
+	size_t			arena_size;
+
+	bool			failed;
+};
+
+static void *
+wormhole_cc_arena_alloc(struct wormhole_cc_reader *r, size_t size)
+{
+	size_t offset = CC_ALIGN(r->arena_used);
+
+	if (offset + size > r->arena_size) {
+		r->failed = true;
+		return NULL;
+	}
+
+	r->arena_used = offset + size;
+	return r->arena + offset;
+}
+
+static const void *
+wormhole_cc_array(struct wormhole_cc_reader *r, uint32_t offset, uint32_t count, size_t elem_size)
+{
+	if (count == 0)
+		return NULL;
+
+	if (offset == 0 || offset > r->size || count > (r->size - offset) / elem_size) {
+		r->failed = true;
+		return NULL;
+	}
+
+	return r->data + offset;
+}
+
+static char *
+wormhole_cc_get_string(struct wormhole_cc_reader *r, uint32_t offset)
+{
+	if (offset == 0)
+		return NULL;
+
+	if (offset >= r->size || memchr(r->data + offset, '\0', r->size - offset) == NULL) {
+		r->failed = true;
+		return NULL;
+	}
+
+	return (char *) r->data + offset;
+}
+
+static void
+wormhole_cc_get_string_array(struct wormhole_cc_reader *r, struct strutil_array *array, uint32_t offset, uint32_t count)
+{
+	const uint32_t *strings;
+	unsigned int i;
+
+	if (!(strings = wormhole_cc_array(r, offset, count, sizeof(uint32_t))))
+		return;
+
+	if (!(array->data = wormhole_cc_arena_alloc(r, (count + 1) * sizeof(char *))))
+		return;
+
+	for (i = 0; i < count; ++i) {
+		if (!(array->data[i] = wormhole_cc_get_string(r, strings[i])))
+			r->failed = true;
+	}
+	array->count = count;
+}
+
+static struct wormhole_layer_config *
+wormhole_cc_get_layers(struct wormhole_cc_reader *r, uint32_t offset, uint32_t count)
+{
+	const struct wormhole_cc_layer *cl;
+	struct wormhole_layer_config *list = NULL, **tail = &list;
+	unsigned int i, j;
+
+	if (!(cl = wormhole_cc_array(r, offset, count, sizeof(*cl))))
+		return NULL;
+
+	for (i = 0; i < count && !r->failed; ++i, ++cl) {
+		const struct wormhole_cc_path *cp;
+		struct wormhole_layer_config *layer;
+
+		if (!(layer = wormhole_cc_arena_alloc(r, sizeof(*layer))))
+			break;
+
+		layer->type = cl->type;
+		layer->use_ldconfig = cl->use_ldconfig;
+		layer->directory = wormhole_cc_get_string(r, cl->directory);
+		layer->image = wormhole_cc_get_string(r, cl->image);
+		layer->lower_layer_name = wormhole_cc_get_string(r, cl->lower_layer_name);
+
+		if ((cp = wormhole_cc_array(r, cl->paths, cl->npaths, sizeof(*cp))) != NULL
+		 && (layer->path = wormhole_cc_arena_alloc(r, cl->npaths * sizeof(layer->path[0]))) != NULL) {
+			for (j = 0; j < cl->npaths; ++j, ++cp) {
+				wormhole_path_info_t *pi = &layer->path[j];
+
+				pi->type = cp->type;
+				pi->path = wormhole_cc_get_string(r, cp->path);
+				if (pi->type == WORMHOLE_PATH_TYPE_MOUNT) {
+					pi->mount.fstype = wormhole_cc_get_string(r, cp->fstype);
+					pi->mount.device = wormhole_cc_get_string(r, cp->device);
+					pi->mount.options = wormhole_cc_get_string(r, cp->options);
+				}
+			}
+			layer->npaths = cl->npaths;
+		}
+
+		*tail = layer;
+		tail = &layer->next;
+	}
+
+	return list;
+}
+
+static bool
+__wormhole_config_cache_decode(struct wormhole_cc_reader *r, const struct wormhole_cc_header *hdr, struct wormhole_config *cfg)
+{
+	struct wormhole_profile_config **ptail = &cfg->profiles;
+	struct wormhole_environment_config **etail = &cfg->environments;
+	const struct wormhole_cc_profile *cp;
+	const struct wormhole_cc_env *ce;
+	unsigned int i;
+
+	cfg->client_path = wormhole_cc_get_string(r, hdr->client_path);
+
+	cp = wormhole_cc_array(r, hdr->profiles, hdr->nprofiles, sizeof(*cp));
+	for (i = 0; cp && i < hdr->nprofiles && !r->failed; ++i, ++cp) {
+		struct wormhole_profile_config *profile;
+
+		if (!(profile = wormhole_cc_arena_alloc(r, sizeof(*profile))))
+			break;
+
+		profile->name = wormhole_cc_get_string(r, cp->name);
+		profile->wrapper = wormhole_cc_get_string(r, cp->wrapper);
+		profile->command = wormhole_cc_get_string(r, cp->command);
+		profile->environment = wormhole_cc_get_string(r, cp->environment);
+
+		*ptail = profile;
+		ptail = &profile->next;
+	}
+
+	ce = wormhole_cc_array(r, hdr->envs, hdr->nenvs, sizeof(*ce));
+	for (i = 0; ce && i < hdr->nenvs && !r->failed; ++i, ++ce) {
+		struct wormhole_environment_config *env;
+
+		if (!(env = wormhole_cc_arena_alloc(r, sizeof(*env))))
+			break;
+
+		if (!(env->name = wormhole_cc_get_string(r, ce->name)))
+			r->failed = true;
+		wormhole_cc_get_string_array(r, &env->provides, ce->provides, ce->nprovides);
+		wormhole_cc_get_string_array(r, &env->requires, ce->requires, ce->nrequires);
+		env->layers = wormhole_cc_get_layers(r, ce->layers, ce->nlayers);
+
+		*etail = env;
+		etail = &env->next;
+	}
+
+	return !r->failed;
+}
+
+struct wormhole_config *
+wormhole_config_cache_load(const char *filename)
+{
+	struct wormhole_cc_reader reader = { .data = NULL };
+	const struct wormhole_cc_header *hdr;
+	struct wormhole_config *cfg = NULL;
+	struct stat src, stb;
+	char *cache_path;
+	void *map = NULL;
+	int fd = -1;
+
+	if (stat(filename, &src) < 0)
+		return NULL;
+
+	if (!(cache_path = __wormhole_config_cache_path(filename)))
+		return NULL;
+
+	if ((fd = open(cache_path, O_RDONLY)) < 0)
+		goto out;
+
+	if (fstat(fd, &stb) < 0 || !S_ISREG(stb.st_mode))
+		goto out;
+
+	/* The cache must belong to whoever owns the config file (or root) */
+	if (stb.st_uid != src.st_uid && stb.st_uid != 0) {
+		trace("Ignoring %s: owned by uid %d", cache_path, stb.st_uid);
+		goto out;
+	}
+
+	if (stb.st_size < (off_t) sizeof(*hdr) || stb.st_size > WORMHOLE_CONFIG_CACHE_MAX)
+		goto out;
+
+	map = mmap(NULL, stb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		goto out;
+	}
+
+	hdr = map;
+	if (memcmp(hdr->magic, WORMHOLE_CONFIG_CACHE_MAGIC, 4)
+	 || hdr->version != WORMHOLE_CONFIG_CACHE_VERSION
+	 || hdr->total_size != stb.st_size)
+		goto out;
+
+	if (hdr->src_dev != src.st_dev
+	 || hdr->src_ino != src.st_ino
+	 || hdr->src_size != (uint64_t) src.st_size
+	 || hdr->src_mtime_sec != src.st_mtim.tv_sec
+	 || hdr->src_mtime_nsec != src.st_mtim.tv_nsec) {
+		trace2("%s is out of date", cache_path);
+		goto out;
+	}
+
+	reader.data = map;
+	reader.size = stb.st_size;
+	reader.arena_size = hdr->nprofiles * CC_ALIGN(sizeof(struct wormhole_profile_config))
+			  + hdr->nenvs * CC_ALIGN(sizeof(struct wormhole_environment_config))
+			  + hdr->nenvs * 2 * sizeof(char *)
+			  + hdr->nlayers * CC_ALIGN(sizeof(struct wormhole_layer_config))
+			  + hdr->npaths * sizeof(wormhole_path_info_t)
+			  + hdr->nstrings * sizeof(char *)
+			  + 8 * (hdr->nlayers + 2 * hdr->nenvs);
+
+	/* Guard against a header claiming absurd counts */
+	if (reader.arena_size > 64 * (size_t) stb.st_size)
+		goto out;
+
+	reader.arena = calloc(1, reader.arena_size? : 1);
+
+	cfg = calloc(1, sizeof(*cfg));
+	strutil_set(&cfg->path, filename);
+	cfg->file_dev = src.st_dev;
+	cfg->file_ino = src.st_ino;
+	cfg->file_size = src.st_size;
+	cfg->file_mtime = src.st_mtim;
+
+	if (!__wormhole_config_cache_decode(&reader, hdr, cfg)) {
+		log_warning("Ignoring corrupted config cache %s", cache_path);
+		free(cfg->path);
+		free(cfg);
+		free(reader.arena);
+		cfg = NULL;
+		goto out;
+	}
+
+	cfg->cache_map = map;
+	cfg->cache_size = stb.st_size;
+	cfg->cache_arena = reader.arena;
+	map = NULL;
+
+	trace2("Loaded %s from compiled cache", filename);
+
+out:
+	if (map)
+		munmap(map, stb.st_size);
+	if (fd >= 0)
+		close(fd);
+	free(cache_path);
+	return cfg;
+}
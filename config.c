@@ -20,6 +20,7 @@
 
 
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
@@ -28,11 +29,13 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <time.h>
 
 #include "wormhole.h"
 #include "profiles.h"
 #include "config.h"
 #include "util.h"
+#include "watch.h"
 #include "tracing.h"
 
 struct parser_state {
@@ -74,24 +77,161 @@ static void		wormhole_profile_config_free(struct wormhole_profile_config *profil
 static void		wormhole_environment_config_free(struct wormhole_environment_config *env);
 
 
+static bool
+__wormhole_config_file_changed(const struct wormhole_config *cfg)
+{
+	struct stat stb;
+
+	if (stat(cfg->path, &stb) < 0)
+		return true;
+
+	return stb.st_dev != cfg->file_dev
+	    || stb.st_ino != cfg->file_ino
+	    || stb.st_size != cfg->file_size
+	    || stb.st_mtim.tv_sec != cfg->file_mtime.tv_sec
+	    || stb.st_mtim.tv_nsec != cfg->file_mtime.tv_nsec;
+}
+
+static struct wormhole_config *	wormhole_known_configs;
+static void			(*wormhole_config_change_fn)(const struct wormhole_config *);
+
+/*
+ * Register a function to be called when a config file returned by
+ * wormhole_config_get() is found to have changed.
+ */
+void
+wormhole_config_notify_changes(void (*fn)(const struct wormhole_config *))
+{
+	wormhole_config_change_fn = fn;
+}
+
+/*
+ * Called by the watcher when the config file, or one of the files it
+ * includes, changed. Forget about it; the next wormhole_config_get()
+ * will load it again.
+ */
+static void
+__wormhole_config_watch_event(const char *path, void *closure)
+{
+	struct wormhole_config **pos, *cfg;
+
+	for (pos = &wormhole_known_configs; (cfg = *pos) != NULL; pos = &cfg->next) {
+		if (cfg == closure) {
+			trace("Configuration file %s changed", cfg->path);
+			*pos = cfg->next;
+			cfg->next = NULL;
+
+			wormhole_watch_cancel(__wormhole_config_watch_event, cfg);
+
+			if (wormhole_config_change_fn)
+				wormhole_config_change_fn(cfg);
+			return;
+		}
+	}
+}
+
+/*
+ * Check whether any of the files included by the config were changed
+ * after the given time.
+ */
+static bool
+__wormhole_config_includes_changed(const struct wormhole_config *cfg, const struct timespec *since)
+{
+	struct stat stb;
+	unsigned int i;
+
+	for (i = 0; i < cfg->included_files.count; ++i) {
+		if (stat(cfg->included_files.data[i], &stb) < 0)
+			continue;
+
+		if (stb.st_ctim.tv_sec > since->tv_sec
+		 || (stb.st_ctim.tv_sec == since->tv_sec && stb.st_ctim.tv_nsec >= since->tv_nsec))
+			return true;
+	}
+
+	return false;
+}
+
+static void
+__wormhole_config_watch(struct wormhole_config *cfg)
+{
+	unsigned int i;
+
+	wormhole_watch_path(cfg->path, __wormhole_config_watch_event, cfg);
+	for (i = 0; i < cfg->included_files.count; ++i)
+		wormhole_watch_path(cfg->included_files.data[i], __wormhole_config_watch_event, cfg);
+}
+
+/*
+ * Return the config object for this file, loading it if needed.
+ * If the file changed since we last loaded it, it is loaded again.
+ * Callers can tell by comparing the pointer returned.
+ *
+ * If we're watching files for changes, we rely on being told about
+ * changes, and do not need to check the file each time.
+ */
 const struct wormhole_config *
 wormhole_config_get(const char *filename)
 {
-	static struct wormhole_config *known_configs = NULL;
 	struct wormhole_config **pos, *cfg;
+	bool watching = wormhole_watch_enabled();
+	struct timespec load_started;
+
+	for (pos = &wormhole_known_configs; (cfg = *pos) != NULL; pos = &cfg->next) {
+		if (strutil_equal(cfg->path, filename)) {
+			if (watching || !__wormhole_config_file_changed(cfg))
+				return cfg; /* I've seen you before */
+
+			trace("Configuration file %s changed", filename);
 
-	for (pos = &known_configs; (cfg = *pos) != NULL; pos = &cfg->next) {
-		if (strutil_equal(cfg->path, filename))
-			return cfg; /* I've seen you before */
+			/* Profiles and environments created from the old
+			 * config may still refer to it, so we cannot free it. */
+			*pos = cfg->next;
+			cfg->next = NULL;
+
+			if (wormhole_config_change_fn)
+				wormhole_config_change_fn(cfg);
+			break;
+		}
 	}
 
+	/* Start watching the file before we load it; otherwise, we would
+	 * miss changes made while we're loading it. We do not have a config
+	 * object yet, so we use a placeholder closure, and replace it once
+	 * we do. Both share the same inotify watch, and any event queued in
+	 * the meantime goes to the real one. */
+	if (watching)
+		wormhole_watch_path(filename, __wormhole_config_watch_event, (void *) filename);
+
 	trace("Loading configuration from %s", filename);
-	if (!(cfg = wormhole_config_load(filename))) {
+	clock_gettime(CLOCK_REALTIME_COARSE, &load_started);
+	cfg = wormhole_config_load_cached(filename);
+
+	if (cfg != NULL && watching) {
+		__wormhole_config_watch(cfg);
+
+		/* We learn about included files only by loading the config.
+		 * If one of them changed while we did, we missed it. */
+		if (__wormhole_config_includes_changed(cfg, &load_started)) {
+			trace("Configuration file %s changed while loading it", filename);
+			wormhole_watch_cancel(__wormhole_config_watch_event, cfg);
+			wormhole_config_free(cfg);
+			cfg = wormhole_config_load_cached(filename);
+			if (cfg != NULL)
+				__wormhole_config_watch(cfg);
+		}
+	}
+
+	if (watching)
+		wormhole_watch_cancel(__wormhole_config_watch_event, (void *) filename);
+
+	if (cfg == NULL) {
 		log_error("Failed to load config file %s", filename);
 		return NULL;
 	}
 
-	*pos = cfg;
+	cfg->next = wormhole_known_configs;
+	wormhole_known_configs = cfg;
 	return cfg;
 }
 
@@ -100,8 +240,19 @@ wormhole_config_load(const char *filename)
 {
 	struct wormhole_config *cfg;
 	struct wormhole_environment_config *env;
+	struct stat stb;
 
 	cfg = __wormhole_config_new(filename);
+
+	/* Do this before parsing the file; if it changes while we're reading
+	 * it, we will notice next time around. */
+	if (stat(filename, &stb) >= 0) {
+		cfg->file_dev = stb.st_dev;
+		cfg->file_ino = stb.st_ino;
+		cfg->file_size = stb.st_size;
+		cfg->file_mtime = stb.st_mtim;
+	}
+
 	if (!wormhole_config_process_file(cfg, filename, NULL)) {
 		wormhole_config_free(cfg);
 		return NULL;
@@ -123,6 +274,25 @@ wormhole_config_load(const char *filename)
 	return cfg;
 }
 
+/*
+ * Same as above, but try the compiled cache first. If there is no
+ * usable cache, parse the file and try to create one.
+ * The config returned must be treated as read-only.
+ */
+struct wormhole_config *
+wormhole_config_load_cached(const char *filename)
+{
+	struct wormhole_config *cfg;
+
+	if ((cfg = wormhole_config_cache_load(filename)) != NULL)
+		return cfg;
+
+	if ((cfg = wormhole_config_load(filename)) != NULL)
+		wormhole_config_cache_write(cfg);
+
+	return cfg;
+}
+
 /*
  * toplevel config object
  */
@@ -143,6 +313,14 @@ wormhole_config_free(struct wormhole_config *cfg)
 	struct wormhole_profile_config *profile;
 	struct wormhole_environment_config *env;
 
+	if (cfg->cache_map) {
+		munmap(cfg->cache_map, cfg->cache_size);
+		free(cfg->cache_arena);
+		free(cfg->path);
+		free(cfg);
+		return;
+	}
+
 	while ((profile = cfg->profiles) != NULL) {
 		cfg->profiles = profile->next;
 		wormhole_profile_config_free(profile);
@@ -153,6 +331,7 @@ wormhole_config_free(struct wormhole_config *cfg)
 		wormhole_environment_config_free(env);
 	}
 
+	strutil_array_destroy(&cfg->included_files);
 	strutil_set(&cfg->client_path, NULL);
 	free(cfg);
 }
@@ -501,6 +680,10 @@ __wormhole_config_process_include(struct wormhole_config *cfg, const char *filen
 {
 	struct stat stb;
 
+	/* Remember this, so that the daemon can watch it for changes.
+	 * This includes files that do not exist (yet). */
+	strutil_array_append(&cfg->included_files, filename);
+
 	if (stat(filename, &stb) < 0) {
 		if (errno == ENOENT)
 			return true;
@@ -553,6 +736,7 @@ wormhole_config_process_include(struct wormhole_config *cfg, struct parser_state
 		return false;
 	}
 
+	cfg->has_includes = true;
 	return __wormhole_config_process_include(cfg, filename, ps);
 }
 
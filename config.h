@@ -21,6 +21,8 @@
 #ifndef _WORMHOLE_CONFIG_H
 #define _WORMHOLE_CONFIG_H
 
+#include <sys/types.h>
+#include <time.h>
 #include "types.h"
 
 struct wormhole_profile_config {
@@ -70,6 +72,24 @@ struct wormhole_config {
 	/* Path the config file was loaded from */
 	char *			path;
 
+	/* Identity of the file at the time we loaded it. We use this to
+	 * detect whether the file was changed or replaced. */
+	dev_t			file_dev;
+	ino_t			file_ino;
+	off_t			file_size;
+	struct timespec		file_mtime;
+
+	/* Set if the file pulls in other config files */
+	bool			has_includes;
+	struct strutil_array	included_files;
+
+	/* If the config was loaded from the compiled cache, all strings
+	 * point into the mapped cache file, and all other objects live
+	 * in a single chunk of memory. */
+	void *			cache_map;
+	size_t			cache_size;
+	void *			cache_arena;
+
 	/* Pathname to the wormhole client 
 	 * XXX is this really needed?
 	 */
@@ -80,7 +100,11 @@ struct wormhole_config {
 };
 
 extern const struct wormhole_config *wormhole_config_get(const char *filename);
+extern void			wormhole_config_notify_changes(void (*fn)(const struct wormhole_config *));
 extern struct wormhole_config *	wormhole_config_load(const char *filename);
+extern struct wormhole_config *	wormhole_config_load_cached(const char *filename);
+extern bool			wormhole_config_cache_write(const struct wormhole_config *cfg);
+extern struct wormhole_config *	wormhole_config_cache_load(const char *filename);
 extern bool			wormhole_config_write(const struct wormhole_config *cfg, const char *filename);
 extern void			wormhole_config_free(struct wormhole_config *cfg);
 
@@ -0,0 +1,582 @@
+/*
+ * dedup.c - content addressed file store for layers
+ *
+ *   Copyright (C) 2020-2021 Olaf Kirch <okir@suse.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pwd.h>
+
+#include "tracing.h"
+#include "wormhole.h"
+#include "dedup.h"
+#include "util.h"
+
+/*
+ * Layers created by digger frequently contain the same files (think of
+ * shared libraries that get pulled into many layers by the same package).
+ * We hash regular files, and replace duplicates with hard links to a
+ * canonical copy kept in a store directory, so that all overlays share
+ * one inode, and one set of page cache pages.
+ *
+ * Store entries are named after the SHA-256 of the file contents plus
+ * the metadata that a hard link would share (mode, owner, mtime, and
+ * extended attributes such as file capabilities, ACLs or SELinux labels),
+ * so that deduplication does not change what the layer looks like.
+ * The hash only serves to find candidates; before linking, we compare
+ * the contents byte by byte.
+ *
+ * Once all layers using a store entry are gone, the store holds the only
+ * link to it; we prune these entries after deduplicating a tree.
+ */
+
+/*
+ * SHA-256, as per FIPS 180-4
+ */
+struct sha256_ctx {
+	uint32_t		state[8];
+	uint64_t		count;
+	unsigned char		buffer[64];
+};
+
+static const uint32_t	sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_init(struct sha256_ctx *ctx)
+{
+	static const uint32_t initial_state[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->state, initial_state, sizeof(initial_state));
+	ctx->count = 0;
+}
+
+static void
+sha256_transform(struct sha256_ctx *ctx, const unsigned char *block)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h;
+	unsigned int i;
+
+	for (i = 0; i < 16; ++i)
+		w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16
+		     | (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+	for (; i < 64; ++i) {
+		uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+	e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+
+	for (i = 0; i < 64; ++i) {
+		uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+	ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+static void
+sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	unsigned int used = ctx->count % 64;
+
+	ctx->count += len;
+
+	if (used) {
+		unsigned int fill = 64 - used;
+
+		if (len < fill) {
+			memcpy(ctx->buffer + used, p, len);
+			return;
+		}
+		memcpy(ctx->buffer + used, p, fill);
+		sha256_transform(ctx, ctx->buffer);
+		p += fill;
+		len -= fill;
+	}
+
+	while (len >= 64) {
+		sha256_transform(ctx, p);
+		p += 64;
+		len -= 64;
+	}
+
+	memcpy(ctx->buffer, p, len);
+}
+
+static void
+sha256_final(struct sha256_ctx *ctx, unsigned char digest[32])
+{
+	uint64_t bits = ctx->count * 8;
+	unsigned char pad[72];
+	unsigned int i, padlen;
+
+	padlen = 64 - (ctx->count % 64);
+	if (padlen < 9)
+		padlen += 64;
+
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; ++i)
+		pad[padlen - 1 - i] = bits >> (8 * i);
+	sha256_update(ctx, pad, padlen);
+
+	for (i = 0; i < 8; ++i) {
+		digest[4 * i] = ctx->state[i] >> 24;
+		digest[4 * i + 1] = ctx->state[i] >> 16;
+		digest[4 * i + 2] = ctx->state[i] >> 8;
+		digest[4 * i + 3] = ctx->state[i];
+	}
+}
+
+#define DEDUP_IOBUF_SIZE	(64 * 1024)
+#define DEDUP_TEMP_SUFFIX	".wormhole-dedup"
+
+struct wormhole_dedup_state {
+	char			store_dir[PATH_MAX];
+	bool			private_store;
+	dev_t			dev;
+
+	struct wormhole_dedup_stats *stats;
+	unsigned char		iobuf[2][DEDUP_IOBUF_SIZE];
+};
+
+const char *
+wormhole_dedup_store_dir(void)
+{
+	static char pathbuf[PATH_MAX];
+	struct passwd *pw;
+
+	if (getuid() == 0)
+		return WORMHOLE_DEDUP_PATH;
+
+	if (!(pw = getpwuid(getuid())) || !pw->pw_dir)
+		return NULL;
+
+	snprintf(pathbuf, sizeof(pathbuf), "%s%s", pw->pw_dir, WORMHOLE_USER_DEDUP_PATH + 1);
+	return pathbuf;
+}
+
+static int
+__wormhole_dedup_xattr_name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(const char **) a, *(const char **) b);
+}
+
+/*
+ * Get the names of all extended attributes of the file, sorted.
+ * Returns the number of names, or -1 on error. The names point into buf.
+ */
+static int
+__wormhole_dedup_xattr_names(int fd, char *buf, size_t size, char **names, unsigned int max)
+{
+	ssize_t len;
+	char *s;
+	int count = 0;
+
+	if ((len = flistxattr(fd, buf, size)) < 0)
+		return (errno == ENOTSUP)? 0 : -1;
+
+	for (s = buf; s < buf + len; s += strlen(s) + 1) {
+		if (count >= max) {
+			errno = E2BIG;
+			return -1;
+		}
+		names[count++] = s;
+	}
+
+	qsort(names, count, sizeof(names[0]), __wormhole_dedup_xattr_name_cmp);
+	return count;
+}
+
+/*
+ * Hash the extended attributes of the file. Returns false on error, and
+ * leaves digest empty if the file has none.
+ */
+static bool
+__wormhole_dedup_hash_xattrs(struct wormhole_dedup_state *ds, int fd, char *digest_hex)
+{
+	char namebuf[4096], *names[64];
+	unsigned char digest[32];
+	struct sha256_ctx ctx;
+	int i, count;
+
+	*digest_hex = '\0';
+
+	if ((count = __wormhole_dedup_xattr_names(fd, namebuf, sizeof(namebuf), names, 64)) <= 0)
+		return count == 0;
+
+	sha256_init(&ctx);
+	for (i = 0; i < count; ++i) {
+		ssize_t n;
+
+		if ((n = fgetxattr(fd, names[i], ds->iobuf[0], DEDUP_IOBUF_SIZE)) < 0)
+			return false;
+
+		sha256_update(&ctx, names[i], strlen(names[i]) + 1);
+		sha256_update(&ctx, &n, sizeof(n));
+		sha256_update(&ctx, ds->iobuf[0], n);
+	}
+	sha256_final(&ctx, digest);
+
+	for (i = 0; i < 8; ++i)
+		digest_hex += sprintf(digest_hex, "%02x", digest[i]);
+	return true;
+}
+
+/*
+ * Copy the extended attributes of sfd to dfd
+ */
+static bool
+__wormhole_dedup_copy_xattrs(struct wormhole_dedup_state *ds, int sfd, int dfd)
+{
+	char namebuf[4096], *names[64];
+	int i, count;
+
+	if ((count = __wormhole_dedup_xattr_names(sfd, namebuf, sizeof(namebuf), names, 64)) < 0)
+		return false;
+
+	for (i = 0; i < count; ++i) {
+		ssize_t n;
+
+		if ((n = fgetxattr(sfd, names[i], ds->iobuf[1], DEDUP_IOBUF_SIZE)) < 0
+		 || fsetxattr(dfd, names[i], ds->iobuf[1], n, 0) < 0)
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+__wormhole_dedup_hash(struct wormhole_dedup_state *ds, int fd, const struct stat *stb, char *key, size_t key_size)
+{
+	struct sha256_ctx ctx;
+	unsigned char digest[32];
+	char xattr_hex[32];
+	unsigned int i;
+	ssize_t n;
+	char *s;
+
+	if (!__wormhole_dedup_hash_xattrs(ds, fd, xattr_hex))
+		return false;
+
+	sha256_init(&ctx);
+	while ((n = read(fd, ds->iobuf[0], DEDUP_IOBUF_SIZE)) > 0)
+		sha256_update(&ctx, ds->iobuf[0], n);
+	if (n < 0)
+		return false;
+	sha256_final(&ctx, digest);
+
+	/* Store entries are spread across 256 subdirectories: xx/xxxxx... */
+	for (i = 0, s = key; i < 32; ++i) {
+		s += sprintf(s, "%02x", digest[i]);
+		if (i == 0)
+			*s++ = '/';
+	}
+	s += snprintf(s, key_size - (s - key), "-%o-%u-%u-%lld",
+			(unsigned int) (stb->st_mode & 07777), stb->st_uid, stb->st_gid,
+			(long long) stb->st_mtim.tv_sec);
+
+	/* Files without extended attributes keep the key they always had */
+	if (xattr_hex[0])
+		snprintf(s, key_size - (s - key), "-x%s", xattr_hex);
+	return true;
+}
+
+static bool
+__wormhole_dedup_same_content(struct wormhole_dedup_state *ds, int fd, const char *store_path)
+{
+	bool same = true;
+	int sfd;
+
+	if ((sfd = open(store_path, O_RDONLY|O_NOFOLLOW)) < 0)
+		return false;
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		close(sfd);
+		return false;
+	}
+
+	while (same) {
+		ssize_t n, m;
+
+		n = read(fd, ds->iobuf[0], DEDUP_IOBUF_SIZE);
+		m = read(sfd, ds->iobuf[1], DEDUP_IOBUF_SIZE);
+		if (n < 0 || n != m)
+			same = false;
+		else if (n == 0)
+			break;
+		else if (memcmp(ds->iobuf[0], ds->iobuf[1], n))
+			same = false;
+	}
+
+	close(sfd);
+	return same;
+}
+
+/*
+ * Create a reflink of store_path at temp_path, with the same metadata.
+ * This is what we fall back to when we cannot hard link, for instance
+ * because the store entry already has the maximum number of links.
+ */
+static bool
+__wormhole_dedup_reflink(struct wormhole_dedup_state *ds, const char *store_path, const char *temp_path, const struct stat *stb)
+{
+	struct timespec times[2] = { stb->st_atim, stb->st_mtim };
+	int sfd, dfd;
+	bool ok = false;
+
+	if ((sfd = open(store_path, O_RDONLY|O_NOFOLLOW)) < 0)
+		return false;
+
+	if ((dfd = open(temp_path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0600)) < 0) {
+		close(sfd);
+		return false;
+	}
+
+	/* Changing the owner clears file capabilities, so copy the
+	 * extended attributes last */
+	if (ioctl(dfd, FICLONE, sfd) >= 0
+	 && fchown(dfd, stb->st_uid, stb->st_gid) >= 0
+	 && fchmod(dfd, stb->st_mode & 07777) >= 0
+	 && __wormhole_dedup_copy_xattrs(ds, sfd, dfd)
+	 && futimens(dfd, times) >= 0)
+		ok = true;
+
+	close(dfd);
+	close(sfd);
+
+	if (!ok)
+		unlink(temp_path);
+	return ok;
+}
+
+static int
+__wormhole_dedup_visitor(const char *dir_path, const struct dirent *d, int flags, void *closure)
+{
+	struct wormhole_dedup_state *ds = closure;
+	struct wormhole_dedup_stats *stats = ds->stats;
+	char key[160];
+	char path[PATH_MAX], store_path[PATH_MAX + sizeof(key)], temp_path[PATH_MAX + 32];
+	struct stat stb, sstb;
+	bool linked;
+	int fd;
+
+	if (d->d_type != DT_REG)
+		return FTW_CONTINUE;
+
+	snprintf(path, sizeof(path), "%s/%s", dir_path, d->d_name);
+
+	if ((fd = open(path, O_RDONLY|O_NOFOLLOW|O_NOCTTY)) < 0) {
+		/* Could be one of our temp links that has been renamed already */
+		if (errno != ENOENT)
+			trace("dedup: cannot open %s: %m", path);
+		return FTW_CONTINUE;
+	}
+
+	if (fstat(fd, &stb) < 0 || !S_ISREG(stb.st_mode) || stb.st_size == 0)
+		goto out;
+
+	stats->files_scanned += 1;
+	stats->bytes_scanned += stb.st_size;
+
+	if (!__wormhole_dedup_hash(ds, fd, &stb, key, sizeof(key))) {
+		log_warning("dedup: error reading %s: %m", path);
+		goto out;
+	}
+
+	snprintf(store_path, sizeof(store_path), "%s/%s", ds->store_dir, key);
+
+	if (lstat(store_path, &sstb) < 0) {
+		if (errno != ENOENT) {
+			trace("dedup: cannot stat %s: %m", store_path);
+			goto out;
+		}
+
+		/* This is the first copy we've seen; make it the canonical one */
+		if (!fsutil_makedirs(pathutil_dirname(store_path), 0755)
+		 || link(path, store_path) < 0)
+			trace("dedup: cannot add %s to store: %m", path);
+		goto out;
+	}
+
+	if (sstb.st_dev == stb.st_dev && sstb.st_ino == stb.st_ino)
+		goto out;
+
+	if (!S_ISREG(sstb.st_mode) || sstb.st_size != stb.st_size
+	 || !__wormhole_dedup_same_content(ds, fd, store_path)) {
+		log_warning("dedup: store entry %s does not match %s, ignoring", store_path, path);
+		goto out;
+	}
+
+	snprintf(temp_path, sizeof(temp_path), "%s" DEDUP_TEMP_SUFFIX, path);
+	(void) unlink(temp_path);
+
+	linked = (link(store_path, temp_path) >= 0);
+	if (!linked)
+		linked = __wormhole_dedup_reflink(ds, store_path, temp_path, &stb);
+
+	if (!linked) {
+		trace("dedup: unable to link %s to %s: %m", path, store_path);
+		goto out;
+	}
+
+	if (rename(temp_path, path) < 0) {
+		log_error("dedup: cannot replace %s: %m", path);
+		unlink(temp_path);
+		goto out;
+	}
+
+	trace2("dedup: %s -> %s", path, key);
+	stats->files_linked += 1;
+	if (stb.st_nlink == 1)
+		stats->bytes_saved += stb.st_size;
+
+out:
+	close(fd);
+	return FTW_CONTINUE;
+}
+
+/*
+ * Remove store entries that no layer links to anymore
+ */
+static int
+__wormhole_dedup_prune_visitor(const char *dir_path, const struct dirent *d, int flags, void *closure)
+{
+	struct wormhole_dedup_state *ds = closure;
+	char path[PATH_MAX];
+	struct stat stb;
+
+	if (d->d_type != DT_REG)
+		return FTW_CONTINUE;
+
+	snprintf(path, sizeof(path), "%s/%s", dir_path, d->d_name);
+	if (lstat(path, &stb) == 0 && S_ISREG(stb.st_mode) && stb.st_nlink == 1) {
+		if (unlink(path) < 0)
+			trace("dedup: cannot remove %s: %m", path);
+		else
+			ds->stats->entries_pruned += 1;
+	}
+
+	return FTW_CONTINUE;
+}
+
+/*
+ * The store must be on the same file system as the tree, and we only
+ * trust it if nobody but us can write to it.
+ * Otherwise, we still deduplicate within the tree, using a temporary
+ * store next to it.
+ */
+static bool
+__wormhole_dedup_select_store(struct wormhole_dedup_state *ds, const char *tree_root, const char *store_dir)
+{
+	struct stat stb;
+
+	if (stat(tree_root, &stb) < 0) {
+		log_error("Cannot stat %s: %m", tree_root);
+		return false;
+	}
+	ds->dev = stb.st_dev;
+
+	if (store_dir != NULL && fsutil_makedirs(store_dir, 0755)) {
+		if (stat(store_dir, &stb) < 0) {
+			trace("dedup: cannot stat %s: %m", store_dir);
+		} else if (stb.st_dev != ds->dev) {
+			trace("dedup: %s is on a different file system than %s", store_dir, tree_root);
+		} else if (stb.st_uid != geteuid() || (stb.st_mode & (S_IWGRP | S_IWOTH))) {
+			log_warning("Not using dedup store %s: writable by others", store_dir);
+		} else if (access(store_dir, W_OK) < 0) {
+			trace("dedup: cannot write to %s", store_dir);
+		} else {
+			snprintf(ds->store_dir, sizeof(ds->store_dir), "%s", store_dir);
+			return true;
+		}
+	}
+
+	snprintf(ds->store_dir, sizeof(ds->store_dir), "%s/.wormhole-dedup.XXXXXX", pathutil_dirname(tree_root));
+	if (mkdtemp(ds->store_dir) == NULL) {
+		log_error("Unable to create temporary dedup store: %m");
+		return false;
+	}
+
+	ds->private_store = true;
+	return true;
+}
+
+bool
+wormhole_dedup_tree(const char *tree_root, const char *store_dir, struct wormhole_dedup_stats *stats)
+{
+	struct wormhole_dedup_state *ds;
+	bool ok;
+
+	memset(stats, 0, sizeof(*stats));
+
+	ds = calloc(1, sizeof(*ds));
+	ds->stats = stats;
+
+	if (!__wormhole_dedup_select_store(ds, tree_root, store_dir)) {
+		free(ds);
+		return false;
+	}
+
+	trace("Deduplicating %s using store %s", tree_root, ds->store_dir);
+	ok = fsutil_ftw(tree_root, __wormhole_dedup_visitor, ds, FSUTIL_FTW_ONE_FILESYSTEM);
+
+	/* The tree holds its own links to everything in a private store */
+	if (ds->private_store) {
+		if (!fsutil_remove_recursively(ds->store_dir))
+			ok = false;
+	} else {
+		fsutil_ftw(ds->store_dir, __wormhole_dedup_prune_visitor, ds, FSUTIL_FTW_ONE_FILESYSTEM);
+		trace("dedup: pruned %u unused entries from %s", stats->entries_pruned, ds->store_dir);
+	}
+
+	free(ds);
+	return ok;
+}
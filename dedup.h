@@ -0,0 +1,38 @@
+/*
+ * dedup.h
+ *
+ *   Copyright (C) 2020-2021 Olaf Kirch <okir@suse.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _WORMHOLE_DEDUP_H
+#define _WORMHOLE_DEDUP_H
+
+#include <stdint.h>
+
+struct wormhole_dedup_stats {
+	unsigned int		files_scanned;
+	unsigned int		files_linked;
+	uint64_t		bytes_scanned;
+	uint64_t		bytes_saved;
+	unsigned int		entries_pruned;
+};
+
+extern const char *		wormhole_dedup_store_dir(void);
+extern bool			wormhole_dedup_tree(const char *tree_root, const char *store_dir,
+					struct wormhole_dedup_stats *stats);
+
+#endif // _WORMHOLE_DEDUP_H
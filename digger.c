@@ -26,6 +26,9 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/stat.h>
 
 #include "tracing.h"
 #include "wormhole.h"
@@ -33,12 +36,15 @@
 #include "config.h"
 #include "util.h"
 #include "buffer.h"
+#include "dedup.h"
 
 enum {
 	OPT_BASE_ENVIRONMENT,
 	OPT_OVERLAY_ROOT,
 	OPT_PRIVILEGED_NAMESPACE,
 	OPT_CLEAN,
+	OPT_INCREMENTAL,
+	OPT_DEDUP,
 	OPT_BIND_MOUNT_TYPE,
 	OPT_BUILD_SCRIPT,
 	OPT_BUILD_DIRECTORY,
@@ -52,6 +58,8 @@ struct option wormhole_options[] = {
 	{ "overlay-directory",	required_argument,	NULL,	OPT_OVERLAY_ROOT },
 	{ "privileged-namespace", no_argument,		NULL,	OPT_PRIVILEGED_NAMESPACE },
 	{ "clean",		no_argument,		NULL,	OPT_CLEAN },
+	{ "incremental",	no_argument,		NULL,	OPT_INCREMENTAL },
+	{ "dedup",		no_argument,		NULL,	OPT_DEDUP },
 	{ "bind-mount-type",	required_argument,	NULL,	OPT_BIND_MOUNT_TYPE },
 	{ "build-script",	required_argument,	NULL,	OPT_BUILD_SCRIPT },
 	{ "build-directory",	required_argument,	NULL,	OPT_BUILD_DIRECTORY },
@@ -64,6 +72,8 @@ const char *		opt_base_environment = NULL;
 const char *		opt_overlay_root = NULL;
 bool			opt_privileged_namespace = false;
 bool			opt_clean = false;
+bool			opt_incremental = false;
+bool			opt_dedup = false;
 const char *		opt_build_script = NULL;
 const char *		opt_build_directory = NULL;
 const char *		opt_bind_mount_types[64];
@@ -75,6 +85,7 @@ static void		usage(int exval);
 int
 main(int argc, char **argv)
 {
+	bool ok;
 	int c;
 
 	while ((c = getopt_long(argc, argv, "dh", wormhole_options, NULL)) != EOF) {
@@ -102,6 +113,14 @@ main(int argc, char **argv)
 			opt_clean = true;
 			break;
 
+		case OPT_INCREMENTAL:
+			opt_incremental = true;
+			break;
+
+		case OPT_DEDUP:
+			opt_dedup = true;
+			break;
+
 		case OPT_BIND_MOUNT_TYPE:
 			if (opt_bind_mount_type_count < 63)
 				opt_bind_mount_types[opt_bind_mount_type_count++] = optarg;
@@ -121,9 +140,16 @@ main(int argc, char **argv)
 		}
 	}
 
+	tracing_events_init();
 	wormhole_common_load_config(opt_config_path);
 
-	if (!wormhole_digger(argc - optind, argv + optind)) {
+	ok = wormhole_digger(argc - optind, argv + optind);
+
+	/* Old trees are removed in the background; wait for that to finish */
+	if (!fsutil_trash_reap())
+		ok = false;
+
+	if (!ok) {
 		log_error("Failed to dig wormhole.");
 		return 1;
 	}
@@ -145,6 +171,10 @@ usage(int exval)
 		"     Increase debugging verbosity\n"
 		"  --clean\n"
 		"     Clean up output directory first\n"
+		"  --incremental\n"
+		"     Keep the output directory if it was built from the same inputs, else rebuild it\n"
+		"  --dedup\n"
+		"     Replace files that are already present in the dedup store with hard links\n"
 		"  --privileged-namespace\n"
 		"     Create container using a regular namespace rather than a user namespace.\n"
 		"  --base-environment <name>\n"
@@ -542,21 +572,29 @@ combine_tree(const char *overlay_root, wormhole_tree_state_t *assembled_tree)
 }
 
 static inline bool
-remove_subdir(const char *dir, const char *name)
+remove_subdir(struct fsutil_trash *trash, const char *dir, const char *name)
 {
 	char namebuf[PATH_MAX];
 
 	snprintf(namebuf, sizeof(namebuf), "%s/%s", dir, name);
-	return fsutil_remove_recursively(namebuf);
+	return fsutil_trash_add(trash, namebuf);
 }
 
+/*
+ * Everything we remove here is moved to a trash directory next to the
+ * overlay root, and deleted in the background once we're done.
+ */
 static bool
 clean_tree(const char *overlay_root, wormhole_tree_state_t *assembled_tree)
 {
+	struct fsutil_trash trash;
 	wormhole_tree_walker_t *walk;
 	wormhole_path_state_t *state;
 	const char *mount_point;
 	const char *root_dir;
+	bool ok = false;
+
+	fsutil_trash_init(&trash, overlay_root);
 
 	walk = wormhole_tree_walk(assembled_tree);
 	while ((state = wormhole_tree_walk_next(walk, &mount_point)) != NULL) {
@@ -567,25 +605,53 @@ clean_tree(const char *overlay_root, wormhole_tree_state_t *assembled_tree)
 
 		subtree = pathutil_dirname(state->overlay.upperdir);
 
-		if (!fsutil_remove_recursively(subtree))
-			return false;
+		if (!fsutil_trash_add(&trash, subtree)) {
+			wormhole_tree_walk_end(walk);
+			goto out;
+		}
 
 		wormhole_tree_state_clear(assembled_tree, mount_point);
 	}
 
 	wormhole_tree_walk_end(walk);
 
-	if (!remove_subdir(overlay_root, "work")
-	 || !remove_subdir(overlay_root, "lower")
-	 || !remove_subdir(overlay_root, "tree/build.sh")
-	 || !remove_subdir(overlay_root, "tree/build")
-	 || !remove_subdir(overlay_root, "tree/provides"))
-		return false;
+	if (!remove_subdir(&trash, overlay_root, "work")
+	 || !remove_subdir(&trash, overlay_root, "lower")
+	 || !remove_subdir(&trash, overlay_root, "tree/build.sh")
+	 || !remove_subdir(&trash, overlay_root, "tree/build")
+	 || !remove_subdir(&trash, overlay_root, "tree/provides"))
+		goto out;
 
 	root_dir = wormhole_tree_state_get_root(assembled_tree);
-	if (root_dir && !fsutil_remove_recursively(root_dir))
+	if (root_dir && !fsutil_trash_add(&trash, root_dir))
+		goto out;
+
+	ok = true;
+
+out:
+	fsutil_trash_destroy(&trash);
+	return ok;
+}
+
+static bool
+dedup_tree(const char *overlay_root, const char *store_dir)
+{
+	struct wormhole_dedup_stats stats;
+	char tree_root[PATH_MAX];
+
+	snprintf(tree_root, sizeof(tree_root), "%s/tree", overlay_root);
+	if (!fsutil_isdir(tree_root))
+		return true;
+
+	if (!wormhole_dedup_tree(tree_root, store_dir, &stats)) {
+		log_error("Failed to deduplicate files in %s", tree_root);
 		return false;
+	}
 
+	printf("Deduplicated %u of %u files, saved %llu of %llu bytes\n",
+			stats.files_linked, stats.files_scanned,
+			(unsigned long long) stats.bytes_saved,
+			(unsigned long long) stats.bytes_scanned);
 	return true;
 }
 
@@ -618,6 +684,245 @@ write_config(const char *root_dir, wormhole_environment_t *env)
 	return ok;
 }
 
+/*
+ * The manifest records what a layer was built from, so that we can
+ * tell whether a rebuild would produce the same thing.
+ *  - the base hash covers the base environment: its layers and, for each
+ *    of them, either the manifest of the digger run that created it, or
+ *    the state of its package database.
+ *  - the build hash covers the command, the contents of the build script,
+ *    and the location of the build directory (but not its contents, which
+ *    are frequently used as a cache by the build itself).
+ */
+#define DIGGER_MANIFEST_NAME	".digger.manifest"
+
+struct digger_manifest {
+	uint64_t		base_hash;
+	uint64_t		build_hash;
+};
+
+static const char *	digger_package_db_paths[] = {
+	"/usr/lib/sysimage/rpm",
+	"/var/lib/rpm",
+	"/var/lib/dpkg/status",
+	"/etc/os-release",
+	NULL
+};
+
+#define DIGGER_HASH_INIT	0xcbf29ce484222325ULL
+
+static inline void
+__digger_hash(uint64_t *hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	/* FNV-1a */
+	while (len--)
+		*hash = (*hash ^ *p++) * 0x100000001b3ULL;
+}
+
+static inline void
+__digger_hash_string(uint64_t *hash, const char *s)
+{
+	if (s == NULL)
+		s = "";
+	/* Include the NUL byte so that ("ab", "c") and ("a", "bc") differ */
+	__digger_hash(hash, s, strlen(s) + 1);
+}
+
+static void
+__digger_hash_stat(uint64_t *hash, const char *path)
+{
+	struct stat stb;
+
+	memset(&stb, 0, sizeof(stb));
+	__digger_hash_string(hash, path);
+	if (stat(path, &stb) >= 0) {
+		uint64_t data[] = {
+			stb.st_dev, stb.st_ino, stb.st_size,
+			stb.st_mtim.tv_sec, stb.st_mtim.tv_nsec,
+		};
+
+		__digger_hash(hash, data, sizeof(data));
+	}
+}
+
+static bool
+__digger_hash_file(uint64_t *hash, const char *path)
+{
+	char buffer[8192];
+	FILE *fp;
+	size_t n;
+
+	if (!(fp = fopen(path, "r"))) {
+		log_error("Unable to open %s: %m", path);
+		return false;
+	}
+
+	while ((n = fread(buffer, 1, sizeof(buffer), fp)) != 0)
+		__digger_hash(hash, buffer, n);
+
+	fclose(fp);
+	return true;
+}
+
+static bool
+digger_manifest_read(const char *overlay_root, struct digger_manifest *m)
+{
+	char pathname[PATH_MAX], line[256];
+	unsigned int found = 0;
+	FILE *fp;
+
+	memset(m, 0, sizeof(*m));
+
+	snprintf(pathname, sizeof(pathname), "%s/%s", overlay_root, DIGGER_MANIFEST_NAME);
+	if (!(fp = fopen(pathname, "r")))
+		return false;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "base-hash %" SCNx64, &m->base_hash) == 1)
+			found |= 1;
+		else if (sscanf(line, "build-hash %" SCNx64, &m->build_hash) == 1)
+			found |= 2;
+	}
+
+	fclose(fp);
+	return found == 3;
+}
+
+static bool
+digger_manifest_write(const char *overlay_root, const struct digger_manifest *m,
+			char **argv, const wormhole_environment_t *env)
+{
+	char pathname[PATH_MAX];
+	unsigned int i;
+	FILE *fp;
+
+	snprintf(pathname, sizeof(pathname), "%s/%s", overlay_root, DIGGER_MANIFEST_NAME);
+	if (!(fp = fopen(pathname, "w"))) {
+		log_error("Unable to create %s: %m", pathname);
+		return false;
+	}
+
+	fprintf(fp, "# Written by wormhole-digger. Do not edit.\n");
+	fprintf(fp, "base-hash %016" PRIx64 "\n", m->base_hash);
+	fprintf(fp, "build-hash %016" PRIx64 "\n", m->build_hash);
+	if (opt_base_environment)
+		fprintf(fp, "base-environment %s\n", opt_base_environment);
+	if (opt_build_script)
+		fprintf(fp, "build-script %s\n", opt_build_script);
+	for (; *argv; ++argv)
+		fprintf(fp, "argv %s\n", *argv);
+	for (i = 0; i < env->provides.count; ++i)
+		fprintf(fp, "provides %s\n", env->provides.data[i]);
+
+	if (fclose(fp) == EOF) {
+		log_error("Error writing %s: %m", pathname);
+		return false;
+	}
+
+	return true;
+}
+
+static void
+__digger_hash_root(uint64_t *hash, const char *root)
+{
+	char pathname[PATH_MAX];
+	const char **pp;
+
+	for (pp = digger_package_db_paths; *pp; ++pp) {
+		snprintf(pathname, sizeof(pathname), "%s%s", strcmp(root, "/")? root : "", *pp);
+		__digger_hash_stat(hash, pathname);
+	}
+}
+
+static uint64_t
+digger_base_hash(const wormhole_environment_t *base_env)
+{
+	uint64_t hash = DIGGER_HASH_INIT;
+	unsigned int i;
+
+	if (base_env == NULL) {
+		__digger_hash_root(&hash, "/");
+		return hash;
+	}
+
+	for (i = 0; i < base_env->nlayers; ++i) {
+		const struct wormhole_layer_config *layer = base_env->layer[i];
+		struct digger_manifest base_manifest;
+
+		__digger_hash(&hash, &layer->type, sizeof(layer->type));
+		__digger_hash_string(&hash, layer->directory);
+		__digger_hash_string(&hash, layer->image);
+
+		if (layer->directory == NULL)
+			continue;
+
+		/* Layers built by digger have their tree in $overlay_root/tree,
+		 * next to the manifest. If there's one, it describes the layer
+		 * better than anything we could look at. */
+		if (digger_manifest_read(pathutil_dirname(layer->directory), &base_manifest))
+			__digger_hash(&hash, &base_manifest, sizeof(base_manifest));
+		else
+			__digger_hash_root(&hash, layer->directory);
+	}
+
+	return hash;
+}
+
+static bool
+digger_build_hash(char **argv, uint64_t *hash_ret)
+{
+	uint64_t hash = DIGGER_HASH_INIT;
+	unsigned int i;
+
+	for (; *argv; ++argv)
+		__digger_hash_string(&hash, *argv);
+
+	__digger_hash_string(&hash, opt_build_directory);
+	if (opt_build_script && !__digger_hash_file(&hash, opt_build_script))
+		return false;
+
+	/* These change what we write to the output, too. The environment
+	 * name defaults to the name of the output directory. */
+	__digger_hash_string(&hash, opt_environment_name?: pathutil_const_basename(opt_overlay_root));
+	__digger_hash(&hash, &opt_bind_mount_type_count, sizeof(opt_bind_mount_type_count));
+	for (i = 0; i < opt_bind_mount_type_count; ++i)
+		__digger_hash_string(&hash, opt_bind_mount_types[i]);
+
+	*hash_ret = hash;
+	return true;
+}
+
+/*
+ * Returns true if the existing output in overlay_root was built from
+ * the same inputs.
+ */
+static bool
+digger_manifest_check(const char *overlay_root, const struct digger_manifest *m)
+{
+	struct digger_manifest old;
+
+	if (!digger_manifest_read(overlay_root, &old)) {
+		log_info("%s has no usable manifest, rebuilding", overlay_root);
+		return false;
+	}
+
+	if (old.base_hash != m->base_hash) {
+		log_info("Base environment has changed, rebuilding");
+		return false;
+	}
+
+	if (old.build_hash != m->build_hash) {
+		/* The base environment is used as-is by the new build; there
+		 * is nothing from the previous run that we could reuse. */
+		log_info("Build command or script has changed, rebuilding on top of unchanged base");
+		return false;
+	}
+
+	return true;
+}
+
 static char **
 make_argv_shell(void)
 {
@@ -632,8 +937,12 @@ make_argv_shell(void)
 bool
 wormhole_digger(int argc, char **argv)
 {
-	wormhole_environment_t *env = NULL;
+	wormhole_environment_t *env = NULL, *base_env = NULL;
 	wormhole_tree_state_t *assembled_tree;
+	struct digger_manifest manifest;
+	struct fsutil_trash trash;
+	bool have_manifest = false;
+	const char *dedup_store = NULL;
 	const char *root_dir;
 
 	if (opt_overlay_root == NULL) {
@@ -641,16 +950,49 @@ wormhole_digger(int argc, char **argv)
 		return false;
 	}
 
+	if (opt_base_environment != 0) {
+		if ((base_env = wormhole_environment_by_capability(opt_base_environment)) == NULL) {
+			log_error("Unknown environment %s", opt_base_environment);
+			return false;
+		}
+	}
+
+	/* An interactive shell is not something we can ever consider unchanged */
+	if (opt_incremental && (*argv || opt_build_script)) {
+		char *build_argv[] = { "/build.sh", NULL };
+
+		manifest.base_hash = digger_base_hash(base_env);
+		if (!digger_build_hash(*argv? argv : build_argv, &manifest.build_hash))
+			return false;
+		have_manifest = true;
+
+		trace("Build inputs: base hash %016" PRIx64 ", build hash %016" PRIx64,
+				manifest.base_hash, manifest.build_hash);
+	}
+
+	/* Pick the store now; inside the user namespace, we're root. */
+	if (opt_dedup)
+		dedup_store = wormhole_dedup_store_dir();
+
 	if (fsutil_isdir(opt_overlay_root)) {
-		if (!opt_clean) {
+		if (have_manifest && digger_manifest_check(opt_overlay_root, &manifest)) {
+			printf("%s is up to date, reusing previous build\n", opt_overlay_root);
+			return true;
+		}
+
+		if (!opt_clean && !opt_incremental) {
 			log_error("Directory %s already exists. Please remove, or invoke me with --clean.", opt_overlay_root);
 			return false;
 		}
 
-		if (!fsutil_remove_recursively(opt_overlay_root)) {
+		/* Move the old tree out of the way and remove it while we build */
+		fsutil_trash_init(&trash, opt_overlay_root);
+		if (!fsutil_trash_add(&trash, opt_overlay_root)) {
 			log_error("Unable to clean up %s.", opt_overlay_root);
+			fsutil_trash_destroy(&trash);
 			return false;
 		}
+		fsutil_trash_destroy(&trash);
 	}
 
 	if (!fsutil_makedirs(opt_overlay_root, 0755)) {
@@ -678,16 +1020,11 @@ wormhole_digger(int argc, char **argv)
 	if (opt_environment_name == NULL)
 		opt_environment_name = pathutil_const_basename(opt_overlay_root);
 
-	if (opt_base_environment != 0) {
+	if (base_env != NULL) {
 		/* Set up base environment */
-                if ((env = wormhole_environment_by_capability(opt_base_environment)) == NULL) {
-			log_error("Unknown environment %s", opt_base_environment);
-			return false;
-		}
-
-		trace("Using environment %s (type %d)", env->name, env->layer[0]->type);
+		trace("Using environment %s (type %d)", base_env->name, base_env->layer[0]->type);
 
-		env = wormhole_environment_new(opt_environment_name, env);
+		env = wormhole_environment_new(opt_environment_name, base_env);
 		strutil_array_append(&env->requires, opt_base_environment);
 	} else {
 		env = wormhole_environment_new(opt_environment_name, NULL);
@@ -748,6 +1085,9 @@ wormhole_digger(int argc, char **argv)
 		return false;
 	}
 
+	if (opt_dedup && !dedup_tree(opt_overlay_root, dedup_store))
+		return false;
+
 	if (!update_provides(env))
 		return false;
 
@@ -756,6 +1096,9 @@ wormhole_digger(int argc, char **argv)
 		return false;
 	}
 
+	if (have_manifest && !digger_manifest_write(opt_overlay_root, &manifest, argv, env))
+		return false;
+
 	printf("Combined overlay tree is now in %s\n", opt_overlay_root);
 	return true;
 }
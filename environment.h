@@ -21,7 +21,10 @@
 #ifndef _WORMHOLE_ENVIRONMENT_H
 #define _WORMHOLE_ENVIRONMENT_H
 
+#include <stdint.h>
+
 #include "types.h"
+#include "util.h"
 
 /* fwd decl */
 struct wormhole_profile;
@@ -111,8 +114,31 @@ struct wormhole_environment {
 	int			nsfd;
 	bool			failed;
 
+	/* The daemon sets up environments for unprivileged users inside
+	 * a user namespace owned by that user, so that the client is able
+	 * to join it. For root, these are 0. */
+	uid_t			owner_uid;
+	gid_t			owner_gid;
+
 	wormhole_tree_state_t *	tree_state;
 
+	/* Mask of the layers whose container mounts we hold */
+	unsigned int		images_held;
+
+	/* When using the new mount API, we assemble the environment in
+	 * a detached copy of the mount tree, and attach it at the end. */
+	struct {
+		bool		enabled;
+		int		fd;
+	} mount_tree;
+
+	/* How long the last setup of this environment took */
+	unsigned long long	setup_usec;
+
+	/* The daemon runs the setup process (and whatever it leaves behind)
+	 * in a cgroup of its own. NULL if cgroups are not in use. */
+	char *			cgroup;
+
 	/* Information on the sub-daemon for this context. */
 	struct {
 		char *		socket_name;
@@ -123,18 +149,48 @@ struct wormhole_environment {
 /* fwd decl */
 struct procutil_command;
 
+typedef void			wormhole_environment_async_callback_fn_t(wormhole_environment_t *, void *closure);
+
 extern wormhole_environment_t *	wormhole_environment_find(const char *name);
+extern wormhole_environment_t *	wormhole_environment_list(void);
 extern wormhole_environment_t *	wormhole_environment_by_capability(const char *name);
 extern bool			wormhole_environment_setup(wormhole_environment_t *env);
+extern bool			wormhole_environment_setup_detached(wormhole_environment_t *env);
 extern bool			wormhole_environment_async_check(wormhole_environment_t *);
 extern struct wormhole_socket *	wormhole_environment_async_setup(wormhole_environment_t *, struct wormhole_profile *);
-extern wormhole_environment_t *	wormhole_environment_async_complete(pid_t pid, int status);
+extern wormhole_environment_t *	wormhole_environment_async_complete(void);
+extern void			wormhole_environment_async_finish(wormhole_environment_t *);
+extern bool			wormhole_environment_async_child_exited(pid_t pid, int status);
+extern bool			wormhole_environment_async_available(void);
+extern bool			wormhole_environment_async_pool_init(unsigned int size, char **argv);
+extern void			wormhole_environment_async_pool_restart(void);
+extern int			wormhole_setup_worker_main(int control_fd);
+extern bool			wormhole_environment_async_wait(wormhole_environment_t *,
+					wormhole_environment_async_callback_fn_t *, void *closure);
+extern void			wormhole_environment_async_cancel_wait(wormhole_environment_t *, void *closure);
+
+struct wormhole_async_setup_stats {
+	unsigned int		started;
+	unsigned int		failed;
+	unsigned int		in_progress;
+	unsigned int		workers;
+	unsigned int		worker_deaths;
+	struct timeutil_histogram duration;
+};
+
+extern void			wormhole_environment_async_get_stats(struct wormhole_async_setup_stats *);
 extern wormhole_environment_t *	wormhole_environment_new(const char *name, const wormhole_environment_t *base_env);
 extern void			wormhole_environment_set_root_directory(wormhole_environment_t *env, const char *);
 extern void			wormhole_environment_set_working_directory(wormhole_environment_t *env, const char *);
 extern bool			wormhole_environment_make_command(wormhole_environment_t *env, struct procutil_command *cmd, char **argv);
 
 extern void			wormhole_environment_set_fd(wormhole_environment_t *env, int fd);
+extern void			wormhole_environment_reset(wormhole_environment_t *env);
+extern void			wormhole_environment_release_images(wormhole_environment_t *env, unsigned int mask);
+extern unsigned int		wormhole_environment_lend_images(wormhole_environment_t *env, const char **mount_point);
+extern bool			wormhole_environment_borrow_image(wormhole_environment_t *env, unsigned int layer, const char *mount_point);
+extern const char *		wormhole_environment_image_mount_point(wormhole_environment_t *env, unsigned int layer);
+extern void			wormhole_environment_adopt_images(wormhole_environment_t *env, unsigned int lent, char **mount_point);
 
 extern wormhole_tree_state_t *	wormhole_tree_state_new(void);
 extern void			wormhole_tree_state_free(wormhole_tree_state_t *tree);
@@ -159,11 +215,42 @@ extern void			wormhole_tree_walk_end(wormhole_tree_walker_t *t);
 extern bool			wormhole_capability_register(const struct strutil_array *provides, const char *path);
 extern bool			wormhole_capability_unregister(const struct strutil_array *provides, const char *path);
 extern char *			wormhole_capability_get_best_match(const char *id);
+extern unsigned int		wormhole_capability_get_best_matches(const struct strutil_array *ids, char **paths);
 extern bool			wormhole_capabilities_gc(void);
+/* Same as above, with an explicit registry directory */
+extern bool			__wormhole_capability_register(const char *capability_dir_path,
+					const struct strutil_array *provides, const char *path);
+extern unsigned int		__wormhole_capability_get_best_matches(const char *capability_dir_path,
+					const struct strutil_array *ids, char **paths);
 extern bool			wormhole_command_register(const struct strutil_array *names, const char *path);
 extern bool			wormhole_command_unregister(const struct strutil_array *names, const char *path);
 extern char *			wormhole_command_get_best_match(const char *id);
+extern bool			wormhole_command_registry_list(struct strutil_array *names);
 
 extern wormhole_tree_state_t *	wormhole_get_mount_state(const char *mtab);
 
+struct wormhole_mount_entry {
+	uint64_t		mnt_id;
+	uint64_t		parent_id;
+	const char *		mount_point;
+	const char *		fstype;
+	const char *		source;
+};
+
+struct wormhole_mount_table {
+	unsigned int		count;
+	struct wormhole_mount_entry *entry;
+	char *			strings;
+};
+
+extern struct wormhole_mount_table *wormhole_mount_table_snapshot(void);
+extern const struct wormhole_mount_table *wormhole_mount_table_current(void);
+extern void			wormhole_mount_table_free(struct wormhole_mount_table *);
+extern unsigned int		wormhole_mount_table_diff(const struct wormhole_mount_table *old_table,
+					const struct wormhole_mount_table *new_table,
+					void (*fn)(const struct wormhole_mount_entry *old_entry,
+						   const struct wormhole_mount_entry *new_entry,
+						   void *closure),
+					void *closure);
+
 #endif // _WORMHOLE_ENVIRONMENT_H
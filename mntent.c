@@ -18,16 +18,509 @@
  *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#include <sys/syscall.h>
+#include <sys/stat.h>
 #include <stdio.h>
 #include <mntent.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 
 #include "tracing.h"
 #include "environment.h"
 #include "util.h"
 
+/*
+ * Mount table snapshots.
+ *
+ * We use listmount(2) and statmount(2) where the kernel has them, and
+ * parse /proc/self/mountinfo otherwise. With listmount, mount IDs are the
+ * unique 64bit IDs that are never reused; with mountinfo, they are the
+ * old style IDs. Snapshots are only comparable if they were taken the
+ * same way, which is the case within one process.
+ */
+#ifndef SYS_statmount
+# define SYS_statmount			457
+# define SYS_listmount			458
+#endif
+
+#define WORMHOLE_LSMT_ROOT		0xffffffffffffffffULL
+#define WORMHOLE_MNT_ID_REQ_SIZE_VER0	24
+
+#define WORMHOLE_STATMOUNT_MNT_BASIC	0x00000002U
+#define WORMHOLE_STATMOUNT_MNT_POINT	0x00000010U
+#define WORMHOLE_STATMOUNT_FS_TYPE	0x00000020U
+#define WORMHOLE_STATMOUNT_SB_SOURCE	0x00000200U
+
+struct wormhole_mnt_id_req {
+	uint32_t	size;
+	uint32_t	spare;
+	uint64_t	mnt_id;
+	uint64_t	param;
+};
+
+/* The leading part of struct statmount that we're interested in.
+ * The kernel's struct is 512 bytes, followed by the strings. */
+struct wormhole_statmount {
+	uint32_t	size;
+	uint32_t	mnt_opts;
+	uint64_t	mask;
+	uint32_t	sb_dev_major;
+	uint32_t	sb_dev_minor;
+	uint64_t	sb_magic;
+	uint32_t	sb_flags;
+	uint32_t	fs_type;
+	uint64_t	mnt_id;
+	uint64_t	mnt_parent_id;
+	uint32_t	mnt_id_old;
+	uint32_t	mnt_parent_id_old;
+	uint64_t	mnt_attr;
+	uint64_t	mnt_propagation;
+	uint64_t	mnt_peer_group;
+	uint64_t	mnt_master;
+	uint64_t	propagate_from;
+	uint32_t	mnt_root;
+	uint32_t	mnt_point;
+	uint64_t	mnt_ns_id;
+	uint32_t	fs_subtype;
+	uint32_t	sb_source;
+	uint64_t	__spare[48];
+	char		str[];
+};
+
+struct wormhole_mount_table_builder {
+	unsigned int	count, size;
+	struct wormhole_mount_entry *entry;
+
+	/* All strings live in one buffer; while building, entries
+	 * refer to them by offset */
+	char *		strings;
+	size_t		strings_len, strings_size;
+};
+
+static size_t
+__wormhole_mount_table_add_string(struct wormhole_mount_table_builder *b, const char *s)
+{
+	size_t len = strlen(s) + 1, offset;
+
+	if (b->strings_len + len > b->strings_size) {
+		while (b->strings_len + len > b->strings_size)
+			b->strings_size = b->strings_size? 2 * b->strings_size : 16384;
+		b->strings = realloc(b->strings, b->strings_size);
+	}
+
+	offset = b->strings_len;
+	memcpy(b->strings + offset, s, len);
+	b->strings_len += len;
+	return offset;
+}
+
+static void
+wormhole_mount_table_builder_add(struct wormhole_mount_table_builder *b, uint64_t mnt_id, uint64_t parent_id,
+			const char *mount_point, const char *fstype, const char *source)
+{
+	struct wormhole_mount_entry *e;
+
+	if (b->count >= b->size) {
+		b->size = b->size? 2 * b->size : 64;
+		b->entry = realloc(b->entry, b->size * sizeof(b->entry[0]));
+	}
+
+	e = &b->entry[b->count++];
+	e->mnt_id = mnt_id;
+	e->parent_id = parent_id;
+
+	/* Stash the string offsets in the pointers for now */
+	e->mount_point = (char *) (uintptr_t) __wormhole_mount_table_add_string(b, mount_point);
+	e->fstype = (char *) (uintptr_t) __wormhole_mount_table_add_string(b, fstype?: "none");
+	e->source = (char *) (uintptr_t) __wormhole_mount_table_add_string(b, source?: "none");
+}
+
+static struct wormhole_mount_table *
+wormhole_mount_table_builder_finish(struct wormhole_mount_table_builder *b)
+{
+	struct wormhole_mount_table *table;
+	unsigned int i;
+
+	for (i = 0; i < b->count; ++i) {
+		struct wormhole_mount_entry *e = &b->entry[i];
+
+		e->mount_point = b->strings + (uintptr_t) e->mount_point;
+		e->fstype = b->strings + (uintptr_t) e->fstype;
+		e->source = b->strings + (uintptr_t) e->source;
+	}
+
+	table = calloc(1, sizeof(*table));
+	table->count = b->count;
+	table->entry = b->entry;
+	table->strings = b->strings;
+	return table;
+}
+
+static void
+wormhole_mount_table_builder_destroy(struct wormhole_mount_table_builder *b)
+{
+	free(b->entry);
+	free(b->strings);
+	memset(b, 0, sizeof(*b));
+}
+
+static int	wormhole_listmount_supported = -1;
+
+static bool
+__wormhole_statmount_one(uint64_t mnt_id, struct wormhole_statmount **bufp, size_t *buf_size, uint64_t mask)
+{
+	struct wormhole_mnt_id_req req = {
+		.size	= WORMHOLE_MNT_ID_REQ_SIZE_VER0,
+		.mnt_id	= mnt_id,
+		.param	= mask,
+	};
+
+	while (syscall(SYS_statmount, &req, *bufp, *buf_size, 0) < 0) {
+		if (errno != EOVERFLOW)
+			return false;
+
+		*buf_size *= 2;
+		*bufp = realloc(*bufp, *buf_size);
+	}
+
+	return true;
+}
+
+static bool
+wormhole_mount_table_listmount(struct wormhole_mount_table_builder *b)
+{
+	struct wormhole_mnt_id_req req = {
+		.size	= WORMHOLE_MNT_ID_REQ_SIZE_VER0,
+		.mnt_id	= WORMHOLE_LSMT_ROOT,
+	};
+	uint64_t mask = WORMHOLE_STATMOUNT_MNT_BASIC | WORMHOLE_STATMOUNT_MNT_POINT |
+			WORMHOLE_STATMOUNT_FS_TYPE | WORMHOLE_STATMOUNT_SB_SOURCE;
+	struct wormhole_statmount *sm;
+	size_t sm_size = 4096;
+	uint64_t ids[256];
+	long i, n;
+
+	sm = malloc(sm_size);
+	while ((n = syscall(SYS_listmount, &req, ids, 256, 0)) > 0) {
+		for (i = 0; i < n; ++i) {
+			const char *source = NULL;
+
+			if (!__wormhole_statmount_one(ids[i], &sm, &sm_size, mask)) {
+				/* Kernels before 6.11 do not know about SB_SOURCE */
+				if (errno == EINVAL && (mask & WORMHOLE_STATMOUNT_SB_SOURCE)) {
+					mask &= ~WORMHOLE_STATMOUNT_SB_SOURCE;
+					--i;
+					continue;
+				}
+
+				/* The mount went away in the meantime */
+				if (errno == ENOENT)
+					continue;
+
+				log_error("statmount(0x%llx) failed: %m", (unsigned long long) ids[i]);
+				goto failed;
+			}
+
+			if (sm->mask & WORMHOLE_STATMOUNT_SB_SOURCE)
+				source = sm->str + sm->sb_source;
+
+			wormhole_mount_table_builder_add(b, sm->mnt_id, sm->mnt_parent_id,
+					sm->str + sm->mnt_point, sm->str + sm->fs_type, source);
+		}
+
+		req.param = ids[n - 1];
+	}
+
+	if (n < 0) {
+		if (b->count == 0 && (errno == ENOSYS || errno == EINVAL || errno == EPERM)) {
+			trace("listmount not supported, falling back to mountinfo");
+			wormhole_listmount_supported = 0;
+		} else {
+			log_error("listmount failed: %m");
+		}
+		goto failed;
+	}
+
+	free(sm);
+	return true;
+
+failed:
+	free(sm);
+	return false;
+}
+
+/*
+ * mountinfo escapes blanks etc as octal sequences
+ */
+static char *
+__wormhole_mountinfo_unescape(char *s)
+{
+	char *r, *w;
+
+	for (r = w = s; *r; ) {
+		if (r[0] == '\\' && r[1] >= '0' && r[1] <= '3'
+		 && r[2] >= '0' && r[2] <= '7' && r[3] >= '0' && r[3] <= '7') {
+			*w++ = ((r[1] - '0') << 6) | ((r[2] - '0') << 3) | (r[3] - '0');
+			r += 4;
+		} else {
+			*w++ = *r++;
+		}
+	}
+	*w = '\0';
+	return s;
+}
+
+static bool
+wormhole_mount_table_mountinfo(struct wormhole_mount_table_builder *b)
+{
+	char *line = NULL;
+	size_t line_size = 0;
+	FILE *fp;
+
+	if (!(fp = fopen("/proc/self/mountinfo", "re"))) {
+		log_error("Unable to open /proc/self/mountinfo: %m");
+		return false;
+	}
+
+	while (getline(&line, &line_size, fp) > 0) {
+		char *fields[6], *fstype, *source, *s;
+		unsigned int nfields = 0;
+
+		line[strcspn(line, "\n")] = '\0';
+
+		/* mnt_id parent_id major:minor root mount_point options [optional...] - fstype source superopts */
+		for (s = strtok(line, " "); s; s = strtok(NULL, " ")) {
+			fields[nfields++] = s;
+			if (nfields == 6)
+				break;
+		}
+		if (nfields < 6)
+			continue;
+
+		/* Skip optional fields */
+		for (s = fields[5]; s && strcmp(s, "-"); s = strtok(NULL, " "))
+			;
+		if (s == NULL
+		 || !(fstype = strtok(NULL, " "))
+		 || !(source = strtok(NULL, " ")))
+			continue;
+
+		wormhole_mount_table_builder_add(b,
+				strtoull(fields[0], NULL, 10),
+				strtoull(fields[1], NULL, 10),
+				__wormhole_mountinfo_unescape(fields[4]),
+				fstype,
+				__wormhole_mountinfo_unescape(source));
+	}
+
+	free(line);
+	fclose(fp);
+	return true;
+}
+
+/*
+ * Take a snapshot of the mount table. The caller owns the result.
+ */
+struct wormhole_mount_table *
+wormhole_mount_table_snapshot(void)
+{
+	struct wormhole_mount_table_builder builder;
+
+	memset(&builder, 0, sizeof(builder));
+
+	if (wormhole_listmount_supported != 0) {
+		if (wormhole_mount_table_listmount(&builder)) {
+			wormhole_listmount_supported = 1;
+			return wormhole_mount_table_builder_finish(&builder);
+		}
+		wormhole_mount_table_builder_destroy(&builder);
+		if (wormhole_listmount_supported != 0)
+			return NULL;
+	}
+
+	if (!wormhole_mount_table_mountinfo(&builder)) {
+		wormhole_mount_table_builder_destroy(&builder);
+		return NULL;
+	}
+
+	return wormhole_mount_table_builder_finish(&builder);
+}
+
+void
+wormhole_mount_table_free(struct wormhole_mount_table *table)
+{
+	free(table->entry);
+	free(table->strings);
+	free(table);
+}
+
+/*
+ * Return the current mount table. We keep the last snapshot around, and
+ * reuse it as long as the kernel does not report a change of the mount
+ * namespace. The result is owned by us, and remains valid until the next call.
+ *
+ * The mountinfo fd we poll belongs to the namespace we opened it in, and
+ * the paths it reports are relative to our root directory. So if we have
+ * switched to another namespace (setns, unshare) or root since, we start
+ * over.
+ */
+const struct wormhole_mount_table *
+wormhole_mount_table_current(void)
+{
+	static struct wormhole_mount_table *cached;
+	static int watch_fd = -1;
+	static struct stat ns_stb, root_stb;
+	struct stat stb[2];
+	struct pollfd pfd;
+
+	if (stat("/proc/self/ns/mnt", &stb[0]) < 0 || stat("/", &stb[1]) < 0)
+		memset(stb, 0, sizeof(stb));
+
+	if (watch_fd >= 0
+	 && (stb[0].st_ino == 0
+	  || stb[0].st_dev != ns_stb.st_dev || stb[0].st_ino != ns_stb.st_ino
+	  || stb[1].st_dev != root_stb.st_dev || stb[1].st_ino != root_stb.st_ino)) {
+		trace("Mount namespace or root changed, discarding mount table snapshot");
+		close(watch_fd);
+		watch_fd = -1;
+	}
+
+	/* Polling mountinfo reports POLLPRI when the namespace's mount table
+	 * changed since we last polled. If we cannot tell which namespace
+	 * we're in, do not cache anything. */
+	if (watch_fd < 0) {
+		if (stb[0].st_ino != 0) {
+			watch_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+			ns_stb = stb[0];
+			root_stb = stb[1];
+		}
+	} else if (cached) {
+		pfd.fd = watch_fd;
+		pfd.events = POLLPRI;
+		if (poll(&pfd, 1, 0) == 0)
+			return cached;
+	}
+
+	if (cached) {
+		wormhole_mount_table_free(cached);
+		cached = NULL;
+	}
+
+	/* If we cannot watch for changes, don't cache */
+	if (watch_fd < 0) {
+		static struct wormhole_mount_table *uncached;
+
+		if (uncached)
+			wormhole_mount_table_free(uncached);
+		return (uncached = wormhole_mount_table_snapshot());
+	}
+
+	/* Clear any pending event before we take the snapshot */
+	pfd.fd = watch_fd;
+	pfd.events = POLLPRI;
+	(void) poll(&pfd, 1, 0);
+
+	cached = wormhole_mount_table_snapshot();
+	return cached;
+}
+
+static int
+__wormhole_mount_entry_cmp(const void *a, const void *b)
+{
+	const struct wormhole_mount_entry *ea = *(const struct wormhole_mount_entry **) a;
+	const struct wormhole_mount_entry *eb = *(const struct wormhole_mount_entry **) b;
+
+	if (ea->mnt_id < eb->mnt_id)
+		return -1;
+	return ea->mnt_id > eb->mnt_id;
+}
+
+static const struct wormhole_mount_entry **
+__wormhole_mount_table_sorted(const struct wormhole_mount_table *table)
+{
+	const struct wormhole_mount_entry **sorted;
+	unsigned int i;
+
+	sorted = calloc(table->count + 1, sizeof(sorted[0]));
+	for (i = 0; i < table->count; ++i)
+		sorted[i] = &table->entry[i];
+	qsort(sorted, table->count, sizeof(sorted[0]), __wormhole_mount_entry_cmp);
+	return sorted;
+}
+
+static inline bool
+__wormhole_mount_entry_equal(const struct wormhole_mount_entry *a, const struct wormhole_mount_entry *b)
+{
+	return a->parent_id == b->parent_id
+	    && !strcmp(a->mount_point, b->mount_point)
+	    && !strcmp(a->fstype, b->fstype)
+	    && !strcmp(a->source, b->source);
+}
+
+/*
+ * Compare two snapshots, and call fn for every mount that was added
+ * (old_entry == NULL), removed (new_entry == NULL), or changed.
+ * Returns the number of differences.
+ */
+unsigned int
+wormhole_mount_table_diff(const struct wormhole_mount_table *old_table, const struct wormhole_mount_table *new_table,
+			void (*fn)(const struct wormhole_mount_entry *old_entry, const struct wormhole_mount_entry *new_entry, void *closure),
+			void *closure)
+{
+	const struct wormhole_mount_entry **old_sorted, **new_sorted;
+	unsigned int i = 0, j = 0, changes = 0;
+
+	old_sorted = __wormhole_mount_table_sorted(old_table);
+	new_sorted = __wormhole_mount_table_sorted(new_table);
+
+	while (i < old_table->count || j < new_table->count) {
+		const struct wormhole_mount_entry *o = NULL, *n = NULL;
+
+		if (j >= new_table->count
+		 || (i < old_table->count && old_sorted[i]->mnt_id < new_sorted[j]->mnt_id)) {
+			o = old_sorted[i++];
+		} else
+		if (i >= old_table->count || new_sorted[j]->mnt_id < old_sorted[i]->mnt_id) {
+			n = new_sorted[j++];
+		} else {
+			o = old_sorted[i++];
+			n = new_sorted[j++];
+			if (__wormhole_mount_entry_equal(o, n))
+				continue;
+		}
+
+		if (fn)
+			fn(o, n, closure);
+		changes++;
+	}
+
+	free(old_sorted);
+	free(new_sorted);
+	return changes;
+}
+
+static wormhole_tree_state_t *
+__wormhole_mount_table_to_tree(const struct wormhole_mount_table *table)
+{
+	wormhole_tree_state_t *tree;
+	unsigned int i;
+
+	tree = wormhole_tree_state_new();
+	for (i = 0; i < table->count; ++i) {
+		const struct wormhole_mount_entry *e = &table->entry[i];
+
+		wormhole_tree_state_set_system_mount(tree, e->mount_point, e->fstype, e->source);
+	}
+
+	return tree;
+}
+
 static wormhole_tree_state_t *
 __wormhole_get_mount_state(const char *mtab, const char *root_dir)
 {
@@ -82,5 +575,10 @@ __wormhole_get_mount_state(const char *mtab, const char *root_dir)
 wormhole_tree_state_t *
 wormhole_get_mount_state(const char *mtab)
 {
+	const struct wormhole_mount_table *table;
+
+	if (mtab == NULL && (table = wormhole_mount_table_current()) != NULL)
+		return __wormhole_mount_table_to_tree(table);
+
 	return __wormhole_get_mount_state(mtab, NULL);
 }
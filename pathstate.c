@@ -41,23 +41,212 @@
 #endif
 
 
+/*
+ * Nodes and their names are allocated from an arena, and go away
+ * all at once when the tree is freed.
+ */
+#define WORMHOLE_TREE_ARENA_CHUNK	(64 * 1024)
+
+struct wormhole_tree_arena_chunk {
+	struct wormhole_tree_arena_chunk *next;
+	size_t			size, used;
+	unsigned char		data[];
+};
+
+/*
+ * Path name components are interned, so that comparing two names is
+ * just a pointer comparison.
+ */
+struct wormhole_path_name {
+	unsigned int		hash;
+	unsigned int		len;
+	char			value[];
+};
+
 struct wormhole_tree_state {
 	char *				root_dir;
 
 	wormhole_path_state_node_t *	root;
+
+	struct wormhole_tree_arena_chunk *arena;
+
+	/* Interned names; open addressing */
+	struct {
+		unsigned int		size, count;
+		struct wormhole_path_name **slot;
+	} names;
+
+	/* All nodes but the root, hashed by (parent, name); open addressing */
+	struct {
+		unsigned int		size, count;
+		wormhole_path_state_node_t **slot;
+	} nodes;
 };
 
 struct wormhole_path_state_node {
 	wormhole_path_state_node_t *parent;
 	wormhole_path_state_node_t *next;
 
-	char *			name;
+	const char *		name;
+	const struct wormhole_path_name *iname;
 
 	wormhole_path_state_t	state;
 
+	/* Number of nodes in this subtree (including this one) that are not
+	 * UNCHANGED. This lets the walker skip over subtrees with nothing
+	 * of interest. */
+	unsigned int		num_marked;
+
 	wormhole_path_state_node_t *children;
 };
 
+static void *
+wormhole_tree_arena_alloc(wormhole_tree_state_t *tree, size_t size)
+{
+	struct wormhole_tree_arena_chunk *chunk = tree->arena;
+	void *p;
+
+	size = (size + 7) & ~(size_t) 7;
+	if (chunk == NULL || chunk->used + size > chunk->size) {
+		size_t chunk_size = WORMHOLE_TREE_ARENA_CHUNK;
+
+		if (size > chunk_size / 4)
+			chunk_size = size;
+
+		chunk = malloc(sizeof(*chunk) + chunk_size);
+		if (chunk == NULL)
+			log_fatal("%s: out of memory", __func__);
+		chunk->size = chunk_size;
+		chunk->used = 0;
+
+		/* Oversized chunks go behind the current one, so that we
+		 * keep allocating from the current chunk */
+		if (tree->arena && chunk_size == size) {
+			chunk->next = tree->arena->next;
+			tree->arena->next = chunk;
+		} else {
+			chunk->next = tree->arena;
+			tree->arena = chunk;
+		}
+	}
+
+	p = chunk->data + chunk->used;
+	chunk->used += size;
+	memset(p, 0, size);
+	return p;
+}
+
+static void
+wormhole_tree_arena_free(wormhole_tree_state_t *tree)
+{
+	struct wormhole_tree_arena_chunk *chunk;
+
+	while ((chunk = tree->arena) != NULL) {
+		tree->arena = chunk->next;
+		free(chunk);
+	}
+}
+
+static inline unsigned int
+__wormhole_path_name_hash(const char *name, unsigned int len)
+{
+	unsigned int hash = 2166136261U;
+
+	while (len--)
+		hash = (hash ^ (unsigned char) *name++) * 16777619U;
+	return hash;
+}
+
+static inline unsigned int
+__wormhole_path_node_hash(const wormhole_path_state_node_t *parent, const struct wormhole_path_name *iname)
+{
+	unsigned long key = (unsigned long) parent;
+
+	key ^= key >> 17;
+	return (unsigned int) (key * 0x9E3779B1U) ^ iname->hash;
+}
+
+static void
+wormhole_tree_names_rehash(wormhole_tree_state_t *tree)
+{
+	struct wormhole_path_name **old_slot = tree->names.slot;
+	unsigned int i, old_size = tree->names.size;
+
+	tree->names.size = old_size? 2 * old_size : 256;
+	tree->names.slot = calloc(tree->names.size, sizeof(tree->names.slot[0]));
+
+	for (i = 0; i < old_size; ++i) {
+		struct wormhole_path_name *iname = old_slot[i];
+		unsigned int k;
+
+		if (iname == NULL)
+			continue;
+
+		k = iname->hash & (tree->names.size - 1);
+		while (tree->names.slot[k])
+			k = (k + 1) & (tree->names.size - 1);
+		tree->names.slot[k] = iname;
+	}
+
+	free(old_slot);
+}
+
+static const struct wormhole_path_name *
+wormhole_tree_intern_name(wormhole_tree_state_t *tree, const char *name, unsigned int len, bool create)
+{
+	struct wormhole_path_name *iname;
+	unsigned int hash, k;
+
+	if (create && 2 * (tree->names.count + 1) > tree->names.size)
+		wormhole_tree_names_rehash(tree);
+
+	if (tree->names.size == 0)
+		return NULL;
+
+	hash = __wormhole_path_name_hash(name, len);
+	for (k = hash & (tree->names.size - 1); (iname = tree->names.slot[k]) != NULL; k = (k + 1) & (tree->names.size - 1)) {
+		if (iname->hash == hash && iname->len == len && !memcmp(iname->value, name, len))
+			return iname;
+	}
+
+	if (!create)
+		return NULL;
+
+	iname = wormhole_tree_arena_alloc(tree, sizeof(*iname) + len + 1);
+	iname->hash = hash;
+	iname->len = len;
+	memcpy(iname->value, name, len);
+
+	tree->names.slot[k] = iname;
+	tree->names.count++;
+	return iname;
+}
+
+static void
+wormhole_tree_nodes_rehash(wormhole_tree_state_t *tree)
+{
+	wormhole_path_state_node_t **old_slot = tree->nodes.slot;
+	unsigned int i, old_size = tree->nodes.size;
+
+	tree->nodes.size = old_size? 2 * old_size : 256;
+	tree->nodes.slot = calloc(tree->nodes.size, sizeof(tree->nodes.slot[0]));
+
+	for (i = 0; i < old_size; ++i) {
+		wormhole_path_state_node_t *node = old_slot[i];
+		unsigned int k;
+
+		if (node == NULL)
+			continue;
+
+		k = __wormhole_path_node_hash(node->parent, node->iname) & (tree->nodes.size - 1);
+		while (tree->nodes.slot[k])
+			k = (k + 1) & (tree->nodes.size - 1);
+		tree->nodes.slot[k] = node;
+	}
+
+	free(old_slot);
+}
+
 static inline void
 wormhole_path_state_set_upperdir(wormhole_path_state_t *state, const char *path)
 {
@@ -85,15 +274,21 @@ wormhole_path_state_clear(wormhole_path_state_t *state)
 	}
 }
 
+#ifdef DEBUG_PATHSTATE
+static const char *	wormhole_path_state_node_to_path(const wormhole_path_state_node_t *node);
+#endif
+
 static wormhole_path_state_node_t *
-wormhole_path_state_node_new(const char *name, wormhole_path_state_node_t *parent)
+wormhole_path_state_node_new(wormhole_tree_state_t *tree, const struct wormhole_path_name *iname, wormhole_path_state_node_t *parent)
 {
 	wormhole_path_state_node_t *ps;
 
-	ps = calloc(1, sizeof(*ps));
+	ps = wormhole_tree_arena_alloc(tree, sizeof(*ps));
 
-	if (name)
-		ps->name = strdup(name);
+	if (iname) {
+		ps->iname = iname;
+		ps->name = iname->value;
+	}
 
 	if (parent) {
 		ps->next = parent->children;
@@ -105,26 +300,37 @@ wormhole_path_state_node_new(const char *name, wormhole_path_state_node_t *paren
 	return ps;
 }
 
-static void
-wormhole_path_state_node_free(wormhole_path_state_node_t *ps)
+/*
+ * Find the child of a node with the given (interned) name
+ */
+static wormhole_path_state_node_t *
+wormhole_path_state_node_child(wormhole_tree_state_t *tree, wormhole_path_state_node_t *parent,
+			const struct wormhole_path_name *iname, bool create)
 {
 	wormhole_path_state_node_t *child;
+	unsigned int k;
 
-	while ((child = ps->children) != NULL) {
-		assert(child->parent == ps);
+	if (create && 2 * (tree->nodes.count + 1) > tree->nodes.size)
+		wormhole_tree_nodes_rehash(tree);
 
-		ps->children = child->next;
-		child->next = NULL;
-		child->parent = NULL;
+	if (tree->nodes.size == 0)
+		return NULL;
 
-		wormhole_path_state_node_free(child);
+	k = __wormhole_path_node_hash(parent, iname) & (tree->nodes.size - 1);
+	while ((child = tree->nodes.slot[k]) != NULL) {
+		if (child->parent == parent && child->iname == iname)
+			return child;
+		k = (k + 1) & (tree->nodes.size - 1);
 	}
 
-	wormhole_path_state_clear(&ps->state);
+	if (!create)
+		return NULL;
 
-	if (ps->name)
-		free(ps->name);
-	free(ps);
+	trace_path("Creating new node \"%s\" as child of %s", iname->value, wormhole_path_state_node_to_path(parent));
+	child = wormhole_path_state_node_new(tree, iname, parent);
+	tree->nodes.slot[k] = child;
+	tree->nodes.count++;
+	return child;
 }
 
 const char *
@@ -169,6 +375,7 @@ __wormhole_path_state_describe(const wormhole_path_state_t *state)
 	return __wormhole_path_state_type_string(state);
 }
 
+#ifdef DEBUG_PATHSTATE
 /*
  * Helper function to construct the full path of a path state node
  */
@@ -210,39 +417,35 @@ wormhole_path_state_node_to_path(const wormhole_path_state_node_t *node)
 
 	return w;
 }
+#endif
 
 wormhole_path_state_node_t *
 wormhole_path_state_node_lookup(wormhole_tree_state_t *tree, const char *path, bool create)
 {
-	wormhole_path_state_node_t *current;
-	char *s, *path_copy;
+	wormhole_path_state_node_t *current = tree->root;
 
-	while (*path == '/')
-		++path;
+	while (current) {
+		const struct wormhole_path_name *iname;
+		unsigned int len;
 
-	path_copy = strdup(path);
+		while (*path == '/')
+			++path;
+		if (*path == '\0')
+			break;
 
-	current = tree->root;
-	for (s = strtok(path_copy, "/"); s && current; s = strtok(NULL, "/")) {
-		wormhole_path_state_node_t *child;
+		len = strcspn(path, "/");
 
-		trace_path("Looking for %s below %s", s, wormhole_path_state_node_to_path(current));
-		for (child = current->children; child != NULL; child = child->next) {
-			if (!strcmp(child->name, s))
-				break;
+		/* If we've never seen this name, there's no such node */
+		if (!(iname = wormhole_tree_intern_name(tree, path, len, create))) {
+			current = NULL;
+			break;
 		}
 
-		if (child || !create) {
-			current = child;
-		} else {
-			trace_path("Creating new node \"%s\" as child of %s", s, wormhole_path_state_node_to_path(current));
-			current = wormhole_path_state_node_new(s, current);
-		}
+		current = wormhole_path_state_node_child(tree, current, iname, create);
+		path += len;
 	}
 
-	free(path_copy);
-
-	trace_path("%s(%s) returns node %s", __func__, path, wormhole_path_state_node_to_path(current));
+	trace_path("%s() returns node %s", __func__, wormhole_path_state_node_to_path(current));
 	return current;
 }
 
@@ -252,14 +455,27 @@ wormhole_tree_state_new(void)
 	wormhole_tree_state_t *tree;
 
 	tree = calloc(1, sizeof(*tree));
-	tree->root = wormhole_path_state_node_new(NULL, NULL);
+	tree->root = wormhole_path_state_node_new(tree, NULL, NULL);
 	return tree;
 }
 
 void
 wormhole_tree_state_free(wormhole_tree_state_t *tree)
 {
-	wormhole_path_state_node_free(tree->root);
+	unsigned int i;
+
+	/* The nodes live in the arena; we only need to release what their
+	 * state points to. */
+	for (i = 0; i < tree->nodes.size; ++i) {
+		if (tree->nodes.slot[i])
+			wormhole_path_state_clear(&tree->nodes.slot[i]->state);
+	}
+	wormhole_path_state_clear(&tree->root->state);
+
+	free(tree->nodes.slot);
+	free(tree->names.slot);
+	wormhole_tree_arena_free(tree);
+
 	strutil_set(&tree->root_dir, NULL);
 	free(tree);
 }
@@ -298,6 +514,17 @@ __wormhole_tree_state_set(wormhole_tree_state_t *tree, const char *path, int new
 
 	wormhole_path_state_clear(&ps->state);
 
+	if ((ps->state.state != WORMHOLE_PATH_STATE_UNCHANGED) != (new_state != WORMHOLE_PATH_STATE_UNCHANGED)) {
+		wormhole_path_state_node_t *node;
+
+		for (node = ps; node; node = node->parent) {
+			if (new_state != WORMHOLE_PATH_STATE_UNCHANGED)
+				node->num_marked++;
+			else
+				node->num_marked--;
+		}
+	}
+
 	ps->state.state = new_state;
 	return ps;
 }
@@ -373,10 +600,22 @@ wormhole_tree_state_get_user_data(wormhole_tree_state_t *tree, const char *path)
 	return ps->state.user_data;
 }
 
+/*
+ * The walker keeps the path of the current node in its own buffer, and
+ * updates it as it moves through the tree. It only visits subtrees that
+ * contain nodes that are not UNCHANGED.
+ * It is okay to change the state of nodes while walking the tree; nodes
+ * are never removed from a tree.
+ */
 struct wormhole_tree_walker {
 	wormhole_tree_state_t *		tree;
 	wormhole_path_state_node_t *	pos;
 	bool				skip_children;
+
+	/* Number of path components that did not fit into path[] */
+	unsigned int			overflow;
+	unsigned int			path_len;
+	char				path[PATH_MAX];
 };
 
 void
@@ -428,78 +667,124 @@ wormhole_tree_walk(wormhole_tree_state_t *tree)
 void
 wormhole_tree_walk_end(wormhole_tree_walker_t *t)
 {
-	memset(t, 0, sizeof(*t));
 	free(t);
 }
 
-static wormhole_path_state_node_t *
-__traverse_right(wormhole_path_state_node_t *node)
+static void
+__wormhole_tree_walk_push(wormhole_tree_walker_t *t, const wormhole_path_state_node_t *node)
 {
-	do {
-		trace_path("looking for siblings of %s", wormhole_path_state_node_to_path(node));
-		if (node->next) {
-			node = node->next;
-			break;
-		}
+	unsigned int len = node->iname->len;
 
-		trace_path("no more siblings of %s, going up", wormhole_path_state_node_to_path(node));
+	if (t->overflow || t->path_len + len + 2 > sizeof(t->path)) {
+		t->overflow++;
+		return;
+	}
 
-		node = node->parent;
-	} while (node);
+	t->path[t->path_len++] = '/';
+	memcpy(t->path + t->path_len, node->iname->value, len);
+	t->path_len += len;
+	t->path[t->path_len] = '\0';
+}
+
+static void
+__wormhole_tree_walk_pop(wormhole_tree_walker_t *t, const wormhole_path_state_node_t *node)
+{
+	if (t->overflow) {
+		t->overflow--;
+		return;
+	}
 
+	t->path_len -= node->iname->len + 1;
+	t->path[t->path_len] = '\0';
+}
+
+static inline bool
+__wormhole_tree_walk_descendants_marked(const wormhole_path_state_node_t *node)
+{
+	return node->num_marked > (node->state.state != WORMHOLE_PATH_STATE_UNCHANGED);
+}
+
+static inline wormhole_path_state_node_t *
+__wormhole_tree_walk_first_marked(wormhole_path_state_node_t *node)
+{
+	while (node && node->num_marked == 0)
+		node = node->next;
 	return node;
 }
 
+/*
+ * Advance to the next node in depth-first order, skipping subtrees
+ * where nothing is marked.
+ */
 static wormhole_path_state_node_t *
-__traverse_down(wormhole_path_state_node_t *node, bool skip_children)
+__wormhole_tree_walk_advance(wormhole_tree_walker_t *t, wormhole_path_state_node_t *node, bool skip_children)
 {
-	trace_path("%s(%s)", __func__, wormhole_path_state_node_to_path(node));
-	while (node) {
-		if (node->children && !skip_children) {
-			trace_path(" inspecting children of %s (%d)", wormhole_path_state_node_to_path(node), node->state.state);
-			node = node->children;
-		} else {
-			node = __traverse_right(node);
-		}
+	wormhole_path_state_node_t *next;
 
-		if (node && node->state.state > 0)
-			break;
+	if (!skip_children && __wormhole_tree_walk_descendants_marked(node)) {
+		next = __wormhole_tree_walk_first_marked(node->children);
+		assert(next);
+		__wormhole_tree_walk_push(t, next);
+		return next;
+	}
 
-		skip_children = false;
+	while (node->parent) {
+		__wormhole_tree_walk_pop(t, node);
+
+		if ((next = __wormhole_tree_walk_first_marked(node->next)) != NULL) {
+			__wormhole_tree_walk_push(t, next);
+			return next;
+		}
+
+		trace_path("no more siblings of %s, going up", wormhole_path_state_node_to_path(node));
+		node = node->parent;
 	}
 
-	return node;
+	return NULL;
 }
 
 wormhole_path_state_t *
 wormhole_tree_walk_next(wormhole_tree_walker_t *t, const char **path_p)
 {
 	wormhole_path_state_node_t *node;
-	const char *path;
+	bool skip_children;
 
-	if (t->pos == NULL)
+	if ((node = t->pos) == NULL)
 		return NULL;
 
-	if (!(node = __traverse_down(t->pos, t->skip_children))) {
-		t->pos = NULL;
-		return NULL;
+	skip_children = t->skip_children;
+	t->skip_children = false;
+
+	while (true) {
+		if (!(node = __wormhole_tree_walk_advance(t, node, skip_children))) {
+			t->pos = NULL;
+			return NULL;
+		}
+
+		skip_children = false;
+		if (node->state.state == WORMHOLE_PATH_STATE_UNCHANGED)
+			continue;
+
+		if (t->overflow) {
+			log_error("%s: path name too long, skipping node below %s", __func__, t->path);
+			continue;
+		}
+
+		break;
 	}
 
-	t->skip_children = false;
 	t->pos = node;
 
-	path = wormhole_path_state_node_to_path(node);
-
 	if (path_p)
-		*path_p = path;
+		*path_p = t->path;
 
-	trace_path("%s() returns %s", __func__, path);
+	trace_path("%s() returns %s", __func__, t->path);
 	return &node->state;
 }
 
 void
 wormhole_tree_walk_skip_children(wormhole_tree_walker_t *t)
 {
-	trace_path("Going to skip children of %s", wormhole_path_state_node_to_path(t->pos));
+	trace_path("Going to skip children of %s", t->path);
 	t->skip_children = true;
 }
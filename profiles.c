@@ -30,6 +30,8 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <glob.h>
+#include <pwd.h>
+#include <stdint.h>
 
 #include "wormhole.h"
 #include "tracing.h"
@@ -38,12 +40,55 @@
 #include "runtime.h"
 #include "server.h"
 #include "socket.h"
+#include "watch.h"
 #include "util.h"
 
 static wormhole_profile_t *	wormhole_profiles;
 static wormhole_environment_t *	wormhole_environments;
 static const char *		wormhole_client_path;
 
+/*
+ * The daemon looks up profiles for every request it receives. Rather than
+ * building new profile and environment objects each time, we intern them.
+ * Profiles are keyed by (config file, wrapper, owner), environments by
+ * (config file, environment name, owner), where the owner is a uid/gid pair.
+ * When a config file changes, wormhole_config_get() hands us a new config
+ * object, and entries referring to the old one are replaced.
+ *
+ * Finding the config file for a command involves a registry lookup, and
+ * checking whether the file changed. We remember the result, too. While
+ * the watcher is active, it tells us when anything changed; otherwise, we
+ * check again once the entry is older than WORMHOLE_COMMAND_CACHE_TTL.
+ */
+#define WORMHOLE_INTERN_HASH_SIZE	256
+#define WORMHOLE_COMMAND_CACHE_TTL	1000000ULL	/* usec */
+
+struct wormhole_intern {
+	struct wormhole_intern *next;
+	unsigned int		hash;
+
+	const struct wormhole_config *config;
+	const char *		key;
+	uid_t			owner_uid;
+	gid_t			owner_gid;
+
+	void *			object;
+};
+
+struct wormhole_command_cache {
+	struct wormhole_command_cache *next;
+	unsigned int		hash;
+
+	char *			argv0;
+	const struct wormhole_config *config;
+	unsigned int		watch_generation;
+	unsigned long long	checked;
+};
+
+static struct wormhole_intern *	wormhole_profile_cache[WORMHOLE_INTERN_HASH_SIZE];
+static struct wormhole_intern *	wormhole_environment_cache[WORMHOLE_INTERN_HASH_SIZE];
+static struct wormhole_command_cache *wormhole_command_cache[WORMHOLE_INTERN_HASH_SIZE];
+
 static bool			__wormhole_profiles_configure_environments(struct wormhole_environment_config *list);
 static bool			__wormhole_profiles_configure_profiles(struct wormhole_profile_config *list);
 
@@ -105,19 +150,45 @@ wormhole_scaffold_dest_path(const struct wormhole_scaffold *scaffold, const char
 bool
 wormhole_profiles_configure(struct wormhole_config *cfg)
 {
+	wormhole_environment_t *old_environments = wormhole_environments;
+	wormhole_profile_t *old_profiles = wormhole_profiles;
+	const char *old_client_path = wormhole_client_path;
 	bool success = true;
 
 	wormhole_client_path = cfg->client_path;
 	if (wormhole_client_path == NULL)
 		wormhole_client_path = WORMHOLE_CLIENT_PATH;
 
-	if (!__wormhole_profiles_configure_environments(cfg->environments))
-		success = false;
-	if (!__wormhole_profiles_configure_profiles(cfg->profiles))
+	if (!__wormhole_profiles_configure_environments(cfg->environments)
+	 || !__wormhole_profiles_configure_profiles(cfg->profiles))
 		success = false;
+
+	/* Do not leave a half configured list behind; when reloading,
+	 * the caller keeps using the old config. As above, the objects
+	 * we created may be referenced already, so we do not free them. */
+	if (!success) {
+		wormhole_environments = old_environments;
+		wormhole_profiles = old_profiles;
+		wormhole_client_path = old_client_path;
+	}
+
 	return success;
 }
 
+/*
+ * Free an environment we just built, and that failed to come together.
+ * Environments that made it into a list or cache are never freed, as
+ * requests and setup processes may still refer to them.
+ */
+static void
+wormhole_environment_free(wormhole_environment_t *env)
+{
+	strutil_array_destroy(&env->provides);
+	strutil_array_destroy(&env->requires);
+	free(env->name);
+	free(env);
+}
+
 wormhole_environment_t *
 __wormhole_environment_from_config(const struct wormhole_environment_config *cfg)
 {
@@ -177,6 +248,10 @@ __wormhole_profiles_configure_environments(struct wormhole_environment_config *l
 	wormhole_environment_t *env;
 	bool success = true;
 
+	/* When reconfiguring, the old objects may still be in use, so we
+	 * cannot free them. */
+	wormhole_environments = NULL;
+
 	for (cfg = list; cfg; cfg = cfg->next) {
 		if (!(env = __wormhole_environment_from_config(cfg)))
 			return false;
@@ -224,6 +299,8 @@ __wormhole_profiles_configure_profiles(struct wormhole_profile_config *list)
 	wormhole_profile_t **tail = &wormhole_profiles;
 	struct wormhole_profile_config *cfg;
 
+	wormhole_profiles = NULL;
+
 	for (cfg = list; cfg; cfg = cfg->next) {
 		wormhole_profile_t *profile;
 
@@ -248,12 +325,76 @@ wormhole_profile_new(const char *name)
 	return profile;
 }
 
+static unsigned int
+__wormhole_intern_hash(const char *path, const char *key, uid_t owner_uid, gid_t owner_gid)
+{
+	unsigned int hash = 5381 + owner_uid * 33 + owner_gid;
+
+	/* djb2 */
+	while (*path)
+		hash = hash * 33 + (unsigned char) *path++;
+	hash = hash * 33;
+	while (*key)
+		hash = hash * 33 + (unsigned char) *key++;
+
+	return hash;
+}
+
+static void *
+__wormhole_intern_lookup(struct wormhole_intern **table, const struct wormhole_config *cfg, const char *key,
+			uid_t owner_uid, gid_t owner_gid)
+{
+	unsigned int hash = __wormhole_intern_hash(cfg->path, key, owner_uid, owner_gid);
+	struct wormhole_intern **pos, *entry;
+
+	for (pos = &table[hash % WORMHOLE_INTERN_HASH_SIZE]; (entry = *pos) != NULL; pos = &entry->next) {
+		if (entry->hash != hash
+		 || entry->owner_uid != owner_uid
+		 || entry->owner_gid != owner_gid
+		 || strcmp(entry->key, key)
+		 || !strutil_equal(entry->config->path, cfg->path))
+			continue;
+
+		if (entry->config == cfg)
+			return entry->object;
+
+		/* The config file was reloaded. Drop this entry, but not the
+		 * object, which may still be in use. */
+		trace("%s: dropping stale entry for %s", cfg->path, key);
+		*pos = entry->next;
+		free(entry);
+		break;
+	}
+
+	return NULL;
+}
+
+static void
+__wormhole_intern_insert(struct wormhole_intern **table, const struct wormhole_config *cfg, const char *key,
+			uid_t owner_uid, gid_t owner_gid, void *object)
+{
+	struct wormhole_intern *entry, **pos;
+
+	entry = calloc(1, sizeof(*entry));
+	entry->hash = __wormhole_intern_hash(cfg->path, key, owner_uid, owner_gid);
+	entry->config = cfg;
+	entry->key = key;
+	entry->owner_uid = owner_uid;
+	entry->owner_gid = owner_gid;
+	entry->object = object;
+
+	pos = &table[entry->hash % WORMHOLE_INTERN_HASH_SIZE];
+	entry->next = *pos;
+	*pos = entry;
+}
+
 /*
  * Find a profile for a given command
  */
 static const struct wormhole_config *
-__wormhole_config_for_command(const char *argv0)
+__wormhole_config_for_command_uncached(const char *argv0)
 {
+	const struct wormhole_config *cfg;
 	const char *id;
 	char *config_path;
 
@@ -261,8 +402,48 @@ __wormhole_config_for_command(const char *argv0)
 	if (!(config_path = wormhole_command_get_best_match(id)))
 		return NULL;
 
-	trace("%s: found config file at %s", argv0, config_path);
-	return wormhole_config_get(config_path);
+	trace2("%s: found config file at %s", argv0, config_path);
+	cfg = wormhole_config_get(config_path);
+	free(config_path);
+
+	return cfg;
+}
+
+static const struct wormhole_config *
+__wormhole_config_for_command(const char *argv0)
+{
+	unsigned int hash = __wormhole_intern_hash("", argv0, 0, 0);
+	bool watching = wormhole_watch_enabled();
+	struct wormhole_command_cache **pos, *entry;
+	unsigned long long now;
+
+	now = timeutil_monotonic_usec();
+	for (pos = &wormhole_command_cache[hash % WORMHOLE_INTERN_HASH_SIZE]; (entry = *pos) != NULL; pos = &entry->next) {
+		if (entry->hash == hash && !strcmp(entry->argv0, argv0))
+			break;
+	}
+
+	/* Do not remember failures; the config file may just be missing for now,
+	 * and nobody would tell us when it shows up. */
+	if (entry != NULL) {
+		if (entry->config != NULL
+		 && (watching? entry->watch_generation == wormhole_watch_generation()
+			     : now - entry->checked < WORMHOLE_COMMAND_CACHE_TTL))
+			return entry->config;
+	} else {
+		entry = calloc(1, sizeof(*entry));
+		entry->hash = hash;
+		entry->argv0 = strdup(argv0);
+		entry->next = *pos;
+		*pos = entry;
+	}
+
+	/* Look at the registry and the config file again. Loading the config
+	 * may add watches, so get the generation afterwards. */
+	entry->config = __wormhole_config_for_command_uncached(argv0);
+	entry->watch_generation = wormhole_watch_generation();
+	entry->checked = now;
+	return entry->config;
 }
 
 static const struct wormhole_profile_config *
@@ -325,28 +506,46 @@ __wormhole_environment_config_for_command(const struct wormhole_config *cfg, con
 	return NULL;
 }
 
-static bool
-__wormhole_profile_configure_environment(wormhole_profile_t *profile, const struct wormhole_config *cfg)
+static wormhole_environment_t *
+__wormhole_environment_for_command(const struct wormhole_config *cfg, const struct wormhole_profile_config *cmd_cfg,
+			uid_t owner_uid, gid_t owner_gid)
 {
 	const struct wormhole_environment_config *env_cfg;
+	wormhole_environment_t *env;
 
-	if (!(env_cfg = __wormhole_environment_config_for_command(cfg, profile->config)))
-		return false;
+	if (!(env_cfg = __wormhole_environment_config_for_command(cfg, cmd_cfg)))
+		return NULL;
+
+	env = __wormhole_intern_lookup(wormhole_environment_cache, cfg, env_cfg->name, owner_uid, owner_gid);
+	if (env != NULL)
+		return env;
 
 	/* Now put everything together */
-	profile->environment = __wormhole_environment_from_config(env_cfg);
-	if (!__wormhole_environment_chase_layers(profile->environment, env_cfg))
-		return false;
+	env = __wormhole_environment_from_config(env_cfg);
+	if (!__wormhole_environment_chase_layers(env, env_cfg)) {
+		wormhole_environment_free(env);
+		return NULL;
+	}
 
-	return true;
+	env->owner_uid = owner_uid;
+	env->owner_gid = owner_gid;
+
+	__wormhole_intern_insert(wormhole_environment_cache, cfg, env_cfg->name, owner_uid, owner_gid, env);
+	return env;
 }
 
+/*
+ * Find the profile for a command. The daemon sets up environments for
+ * unprivileged users in a user namespace owned by them, so each user
+ * gets their own environment object.
+ */
 wormhole_profile_t *
-wormhole_profile_find(const char *argv0)
+wormhole_profile_find_for_user(const char *argv0, uid_t owner_uid, gid_t owner_gid)
 {
 	const struct wormhole_config *cfg;
 	const struct wormhole_profile_config *cmd_cfg;
-	wormhole_profile_t *profile = NULL;
+	wormhole_environment_t *env;
+	wormhole_profile_t *profile;
 
 	if (!(cfg = __wormhole_config_for_command(argv0)))
 		return NULL;
@@ -354,20 +553,25 @@ wormhole_profile_find(const char *argv0)
 	if (!(cmd_cfg = __wormhole_profile_config_for_command(cfg, argv0)))
 		return NULL;
 
+	profile = __wormhole_intern_lookup(wormhole_profile_cache, cfg, cmd_cfg->wrapper?: cmd_cfg->name, owner_uid, owner_gid);
+	if (profile != NULL)
+		return profile;
+
+	if (!(env = __wormhole_environment_for_command(cfg, cmd_cfg, owner_uid, owner_gid)))
+		return NULL;
+
 	profile = wormhole_profile_new(cmd_cfg->name);
 	profile->config = cmd_cfg;
+	profile->environment = env;
 
-	if (!__wormhole_profile_configure_environment(profile, cfg))
-		goto failed;
-
+	__wormhole_intern_insert(wormhole_profile_cache, cfg, cmd_cfg->wrapper?: cmd_cfg->name, owner_uid, owner_gid, profile);
 	return profile;
+}
 
-failed:
-#ifdef fix_this_memory_leak
-	if (profile)
-		wormhole_profile_free(profile);
-#endif
-	return NULL;
+wormhole_profile_t *
+wormhole_profile_find(const char *argv0)
+{
+	return wormhole_profile_find_for_user(argv0, 0, 0);
 }
 
 wormhole_profile_t *
@@ -468,7 +672,7 @@ void
 wormhole_environment_set_fd(wormhole_environment_t *env, int fd)
 {
 	if (env->nsfd >= 0) {
-		close(env->nsfd >= 0);
+		close(env->nsfd);
 		env->nsfd = -1;
 	}
 
@@ -476,6 +680,34 @@ wormhole_environment_set_fd(wormhole_environment_t *env, int fd)
 	env->nsfd = fd;
 }
 
+/*
+ * Returns the list of environments from the global configuration
+ */
+wormhole_environment_t *
+wormhole_environment_list(void)
+{
+	return wormhole_environments;
+}
+
+/*
+ * Forget about the namespace we set up for this environment.
+ * The next request will have to set it up from scratch.
+ */
+void
+wormhole_environment_reset(wormhole_environment_t *env)
+{
+	if (env->nsfd >= 0) {
+		trace("Environment \"%s\": closing namespace fd %d", env->name, env->nsfd);
+		close(env->nsfd);
+		env->nsfd = -1;
+	}
+
+	wormhole_environment_release_images(env, env->images_held);
+	env->images_held = 0;
+
+	env->failed = false;
+}
+
 wormhole_environment_t *
 wormhole_environment_find(const char *name)
 {
@@ -508,7 +740,7 @@ wormhole_environment_by_capability(const char *name)
 	if (!(path = wormhole_capability_get_best_match(name)))
 		return NULL;
 
-	cfg = wormhole_config_load(path);
+	cfg = wormhole_config_load_cached(path);
 	if (cfg == NULL)
 		log_fatal("Unable to parse config file %s", path);
 	free(path);
@@ -524,7 +756,7 @@ wormhole_environment_by_capability(const char *name)
 	if (env_cfg) {
 		env = __wormhole_environment_from_config(env_cfg);
 		if (!__wormhole_environment_chase_layers(env, env_cfg)) {
-			/* wormhole_environment_free(env); */
+			wormhole_environment_free(env);
 			env = NULL;
 		}
 	}
@@ -594,27 +826,150 @@ overlay_container_mount(const wormhole_environment_t *env, const char *container
 static bool
 overlay_container_unmount(const wormhole_environment_t *env, const char *container_image, const char *mount_point)
 {
-	return true;
+	const char *local_name;
+
+	if (!(local_name = container_make_local_name(container_image)))
+		return false;
+
+	return wormhole_container_unmount(local_name);
+}
+
+/*
+ * Drop our references to the container mounts of the layers in mask.
+ */
+void
+wormhole_environment_release_images(wormhole_environment_t *env, unsigned int mask)
+{
+	unsigned int i;
+
+	for (i = 0; i < env->nlayers; ++i) {
+		struct wormhole_layer_config *layer = env->layer[i];
+
+		if (!(mask & (1U << i)) || layer->image == NULL)
+			continue;
+
+		if (!overlay_container_unmount(env, layer->image, NULL))
+			log_error("Environment %s: unable to unmount \"%s\"", env->name, layer->image);
+	}
+}
+
+/*
+ * The daemon hands setups to worker processes, but it is the daemon
+ * that outlives them, so it keeps track of the container mounts:
+ *
+ *  - before starting a setup, it lends the setup process the mounts
+ *    it holds already, so that it does not have to ask the runtime;
+ *  - the setup process reports back the mounts it made itself, and the
+ *    daemon takes them over.
+ *
+ * Either way, the environment holds on to them until
+ * wormhole_environment_reset().
+ *
+ * Returns the mask of layers whose mounts we lent; the caller has to
+ * pass it to wormhole_environment_adopt_images() or
+ * wormhole_environment_release_images() when the setup is done.
+ */
+unsigned int
+wormhole_environment_lend_images(wormhole_environment_t *env, const char **mount_point)
+{
+	unsigned int i, mask = 0;
+
+	for (i = 0; i < env->nlayers; ++i) {
+		struct wormhole_layer_config *layer = env->layer[i];
+		const char *local_name;
+
+		mount_point[i] = NULL;
+		if (layer->image == NULL || !(local_name = container_make_local_name(layer->image)))
+			continue;
+
+		if ((mount_point[i] = wormhole_container_mount_cached(local_name)) != NULL)
+			mask |= 1U << i;
+	}
+
+	return mask;
+}
+
+/*
+ * In the setup process: use the mount the daemon lent us for this layer.
+ */
+bool
+wormhole_environment_borrow_image(wormhole_environment_t *env, unsigned int i, const char *mount_point)
+{
+	const char *local_name;
+
+	if (i >= env->nlayers || env->layer[i]->image == NULL)
+		return false;
+
+	if (!(local_name = container_make_local_name(env->layer[i]->image)))
+		return false;
+
+	return wormhole_container_adopt_mount(local_name, mount_point, false);
+}
+
+/*
+ * In the setup process: where did we mount this layer's image?
+ */
+const char *
+wormhole_environment_image_mount_point(wormhole_environment_t *env, unsigned int i)
+{
+	const char *local_name;
+
+	if (i >= env->nlayers || env->layer[i]->image == NULL)
+		return NULL;
+
+	if (!(local_name = container_make_local_name(env->layer[i]->image)))
+		return NULL;
+
+	return wormhole_container_mount_point(local_name);
+}
+
+/*
+ * In the daemon: setup succeeded. Take over the mounts the setup process
+ * made, and hold them along with the ones we lent it.
+ */
+void
+wormhole_environment_adopt_images(wormhole_environment_t *env, unsigned int lent, char **mount_point)
+{
+	unsigned int i, mask = lent;
+
+	for (i = 0; i < env->nlayers; ++i) {
+		struct wormhole_layer_config *layer = env->layer[i];
+		const char *local_name;
+
+		if (mount_point[i] == NULL || (lent & (1U << i)) || layer->image == NULL)
+			continue;
+
+		if (!(local_name = container_make_local_name(layer->image)))
+			continue;
+
+		if (wormhole_container_adopt_mount(local_name, mount_point[i], true))
+			mask |= 1U << i;
+	}
+
+	wormhole_environment_release_images(env, env->images_held);
+	env->images_held = mask;
 }
 
 void
 dump_mtab(const char *msg)
 {
-	FILE *fp;
-	char line[256];
+	const struct wormhole_mount_table *table;
+	unsigned int i;
 
-	printf("== mtab %s ==", msg);
-	fp = fopen("/proc/mounts", "r");
-	if (fp == NULL) {
-		log_error("Unable to open /proc/mounts: %m");
+	printf("== mtab %s ==\n", msg);
+	if (!(table = wormhole_mount_table_current())) {
+		log_error("Unable to get mount table");
 		exit(7);
 	}
 
-	while (fgets(line, sizeof(line), fp) != NULL) {
-		line[strcspn(line, "\n")] = '\0';
-		printf("%s\n", line);
+	for (i = 0; i < table->count; ++i) {
+		const struct wormhole_mount_entry *e = &table->entry[i];
+
+		printf("%llu %llu %s %s %s\n",
+				(unsigned long long) e->mnt_id,
+				(unsigned long long) e->parent_id,
+				e->source, e->mount_point, e->fstype);
 	}
-	fclose(fp);
 }
 
 /*
@@ -643,9 +998,51 @@ pathinfo_type_string(int type)
 	return "UNKNOWN";
 }
 
+/*
+ * When assembling the environment in a detached mount tree, all mount
+ * targets refer to locations inside that tree. We clone the tree when
+ * we're about to mount the first thing, so that it includes what the
+ * container runtime mounted for us when setting up the bottom layer.
+ */
+static int
+wormhole_environment_mount_tree(wormhole_environment_t *env)
+{
+	if (!env->mount_tree.enabled)
+		return -1;
+
+	if (env->mount_tree.fd < 0
+	 && (env->mount_tree.fd = fsutil_mount_tree_clone("/")) < 0) {
+		log_warning("Environment %s: falling back to setting up mounts in place", env->name);
+		env->mount_tree.enabled = false;
+	}
+
+	return env->mount_tree.fd;
+}
+
+/*
+ * Return the path through which we access the mount target path.
+ * May return a static buffer.
+ */
+static const char *
+wormhole_environment_target_path(wormhole_environment_t *env, const char *path)
+{
+	int tree_fd;
+
+	if ((tree_fd = wormhole_environment_mount_tree(env)) < 0)
+		return path;
+
+	return fsutil_mount_tree_path(tree_fd, path);
+}
+
 static bool
 _pathinfo_bind_one(wormhole_environment_t *environment, const char *source, const char *target)
 {
+	int tree_fd = wormhole_environment_mount_tree(environment);
+
+	if (tree_fd >= 0) {
+		if (!fsutil_mount_tree_bind(tree_fd, source, target))
+			return false;
+	} else
 	if (!fsutil_mount_bind(source, target, true))
 		return false;
 
@@ -653,6 +1050,20 @@ _pathinfo_bind_one(wormhole_environment_t *environment, const char *source, cons
 	return true;
 }
 
+/*
+ * Mount a read-only overlay of the given lower layers at target
+ */
+static bool
+_pathinfo_overlay_lower(wormhole_environment_t *environment, const char *lower_path_list, const char *target)
+{
+	int tree_fd = wormhole_environment_mount_tree(environment);
+
+	if (tree_fd >= 0)
+		return fsutil_mount_tree_overlay(tree_fd, lower_path_list, NULL, NULL, target);
+
+	return fsutil_mount_overlay(lower_path_list, NULL, NULL, target);
+}
+
 static bool
 _pathinfo_overlay_one(wormhole_environment_t *environment,
 		const char *source, const char *target,
@@ -661,10 +1072,11 @@ _pathinfo_overlay_one(wormhole_environment_t *environment,
 #if 1
 	char lower_path_list[2 * PATH_MAX];
 
-	snprintf(lower_path_list, sizeof(lower_path_list), "%s:%s", target, source);
+	snprintf(lower_path_list, sizeof(lower_path_list), "%s:%s",
+			wormhole_environment_target_path(environment, target), source);
 
 	/* Overlay "source" on top of "target" and mount at path "target" */
-	if (!fsutil_mount_overlay(lower_path_list, NULL, NULL, target))
+	if (!_pathinfo_overlay_lower(environment, lower_path_list, target))
 		return false;
 #else
 	if (!fsutil_makedirs(workdir, 0755)) {
@@ -685,6 +1097,12 @@ static bool
 _pathinfo_mount_one(wormhole_environment_t *environment, const wormhole_path_info_t *pi,
 			const char *dest)
 {
+	int tree_fd = wormhole_environment_mount_tree(environment);
+
+	if (tree_fd >= 0) {
+		if (!fsutil_mount_tree_virtual_fs(tree_fd, dest, pi->mount.fstype, pi->mount.options))
+			return false;
+	} else
 	if (!fsutil_mount_virtual_fs(dest, pi->mount.fstype, pi->mount.options))
 		return false;
 
@@ -717,11 +1135,51 @@ pathinfo_overlay_path(wormhole_environment_t *environment, const wormhole_path_i
 	return _pathinfo_overlay_one(environment, source, dest, workdir);
 }
 
+/*
+ * With the new mount API, we do not need a temp directory for the upper
+ * and work dirs; we use a tmpfs that is not mounted anywhere.
+ */
+static bool
+pathinfo_create_overlay_detached(wormhole_environment_t *environment, int tree_fd, const char *where)
+{
+	char upper[PATH_MAX], lower[PATH_MAX], work[PATH_MAX];
+	bool ok = false;
+	int tmp_fd;
+
+	if ((tmp_fd = fsutil_mount_detached_tmpfs()) < 0)
+		return false;
+
+	if (mkdirat(tmp_fd, "upper", 0755) < 0 || mkdirat(tmp_fd, "work", 0755) < 0) {
+		log_error("Unable to create overlay directories: %m");
+		goto out;
+	}
+
+	snprintf(lower, sizeof(lower), "%s", fsutil_mount_tree_path(tree_fd, where));
+	snprintf(upper, sizeof(upper), "%s", fsutil_mount_tree_path(tmp_fd, "upper"));
+	snprintf(work, sizeof(work), "%s", fsutil_mount_tree_path(tmp_fd, "work"));
+
+	if (!fsutil_mount_tree_overlay(tree_fd, lower, upper, work, where))
+		goto out;
+
+	wormhole_tree_state_set_overlay_mounted(environment->tree_state, where, NULL);
+	ok = true;
+
+out:
+	close(tmp_fd);
+	return ok;
+}
+
 static bool
-pathinfo_create_overlay(wormhole_environment_t *environment, const char *tempdir, const char *where)
+pathinfo_create_overlay(wormhole_environment_t *environment, struct fsutil_tempdir *td, const char *where)
 {
 	char upper[PATH_MAX], lower[PATH_MAX], work[PATH_MAX];
+	const char *tempdir;
+	int tree_fd;
 
+	if ((tree_fd = wormhole_environment_mount_tree(environment)) >= 0)
+		return pathinfo_create_overlay_detached(environment, tree_fd, where);
+
+	tempdir = fsutil_tempdir_path(td);
 	snprintf(lower, sizeof(lower), "%s/lower", tempdir);
 	snprintf(upper, sizeof(upper), "%s/upper", tempdir);
 	snprintf(work, sizeof(work), "%s/work", tempdir);
@@ -748,19 +1206,42 @@ pathinfo_create_overlay(wormhole_environment_t *environment, const char *tempdir
 	return true;
 }
 
+/*
+ * Rather than binding each entry of the source directory individually, we
+ * can often mount a single read-only overlay with the source directory on
+ * top of the destination. For regular files, and for directories that do not
+ * exist in the destination, this gives the same result. Directories that exist
+ * on both sides would be merged by the overlay, though, so we bind mount these
+ * on top of it afterwards.
+ *
+ * We can only do this if the source directory contains nothing but
+ * directories, regular files and symlinks; we do not want to expose anything
+ * else (such as overlayfs whiteouts). Symlinks cannot be bind mounted
+ * (that would follow the link), so the per-entry code skips them, but they
+ * are what library directories are mostly made of (libfoo.so -> libfoo.so.1),
+ * and the overlay shows them as they are. We only count them, so that they
+ * never end up in the list of entries to bind mount.
+ *
+ * One thing that differs is that the entries are no longer writable. With
+ * bind mounts, modifying a file inside the environment modified the layer
+ * itself, ie for every environment using it, and for image layers, the
+ * container. Layers are meant to be read-only building blocks, so we accept
+ * this.
+ */
+struct pathinfo_children {
+	struct strutil_array	names;		/* entries that need to be mounted */
+	struct strutil_array	dir_conflicts;	/* directories that exist on both sides */
+	unsigned int		num_identical;
+	unsigned int		num_symlinks;	/* shown by the overlay only */
+	bool			collapsible;
+};
+
 static bool
-pathinfo_bind_children(wormhole_environment_t *environment, const wormhole_path_info_t *pi,
-		const struct wormhole_scaffold *scaffold,
-		const char *dest, const char *source)
+pathinfo_scan_children(wormhole_environment_t *environment, const char *dest, const char *source,
+		struct pathinfo_children *children)
 {
-	struct fsutil_tempdir td;
-	const char *tempdir;
 	struct dirent *d;
 	DIR *dirfd;
-	unsigned int num_mounted = 0;
-	bool ok = false;
-
-	trace2("%s(%s, %s)", __func__, dest, source);
 
 	dirfd = opendir(source);
 	if (dirfd == NULL) {
@@ -768,260 +1249,436 @@ pathinfo_bind_children(wormhole_environment_t *environment, const wormhole_path_
 		return false;
 	}
 
-	fsutil_tempdir_init(&td);
-
-	tempdir = fsutil_tempdir_path(&td);
-	if (!pathinfo_create_overlay(environment, tempdir, dest)) {
-		log_error("unable to create overlay at \"%s\"", dest);
-		goto out;
-	}
-
+	children->collapsible = true;
 	while ((d = readdir(dirfd)) != NULL) {
 		char source_entry[PATH_MAX], target_entry[PATH_MAX];
+		struct stat stb;
+
+		unsigned char d_type = d->d_type;
 
-		if (d->d_type != DT_DIR && d->d_type != DT_REG)
-			continue;
 		if (d->d_name[0] == '.' && (d->d_name[1] == '\0' || d->d_name[1] == '.'))
 			continue;
 
-		/* printf("Trying to mount %s from %s to %s\n", d->d_name, source, dest); */
 		snprintf(source_entry, sizeof(source_entry), "%s/%s", source, d->d_name);
 		snprintf(target_entry, sizeof(target_entry), "%s/%s", dest, d->d_name);
 
-		/* FIXME: avoid mounting if source and target are exactly the same file;
+		/* Not all file systems fill in d_type */
+		if (d_type == DT_UNKNOWN && lstat(source_entry, &stb) == 0)
+			d_type = IFTODT(stb.st_mode);
+
+		if (d_type != DT_DIR && d_type != DT_REG && d_type != DT_LNK) {
+			children->collapsible = false;
+			continue;
+		}
+
+		/* No need to mount if source and target are exactly the same file;
 		 * this happens a lot when you mount a /lib directory. */
+		if (fsutil_same_file(source_entry, wormhole_environment_target_path(environment, target_entry))) {
+			children->num_identical++;
+			continue;
+		}
+
+		if (d_type == DT_LNK) {
+			children->num_symlinks++;
+			continue;
+		}
+
+		strutil_array_append(&children->names, d->d_name);
+
+		if (d_type == DT_DIR
+		 && stat(wormhole_environment_target_path(environment, target_entry), &stb) == 0
+		 && S_ISDIR(stb.st_mode))
+			strutil_array_append(&children->dir_conflicts, d->d_name);
+	}
 
-		if (access(target_entry, F_OK) < 0 && errno == ENOENT) {
-			if (d->d_type == DT_DIR)
-				(void) mkdir(target_entry, 0700);
+	closedir(dirfd);
+	return true;
+}
+
+static bool
+pathinfo_bind_entries(wormhole_environment_t *environment, const char *dest, const char *source,
+		const struct strutil_array *names, bool create)
+{
+	unsigned int i;
+
+	for (i = 0; i < names->count; ++i) {
+		char source_entry[PATH_MAX], target_entry[PATH_MAX];
+		const char *create_path;
+		struct stat stb;
+
+		snprintf(source_entry, sizeof(source_entry), "%s/%s", source, names->data[i]);
+		snprintf(target_entry, sizeof(target_entry), "%s/%s", dest, names->data[i]);
+
+		create_path = wormhole_environment_target_path(environment, target_entry);
+		if (create && access(create_path, F_OK) < 0 && errno == ENOENT) {
+			if (stat(source_entry, &stb) == 0 && S_ISDIR(stb.st_mode))
+				(void) mkdir(create_path, 0700);
 			else {
 				int fd;
 
-				fd = open(target_entry, O_CREAT, 0600);
+				fd = open(create_path, O_CREAT, 0600);
 				if (fd >= 0)
 					close(fd);
 			}
 		}
 
 		if (!_pathinfo_bind_one(environment, source_entry, target_entry))
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+pathinfo_bind_children(wormhole_environment_t *environment, const wormhole_path_info_t *pi,
+		const struct wormhole_scaffold *scaffold,
+		const char *dest, const char *source)
+{
+	struct pathinfo_children children;
+	struct fsutil_tempdir td;
+	unsigned int num_entries, num_mounts;
+	bool ok = false;
+
+	trace2("%s(%s, %s)", __func__, dest, source);
+
+	memset(&children, 0, sizeof(children));
+	if (!pathinfo_scan_children(environment, dest, source, &children))
+		return false;
+
+	num_entries = children.names.count + children.num_identical;
+	fsutil_tempdir_init(&td);
+
+	if (children.names.count == 0) {
+		num_mounts = 0;
+	} else
+	if (children.collapsible && children.dir_conflicts.count + 1 < children.names.count + children.num_symlinks) {
+		char lower_path_list[2 * PATH_MAX];
+
+		snprintf(lower_path_list, sizeof(lower_path_list), "%s:%s",
+				source, wormhole_environment_target_path(environment, dest));
+
+		if (!_pathinfo_overlay_lower(environment, lower_path_list, dest)) {
+			log_error("unable to create overlay at \"%s\"", dest);
+			goto out;
+		}
+		wormhole_tree_state_set_overlay_mounted(environment->tree_state, dest, NULL);
+
+		if (!pathinfo_bind_entries(environment, dest, source, &children.dir_conflicts, false))
 			goto out;
 
-		num_mounted ++;
+		num_entries += children.num_symlinks;
+		num_mounts = 1 + children.dir_conflicts.count;
+	} else {
+		if (!pathinfo_create_overlay(environment, &td, dest)) {
+			log_error("unable to create overlay at \"%s\"", dest);
+			goto out;
+		}
+
+		if (!pathinfo_bind_entries(environment, dest, source, &children.names, true))
+			goto out;
+
+		num_mounts = 1 + children.names.count;
 	}
 
-	trace("Mounted %u entries", num_mounted);
+	trace("Mounted %u entries using %u mounts; saved %u mounts (%u identical entries skipped)",
+			num_entries, num_mounts, num_entries + 1 - num_mounts, children.num_identical);
 	ok = true;
 
 out:
 	fsutil_tempdir_cleanup(&td);
-	if (dirfd)
-		closedir(dirfd);
+	strutil_array_destroy(&children.names);
+	strutil_array_destroy(&children.dir_conflicts);
 	return ok;
 }
 
-static bool
-pathinfo_bind_wormhole(wormhole_environment_t *environment, const wormhole_path_info_t *pi, const struct wormhole_scaffold *scaffold)
-{
-	const char *dest;
+/*
+ * Some overlays contain shared libraries. Maintain a separate ld.so.cache for the layer.
+ *
+ * Running ldconfig is expensive, so we keep the caches we generate in a store,
+ * keyed by a hash of the library directories and the ld.so.conf files they
+ * were generated from, both as seen inside the environment and in each
+ * layer's own directory.
+ * We never hash st_dev. Overlayfs picks a new anonymous device for every
+ * mount, so the key would change with each setup. Instead, a layer is
+ * identified by the path of its root directory.
+ * The system wide store in /var/lib/wormhole/ldcache is only written by root;
+ * unprivileged users get their own store in ~/.cache/wormhole/ldcache.
+ */
+static const char *	wormhole_ldcache_lib_dirs[] = {
+	"/lib", "/lib64", "/usr/lib", "/usr/lib64", "/usr/local/lib", "/usr/local/lib64",
+	NULL
+};
 
-	trace2("%s(%s)", __func__, pi->path);
+/* Inside a user namespace, getuid() returns 0. So we record the
+ * user we're setting up the environment for before creating it. */
+static uid_t		wormhole_setup_uid = -1;
 
-	dest = wormhole_scaffold_dest_path(scaffold, pi->path);
-	return _pathinfo_bind_one(environment, wormhole_client_path, dest);
+static void
+__wormhole_ldcache_hash_string(uint64_t *hash, const char *string)
+{
+	const unsigned char *p;
+
+	/* FNV-1a, including the NUL */
+	p = (const unsigned char *) string;
+	do {
+		*hash = (*hash ^ *p) * 0x100000001b3ULL;
+	} while (*p++);
 }
 
-static bool
-pathinfo_process_glob(wormhole_environment_t *env, const wormhole_path_info_t *pi, const struct wormhole_scaffold *scaffold,
-			bool (*func)(wormhole_environment_t *env, const wormhole_path_info_t *pi, const struct wormhole_scaffold *scaffold, const char *dest, const char *source))
+static void
+__wormhole_ldcache_hash_file(uint64_t *hash, const char *path)
 {
-	bool retval = false;
-	char pattern[PATH_MAX];
-	glob_t globbed;
+	const unsigned char *p;
+	struct stat stb;
 	size_t n;
-	int r;
 
-	trace("pathinfo_process_glob(path=%s)", wormhole_scaffold_source_path(scaffold, pi->path));
+	memset(&stb, 0, sizeof(stb));
+	if (stat(path, &stb) < 0)
+		stb.st_ino = 0;
 
-	/* We check for this in the config file parsing code, so an assert is good enough here. */
-	assert(pi->path[0] == '/');
-
-	/* Build the pattern to glob for.
-	 * Overlay case: $overlay_root/$path
-	 * Image case: $path
-	 */
-	strncpy(pattern, wormhole_scaffold_source_path(scaffold, pi->path), sizeof(pattern));
+	{
+		uint64_t data[] = {
+			stb.st_ino, stb.st_size,
+			stb.st_mtim.tv_sec, stb.st_mtim.tv_nsec,
+		};
 
-	r = glob(pattern, GLOB_NOSORT | GLOB_NOMAGIC | GLOB_TILDE, NULL, &globbed);
-	if (r != 0) {
-		/* I'm globsmacked. Why did it fail? */
-		log_error("pathinfo expansion failed, glob(%s) returns %d", pattern, r);
-		goto done;
+		for (p = (const unsigned char *) data, n = 0; n < sizeof(data); ++n)
+			*hash = (*hash ^ p[n]) * 0x100000001b3ULL;
 	}
+}
 
-	for (n = 0; n < globbed.gl_pathc; ++n) {
-		const char *source, *abs_path, *dest;
+static void
+__wormhole_ldcache_hash_stat(uint64_t *hash, wormhole_environment_t *env,
+			const char **layer_root, unsigned int nlayers, const char *path)
+{
+	char layer_path[PATH_MAX];
+	unsigned int i;
 
-		source = globbed.gl_pathv[n];
+	__wormhole_ldcache_hash_string(hash, path);
+	__wormhole_ldcache_hash_file(hash, wormhole_environment_target_path(env, path));
 
-		/* Get the un-prefixed path for $glob
-		 * Overlay case: Strip $overlay_root from $overlay_root/$glob
-		 * Image case: $glob
-		 */
-		abs_path = wormhole_scaffold_source_path_inverse(scaffold, source);
-		if (abs_path == NULL) {
-			log_error("%s: strange - glob expansion of %s returned path name %s", __func__,
-					pattern, source);
-			goto done;
-		}
+	for (i = 0; i < nlayers; ++i) {
+		snprintf(layer_path, sizeof(layer_path), "%s%s", layer_root[i], path);
+		__wormhole_ldcache_hash_file(hash, layer_path);
+	}
+}
+
+/*
+ * Library directories listed in ld.so.conf.d
+ */
+static void
+__wormhole_ldcache_hash_conf(uint64_t *hash, wormhole_environment_t *env,
+			const char **layer_root, unsigned int nlayers, const char *conf_path)
+{
+	char line[PATH_MAX];
+	FILE *fp;
 
-		dest = wormhole_scaffold_dest_path(scaffold, abs_path);
+	__wormhole_ldcache_hash_stat(hash, env, layer_root, nlayers, conf_path);
 
-		if (!func(env, pi, scaffold, dest, source))
-			goto done;
-	}
+	if (!(fp = fopen(wormhole_environment_target_path(env, conf_path), "r")))
+		return;
 
-	retval = true;
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, " \t\r\n#")] = '\0';
+		if (line[0] == '/')
+			__wormhole_ldcache_hash_stat(hash, env, layer_root, nlayers, line);
+	}
 
-done:
-	globfree(&globbed);
-	return retval;
+	fclose(fp);
 }
 
-static bool
-pathinfo_process_mount(wormhole_environment_t *env, const wormhole_path_info_t *pi,
-			const struct wormhole_scaffold *scaffold)
+static uint64_t
+wormhole_ldcache_key(wormhole_environment_t *env, const char **layer_root, unsigned int nlayers)
 {
-	const char *dest;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const char **dirs;
+	struct dirent *d;
+	unsigned int i;
+	DIR *dir;
 
-	trace("%s(path=%s)", __func__, pi->path);
+	for (i = 0; i < nlayers; ++i)
+		__wormhole_ldcache_hash_string(&hash, layer_root[i]);
 
-	/* We check for this in the config file parsing code, so an assert is good enough here. */
-	assert(pi->path[0] == '/');
+	for (dirs = wormhole_ldcache_lib_dirs; *dirs; ++dirs)
+		__wormhole_ldcache_hash_stat(&hash, env, layer_root, nlayers, *dirs);
 
-	dest = wormhole_scaffold_dest_path(scaffold, pi->path);
+	__wormhole_ldcache_hash_conf(&hash, env, layer_root, nlayers, "/etc/ld.so.conf");
+	__wormhole_ldcache_hash_stat(&hash, env, layer_root, nlayers, "/etc/ld.so.conf.d");
 
-	if (!_pathinfo_mount_one(env, pi, dest))
-		return false;
+	/* readdir order is stable as long as the directory does not change,
+	 * and if it changes, so does its mtime. */
+	if ((dir = opendir(wormhole_environment_target_path(env, "/etc/ld.so.conf.d"))) != NULL) {
+		while ((d = readdir(dir)) != NULL) {
+			char conf_path[PATH_MAX];
 
-	return true;
+			if (d->d_name[0] == '.')
+				continue;
+
+			snprintf(conf_path, sizeof(conf_path), "/etc/ld.so.conf.d/%s", d->d_name);
+			__wormhole_ldcache_hash_conf(&hash, env, layer_root, nlayers, conf_path);
+		}
+		closedir(dir);
+	}
+
+	return hash;
 }
 
+/*
+ * Only use cache files that cannot have been planted by someone else:
+ * file and directory must have the same owner, and must not be writable
+ * by anyone else.
+ */
 static bool
-pathinfo_process(wormhole_environment_t *env, const wormhole_path_info_t *pi, const struct wormhole_scaffold *scaffold)
+wormhole_ldcache_trusted(const char *store_dir, const char *cache_path)
 {
-	if (pi->type == WORMHOLE_PATH_TYPE_HIDE) {
-		/* hiding is not yet implemented */
-		log_error("Environment %s: do not know how to hide %s - no yet implemented", env->name, pi->path);
-		return false;
-	}
+	struct stat dstb, fstb;
 
-	switch (pi->type) {
-	case WORMHOLE_PATH_TYPE_BIND:
-		return pathinfo_process_glob(env, pi, scaffold, pathinfo_bind_path);
+	if (stat(store_dir, &dstb) < 0 || stat(cache_path, &fstb) < 0)
+		return false;
 
-	case WORMHOLE_PATH_TYPE_BIND_CHILDREN:
-		return pathinfo_process_glob(env, pi, scaffold, pathinfo_bind_children);
+	if (!S_ISREG(fstb.st_mode) || fstb.st_uid != dstb.st_uid
+	 || (dstb.st_mode & (S_IWGRP | S_IWOTH))
+	 || (fstb.st_mode & (S_IWGRP | S_IWOTH))) {
+		log_warning("Ignoring untrusted ld.so.cache %s", cache_path);
+		return false;
+	}
 
-	case WORMHOLE_PATH_TYPE_OVERLAY:
-		return pathinfo_process_glob(env, pi, scaffold, pathinfo_overlay_path);
+	return true;
+}
 
-#if 0
-	case WORMHOLE_PATH_TYPE_OVERLAY_CHILDREN:
-		return pathinfo_process_glob(env, pi, scaffold, pathinfo_overlay_children);
-#endif
+static const char *
+wormhole_ldcache_user_dir(void)
+{
+	static char pathbuf[PATH_MAX];
+	uid_t uid = wormhole_setup_uid;
+	struct passwd *pw;
 
-	case WORMHOLE_PATH_TYPE_MOUNT:
-		return pathinfo_process_mount(env, pi, scaffold);
+	if (uid == (uid_t) -1)
+		uid = getuid();
 
-	case WORMHOLE_PATH_TYPE_WORMHOLE:
-		return pathinfo_bind_wormhole(env, pi, scaffold);
+	if (!(pw = getpwuid(uid)) || !pw->pw_dir)
+		return NULL;
 
-	default:
-		log_error("Environment %s: unsupported path_info type %s", env->name, pathinfo_type_string(pi->type));
-		return false;
-	}
+	snprintf(pathbuf, sizeof(pathbuf), "%s%s", pw->pw_dir, WORMHOLE_USER_LDCACHE_PATH + 1);
+	return pathbuf;
 }
 
 /*
- * Some overlays contain shared libraries. Maintain a separate ld.so.cache inside the layer.
+ * Run ldconfig to create a new cache file at cache_path, by way of a
+ * temporary file in the same directory.
  */
 static bool
-wormhole_layer_ldconfig(wormhole_environment_t *env, const struct wormhole_layer_config *layer, const char *overlay_root)
+wormhole_ldcache_generate(wormhole_environment_t *env, const char *store_dir, const char *cache_path)
 {
-	char overlay_etc[PATH_MAX];
-	int verdict;
-	bool ok = false, is_tempfile = false;
+	char temp_path[PATH_MAX], root_path[PATH_MAX];
+	char *argv[] = { "/sbin/ldconfig", "-X", "-C", temp_path, NULL };
+	struct procutil_command cmd;
+	int fd, status;
 
-	snprintf(overlay_etc, sizeof(overlay_etc), "%s/etc", overlay_root);
-	if (!fsutil_makedirs(overlay_etc, 0755)) {
-		log_error("Environment %s: unable to create /etc directory for ld.so.cache", env->name);
+	if (!fsutil_makedirs(store_dir, 0755))
 		return false;
-	}
 
-	if (geteuid() == 0) {
-		snprintf(overlay_etc, sizeof(overlay_etc), "%s/etc/ld.so.cache", overlay_root);
+	snprintf(temp_path, sizeof(temp_path), "%s/.new.XXXXXX", store_dir);
+	if ((fd = mkstemp(temp_path)) < 0) {
+		trace("Cannot create %s: %m", temp_path);
+		return false;
+	}
+	fchmod(fd, 0644);
+	close(fd);
+
+	trace2("Environment %s: updating ld.so.cache", env->name);
+
+	/* We do not re-create links. The links inside the layer should be
+	 * up-to-date (hopefully!); and touching links in layers below may
+	 * fail.
+	 * If we're assembling the environment in a detached tree, ldconfig
+	 * needs to look at that tree rather than ours. The store directory
+	 * is visible in there, too. */
+	procutil_command_init(&cmd, argv);
+	if (wormhole_environment_mount_tree(env) >= 0) {
+		snprintf(root_path, sizeof(root_path), "%s", wormhole_environment_target_path(env, "/"));
+		cmd.root_directory = root_path;
+	}
 
-		verdict = fsutil_inode_compare("/etc/ld.so.cache", overlay_etc);
-	} else {
-		int fd;
+	if (!procutil_command_run(&cmd, &status) || !procutil_child_status_okay(status)) {
+		log_warning("Environment %s: ldconfig failed", env->name);
+		unlink(temp_path);
+		return false;
+	}
 
-		strncpy(overlay_etc, "/tmp/ld.so.XXXXXX.conf", sizeof(overlay_etc));
-		if ((fd = mkstemps(overlay_etc, sizeof(".conf") - 1)) < 0) {
-			log_error("Cannot create temp file for ld.so.conf: %m");
-			return false;
-		}
+	if (rename(temp_path, cache_path) < 0) {
+		log_error("Unable to rename %s to %s: %m", temp_path, cache_path);
+		unlink(temp_path);
+		return false;
+	}
 
-		is_tempfile = true;
-		close(fd);
+	return true;
+}
 
-		verdict = -1;
-	}
+static bool
+wormhole_layer_ldconfig(wormhole_environment_t *env, const struct wormhole_layer_config *layer, const char *overlay_root,
+			const char **layer_root, unsigned int nlayers)
+{
+	const char *store_dirs[2], *store_dir;
+	char layer_cache[PATH_MAX], cache_path[PATH_MAX], key[32];
+	unsigned int i, num_stores = 0;
+	int verdict;
 
 	/* If the layer has its own version of /etc/ld.so.cache that has a more recent time
 	 * stamp than the "real" one, there's no need to regenerate.
 	 */
-	if (verdict < 0 || !(verdict & FSUTIL_FILE_YOUNGER)) {
-		char command[PATH_MAX];
+	snprintf(layer_cache, sizeof(layer_cache), "%s/etc/ld.so.cache", overlay_root);
+	verdict = fsutil_inode_compare("/etc/ld.so.cache", layer_cache);
+	if (verdict >= 0 && (verdict & FSUTIL_FILE_YOUNGER)) {
+		trace2("Environment %s: ld.so.cache exists and is recent - not updating it", env->name);
+		return _pathinfo_bind_one(env, layer_cache, "/etc/ld.so.cache");
+	}
 
-		trace2("Environment %s: updating ld.so.cache", env->name);
+	snprintf(key, sizeof(key), "%016llx", (unsigned long long) wormhole_ldcache_key(env, layer_root, nlayers));
 
-		/* We do not re-create links. The links inside the layer should be
-		 * up-to-date (hopefully!); and touching links in layers below may
-		 * fail. */
-		snprintf(command, sizeof(command), "/sbin/ldconfig -X -C %s", overlay_etc);
+	store_dirs[num_stores++] = WORMHOLE_LDCACHE_PATH;
+	if ((store_dir = wormhole_ldcache_user_dir()) != NULL)
+		store_dirs[num_stores++] = store_dir;
 
-		trace2("Running \"%s\"", command);
-		if (system(command) != 0)
-			log_warning("Environment %s: ldconfig failed", env->name);
-	} else {
-		trace2("Environment %s: ld.so.cache exists and is recent - not updating it", env->name);
+	for (i = 0; i < num_stores; ++i) {
+		snprintf(cache_path, sizeof(cache_path), "%s/%s", store_dirs[i], key);
+		if (wormhole_ldcache_trusted(store_dirs[i], cache_path)) {
+			trace2("Environment %s: using ld.so.cache %s", env->name, cache_path);
+			return _pathinfo_bind_one(env, cache_path, "/etc/ld.so.cache");
+		}
 	}
 
-	/* Now bind mount it */
-	ok = _pathinfo_bind_one(env, overlay_etc, "/etc/ld.so.cache");
+	/* Not found; generate it in the first store we're allowed to write to. */
+	for (i = 0; i < num_stores; ++i) {
+		if (access(store_dirs[i], W_OK) < 0 && errno != ENOENT)
+			continue;
 
-	if (is_tempfile)
-		unlink(overlay_etc);
+		snprintf(cache_path, sizeof(cache_path), "%s/%s", store_dirs[i], key);
+		if (wormhole_ldcache_generate(env, store_dirs[i], cache_path))
+			return _pathinfo_bind_one(env, cache_path, "/etc/ld.so.cache");
+	}
 
-	return ok;
+	/* Carry on with whatever ld.so.cache the environment has */
+	log_warning("Environment %s: unable to create ld.so.cache", env->name);
+	return true;
 }
 
-static bool
-wormhole_layer_setup(wormhole_environment_t *env, const struct wormhole_layer_config *layer)
+/*
+ * Mount the layer's container (if any) and find its root directory.
+ * For image layers, this also sets the root directory of the environment.
+ */
+static const char *
+wormhole_layer_prepare(wormhole_environment_t *env, const struct wormhole_layer_config *layer)
 {
 	const char *overlay_root;
-	const wormhole_path_info_t *pi;
-	struct wormhole_scaffold scaffold;
-	bool mounted = false;
-	bool ok = true;
-	unsigned int i;
 
 	if (layer->image) {
 		/* The overlay is provided via a container image. */
 		overlay_root = overlay_container_mount(env, layer->image);
-		if (!overlay_root)
+		if (!overlay_root) {
 			log_error("Environment %s: unable to mount container \"%s\"", env->name, layer->image);
-		mounted = true;
+			return NULL;
+		}
 	} else {
 		assert(layer->directory);
 		overlay_root = layer->directory;
@@ -1040,44 +1697,367 @@ wormhole_layer_setup(wormhole_environment_t *env, const struct wormhole_layer_co
 			trace("  root directory %s", env->root_directory);
 			if (env->orig_root_directory)
 				trace("  original root directory %s", env->orig_root_directory);
-			return false;
+			return NULL;
 		}
 
 		trace("Image layer: overlaying directories from / onto %s", env->root_directory);
-		scaffold.source_dir = NULL;
 	} else {
 		trace("Overlay layer: overlaying directories from %s onto %s", overlay_root, env->root_directory?: "/");
-		scaffold.source_dir = overlay_root;
 	}
 
-	scaffold.dest_dir = env->root_directory;
+	return overlay_root;
+}
 
-	for (i = 0, pi = layer->path; ok && i < layer->npaths; ++i, ++pi) {
-		trace("Environment %s: pathinfo %s: %s", env->name,
-				pathinfo_type_string(pi->type), pi->path);
-		ok = pathinfo_process(env, pi, &scaffold);
-		trace("  result: %sok", ok? "" : "not ");
+static void
+wormhole_layer_scaffold(const wormhole_environment_t *env, const struct wormhole_layer_config *layer,
+			const char *overlay_root, struct wormhole_scaffold *scaffold)
+{
+	scaffold->source_dir = (layer->type == WORMHOLE_LAYER_TYPE_IMAGE)? NULL : overlay_root;
+	scaffold->dest_dir = env->root_directory;
+}
+
+/*
+ * Before mounting anything, we merge the path info of all layers into
+ * a single mount plan. When several layers overlay the same directory,
+ * this gives us one overlay with several lower dirs rather than a stack
+ * of overlays; and paths that are bound identically by several layers
+ * are bound only once.
+ */
+struct wormhole_mount_plan_entry {
+	unsigned int		layer;
+	const wormhole_path_info_t *pi;
+	char *			dest;
+	char *			source;
+
+	/* Sources of overlays merged into this one, bottom most last */
+	struct strutil_array	more_sources;
+};
+
+struct wormhole_mount_plan {
+	char *			layer_root[WORMHOLE_ENVIRONMENT_LAYER_MAX];
+
+	unsigned int		count;
+	struct wormhole_mount_plan_entry *entry;
+
+	unsigned int		merged;
+};
+
+/* Do not let the lowerdir option of a merged overlay grow without bounds */
+#define WORMHOLE_MOUNT_PLAN_LOWER_MAX	4000
+
+static void
+wormhole_mount_plan_free(struct wormhole_mount_plan *plan)
+{
+	unsigned int i;
+
+	for (i = 0; i < plan->count; ++i) {
+		struct wormhole_mount_plan_entry *e = &plan->entry[i];
+
+		free(e->dest);
+		free(e->source);
+		strutil_array_destroy(&e->more_sources);
 	}
+	for (i = 0; i < WORMHOLE_ENVIRONMENT_LAYER_MAX; ++i)
+		free(plan->layer_root[i]);
+	free(plan->entry);
+	free(plan);
+}
+
+/*
+ * Returns true if one of the paths is a prefix of the other.
+ */
+static bool
+__wormhole_mount_plan_paths_overlap(const char *a, const char *b)
+{
+	size_t alen = strlen(a), blen = strlen(b);
 
-	if (ok && layer->use_ldconfig)
-		ok = wormhole_layer_ldconfig(env, layer, overlay_root);
+	if (alen > blen) {
+		const char *t = a;
 
-	if (mounted && !overlay_container_unmount(env, layer->image, overlay_root)) {
-		log_error("Environment %s: unable to unmount \"%s\": %m", env->name, overlay_root);
-		ok = false;
+		a = b; b = t;
+		alen = blen;
 	}
 
-	return ok;
+	if (strncmp(a, b, alen))
+		return false;
+
+	return b[alen] == '\0' || b[alen] == '/' || (alen && a[alen - 1] == '/');
+}
+
+static bool
+__wormhole_mount_plan_entry_same(const struct wormhole_mount_plan_entry *e,
+				const wormhole_path_info_t *pi, const char *source)
+{
+	if (e->pi->type != pi->type || e->more_sources.count)
+		return false;
+
+	switch (pi->type) {
+	case WORMHOLE_PATH_TYPE_BIND:
+	case WORMHOLE_PATH_TYPE_WORMHOLE:
+		return strutil_equal(e->source, source);
+
+	case WORMHOLE_PATH_TYPE_MOUNT:
+		return strutil_equal(e->pi->mount.fstype, pi->mount.fstype)
+		    && strutil_equal(e->pi->mount.options, pi->mount.options);
+	}
+
+	return false;
+}
+
+static size_t
+__wormhole_mount_plan_entry_lower_len(const struct wormhole_mount_plan_entry *e)
+{
+	size_t len = strlen(e->dest) + strlen(e->source) + 2;
+	unsigned int i;
+
+	for (i = 0; i < e->more_sources.count; ++i)
+		len += strlen(e->more_sources.data[i]) + 1;
+	return len;
+}
+
+static void
+wormhole_mount_plan_add(struct wormhole_mount_plan *plan, unsigned int layer,
+			const wormhole_path_info_t *pi, const char *dest, const char *source)
+{
+	struct wormhole_mount_plan_entry *e;
+	unsigned int i;
+
+	/* Find the most recent entry that touches dest, or anything above
+	 * or below it. Anything before that cannot interfere. */
+	for (i = plan->count; i--; ) {
+		e = &plan->entry[i];
+
+		if (!__wormhole_mount_plan_paths_overlap(e->dest, dest))
+			continue;
+
+		if (strcmp(e->dest, dest))
+			break;
+
+		if (__wormhole_mount_plan_entry_same(e, pi, source)) {
+			trace2("Mount plan: %s already set up by layer %u", dest, e->layer);
+			plan->merged++;
+			return;
+		}
+
+		if (e->pi->type == WORMHOLE_PATH_TYPE_OVERLAY && pi->type == WORMHOLE_PATH_TYPE_OVERLAY
+		 && __wormhole_mount_plan_entry_lower_len(e) + strlen(source) < WORMHOLE_MOUNT_PLAN_LOWER_MAX) {
+			trace2("Mount plan: stacking %s onto overlay at %s", source, dest);
+			strutil_array_append(&e->more_sources, source);
+			plan->merged++;
+			return;
+		}
+
+		break;
+	}
+
+	if ((plan->count % 32) == 0)
+		plan->entry = realloc(plan->entry, (plan->count + 32) * sizeof(plan->entry[0]));
+
+	e = &plan->entry[plan->count++];
+	memset(e, 0, sizeof(*e));
+	e->layer = layer;
+	e->pi = pi;
+	e->dest = strdup(dest);
+	e->source = source? strdup(source) : NULL;
+}
+
+static bool
+wormhole_mount_plan_add_glob(struct wormhole_mount_plan *plan, unsigned int layer,
+			const wormhole_path_info_t *pi, const struct wormhole_scaffold *scaffold)
+{
+	char pattern[PATH_MAX];
+	glob_t globbed;
+	size_t n;
+	int r;
+
+	/* We check for this in the config file parsing code, so an assert is good enough here. */
+	assert(pi->path[0] == '/');
+
+	/* Build the pattern to glob for.
+	 * Overlay case: $overlay_root/$path
+	 * Image case: $path
+	 */
+	snprintf(pattern, sizeof(pattern), "%s", wormhole_scaffold_source_path(scaffold, pi->path));
+
+	r = glob(pattern, GLOB_NOSORT | GLOB_NOMAGIC | GLOB_TILDE, NULL, &globbed);
+	if (r != 0) {
+		/* I'm globsmacked. Why did it fail? */
+		log_error("pathinfo expansion failed, glob(%s) returns %d", pattern, r);
+		return false;
+	}
+
+	for (n = 0; n < globbed.gl_pathc; ++n) {
+		const char *source, *abs_path;
+
+		source = globbed.gl_pathv[n];
+
+		/* Get the un-prefixed path for $glob
+		 * Overlay case: Strip $overlay_root from $overlay_root/$glob
+		 * Image case: $glob
+		 */
+		abs_path = wormhole_scaffold_source_path_inverse(scaffold, source);
+		if (abs_path == NULL) {
+			log_error("%s: strange - glob expansion of %s returned path name %s", __func__,
+					pattern, source);
+			globfree(&globbed);
+			return false;
+		}
+
+		wormhole_mount_plan_add(plan, layer, pi, wormhole_scaffold_dest_path(scaffold, abs_path), source);
+	}
+
+	globfree(&globbed);
+	return true;
+}
+
+static struct wormhole_mount_plan *
+wormhole_mount_plan_build(wormhole_environment_t *env, const char **layer_root)
+{
+	struct wormhole_mount_plan *plan;
+	unsigned int i, j;
+
+	plan = calloc(1, sizeof(*plan));
+
+	for (i = 0; i < env->nlayers; ++i) {
+		const struct wormhole_layer_config *layer = env->layer[i];
+		struct wormhole_scaffold scaffold;
+		const wormhole_path_info_t *pi;
+
+		strutil_set(&plan->layer_root[i], layer_root[i]);
+		wormhole_layer_scaffold(env, layer, layer_root[i], &scaffold);
+
+		for (j = 0, pi = layer->path; j < layer->npaths; ++j, ++pi) {
+			switch (pi->type) {
+			case WORMHOLE_PATH_TYPE_BIND:
+			case WORMHOLE_PATH_TYPE_BIND_CHILDREN:
+			case WORMHOLE_PATH_TYPE_OVERLAY:
+				if (!wormhole_mount_plan_add_glob(plan, i, pi, &scaffold))
+					goto failed;
+				break;
+
+			case WORMHOLE_PATH_TYPE_MOUNT:
+				assert(pi->path[0] == '/');
+				wormhole_mount_plan_add(plan, i, pi, wormhole_scaffold_dest_path(&scaffold, pi->path), NULL);
+				break;
+
+			case WORMHOLE_PATH_TYPE_WORMHOLE:
+				wormhole_mount_plan_add(plan, i, pi, wormhole_scaffold_dest_path(&scaffold, pi->path),
+						wormhole_client_path);
+				break;
+
+			case WORMHOLE_PATH_TYPE_HIDE:
+				/* hiding is not yet implemented */
+				log_error("Environment %s: do not know how to hide %s - no yet implemented", env->name, pi->path);
+				goto failed;
+
+			default:
+				log_error("Environment %s: unsupported path_info type %s", env->name, pathinfo_type_string(pi->type));
+				goto failed;
+			}
+		}
+	}
+
+	trace("Environment %s: mount plan has %u entries, %u merged", env->name, plan->count, plan->merged);
+	return plan;
+
+failed:
+	wormhole_mount_plan_free(plan);
+	return NULL;
+}
+
+/*
+ * Mount an overlay with several lower layers at dest
+ */
+static bool
+pathinfo_overlay_stack(wormhole_environment_t *environment, const struct wormhole_mount_plan_entry *e)
+{
+	char lower_path_list[WORMHOLE_MOUNT_PLAN_LOWER_MAX + PATH_MAX];
+	unsigned int i, len;
+
+	trace2("%s(%s, %s + %u)", __func__, e->dest, e->source, e->more_sources.count);
+
+	len = snprintf(lower_path_list, sizeof(lower_path_list), "%s:%s",
+			wormhole_environment_target_path(environment, e->dest), e->source);
+	for (i = 0; i < e->more_sources.count && len < sizeof(lower_path_list); ++i)
+		len += snprintf(lower_path_list + len, sizeof(lower_path_list) - len, ":%s", e->more_sources.data[i]);
+
+	if (len >= sizeof(lower_path_list)) {
+		log_error("Environment %s: too many layers to overlay at %s", environment->name, e->dest);
+		return false;
+	}
+
+	if (!_pathinfo_overlay_lower(environment, lower_path_list, e->dest))
+		return false;
+
+	wormhole_tree_state_set_overlay_mounted(environment->tree_state, e->dest, NULL);
+	return true;
+}
+
+static bool
+wormhole_mount_plan_execute(wormhole_environment_t *env, const struct wormhole_mount_plan *plan)
+{
+	unsigned int i;
+
+	for (i = 0; i < plan->count; ++i) {
+		const struct wormhole_mount_plan_entry *e = &plan->entry[i];
+		const wormhole_path_info_t *pi = e->pi;
+		struct wormhole_scaffold scaffold;
+		bool ok;
+
+		wormhole_layer_scaffold(env, env->layer[e->layer], plan->layer_root[e->layer], &scaffold);
+
+		trace("Environment %s: pathinfo %s: %s", env->name,
+				pathinfo_type_string(pi->type), e->dest);
+		trace_span_begin(TRACE_EV_MOUNT, i, e->dest);
+
+		switch (pi->type) {
+		case WORMHOLE_PATH_TYPE_BIND:
+		case WORMHOLE_PATH_TYPE_WORMHOLE:
+			ok = pathinfo_bind_path(env, pi, &scaffold, e->dest, e->source);
+			break;
+
+		case WORMHOLE_PATH_TYPE_BIND_CHILDREN:
+			ok = pathinfo_bind_children(env, pi, &scaffold, e->dest, e->source);
+			break;
+
+		case WORMHOLE_PATH_TYPE_OVERLAY:
+			if (e->more_sources.count)
+				ok = pathinfo_overlay_stack(env, e);
+			else
+				ok = pathinfo_overlay_path(env, pi, &scaffold, e->dest, e->source);
+			break;
+
+		case WORMHOLE_PATH_TYPE_MOUNT:
+			ok = _pathinfo_mount_one(env, pi, e->dest);
+			break;
+
+		default:
+			ok = false;
+		}
+
+		trace_span_end(TRACE_EV_MOUNT, i, pathinfo_type_string(pi->type));
+		trace("  result: %sok", ok? "" : "not ");
+		if (!ok)
+			return false;
+	}
+
+	return true;
 }
 
 bool
 wormhole_environment_setup(wormhole_environment_t *env)
 {
-	unsigned int i;
+	const char *layer_root[WORMHOLE_ENVIRONMENT_LAYER_MAX];
+	struct wormhole_mount_plan *plan = NULL;
+	unsigned int i, nprepared = 0;
+	int ldconfig_layer = -1;
+	bool ok = false;
 
 	if (env->failed)
 		return false;
 
+	trace_span_begin(TRACE_EV_ENV_SETUP, 0, env->name);
+
 	if (env->tree_state)
 		wormhole_tree_state_free(env->tree_state);
 	env->tree_state = wormhole_tree_state_new();
@@ -1087,16 +2067,157 @@ wormhole_environment_setup(wormhole_environment_t *env)
 
 		if (i && layer->type == WORMHOLE_LAYER_TYPE_IMAGE) {
 			log_error("Environment %s specifies an image container, but it's not the bottom most layer", env->name);
-			return false;
+			goto out;
 		}
 
-		if (!wormhole_layer_setup(env, layer))
-			return false;
+		trace_span_begin(TRACE_EV_LAYER_PREPARE, i, layer->image ?: layer->directory);
+		layer_root[i] = wormhole_layer_prepare(env, layer);
+		trace_span_end(TRACE_EV_LAYER_PREPARE, i, layer->image ?: layer->directory);
+		if (layer_root[i] == NULL)
+			goto out;
+		nprepared++;
+
+		if (layer->use_ldconfig)
+			ldconfig_layer = i;
+	}
+
+	trace_span_begin(TRACE_EV_MOUNT_PLAN_BUILD, 0, env->name);
+	plan = wormhole_mount_plan_build(env, layer_root);
+	trace_span_end(TRACE_EV_MOUNT_PLAN_BUILD, 0, env->name);
+	if (plan == NULL)
+		goto out;
+
+	if (!wormhole_mount_plan_execute(env, plan))
+		goto out;
+
+	/* Only the ld.so.cache of the top most layer is visible in the end,
+	 * and it has to know about the libraries of all layers. So there's
+	 * no point in generating one per layer. */
+	if (ldconfig_layer >= 0) {
+		bool done;
+
+		trace_span_begin(TRACE_EV_LDCONFIG, ldconfig_layer, env->name);
+		done = wormhole_layer_ldconfig(env, env->layer[ldconfig_layer], layer_root[ldconfig_layer],
+				layer_root, env->nlayers);
+		trace_span_end(TRACE_EV_LDCONFIG, ldconfig_layer, env->name);
+		if (!done)
+			goto out;
+	}
+
+	ok = true;
+
+out:
+	if (plan)
+		wormhole_mount_plan_free(plan);
+
+	/* The mounts of container images are in use for as long as the
+	 * environment is: an image layer's mount is our root directory.
+	 * So we hold on to them until wormhole_environment_reset(), and
+	 * drop the ones from any previous setup instead. */
+	if (ok) {
+		wormhole_environment_release_images(env, env->images_held);
+		env->images_held = (1U << nprepared) - 1;
+	} else {
+		wormhole_environment_release_images(env, (1U << nprepared) - 1);
+	}
+
+	trace_span_end(TRACE_EV_ENV_SETUP, 0, env->name);
+	return ok;
+}
+
+/*
+ * Set up the environment in a detached copy of the mount tree, and
+ * attach it on top of / when done. This avoids a lot of mount propagation
+ * work in the kernel. If the kernel does not support this, we fall back
+ * to mounting everything in place.
+ *
+ * On success, the calling process has its root changed to the new tree.
+ * Processes joining the namespace later will see it, too.
+ */
+static bool
+__wormhole_environment_setup_detached(wormhole_environment_t *env)
+{
+	bool ok;
+	int tree_fd;
+
+	if (!fsutil_mount_tree_supported())
+		return wormhole_environment_setup(env);
+
+	env->mount_tree.enabled = true;
+	env->mount_tree.fd = -1;
+
+	ok = wormhole_environment_setup(env);
+
+	tree_fd = env->mount_tree.fd;
+	env->mount_tree.enabled = false;
+	env->mount_tree.fd = -1;
+
+	/* Nothing was mounted, or we fell back to mounting in place */
+	if (tree_fd < 0)
+		return ok;
+
+	if (!ok) {
+		close(tree_fd);
+		return false;
+	}
+
+	if (fchdir(tree_fd) < 0) {
+		log_error("Environment %s: unable to change to new mount tree: %m", env->name);
+		close(tree_fd);
+		return false;
+	}
+
+	if (!fsutil_mount_tree_attach(tree_fd, "/"))
+		return false;
+
+	if (chroot(".") < 0 || chdir("/") < 0) {
+		log_error("Environment %s: unable to change root to new mount tree: %m", env->name);
+		return false;
 	}
 
+	trace("Environment %s: attached mount tree", env->name);
 	return true;
 }
 
+static void
+__wormhole_environment_trace_mount(const struct wormhole_mount_entry *old_entry,
+				const struct wormhole_mount_entry *new_entry,
+				void *closure)
+{
+	const wormhole_environment_t *env = closure;
+
+	if (old_entry == NULL)
+		trace2("Environment %s: mounted %s at %s (%s)", env->name,
+				new_entry->source, new_entry->mount_point, new_entry->fstype);
+	else if (new_entry == NULL)
+		trace2("Environment %s: unmounted %s", env->name, old_entry->mount_point);
+	else
+		trace2("Environment %s: mount at %s changed", env->name, new_entry->mount_point);
+}
+
+bool
+wormhole_environment_setup_detached(wormhole_environment_t *env)
+{
+	struct wormhole_mount_table *before, *after;
+	bool ok;
+
+	if (tracing_level < 2)
+		return __wormhole_environment_setup_detached(env);
+
+	/* Show exactly what the setup did to the mount table */
+	before = wormhole_mount_table_snapshot();
+	ok = __wormhole_environment_setup_detached(env);
+	if (before && (after = wormhole_mount_table_snapshot()) != NULL) {
+		trace2("Environment %s: setup changed %u mounts", env->name,
+				wormhole_mount_table_diff(before, after, __wormhole_environment_trace_mount, env));
+		wormhole_mount_table_free(after);
+	}
+	if (before)
+		wormhole_mount_table_free(before);
+
+	return ok;
+}
+
 int
 wormhole_profile_setup(wormhole_profile_t *profile, bool userns)
 {
@@ -1112,6 +2233,8 @@ wormhole_profile_setup(wormhole_profile_t *profile, bool userns)
                 log_fatal("Unable to change file system root to private (no propagation)");
 #endif
 
+	wormhole_setup_uid = getuid();
+
 	if (userns) {
 		if (!wormhole_create_user_namespace())
 			return -1;
@@ -1120,7 +2243,7 @@ wormhole_profile_setup(wormhole_profile_t *profile, bool userns)
 			return -1;
 	}
 
-	if (!wormhole_environment_setup(env))
+	if (!wormhole_environment_setup_detached(env))
 		return -1;
 
 	return 0;
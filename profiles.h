@@ -38,6 +38,7 @@ struct wormhole_profile {
 
 extern bool			wormhole_profiles_configure(struct wormhole_config *);
 extern wormhole_profile_t *	wormhole_profile_find(const char *argv0);
+extern wormhole_profile_t *	wormhole_profile_find_for_user(const char *argv0, uid_t owner_uid, gid_t owner_gid);
 extern int			wormhole_profile_setup(wormhole_profile_t *, bool userns);
 
 extern const char *		wormhole_profile_command(const wormhole_profile_t *);
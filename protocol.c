@@ -33,51 +33,115 @@
 #define WORMHOLE_PROTO_TYPE_STRING	's'
 #define WORMHOLE_PROTO_TYPE_ARRAY	'A'
 
+/*
+ * Everything we decode from a message lives in a single allocation
+ * together with the parsed message, so that freeing the message is one
+ * free() call. Strings take no more room than they occupy in the payload.
+ * Each array element or stats entry takes at least 3 bytes on the wire,
+ * so the pointers and structs we need for them fit in len/3 pointers,
+ * plus a bit for alignment.
+ */
+struct wormhole_message_arena {
+	char *			data;
+	size_t			size;
+	size_t			used;
+};
+
+#define WORMHOLE_MESSAGE_ARENA_SIZE(payload_len) \
+	((payload_len) + ((payload_len) / 3 + 4) * sizeof(void *))
+
+static void *
+wormhole_message_arena_alloc(struct wormhole_message_arena *arena, size_t size, size_t align)
+{
+	size_t offset = (arena->used + align - 1) & ~(align - 1);
+
+	if (offset > arena->size || size > arena->size - offset)
+		return NULL;
+
+	arena->used = offset + size;
+	return arena->data + offset;
+}
+
+/*
+ * Allocate a buffer for building a message payload. We leave room for the
+ * message header in front, so that wormhole_message_build() does not have
+ * to copy anything.
+ */
+static struct buf *
+wormhole_message_payload_alloc(void)
+{
+	struct buf *bp = buf_alloc();
+
+	buf_reserve_head(bp, sizeof(struct wormhole_message));
+	return bp;
+}
+
+/*
+ * Turn the payload into a message by prepending the header.
+ * This consumes the payload buffer chain.
+ */
 struct buf *
-wormhole_message_build(int opcode, const struct buf *payload)
+wormhole_message_build(int opcode, struct buf *payload)
 {
-	unsigned int payload_len = buf_available(payload);
+	unsigned long payload_len = buf_chain_available(payload);
 	struct wormhole_message msg;
-	struct buf *bp = buf_alloc();
 
-	if (payload_len >= 0x10000)
+	if (payload_len > WORMHOLE_PROTOCOL_PAYLOAD_MAX) {
+		log_error("%s: message payload of %lu bytes too big", __func__, payload_len);
+		buf_chain_free(payload);
 		return NULL;
+	}
 
 	memset(&msg, 0, sizeof(msg));
 	msg.version = htons(WORMHOLE_PROTOCOL_VERSION);
 	msg.opcode = htons(opcode);
 	msg.payload_len = htons(payload_len);
 
-	buf_put(bp, &msg, sizeof(msg));
+	if (!buf_prepend(payload, &msg, sizeof(msg))) {
+		log_error("%s: no room for message header", __func__);
+		buf_chain_free(payload);
+		return NULL;
+	}
 
-	/* Now copy the payload into the message */
-	if (payload_len) {
-		const void *data = buf_head(payload);
+	return payload;
+}
 
-		if (!buf_put(bp, data, payload_len))
-			return NULL;
-	}
-	return bp;
+/*
+ * Set the transaction ID of a message we built previously.
+ * Servers echo the transaction ID of a request in their reply, which
+ * allows them to respond to requests out of order.
+ */
+void
+wormhole_message_set_xid(struct buf *bp, unsigned int xid)
+{
+	struct wormhole_message *msg = (struct wormhole_message *) buf_head(bp);
+
+	assert(msg && buf_available(bp) >= sizeof(*msg));
+	msg->xid = htons(xid);
 }
 
+/*
+ * Each element is encoded as a single type byte, followed by a 16 bit
+ * size in network byte order, followed by the data.
+ */
 static inline bool
 __wormhole_message_put_type_and_size(struct buf *bp, char type, size_t len)
 {
-	unsigned char size;
+	uint16_t size;
 
-	if (len >= 256)
+	if (len > WORMHOLE_PROTOCOL_ELEMENT_MAX)
 		return false;
-	size = len;
+	size = htons(len);
 
-	return buf_put(bp, &type, 1)
-	    && buf_put(bp, &size, 1);
+	return buf_chain_put(bp, &type, 1) == 1
+	    && buf_chain_put(bp, &size, 2) == 2;
 }
 
 static inline bool
 __wormhole_message_put(struct buf *bp, char type, const void *datum, size_t len)
 {
 	return __wormhole_message_put_type_and_size(bp, type, len)
-	    && buf_put(bp, datum, len);
+	    && buf_chain_put(bp, datum, len) == len;
 }
 
 static inline bool
@@ -91,19 +155,21 @@ wormhole_message_put_int32(struct buf *bp, uint32_t value)
 static inline bool
 __wormhole_buffer_get(struct buf *bp, void *ptr, size_t len)
 {
-	if (!buf_get(bp, ptr, len))
+	if (buf_get(bp, ptr, len) < len)
 		return false;
-	__buf_advance_head(bp, len);
+	buf_chain_advance(bp, len);
 	return true;
 }
 
 static inline char
 __wormhole_message_get_type_and_size(struct buf *bp, size_t *size_p)
 {
-	unsigned char type, size;
+	unsigned char type;
+	uint16_t size;
 
-	if (!__wormhole_buffer_get(bp, &type, 1) || !__wormhole_buffer_get(bp, &size, 1))
+	if (!__wormhole_buffer_get(bp, &type, 1) || !__wormhole_buffer_get(bp, &size, 2))
 		return '\0';
+	size = ntohs(size);
 
 	if (type != WORMHOLE_PROTO_TYPE_INT32
 	 && type != WORMHOLE_PROTO_TYPE_STRING
@@ -141,7 +207,7 @@ wormhole_message_put_string(struct buf *bp, const char *s)
 }
 
 static inline char *
-wormhole_message_get_string(struct buf *bp)
+wormhole_message_get_string(struct buf *bp, struct wormhole_message_arena *arena)
 {
 	size_t size;
 	char *ret;
@@ -153,11 +219,10 @@ wormhole_message_get_string(struct buf *bp)
 		return false;
 
 	/* Extract the NUL terminated string from the buffer */
-	ret = malloc(size);
-	if (__wormhole_buffer_get(bp, ret, size) && ret[size - 1] == '\0')
+	ret = wormhole_message_arena_alloc(arena, size, 1);
+	if (ret && __wormhole_buffer_get(bp, ret, size) && ret[size - 1] == '\0')
 		return ret;
 
-	free(ret);
 	return NULL;
 }
 
@@ -183,18 +248,8 @@ wormhole_message_put_string_array(struct buf *bp, const char **array)
 	return true;
 }
 
-static inline void
-wormhole_message_free_string_array(char **array)
-{
-	unsigned int i;
-
-	for (i = 0; array[i]; ++i)
-		free(array[i]);
-	free(array);
-}
-
 static char **
-wormhole_message_get_string_array(struct buf *bp)
+wormhole_message_get_string_array(struct buf *bp, struct wormhole_message_arena *arena)
 {
 	size_t count;
 	unsigned int i;
@@ -203,31 +258,31 @@ wormhole_message_get_string_array(struct buf *bp)
 	if (__wormhole_message_get_type_and_size(bp, &count) != WORMHOLE_PROTO_TYPE_ARRAY)
 		return NULL;
 
-	ret = calloc(count + 1, sizeof(ret[0]));
+	ret = wormhole_message_arena_alloc(arena, (count + 1) * sizeof(ret[0]), sizeof(ret[0]));
+	if (ret == NULL)
+		return NULL;
+
 	for (i = 0; i < count; ++i) {
-		ret[i] = wormhole_message_get_string(bp);
+		ret[i] = wormhole_message_get_string(bp, arena);
 		if (ret[i] == NULL)
-			goto failed;
+			return NULL;
 	}
+	ret[count] = NULL;
 
 	return ret;
-
-failed:
-	wormhole_message_free_string_array(ret);
-	return NULL;
 }
 
 struct buf *
 wormhole_message_build_status(unsigned int status)
 {
-	struct buf *payload = buf_alloc();
-	struct buf *msg = NULL;
+	struct buf *payload = wormhole_message_payload_alloc();
 
-	if (wormhole_message_put_int32(payload, status))
-		msg =  wormhole_message_build(WORMHOLE_OPCODE_STATUS, payload);
+	if (!wormhole_message_put_int32(payload, status)) {
+		buf_chain_free(payload);
+		return NULL;
+	}
 
-	buf_free(payload);
-	return msg;
+	return wormhole_message_build(WORMHOLE_OPCODE_STATUS, payload);
 }
 
 static bool
@@ -239,94 +294,161 @@ wormhole_message_parse_status(struct buf *payload, struct wormhole_message_parse
 struct buf *
 wormhole_message_build_namespace_request(const char *name)
 {
-	struct buf *payload = buf_alloc();
-	struct buf *msg = NULL;
+	struct buf *payload = wormhole_message_payload_alloc();
 
-	if (wormhole_message_put_string(payload, name))
-		msg = wormhole_message_build(WORMHOLE_OPCODE_NAMESPACE_REQUEST, payload);
+	if (!wormhole_message_put_string(payload, name)) {
+		buf_chain_free(payload);
+		return NULL;
+	}
 
-	buf_free(payload);
-	return msg;
+	return wormhole_message_build(WORMHOLE_OPCODE_NAMESPACE_REQUEST, payload);
 }
 
 static bool
-wormhole_message_parse_namespace_request(struct buf *payload, struct wormhole_message_namespace_request *msg)
+wormhole_message_parse_namespace_request(struct buf *payload, struct wormhole_message_namespace_request *msg,
+		struct wormhole_message_arena *arena)
 {
-	msg->profile = wormhole_message_get_string(payload);
+	msg->profile = wormhole_message_get_string(payload, arena);
 	if (msg->profile == NULL)
 		return false;
 
 	return true;
 }
 
-static void
-wormhole_message_destroy_namespace_request(struct wormhole_message_namespace_request *msg)
-{
-	if (msg->profile != NULL)
-		free(msg->profile);
-}
-
 struct buf *
 wormhole_message_build_namespace_response(unsigned int status, const char *cmd, const char **env,
-		const char *socket_name)
+		const char *socket_name, const char *root_dir)
 {
-	struct buf *payload = buf_alloc();
-	struct buf *msg = NULL;
+	struct buf *payload = wormhole_message_payload_alloc();
 
 	if (!wormhole_message_put_int32(payload, status))
-		goto done;
+		goto failed;
 
 	if (status == WORMHOLE_STATUS_OK) {
 		if (!wormhole_message_put_string(payload, cmd))
-			goto done;
+			goto failed;
 
 		if (!wormhole_message_put_string(payload, socket_name))
-			goto done;
+			goto failed;
 
 		if (!wormhole_message_put_string_array(payload, env))
-			goto done;
+			goto failed;
+
+		if (!wormhole_message_put_string(payload, root_dir))
+			goto failed;
 	}
 
-	msg = wormhole_message_build(WORMHOLE_OPCODE_NAMESPACE_RESPONSE, payload);
+	return wormhole_message_build(WORMHOLE_OPCODE_NAMESPACE_RESPONSE, payload);
 
-done:
-	buf_free(payload);
-	return msg;
+failed:
+	buf_chain_free(payload);
+	return NULL;
 }
 
 static bool
-wormhole_message_parse_namespace_response(struct buf *payload, struct wormhole_message_namespace_response *msg)
+wormhole_message_parse_namespace_response(struct buf *payload, struct wormhole_message_namespace_response *msg,
+		unsigned long payload_end, struct wormhole_message_arena *arena)
 {
 	if (!wormhole_message_get_int32(payload, &msg->status))
 		return false;
 
 	if (msg->status == WORMHOLE_STATUS_OK) {
-		msg->command = wormhole_message_get_string(payload);
+		msg->command = wormhole_message_get_string(payload, arena);
 		if (msg->command == NULL)
 			return false;
 
-		msg->server_socket = wormhole_message_get_string(payload);
+		msg->server_socket = wormhole_message_get_string(payload, arena);
 		if (msg->server_socket == NULL)
 			return false;
 
-		msg->environment_vars = wormhole_message_get_string_array(payload);
+		msg->environment_vars = wormhole_message_get_string_array(payload, arena);
 		if (msg->environment_vars == NULL)
 			return false;
+
+		/* Servers speaking protocol 1.0 do not send a root directory */
+		if (buf_chain_available(payload) > payload_end) {
+			msg->root_directory = wormhole_message_get_string(payload, arena);
+			if (msg->root_directory == NULL)
+				return false;
+
+			if (msg->root_directory[0] == '\0')
+				msg->root_directory = NULL;
+		}
 	}
 
 	return true;
 }
 
-static void
-wormhole_message_destroy_namespace_response(struct wormhole_message_namespace_response *msg)
+struct buf *
+wormhole_message_build_stats_request(void)
+{
+	return wormhole_message_build(WORMHOLE_OPCODE_STATS_REQUEST, wormhole_message_payload_alloc());
+}
+
+struct buf *
+wormhole_message_build_stats_response(unsigned int status, const struct wormhole_stat *stats, unsigned int count)
+{
+	struct buf *payload = wormhole_message_payload_alloc();
+	unsigned int i;
+
+	if (!wormhole_message_put_int32(payload, status))
+		goto failed;
+
+	if (status == WORMHOLE_STATUS_OK) {
+		if (!wormhole_message_put_int32(payload, count))
+			goto failed;
+
+		for (i = 0; i < count; ++i) {
+			if (!wormhole_message_put_string(payload, stats[i].name)
+			 || !wormhole_message_put_int32(payload, stats[i].value))
+				goto failed;
+		}
+	}
+
+	return wormhole_message_build(WORMHOLE_OPCODE_STATS_RESPONSE, payload);
+
+failed:
+	buf_chain_free(payload);
+	return NULL;
+}
+
+static bool
+wormhole_message_parse_stats_response(struct buf *payload, struct wormhole_message_stats_response *msg,
+		struct wormhole_message_arena *arena)
 {
-	if (msg->command != NULL)
-		free(msg->command);
-	if (msg->server_socket != NULL)
-		free(msg->server_socket);
+	uint32_t count;
+	unsigned int i;
+
+	if (!wormhole_message_get_int32(payload, &msg->status))
+		return false;
+
+	if (msg->status != WORMHOLE_STATUS_OK)
+		return true;
 
-	if (msg->environment_vars != NULL)
-		wormhole_message_free_string_array(msg->environment_vars);
+	if (!wormhole_message_get_int32(payload, &count))
+		return false;
+
+	/* Each entry takes at least 11 bytes; don't let a bogus count
+	 * make us allocate lots of memory. */
+	if (count > buf_chain_available(payload) / 11)
+		return false;
+
+	msg->stats = wormhole_message_arena_alloc(arena, count * sizeof(msg->stats[0]), sizeof(void *));
+	if (msg->stats == NULL)
+		return false;
+
+	for (i = 0; i < count; ++i) {
+		struct wormhole_stat *st = &msg->stats[msg->count];
+
+		if (!(st->name = wormhole_message_get_string(payload, arena)))
+			return false;
+		msg->count++;
+
+		if (!wormhole_message_get_int32(payload, &st->value))
+			return false;
+	}
+
+	return true;
 }
 
 static inline bool
@@ -344,43 +466,56 @@ __wormhole_message_dissect_header(struct buf *bp, struct wormhole_message *msg,
 		return false;
 
 	msg->version = ntohs(msg->version);
+	msg->xid = ntohs(msg->xid);
 	msg->opcode = ntohs(msg->opcode);
 	msg->payload_len = ntohs(msg->payload_len);
 
-	if (buf_available(bp) < hdrlen + msg->payload_len)
+	if (buf_chain_available(bp) < hdrlen + msg->payload_len)
 		return false;
 
 	if (consume)
-		__buf_advance_head(bp, hdrlen);
+		buf_chain_advance(bp, hdrlen);
 
 	return true;
 }
 
-static struct buf *
-wormhole_message_get_payload(struct buf *bp, struct wormhole_message_parsed *pmsg)
+#ifdef PROTOCOL_TRACING
+static void
+wormhole_message_dump_payload(struct buf *bp, unsigned int count)
 {
-	unsigned int payload_len = pmsg->hdr.payload_len;
-	struct buf *payload;
+	unsigned char *data;
+	unsigned int i, base;
 
-	if (buf_available(bp) < payload_len) {
-		trace("%s: hdr.payload_len = %u exceeds available data from buffer (%u bytes)",
-				payload_len, buf_available(bp));
-		return NULL;
+	data = malloc(count);
+	if (data == NULL || buf_get(bp, data, count) < count) {
+		free(data);
+		return;
 	}
 
-	/* Copy the message payload to a separate buffer. */
-	payload = buf_alloc();
-	if (!buf_put(payload, buf_head(bp), payload_len)) {
-		buf_free(payload);
-		return NULL;
-	}
+	printf("Dump of message payload (%u bytes)\n", count);
+	for (base = 0; base < count; base += 16) {
+		printf("%04x:", base);
+		for (i = 0; base + i < count && i < 16; ++i) {
+			printf(" %02x", data[base + i]);
+		}
+		while (i++ < 16)
+			printf("   ");
 
-	/* Consume the message payload */
-	__buf_advance_head(bp, payload_len);
+		printf("     ");
+		for (i = 0; base + i < count && i < 16; ++i) {
+			char cc = data[base + i];
 
-	return payload;
-}
+			if (isprint(cc))
+				printf("%c", cc);
+			else
+				printf(".");
+		}
+		printf("\n");
+	}
 
+	free(data);
+}
+#endif
 
 bool
 wormhole_message_complete(struct buf *bp)
@@ -394,18 +529,33 @@ struct wormhole_message_parsed *
 wormhole_message_parse(struct buf *bp, uid_t sender_uid)
 {
 	struct wormhole_message_parsed *pmsg;
-	struct buf *payload = NULL;
+	struct wormhole_message_arena arena;
+	struct wormhole_message hdr;
+	unsigned long avail, consumed;
 
-	pmsg = calloc(1, sizeof(*pmsg));
-
-	if (!__wormhole_message_dissect_header(bp, &pmsg->hdr, true)) {
+	if (!__wormhole_message_dissect_header(bp, &hdr, true)) {
 		/* should not happen. */
 		log_fatal("%s: unable to parse message header", __func__);
 	}
 
+	arena.size = WORMHOLE_MESSAGE_ARENA_SIZE(hdr.payload_len);
+	arena.used = 0;
+
+	pmsg = malloc(sizeof(*pmsg) + arena.size);
+	if (pmsg == NULL) {
+		log_error("%s: out of memory", __func__);
+		buf_chain_advance(bp, hdr.payload_len);
+		return NULL;
+	}
+
+	memset(pmsg, 0, sizeof(*pmsg));
+	pmsg->hdr = hdr;
+	arena.data = (char *) (pmsg + 1);
+
 #ifdef PROTOCOL_TRACING
-	trace("Received message header: protocol version %u opcode %u payload_len %u",
+	trace("Received message header: protocol version %u xid %u opcode %u payload_len %u",
 			pmsg->hdr.version,
+			pmsg->hdr.xid,
 			pmsg->hdr.opcode,
 			pmsg->hdr.payload_len);
 #endif
@@ -416,56 +566,39 @@ wormhole_message_parse(struct buf *bp, uid_t sender_uid)
                 goto failed;
         }
 
-	if (pmsg->hdr.payload_len > BUF_SZ) {
-		log_error("message from uid %d: payload of %u bytes too big",
-				sender_uid, pmsg->hdr.payload_len);
-		goto failed;
-	}
-
-	if (!(payload = wormhole_message_get_payload(bp, pmsg)))
-		goto failed;
+	/* We parse the payload straight from the buffer chain. Remember how
+	 * much data there is, so that we can check afterwards that
+	 * the payload was consumed exactly. */
+	avail = buf_chain_available(bp);
 
 #ifdef PROTOCOL_TRACING
-	if (tracing_level >= 2) {
-		unsigned int i, base, count = buf_available(payload);
-		const unsigned char *data = buf_head(payload);
-
-		printf("Dump of message payload (%u bytes)\n", count);
-		for (base = 0; base < count; base += 16) {
-			printf("%04x:", base);
-			for (i = 0; base + i < count && i < 16; ++i) {
-				printf(" %02x", data[base + i]);
-			}
-			while (i++ < 16)
-				printf("   ");
-
-			printf("     ");
-			for (i = 0; base + i < count && i < 16; ++i) {
-				char cc = data[base + i];
-
-				if (isprint(cc))
-					printf("%c", cc);
-				else
-					printf(".");
-			}
-			printf("\n");
-		}
-	}
+	if (tracing_level >= 2)
+		wormhole_message_dump_payload(bp, pmsg->hdr.payload_len);
 #endif
 
 	switch (pmsg->hdr.opcode) {
 	case WORMHOLE_OPCODE_STATUS:
-		if (!wormhole_message_parse_status(payload, pmsg))
+		if (!wormhole_message_parse_status(bp, pmsg))
 			goto failed;
 		break;
 
 	case WORMHOLE_OPCODE_NAMESPACE_REQUEST:
-		if (!wormhole_message_parse_namespace_request(payload, &pmsg->payload.namespace_request))
+		if (!wormhole_message_parse_namespace_request(bp, &pmsg->payload.namespace_request, &arena))
 			goto failed;
 		break;
 
 	case WORMHOLE_OPCODE_NAMESPACE_RESPONSE:
-		if (!wormhole_message_parse_namespace_response(payload, &pmsg->payload.namespace_response))
+		if (!wormhole_message_parse_namespace_response(bp, &pmsg->payload.namespace_response,
+						avail - pmsg->hdr.payload_len, &arena))
+			goto failed;
+		break;
+
+	case WORMHOLE_OPCODE_STATS_REQUEST:
+		/* No payload */
+		break;
+
+	case WORMHOLE_OPCODE_STATS_RESPONSE:
+		if (!wormhole_message_parse_stats_response(bp, &pmsg->payload.stats_response, &arena))
 			goto failed;
 		break;
 
@@ -474,30 +607,28 @@ wormhole_message_parse(struct buf *bp, uid_t sender_uid)
 		goto failed;
 	}
 
-	if (payload)
-		buf_free(payload);
+	consumed = avail - buf_chain_available(bp);
+	if (consumed > pmsg->hdr.payload_len) {
+		log_error("message from uid %d: payload overrun (%lu bytes, payload_len %u)",
+				sender_uid, consumed, pmsg->hdr.payload_len);
+		goto failed;
+	}
+
+	/* Skip any trailing data we do not understand */
+	buf_chain_advance(bp, pmsg->hdr.payload_len - consumed);
 
 	return pmsg;
 
 failed:
 	wormhole_message_free_parsed(pmsg);
-	if (payload)
-		buf_free(payload);
 	return NULL;
 }
 
+/*
+ * All strings and arrays of the message live in the same allocation.
+ */
 void
 wormhole_message_free_parsed(struct wormhole_message_parsed *pmsg)
 {
-	switch (pmsg->hdr.opcode) {
-	case WORMHOLE_OPCODE_NAMESPACE_REQUEST:
-		wormhole_message_destroy_namespace_request(&pmsg->payload.namespace_request);
-		break;
-
-	case WORMHOLE_OPCODE_NAMESPACE_RESPONSE:
-		wormhole_message_destroy_namespace_response(&pmsg->payload.namespace_response);
-		break;
-	}
-
 	free(pmsg);
 }
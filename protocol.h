@@ -26,15 +26,17 @@
 
 struct wormhole_message {
 	uint16_t	version;
-	uint16_t	reserved;
+	uint16_t	xid;		/* transaction ID, echoed in the reply */
 	uint16_t	opcode;
 	uint16_t	payload_len;
 };
 
-#define WORMHOLE_PROTOCOL_VERSION_MAJOR	0
-#define WORMHOLE_PROTOCOL_VERSION_MINOR	1
+#define WORMHOLE_PROTOCOL_VERSION_MAJOR	1
+#define WORMHOLE_PROTOCOL_VERSION_MINOR	2
 #define WORMHOLE_PROTOCOL_VERSION	((WORMHOLE_PROTOCOL_VERSION_MAJOR << 8) | WORMHOLE_PROTOCOL_VERSION_MINOR)
 #define WORMHOLE_PROTOCOL_STRING_MAX	128
+#define WORMHOLE_PROTOCOL_ELEMENT_MAX	0xFFFF
+#define WORMHOLE_PROTOCOL_PAYLOAD_MAX	0xFFFF
 
 #define WORMHOLE_PROTOCOL_MAJOR(v)	((v) >> 8)
 #define WORMHOLE_PROTOCOL_MINOR(v)	((v) & 0xFF)
@@ -44,11 +46,18 @@ enum {
 
 	WORMHOLE_OPCODE_NAMESPACE_REQUEST = 1,
 	WORMHOLE_OPCODE_NAMESPACE_RESPONSE = 2,
+
+	/* Since protocol 1.2 */
+	WORMHOLE_OPCODE_STATS_REQUEST = 3,
+	WORMHOLE_OPCODE_STATS_RESPONSE = 4,
 };
 
 enum {
 	WORMHOLE_STATUS_OK = 0,
 	WORMHOLE_STATUS_ERROR = 1,
+
+	/* Since protocol 1.2 */
+	WORMHOLE_STATUS_NO_PROFILE = 2,
 };
 
 struct wormhole_message_status {
@@ -65,6 +74,26 @@ struct wormhole_message_namespace_response {
 	char *			command;
 	char *			server_socket;
 	char **			environment_vars;
+
+	/* Since protocol 1.1; NULL if the command should run
+	 * relative to the namespace root. */
+	char *			root_directory;
+};
+
+/*
+ * The stats response is a list of named counters. This keeps the
+ * protocol stable while we add (or remove) statistics on the server side.
+ */
+struct wormhole_stat {
+	char *			name;
+	uint32_t		value;
+};
+
+struct wormhole_message_stats_response {
+	uint32_t		status;
+
+	unsigned int		count;
+	struct wormhole_stat *	stats;
 };
 
 struct wormhole_message_parsed {
@@ -73,6 +102,7 @@ struct wormhole_message_parsed {
 		struct wormhole_message_status status;
 		struct wormhole_message_namespace_request namespace_request;
 		struct wormhole_message_namespace_response namespace_response;
+		struct wormhole_message_stats_response stats_response;
 	} payload;
 };
 
@@ -80,7 +110,13 @@ extern struct buf *	wormhole_message_build_status(unsigned int status);
 extern struct buf *	wormhole_message_build_namespace_request(const char *name);
 extern struct buf *	wormhole_message_build_namespace_response(unsigned int status,
 					const char *cmd, const char **env,
-					const char *socket_name);
+					const char *socket_name, const char *root_dir);
+
+extern struct buf *	wormhole_message_build_stats_request(void);
+extern struct buf *	wormhole_message_build_stats_response(unsigned int status,
+					const struct wormhole_stat *stats, unsigned int count);
+
+extern void		wormhole_message_set_xid(struct buf *bp, unsigned int xid);
 
 extern bool		wormhole_message_complete(struct buf *bp);
 extern struct wormhole_message_parsed *wormhole_message_parse(struct buf *bp, uid_t sender_uid);
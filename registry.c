@@ -33,6 +33,7 @@
 #include "profiles.h"
 #include "config.h"
 #include "util.h"
+#include "watch.h"
 #include "tracing.h"
 
 
@@ -63,6 +64,42 @@
  * wormhole config files in the same way.
  */
 
+/*
+ * Scanning these directories (and parsing every name we find) gets slow
+ * with a few thousand capabilities. So whenever we modify a directory,
+ * we also write an index file next to it (eg /var/lib/wormhole/capability.index).
+ * This holds all entries sorted by name and version, plus the resolved
+ * path of each link, so that lookups can use a binary search.
+ *
+ * The index records the mtime of the directory. If someone modified the
+ * directory behind our back, we ignore the index and scan the directory.
+ */
+#define WORMHOLE_REGISTRY_INDEX_SUFFIX	".index"
+#define WORMHOLE_REGISTRY_INDEX_MAGIC	"wormhole-index-1"
+
+struct wormhole_registry_entry {
+	const char *		name;
+	const char *		id;
+	const char *		path;
+};
+
+struct wormhole_registry_index {
+	struct wormhole_registry_index *next;
+
+	char *			dir_path;
+	struct timespec		dir_mtime;
+
+	unsigned int		count;
+	struct wormhole_registry_entry *entries;
+
+	/* Contents of the index file; the entries point into this */
+	char *			data;
+};
+
+static struct wormhole_registry_index *wormhole_registry_indices;
+
+static bool		__wormhole_registry_index_rebuild(const char *dir_path);
+
 #define WORMHOLE_CAPABILITY_VERSION_MAX		16
 
 typedef struct wormhole_capability {
@@ -246,16 +283,55 @@ wormhole_capability_parse(const char *id)
 	return cap;
 }
 
+/*
+ * Resolving requirements means parsing the same capability strings over
+ * and over again. Keep the parsed versions around for the lifetime of the
+ * process. We also remember strings that failed to parse.
+ */
+#define WORMHOLE_CAPABILITY_CACHE_SIZE	256
+
+struct wormhole_capability_cache_entry {
+	struct wormhole_capability_cache_entry *next;
+	char *			id;
+	wormhole_capability_t *	cap;
+};
+
+static struct wormhole_capability_cache_entry *wormhole_capability_cache[WORMHOLE_CAPABILITY_CACHE_SIZE];
+
+static const wormhole_capability_t *
+wormhole_capability_parse_cached(const char *id)
+{
+	struct wormhole_capability_cache_entry **pos, *entry;
+	unsigned int hash = 5381;
+	const char *s;
+
+	/* djb2 */
+	for (s = id; *s; ++s)
+		hash = hash * 33 + (unsigned char) *s;
+
+	for (pos = &wormhole_capability_cache[hash % WORMHOLE_CAPABILITY_CACHE_SIZE]; (entry = *pos) != NULL; pos = &entry->next) {
+		if (!strcmp(entry->id, id))
+			return entry->cap;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	entry->id = strdup(id);
+	entry->cap = wormhole_capability_parse(id);
+	*pos = entry;
+
+	return entry->cap;
+}
+
 /*
  * Install capability
  */
-static bool
+bool
 __wormhole_capability_register(const char *capability_dir_path, const struct strutil_array *provides, const char *path)
 {
 	struct strutil_array install;
 	unsigned int i;
 	DIR *dir;
-	bool ok;
+	bool ok = false;
 
 	if (!(dir = opendir(capability_dir_path))) {
 		log_error("Unable to open %s: %m", capability_dir_path);
@@ -267,8 +343,10 @@ __wormhole_capability_register(const char *capability_dir_path, const struct str
 	for (i = 0; i < provides->count; ++i) {
 		const char *id = provides->data[i];
 		char target[PATH_MAX];
+		ssize_t len;
 
-		if (readlinkat(dirfd(dir), id, target, sizeof(target)) >= 0) {
+		if ((len = readlinkat(dirfd(dir), id, target, sizeof(target) - 1)) >= 0) {
+			target[len] = '\0';
 			if (strutil_equal(path, target)) {
 				trace("Capability %s already installed, nothing to activate", id);
 				continue;
@@ -301,6 +379,9 @@ __wormhole_capability_register(const char *capability_dir_path, const struct str
 
 failed:
 	closedir(dir);
+
+	if (install.count)
+		__wormhole_registry_index_rebuild(capability_dir_path);
 	strutil_array_destroy(&install);
 
 	return ok;
@@ -353,7 +434,7 @@ __wormhole_capability_unregister(const char *capability_dir_path, const struct s
 	struct strutil_array remove;
 	unsigned int i;
 	DIR *dir;
-	bool ok;
+	bool ok = false;
 
 	if (!(dir = opendir(capability_dir_path))) {
 		log_error("Unable to open %s: %m", capability_dir_path);
@@ -365,11 +446,13 @@ __wormhole_capability_unregister(const char *capability_dir_path, const struct s
 	for (i = 0; i < provides->count; ++i) {
 		const char *id = provides->data[i];
 		char target[PATH_MAX];
+		ssize_t len;
 
-		if (readlinkat(dirfd(dir), id, target, sizeof(target)) < 0) {
+		if ((len = readlinkat(dirfd(dir), id, target, sizeof(target) - 1)) < 0) {
 			trace("symlink for %s does not exist, nothing to deactivate", id);
 			continue;
 		}
+		target[len] = '\0';
 
 		if (!strutil_equal(path, target)) {
 			trace("Capability %s refers to a different config file", id);
@@ -394,6 +477,9 @@ __wormhole_capability_unregister(const char *capability_dir_path, const struct s
 
 failed:
 	closedir(dir);
+
+	if (remove.count)
+		__wormhole_registry_index_rebuild(capability_dir_path);
 	strutil_array_destroy(&remove);
 
 	return ok;
@@ -481,6 +567,10 @@ __wormhole_capabilities_gc(const char *capability_dir_path)
 
 	closedir(dir);
 
+	/* Rebuild the index even if there is nothing to remove; this
+	 * gives the admin a way to recreate it. */
+	__wormhole_registry_index_rebuild(capability_dir_path);
+
 	strutil_array_destroy(&stale);
 	return ok;
 }
@@ -492,6 +582,398 @@ wormhole_capabilities_gc(void)
 	return __wormhole_capabilities_gc(WORMHOLE_CAPABILITY_PATH);
 }
 
+/*
+ * Registry index handling
+ */
+struct wormhole_registry_build_entry {
+	const wormhole_capability_t *cap;
+	const char *		name;
+	char *			id;
+	char *			path;
+};
+
+static int
+__wormhole_registry_entry_compare(const void *pa, const void *pb)
+{
+	const struct wormhole_registry_build_entry *a = pa, *b = pb;
+	int r;
+
+	if ((r = strcmp(a->name, b->name)) != 0)
+		return r;
+
+	/* Names without a version sort first */
+	if (a->cap == NULL || b->cap == NULL)
+		return (a->cap != NULL) - (b->cap != NULL);
+
+	switch (wormhole_capability_compare(a->cap, b->cap)) {
+	case WORMHOLE_VERSION_LESS_THAN:
+		return -1;
+	case WORMHOLE_VERSION_GREATER_THAN:
+		return 1;
+	}
+
+	return strcmp(a->id, b->id);
+}
+
+static void
+__wormhole_registry_index_forget(const char *dir_path)
+{
+	struct wormhole_registry_index **pos, *idx;
+
+	for (pos = &wormhole_registry_indices; (idx = *pos) != NULL; pos = &idx->next) {
+		if (strutil_equal(idx->dir_path, dir_path)) {
+			*pos = idx->next;
+			free(idx->dir_path);
+			free(idx->entries);
+			free(idx->data);
+			free(idx);
+			return;
+		}
+	}
+}
+
+static bool
+__wormhole_registry_index_rebuild(const char *dir_path)
+{
+	struct wormhole_registry_build_entry *entries = NULL;
+	unsigned int i, count = 0;
+	char index_path[PATH_MAX], temp_path[PATH_MAX + 8];
+	struct stat stb;
+	struct dirent *d;
+	DIR *dir = NULL;
+	FILE *fp = NULL;
+	bool ok = false;
+	int fd;
+
+	__wormhole_registry_index_forget(dir_path);
+
+	snprintf(index_path, sizeof(index_path), "%s%s", dir_path, WORMHOLE_REGISTRY_INDEX_SUFFIX);
+	snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", index_path);
+
+	/* Get the mtime before reading the directory. If someone changes the
+	 * directory while we're scanning it, the index will be out of date
+	 * right away, which is what we want. */
+	if (stat(dir_path, &stb) < 0 || !(dir = opendir(dir_path))) {
+		log_error("Unable to open %s: %m", dir_path);
+		return false;
+	}
+
+	while ((d = readdir(dir)) != NULL) {
+		struct wormhole_registry_build_entry *e;
+		char pathbuf[PATH_MAX], resolved_path[PATH_MAX];
+
+		if (d->d_name[0] == '.' || strpbrk(d->d_name, "\t\n"))
+			continue;
+
+		snprintf(pathbuf, sizeof(pathbuf), "%s/%s", dir_path, d->d_name);
+		if (!realpath(pathbuf, resolved_path) || strpbrk(resolved_path, "\t\n"))
+			continue; /* dangling; gc will take care of it */
+
+		if ((count % 64) == 0)
+			entries = realloc(entries, (count + 64) * sizeof(entries[0]));
+
+		e = &entries[count++];
+		e->id = strdup(d->d_name);
+		e->path = strdup(resolved_path);
+		e->cap = wormhole_capability_parse_cached(d->d_name);
+		e->name = e->cap? e->cap->name : e->id;
+	}
+
+	qsort(entries, count, sizeof(entries[0]), __wormhole_registry_entry_compare);
+
+	if ((fd = mkstemp(temp_path)) < 0 || !(fp = fdopen(fd, "w"))) {
+		log_error("Unable to create %s: %m", temp_path);
+		goto out;
+	}
+
+	fprintf(fp, "%s %ld %ld\n", WORMHOLE_REGISTRY_INDEX_MAGIC,
+			(long) stb.st_mtim.tv_sec, (long) stb.st_mtim.tv_nsec);
+	for (i = 0; i < count; ++i)
+		fprintf(fp, "%s\t%s\t%s\n", entries[i].name, entries[i].id, entries[i].path);
+
+	fchmod(fd, 0644);
+	if (fclose(fp) != 0) {
+		fp = NULL;
+		log_error("Unable to write %s: %m", temp_path);
+		unlink(temp_path);
+		goto out;
+	}
+	fp = NULL;
+
+	if (rename(temp_path, index_path) < 0) {
+		log_error("Unable to rename %s to %s: %m", temp_path, index_path);
+		unlink(temp_path);
+		goto out;
+	}
+
+	trace("Rebuilt %s (%u entries)", index_path, count);
+	ok = true;
+
+out:
+	if (fp)
+		fclose(fp);
+	closedir(dir);
+
+	for (i = 0; i < count; ++i) {
+		free(entries[i].id);
+		free(entries[i].path);
+	}
+	free(entries);
+	return ok;
+}
+
+static struct wormhole_registry_index *
+__wormhole_registry_index_load(const char *dir_path, const struct timespec *dir_mtime)
+{
+	struct wormhole_registry_index *idx;
+	char index_path[PATH_MAX];
+	long mtime_sec, mtime_nsec;
+	char *line, *next;
+	struct stat stb;
+	FILE *fp;
+	int n = 0;
+
+	snprintf(index_path, sizeof(index_path), "%s%s", dir_path, WORMHOLE_REGISTRY_INDEX_SUFFIX);
+	if (!(fp = fopen(index_path, "r")))
+		return NULL;
+
+	idx = calloc(1, sizeof(*idx));
+	if (fstat(fileno(fp), &stb) < 0 || !(idx->data = malloc(stb.st_size + 1)))
+		goto failed;
+
+	if (fread(idx->data, 1, stb.st_size, fp) != (size_t) stb.st_size)
+		goto failed;
+	idx->data[stb.st_size] = '\0';
+
+	if (sscanf(idx->data, WORMHOLE_REGISTRY_INDEX_MAGIC " %ld %ld%n", &mtime_sec, &mtime_nsec, &n) != 2 || n == 0)
+		goto failed;
+
+	if (mtime_sec != dir_mtime->tv_sec || mtime_nsec != dir_mtime->tv_nsec) {
+		trace("%s is out of date", index_path);
+		goto failed;
+	}
+
+	for (line = strchr(idx->data, '\n'); line && *++line; line = next) {
+		struct wormhole_registry_entry *e;
+		char *id, *path;
+
+		if ((next = strchr(line, '\n')) == NULL)
+			goto failed;
+		*next = '\0';
+
+		if (!(id = strchr(line, '\t')) || !(path = strchr(id + 1, '\t')))
+			goto failed;
+		*id++ = '\0';
+		*path++ = '\0';
+
+		if ((idx->count % 64) == 0)
+			idx->entries = realloc(idx->entries, (idx->count + 64) * sizeof(idx->entries[0]));
+
+		e = &idx->entries[idx->count++];
+		e->name = line;
+		e->id = id;
+		e->path = path;
+	}
+
+	fclose(fp);
+
+	idx->dir_path = strdup(dir_path);
+	idx->dir_mtime = *dir_mtime;
+	return idx;
+
+failed:
+	fclose(fp);
+	free(idx->entries);
+	free(idx->data);
+	free(idx);
+	return NULL;
+}
+
+/*
+ * When watching for changes, the watcher tells us when the directory
+ * or its index changed, and we drop the index we have in memory.
+ *
+ * We also stop watching. The kernel may have dropped the watch already
+ * (eg because the directory was removed and created again), in which case
+ * we would never hear from it again. wormhole_registry_index_get() will
+ * watch the directory again before it next looks at it.
+ */
+struct wormhole_registry_watch {
+	struct wormhole_registry_watch *next;
+	char *			dir_path;
+};
+
+static struct wormhole_registry_watch *wormhole_registry_watches;
+
+static void
+__wormhole_registry_watch_event(const char *path, void *closure)
+{
+	struct wormhole_registry_watch **pos, *rw;
+
+	for (pos = &wormhole_registry_watches; (rw = *pos) != NULL; pos = &rw->next) {
+		if (rw == closure) {
+			*pos = rw->next;
+			break;
+		}
+	}
+
+	if (rw == NULL)
+		return;
+
+	__wormhole_registry_index_forget(rw->dir_path);
+	wormhole_watch_cancel(__wormhole_registry_watch_event, rw);
+	free(rw->dir_path);
+	free(rw);
+}
+
+static void
+__wormhole_registry_watch(const char *dir_path)
+{
+	struct wormhole_registry_watch *rw;
+	char index_path[PATH_MAX];
+
+	for (rw = wormhole_registry_watches; rw; rw = rw->next) {
+		if (strutil_equal(rw->dir_path, dir_path))
+			return;
+	}
+
+	rw = calloc(1, sizeof(*rw));
+	rw->dir_path = strdup(dir_path);
+	rw->next = wormhole_registry_watches;
+	wormhole_registry_watches = rw;
+
+	snprintf(index_path, sizeof(index_path), "%s%s", dir_path, WORMHOLE_REGISTRY_INDEX_SUFFIX);
+	if (!wormhole_watch_path(dir_path, __wormhole_registry_watch_event, rw)
+	 || !wormhole_watch_path(index_path, __wormhole_registry_watch_event, rw))
+		log_warning("Unable to watch %s for changes", dir_path);
+}
+
+/*
+ * Get the index for this directory, if there is a valid one.
+ * We hang on to it for the lifetime of the process, and check the
+ * mtime of the directory each time - unless someone will tell us
+ * when it changes.
+ */
+static struct wormhole_registry_index *
+wormhole_registry_index_get(const char *dir_path)
+{
+	struct wormhole_registry_index *idx;
+	bool watching = wormhole_watch_enabled();
+	struct stat stb;
+
+	for (idx = wormhole_registry_indices; idx; idx = idx->next) {
+		if (strutil_equal(idx->dir_path, dir_path))
+			break;
+	}
+
+	if (idx != NULL && watching)
+		return idx;
+
+	/* Start watching before we look at the directory; otherwise, we
+	 * would miss changes made while we're loading the index. */
+	if (watching)
+		__wormhole_registry_watch(dir_path);
+
+	if (stat(dir_path, &stb) < 0)
+		return NULL;
+
+	if (idx != NULL) {
+		if (idx->dir_mtime.tv_sec == stb.st_mtim.tv_sec
+		 && idx->dir_mtime.tv_nsec == stb.st_mtim.tv_nsec)
+			return idx;
+
+		__wormhole_registry_index_forget(dir_path);
+	}
+
+	if ((idx = __wormhole_registry_index_load(dir_path, &stb.st_mtim)) != NULL) {
+		idx->next = wormhole_registry_indices;
+		wormhole_registry_indices = idx;
+	}
+
+	return idx;
+}
+
+/*
+ * Returns the index of the first entry whose name is not less than (or,
+ * if upper is set, greater than) the given name.
+ */
+static unsigned int
+wormhole_registry_index_bound(const struct wormhole_registry_index *idx, const char *name, bool upper)
+{
+	unsigned int lo = 0, hi = idx->count;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		int r = strcmp(idx->entries[mid].name, name);
+
+		if (r < 0 || (upper && r == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static char *
+wormhole_registry_index_best_match(const struct wormhole_registry_index *idx, const wormhole_capability_t *search)
+{
+	unsigned int lo, hi;
+
+	lo = wormhole_registry_index_bound(idx, search->name, false);
+	hi = wormhole_registry_index_bound(idx, search->name, true);
+
+	/* Entries are sorted by version, so start with the highest one */
+	while (hi-- > lo) {
+		const struct wormhole_registry_entry *e = &idx->entries[hi];
+		const wormhole_capability_t *cap;
+
+		if (!(cap = wormhole_capability_parse_cached(e->id)))
+			break; /* no more versioned entries */
+
+		if (!wormhole_capability_is_greater_or_equal(cap, search))
+			break;
+
+		if (access(e->path, F_OK) == 0) {
+			trace2("Using %s to satisfy requirement %s", e->path, search->id);
+			return strdup(e->path);
+		}
+
+		log_warning("Dangling capability link %s/%s", idx->dir_path, e->id);
+	}
+
+	return NULL;
+}
+
+static char *
+wormhole_registry_index_lookup(const struct wormhole_registry_index *idx, const char *id)
+{
+	const wormhole_capability_t *cap;
+	const char *name = id;
+	unsigned int i;
+
+	/* Entries are sorted by name, so an id like gcc-11 is listed under gcc */
+	if ((cap = wormhole_capability_parse_cached(id)) != NULL)
+		name = cap->name;
+
+	for (i = wormhole_registry_index_bound(idx, name, false); i < idx->count; ++i) {
+		const struct wormhole_registry_entry *e = &idx->entries[i];
+
+		if (strcmp(e->name, name))
+			break;
+
+		if (strcmp(e->id, id))
+			continue;
+
+		if (access(e->path, F_OK) < 0)
+			return NULL;
+
+		return strdup(e->path);
+	}
+
+	return NULL;
+}
+
 static bool
 wormhole_capability_get_path(const char *capability_dir_path, char **path_var, const char *name)
 {
@@ -508,18 +990,41 @@ wormhole_capability_get_path(const char *capability_dir_path, char **path_var, c
 	return true;
 }
 
-char *
-__wormhole_capability_get_best_match(const char *capability_dir_path, const char *id)
+/*
+ * Resolve a whole list of requirements in one go. This consults the index
+ * (or scans the directory) just once, rather than once per requirement.
+ * On return, paths[i] holds the best match for ids->data[i], or NULL if
+ * the requirement could not be satisfied.
+ *
+ * Returns the number of requirements that were resolved.
+ */
+unsigned int
+__wormhole_capability_get_best_matches(const char *capability_dir_path, const struct strutil_array *ids, char **paths)
 {
-	wormhole_capability_t *search;
-	wormhole_capability_t *best_version = NULL;
-	char *best_path = NULL;
+	const wormhole_capability_t **search, **best_version;
+	struct wormhole_registry_index *idx;
+	unsigned int i, found = 0;
 	DIR *dir;
 	struct dirent *d;
 
-	if (!(search = wormhole_capability_parse(id))) {
-		log_error("Unable to parse capability string \"%s\"", id);
-		return NULL;
+	if (ids->count == 0)
+		return 0;
+
+	search = calloc(ids->count, sizeof(search[0]));
+	best_version = calloc(ids->count, sizeof(best_version[0]));
+
+	for (i = 0; i < ids->count; ++i) {
+		paths[i] = NULL;
+		if (!(search[i] = wormhole_capability_parse_cached(ids->data[i])))
+			log_error("Unable to parse capability string \"%s\"", ids->data[i]);
+	}
+
+	if ((idx = wormhole_registry_index_get(capability_dir_path)) != NULL) {
+		for (i = 0; i < ids->count; ++i) {
+			if (search[i])
+				paths[i] = wormhole_registry_index_best_match(idx, search[i]);
+		}
+		goto done;
 	}
 
 	if (!(dir = opendir(capability_dir_path))) {
@@ -528,51 +1033,59 @@ __wormhole_capability_get_best_match(const char *capability_dir_path, const char
 	}
 
 	while ((d = readdir(dir)) != NULL) {
+		const wormhole_capability_t *cap;
+
 		if (d->d_name[0] == '.')
 			continue;
 
-		if (strncmp(d->d_name, search->name, search->name_len) == 0
-		 && d->d_name[search->name_len] == '-') {
-			wormhole_capability_t *cap;
+		/* trace("Looking at cap link %s", d->d_name); */
+		/* FIXME: do we need to strip ".conf" off the end? */
 
-			/* trace("Looking at cap link %s", d->d_name); */
-			/* FIXME: do we need to strip ".conf" off the end? */
+		if (!(cap = wormhole_capability_parse_cached(d->d_name)))
+			continue; /* silently skip unparseable capability names in the link farm */
 
-			if (!(cap = wormhole_capability_parse(d->d_name)))
-				continue; /* silently skip unparseable capability names in the link farm */
+		for (i = 0; i < ids->count; ++i) {
+			if (search[i] == NULL || strcmp(cap->name, search[i]->name))
+				continue;
 
-			if (wormhole_capability_is_greater_or_equal(cap, search)
-			 && (best_version == NULL || wormhole_capability_is_greater_or_equal(cap, best_version))
-			 && wormhole_capability_get_path(capability_dir_path, &best_path, d->d_name)) {
-				wormhole_capability_t *tmp;
+			/* If we found a better match than we had before, remember it. */
+			if (wormhole_capability_is_greater_or_equal(cap, search[i])
+			 && (best_version[i] == NULL || wormhole_capability_is_greater_or_equal(cap, best_version[i]))
+			 && wormhole_capability_get_path(capability_dir_path, &paths[i], d->d_name))
+				best_version[i] = cap;
+		}
+	}
 
-				/* We found a better match than we had before.
-				 * swap cap and best_version; free previous best_version.
-				 */
-				tmp = best_version;
-				best_version = cap;
-				cap = tmp;
-			}
+	closedir(dir);
 
-			if (cap)
-				wormhole_capability_free(cap);
+done:
+	for (i = 0; i < ids->count; ++i) {
+		if (paths[i]) {
+			trace2("Using %s to satisfy requirement %s", paths[i], ids->data[i]);
+			found++;
 		}
 	}
 
-done:
-	wormhole_capability_free(search);
-	if (best_version)
-		wormhole_capability_free(best_version);
-	if (best_path)
-		trace2("Using %s to satisfy requirement %s", best_path, id);
-	return best_path;
+	free(search);
+	free(best_version);
+	return found;
+}
+
+unsigned int
+wormhole_capability_get_best_matches(const struct strutil_array *ids, char **paths)
+{
+	/* FIXME: support per-user capability directory. */
+	return __wormhole_capability_get_best_matches(WORMHOLE_CAPABILITY_PATH, ids, paths);
 }
 
 char *
 wormhole_capability_get_best_match(const char *id)
 {
-	/* FIXME: support per-user capability directory. */
-	return __wormhole_capability_get_best_match(WORMHOLE_CAPABILITY_PATH, id);
+	struct strutil_array ids = { .count = 1, .data = (char **) &id };
+	char *path;
+
+	wormhole_capability_get_best_matches(&ids, &path);
+	return path;
 }
 
 /*
@@ -583,8 +1096,12 @@ wormhole_capability_get_best_match(const char *id)
 char *
 __wormhole_command_get_best_match(const char *capability_dir_path, const char *id)
 {
+	struct wormhole_registry_index *idx;
 	char *best_path = NULL;
 
+	if ((idx = wormhole_registry_index_get(capability_dir_path)) != NULL)
+		return wormhole_registry_index_lookup(idx, id);
+
 	if (!wormhole_capability_get_path(capability_dir_path, &best_path, id))
 		return NULL;
 
@@ -597,3 +1114,39 @@ wormhole_command_get_best_match(const char *id)
 	/* FIXME: support per-user capability directory. */
 	return __wormhole_command_get_best_match(WORMHOLE_COMMAND_REGISTRY_PATH, id);
 }
+
+/*
+ * List all commands in the registry
+ */
+bool
+__wormhole_command_registry_list(const char *capability_dir_path, struct strutil_array *names)
+{
+	struct dirent *d;
+	DIR *dir;
+
+	if (!(dir = opendir(capability_dir_path))) {
+		/* No commands installed */
+		if (errno == ENOENT)
+			return true;
+
+		log_error("Unable to open %s: %m", capability_dir_path);
+		return false;
+	}
+
+	while ((d = readdir(dir)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+
+		strutil_array_append(names, d->d_name);
+	}
+
+	closedir(dir);
+	return true;
+}
+
+bool
+wormhole_command_registry_list(struct strutil_array *names)
+{
+	/* FIXME: support per-user capability directory. */
+	return __wormhole_command_registry_list(WORMHOLE_COMMAND_REGISTRY_PATH, names);
+}
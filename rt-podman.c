@@ -19,11 +19,14 @@
  */
 
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "tracing.h"
 #include "runtime.h"
@@ -182,13 +185,17 @@ podman_run_and_capture(char *subcmd, ...)
 	if (argv == NULL)
 		return NULL;
 
+	trace_span_begin(TRACE_EV_PODMAN, 0, subcmd);
 	pid = podman_exec(argv, &fd);
-	if (pid < 0)
+	if (pid < 0) {
+		trace_span_end(TRACE_EV_PODMAN, 0, subcmd);
 		return NULL;
+	}
 
 	response = podman_read_response(fd);
 
 	exitcode = podman_wait(pid);
+	trace_span_end(TRACE_EV_PODMAN, 0, subcmd);
 
 	if (exitcode < 0)
 		return NULL;
@@ -216,37 +223,249 @@ podman_run(char *subcmd, ...)
 	if (argv == NULL)
 		return NULL;
 
+	trace_span_begin(TRACE_EV_PODMAN, 0, subcmd);
 	pid = podman_exec(argv, NULL);
-	if (pid < 0)
+	if (pid < 0) {
+		trace_span_end(TRACE_EV_PODMAN, 0, subcmd);
 		return NULL;
+	}
 
 	exitcode = podman_wait(pid);
+	trace_span_end(TRACE_EV_PODMAN, 0, subcmd);
 	if (exitcode < 0)
 		return NULL;
 
 	return exitcode == 0;
 }
 
+/*
+ * Talk to the podman service via its REST API, if it is running. This saves
+ * us the considerable startup cost of the podman command.
+ * Any transport level failure makes us fall back to running the command.
+ */
+#define PODMAN_API_PREFIX	"/v3.0.0/libpod"
+
+static int		podman_api_state = -1;	/* unknown */
+
+static const char *
+podman_api_socket_path(void)
+{
+	static char pathbuf[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+	const char *s;
+
+	if ((s = getenv("CONTAINER_HOST")) != NULL) {
+		if (strncmp(s, "unix://", 7))
+			return NULL;
+		snprintf(pathbuf, sizeof(pathbuf), "%s", s + 7);
+	} else
+	if (geteuid() == 0) {
+		snprintf(pathbuf, sizeof(pathbuf), "/run/podman/podman.sock");
+	} else
+	if ((s = getenv("XDG_RUNTIME_DIR")) != NULL) {
+		snprintf(pathbuf, sizeof(pathbuf), "%s/podman/podman.sock", s);
+	} else {
+		return NULL;
+	}
+
+	return pathbuf;
+}
+
+static int
+podman_api_connect(void)
+{
+	struct sockaddr_un sun;
+	const char *path;
+	int fd;
+
+	if (podman_api_state == 0)
+		return -1;
+
+	if (!(path = podman_api_socket_path()) || access(path, W_OK) < 0)
+		goto unavailable;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path))
+		goto unavailable;
+	strcpy(sun.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		goto unavailable;
+
+	if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+		trace("Cannot connect to podman service at %s: %m", path);
+		close(fd);
+		goto unavailable;
+	}
+
+	if (podman_api_state < 0)
+		trace("Using podman service at %s", path);
+	podman_api_state = 1;
+	return fd;
+
+unavailable:
+	podman_api_state = 0;
+	return -1;
+}
+
+/*
+ * Perform a single request, and return the HTTP status code (or -1 if
+ * we were unable to talk to the service).
+ * We speak HTTP/1.0 so that the response is never chunked, and the
+ * server closes the connection when done.
+ */
+static int
+podman_api_call(const char *method, const char *path, const char *body, char *resp, size_t resp_size)
+{
+	char request[1024], *s;
+	size_t len, total = 0;
+	ssize_t n;
+	int fd, status;
+
+	if (body == NULL)
+		body = "";
+
+	len = snprintf(request, sizeof(request),
+			"%s " PODMAN_API_PREFIX "%s HTTP/1.0\r\n"
+			"Host: d\r\n"
+			"Content-Type: application/json\r\n"
+			"Content-Length: %zu\r\n"
+			"\r\n"
+			"%s",
+			method, path, strlen(body), body);
+	if (len >= sizeof(request))
+		return -1;
+
+	if ((fd = podman_api_connect()) < 0)
+		return -1;
+
+	log_debug("podman API: %s %s", method, path);
+	trace_span_begin(TRACE_EV_PODMAN, 1, path);
+	if (write(fd, request, len) != len) {
+		log_error("podman API: unable to send request: %m");
+		trace_span_end(TRACE_EV_PODMAN, 1, path);
+		close(fd);
+		return -1;
+	}
+
+	while (total + 1 < resp_size && (n = read(fd, resp + total, resp_size - total - 1)) > 0)
+		total += n;
+	resp[total] = '\0';
+	close(fd);
+	trace_span_end(TRACE_EV_PODMAN, 1, path);
+
+	if (sscanf(resp, "HTTP/1.%*d %d", &status) != 1) {
+		log_error("podman API: bad response to %s %s", method, path);
+		return -1;
+	}
+
+	/* Strip the headers */
+	if ((s = strstr(resp, "\r\n\r\n")) == NULL)
+		return -1;
+	memmove(resp, s + 4, strlen(s + 4) + 1);
+
+	return status;
+}
+
+/*
+ * The strings we put into a JSON body or a URL are container and image
+ * names, which have a fairly restricted character set. Rather than
+ * escaping, just refuse anything odd, and let the podman command deal with it.
+ */
+static bool
+podman_api_name_ok(const char *name)
+{
+	for (; *name; ++name) {
+		if (*name <= ' ' || *name >= 0x7f || strchr("\"\\%?#&", *name))
+			return false;
+	}
+	return true;
+}
+
+static int
+podman_api_container_call(const char *method, const char *container_name, const char *action, char *resp, size_t resp_size)
+{
+	char path[512];
+
+	if (!podman_api_name_ok(container_name))
+		return -1;
+
+	if (snprintf(path, sizeof(path), "/containers/%s/%s", container_name, action) >= sizeof(path))
+		return -1;
+
+	return podman_api_call(method, path, NULL, resp, resp_size);
+}
+
 static bool
 podman_container_exists(const char *name)
 {
+	char resp[1024];
+
+	switch (podman_api_container_call("GET", name, "exists", resp, sizeof(resp))) {
+	case 204:
+		return true;
+	case 404:
+		return false;
+	}
+
 	return podman_run("container", "exists", name, NULL);
 }
 
 static bool
 podman_start(const char *image_spec, const char *container_name)
 {
+	char resp[4096], body[512];
+
+	if (podman_api_name_ok(image_spec) && podman_api_name_ok(container_name)
+	 && snprintf(body, sizeof(body), "{\"name\":\"%s\",\"image\":\"%s\"}", container_name, image_spec) < sizeof(body)) {
+		if (podman_api_call("POST", "/containers/create", body, resp, sizeof(resp)) == 201)
+			return true;
+
+		/* Most likely, the image has not been pulled yet. The command
+		 * will take care of that. */
+	}
+
 	return podman_run("create", "--name", container_name, image_spec, NULL);
 }
 
 static const char *
 podman_mount(const char *container_name)
 {
+	static char resp[4096];
+	char *s;
+
+	if (podman_api_container_call("POST", container_name, "mount", resp, sizeof(resp)) == 200) {
+		/* The response is a JSON string */
+		if ((s = strchr(resp, '"')) != NULL) {
+			char *path = ++s;
+
+			s[strcspn(s, "\"\\")] = '\0';
+			if (path[0] == '/')
+				return path;
+		}
+		log_error("podman API: unexpected response to mount request: %s", resp);
+	}
+
 	return podman_run_and_capture("mount", container_name, NULL);
 }
 
+static bool
+podman_unmount(const char *container_name)
+{
+	char resp[1024];
+
+	switch (podman_api_container_call("POST", container_name, "unmount", resp, sizeof(resp))) {
+	case 200:
+	case 204:
+		return true;
+	}
+
+	return podman_run("umount", container_name, NULL);
+}
+
 struct wormhole_container_runtime	wormhole_runtime_podman = {
 	.container_exists		= podman_container_exists,
 	.container_start		= podman_start,
 	.container_mount		= podman_mount,
+	.container_unmount		= podman_unmount,
 };
@@ -23,6 +23,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 #include "profiles.h"
 #include "runtime.h"
@@ -32,6 +33,74 @@
 extern struct wormhole_container_runtime	wormhole_runtime_podman;
 static struct wormhole_container_runtime *	wormhole_runtime;
 
+/*
+ * Talking to the container runtime is expensive, so we remember which
+ * containers exist and where they are mounted.
+ * Mounts are reference counted; we ask the runtime to unmount a container
+ * when the last user is done with it.
+ */
+struct wormhole_container_state {
+	struct wormhole_container_state *next;
+	char *			name;
+	bool			exists;
+
+	unsigned int		refcount;
+	char *			mount_point;
+	dev_t			mount_dev;
+	ino_t			mount_ino;
+};
+
+static struct wormhole_container_state *wormhole_containers;
+
+static struct wormhole_container_state *
+wormhole_container_state_get(const char *name, bool create)
+{
+	struct wormhole_container_state *state;
+
+	for (state = wormhole_containers; state; state = state->next) {
+		if (!strcmp(state->name, name))
+			return state;
+	}
+
+	if (!create)
+		return NULL;
+
+	state = calloc(1, sizeof(*state));
+	state->name = strdup(name);
+	state->next = wormhole_containers;
+	wormhole_containers = state;
+	return state;
+}
+
+static void
+wormhole_container_state_drop_mount(struct wormhole_container_state *state)
+{
+	strutil_set(&state->mount_point, NULL);
+	state->refcount = 0;
+}
+
+/*
+ * Check whether the cached mount point still refers to the file system
+ * we found there when mounting.
+ */
+static bool
+wormhole_container_state_mount_valid(struct wormhole_container_state *state)
+{
+	struct stat stb;
+
+	if (state->mount_point == NULL)
+		return false;
+
+	if (stat(state->mount_point, &stb) < 0
+	 || stb.st_dev != state->mount_dev || stb.st_ino != state->mount_ino) {
+		trace("Container %s: mount point %s changed, discarding", state->name, state->mount_point);
+		wormhole_container_state_drop_mount(state);
+		return false;
+	}
+
+	return true;
+}
+
 static struct wormhole_container_runtime *
 __wormhole_get_runtime(const char *name)
 {
@@ -63,17 +132,148 @@ wormhole_select_runtime(const char *name)
 bool
 wormhole_container_exists(const char *name)
 {
-	return wormhole_runtime->container_exists(name);
+	struct wormhole_container_state *state;
+
+	if ((state = wormhole_container_state_get(name, false)) != NULL && state->exists)
+		return true;
+
+	if (!wormhole_runtime->container_exists(name))
+		return false;
+
+	wormhole_container_state_get(name, true)->exists = true;
+	return true;
 }
 
 bool
 wormhole_container_start(const char *image_spec, const char *container_name)
 {
-	return wormhole_runtime->container_start(image_spec, container_name);
+	if (!wormhole_runtime->container_start(image_spec, container_name))
+		return false;
+
+	wormhole_container_state_get(container_name, true)->exists = true;
+	return true;
 }
 
 const char *
 wormhole_container_mount(const char *container_name)
 {
-	return wormhole_runtime->container_mount(container_name);
+	struct wormhole_container_state *state;
+	const char *mount_point;
+	struct stat stb;
+
+	state = wormhole_container_state_get(container_name, true);
+	if (wormhole_container_state_mount_valid(state)) {
+		state->refcount++;
+		return state->mount_point;
+	}
+
+	/* If the mount fails, the container may have been removed behind
+	 * our back; check again next time. */
+	if (!(mount_point = wormhole_runtime->container_mount(container_name))) {
+		state->exists = false;
+		return NULL;
+	}
+
+	if (stat(mount_point, &stb) < 0) {
+		log_error("Container %s: cannot access mount point %s: %m", container_name, mount_point);
+		wormhole_runtime->container_unmount(container_name);
+		state->exists = false;
+		return NULL;
+	}
+
+	strutil_set(&state->mount_point, mount_point);
+	state->mount_dev = stb.st_dev;
+	state->mount_ino = stb.st_ino;
+	state->exists = true;
+	state->refcount = 1;
+
+	return state->mount_point;
+}
+
+bool
+wormhole_container_unmount(const char *container_name)
+{
+	struct wormhole_container_state *state;
+
+	state = wormhole_container_state_get(container_name, false);
+	if (state == NULL || state->refcount == 0) {
+		log_error("Container %s: unbalanced unmount", container_name);
+		return false;
+	}
+
+	if (--(state->refcount))
+		return true;
+
+	wormhole_container_state_drop_mount(state);
+	return wormhole_runtime->container_unmount(container_name);
+}
+
+/*
+ * Return the mount point of a container we have mounted already, and
+ * take a reference to it. Unlike wormhole_container_mount(), this never
+ * talks to the runtime.
+ */
+const char *
+wormhole_container_mount_cached(const char *container_name)
+{
+	struct wormhole_container_state *state;
+
+	state = wormhole_container_state_get(container_name, false);
+	if (state == NULL || !wormhole_container_state_mount_valid(state))
+		return NULL;
+
+	state->refcount++;
+	return state->mount_point;
+}
+
+/*
+ * Record a container mount made by some other process.
+ *
+ * If transfer is set, that process mounted the container and hands its
+ * mount over to us; we will unmount it when the last reference is gone.
+ * Otherwise, the mount is merely lent to us. Its owner keeps a reference
+ * we never drop, so we will not unmount it.
+ */
+bool
+wormhole_container_adopt_mount(const char *container_name, const char *mount_point, bool transfer)
+{
+	struct wormhole_container_state *state;
+	struct stat stb;
+
+	state = wormhole_container_state_get(container_name, true);
+	if (wormhole_container_state_mount_valid(state)) {
+		/* The runtime now counts one more mount than we do */
+		if (transfer && !wormhole_runtime->container_unmount(container_name))
+			log_error("Container %s: unable to drop duplicate mount", container_name);
+		state->refcount++;
+		return true;
+	}
+
+	if (stat(mount_point, &stb) < 0) {
+		log_error("Container %s: cannot access mount point %s: %m", container_name, mount_point);
+		if (transfer)
+			wormhole_runtime->container_unmount(container_name);
+		return false;
+	}
+
+	strutil_set(&state->mount_point, mount_point);
+	state->mount_dev = stb.st_dev;
+	state->mount_ino = stb.st_ino;
+	state->exists = true;
+	state->refcount = 1;
+	return true;
+}
+
+/*
+ * Where is this container mounted? This does not take a reference.
+ */
+const char *
+wormhole_container_mount_point(const char *container_name)
+{
+	struct wormhole_container_state *state;
+
+	state = wormhole_container_state_get(container_name, false);
+	if (state == NULL || state->refcount == 0)
+		return NULL;
+	return state->mount_point;
 }
@@ -25,7 +25,7 @@ struct wormhole_container_runtime {
 	bool		(*container_exists)(const char *name);
 	bool		(*container_start)(const char *image_spec, const char *container_name);
 	const char *	(*container_mount)(const char *container_name);
-
+	bool		(*container_unmount)(const char *container_name);
 };
 
 extern bool		wormhole_select_runtime(const char *name);
@@ -33,7 +33,10 @@ extern bool		wormhole_select_runtime(const char *name);
 extern bool		wormhole_container_exists(const char *name);
 extern bool		wormhole_container_start(const char *image_spec, const char *container_name);
 extern const char *	wormhole_container_mount(const char *container_name);
-
+extern bool		wormhole_container_unmount(const char *container_name);
+extern const char *	wormhole_container_mount_cached(const char *container_name);
+extern const char *	wormhole_container_mount_point(const char *container_name);
+extern bool		wormhole_container_adopt_mount(const char *container_name, const char *mount_point, bool transfer);
 
 
 #endif // _WORMHOLE_RUNTIME_H
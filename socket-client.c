@@ -144,7 +144,7 @@ wormhole_client(int argc, char **argv)
 	if (opt_environment == NULL)
 		opt_environment = procutil_command_path(argv[0]);
 
-	if (!wormhole_client_namespace_request(opt_environment, wormhole_namespace_response_callback, &closure))
+	if (wormhole_client_namespace_request(opt_environment, wormhole_namespace_response_callback, &closure) != WORMHOLE_CLIENT_OK)
 		return 1;
 
 	return 12;
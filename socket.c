@@ -22,6 +22,8 @@
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
@@ -40,30 +42,120 @@
 #include "buffer.h"
 
 static wormhole_socket_t *	__wormhole_socket_accept(int fd, wormhole_socket_t *(*factory)(int, uid_t, gid_t));
+static void			wormhole_socket_trim_recvbuf(wormhole_socket_t *s);
 
 wormhole_socket_t * wormhole_sockets = NULL;
 unsigned int             wormhole_socket_count = 0;
 
+/*
+ * Event engine. Sockets are registered with epoll, and we only
+ * re-evaluate a socket's interest set (by calling its ->poll function)
+ * when something happened that may have changed it. These sockets
+ * sit on the "changed" list until the next call to wormhole_sockets_poll().
+ */
+#define WORMHOLE_EPOLL_BATCH	64
+
+static int			wormhole_epoll_fd = -1;
+static wormhole_socket_t *	wormhole_sockets_changed = NULL;
+
+static bool
+wormhole_epoll_init(void)
+{
+	if (wormhole_epoll_fd < 0) {
+		wormhole_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (wormhole_epoll_fd < 0) {
+			log_error("epoll_create: %m");
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool
+wormhole_epoll_update(wormhole_socket_t *s, unsigned int events)
+{
+	struct epoll_event ev;
+	int op;
+
+	if (s->poll_registered && s->poll_events == events)
+		return true;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u32 = s->id;
+
+	op = s->poll_registered? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(wormhole_epoll_fd, op, s->fd, &ev) < 0) {
+		log_error("epoll_ctl(sock_id=%d, fd=%d): %m", s->id, s->fd);
+		return false;
+	}
+
+	s->poll_registered = true;
+	s->poll_events = events;
+	return true;
+}
+
+static void
+wormhole_epoll_remove(wormhole_socket_t *s)
+{
+	if (s->poll_registered) {
+		if (epoll_ctl(wormhole_epoll_fd, EPOLL_CTL_DEL, s->fd, NULL) < 0)
+			log_error("epoll_ctl(sock_id=%d, DEL): %m", s->id);
+		s->poll_registered = false;
+		s->poll_events = 0;
+	}
+}
+
+/*
+ * Mark the socket as needing a call to ->poll before we wait for events again.
+ */
 void
-wormhole_install_socket(wormhole_socket_t *s)
+wormhole_socket_changed(wormhole_socket_t *s)
 {
-	wormhole_socket_t **pos;
+	if (s->prevp == NULL || s->changed_prevp != NULL)
+		return;
 
-	/* brutal for now */
-	assert(wormhole_socket_count < WORMHOLE_SOCKET_MAX);
+	s->changed_next = wormhole_sockets_changed;
+	if (wormhole_sockets_changed)
+		wormhole_sockets_changed->changed_prevp = &s->changed_next;
+	wormhole_sockets_changed = s;
+	s->changed_prevp = &wormhole_sockets_changed;
+}
+
+static void
+wormhole_socket_changed_unlink(wormhole_socket_t *s)
+{
+	if (s->changed_prevp == NULL)
+		return;
+
+	*(s->changed_prevp) = s->changed_next;
+	if (s->changed_next)
+		s->changed_next->changed_prevp = s->changed_prevp;
 
+	s->changed_prevp = NULL;
+	s->changed_next = NULL;
+}
+
+void
+wormhole_install_socket(wormhole_socket_t *s)
+{
 	if (s->prevp != NULL) {
 		log_error("%s: cannot install socket twice", __func__);
 		return;
 	}
 
-	for (pos = &wormhole_sockets; *pos; pos = &((*pos)->next))
-		;
+	if (!wormhole_epoll_init())
+		return;
 
-	*pos = s;
-	s->prevp = pos;
+	s->next = wormhole_sockets;
+	if (s->next)
+		s->next->prevp = &s->next;
+	wormhole_sockets = s;
+	s->prevp = &wormhole_sockets;
 
 	wormhole_socket_count++;
+
+	wormhole_socket_changed(s);
 }
 
 void
@@ -72,6 +164,9 @@ wormhole_uninstall_socket(wormhole_socket_t *s)
 	if (s->prevp == NULL)
 		return;
 
+	wormhole_socket_changed_unlink(s);
+	wormhole_epoll_remove(s);
+
 	*(s->prevp) = s->next;
 	if (s->next)
 		s->next->prevp = s->prevp;
@@ -82,26 +177,193 @@ wormhole_uninstall_socket(wormhole_socket_t *s)
 	wormhole_socket_count--;
 }
 
+/*
+ * Update the epoll interest set of all sockets that changed, then
+ * wait for events and process the sockets that are ready.
+ * Sockets whose ->poll or ->process function returns false are freed.
+ */
+void
+wormhole_sockets_poll(int timeout)
+{
+	struct epoll_event events[WORMHOLE_EPOLL_BATCH];
+	wormhole_socket_t *s;
+	int i, nev;
+
+	while ((s = wormhole_sockets_changed) != NULL) {
+		struct pollfd pfd;
+
+		wormhole_socket_changed_unlink(s);
+
+		memset(&pfd, 0, sizeof(pfd));
+		pfd.fd = s->fd;
+		if (!s->ops->poll(s, &pfd) || !wormhole_epoll_update(s, pfd.events)) {
+			/* remove socket from linked list and free it. */
+			wormhole_socket_free(s);
+		}
+	}
+
+	if (wormhole_sockets == NULL)
+		return;
+
+	nev = epoll_wait(wormhole_epoll_fd, events, WORMHOLE_EPOLL_BATCH, timeout);
+	if (nev < 0) {
+		if (errno != EINTR)
+			log_error("epoll_wait: %m");
+		return;
+	}
+
+	for (i = 0; i < nev; ++i) {
+		struct pollfd pfd;
+
+		/* The socket may have been freed while processing an earlier event */
+		s = wormhole_socket_find(events[i].data.u32);
+		if (s == NULL || s->prevp == NULL)
+			continue;
+
+		pfd.fd = s->fd;
+		pfd.events = s->poll_events;
+		pfd.revents = events[i].events;
+
+		if (!s->ops->process(s, &pfd)) {
+			wormhole_socket_free(s);
+			continue;
+		}
+
+		wormhole_socket_changed(s);
+	}
+}
+
+/*
+ * Socket table. A socket ID encodes the index of the table slot in its lower
+ * bits, and the slot's generation count in the upper bits. Whenever a slot is
+ * reused, its generation is bumped, so that the ID of a socket that has been
+ * freed in the meantime (eg because the client disconnected) will not
+ * accidentally match a new socket.
+ */
+#define WORMHOLE_SOCKET_SLOT_BITS	20
+#define WORMHOLE_SOCKET_SLOT_MASK	((1U << WORMHOLE_SOCKET_SLOT_BITS) - 1)
+#define WORMHOLE_SOCKET_GEN_MAX		((~0U) >> WORMHOLE_SOCKET_SLOT_BITS)
+
+struct wormhole_socket_slot {
+	unsigned int		generation;
+	wormhole_socket_t *	sock;
+	unsigned int		next_free;
+};
+
+static struct wormhole_socket_slot *wormhole_socket_table;
+static unsigned int		wormhole_socket_table_size;
+static unsigned int		wormhole_socket_table_free = ~0U;
+
+static bool
+wormhole_socket_table_alloc(wormhole_socket_t *s)
+{
+	struct wormhole_socket_slot *slot;
+	unsigned int index;
+
+	if (wormhole_socket_table_free == ~0U) {
+		unsigned int k, new_size;
+
+		new_size = wormhole_socket_table_size? 2 * wormhole_socket_table_size : 64;
+		if (new_size > WORMHOLE_SOCKET_SLOT_MASK + 1) {
+			log_error("Too many open sockets");
+			return false;
+		}
+
+		slot = realloc(wormhole_socket_table, new_size * sizeof(*slot));
+		if (slot == NULL) {
+			log_error("%s: out of memory", __func__);
+			return false;
+		}
+
+		/* Chain all new slots into the free list, lowest index first */
+		for (k = new_size; k-- > wormhole_socket_table_size; ) {
+			slot[k].generation = 0;
+			slot[k].sock = NULL;
+			slot[k].next_free = wormhole_socket_table_free;
+			wormhole_socket_table_free = k;
+		}
+
+		wormhole_socket_table = slot;
+		wormhole_socket_table_size = new_size;
+	}
+
+	index = wormhole_socket_table_free;
+	slot = &wormhole_socket_table[index];
+	wormhole_socket_table_free = slot->next_free;
+
+	/* Generation 0 is never used, so that a socket ID is never 0 */
+	if (++(slot->generation) > WORMHOLE_SOCKET_GEN_MAX)
+		slot->generation = 1;
+	slot->sock = s;
+	slot->next_free = ~0U;
+
+	s->id = (slot->generation << WORMHOLE_SOCKET_SLOT_BITS) | index;
+	return true;
+}
+
+static void
+wormhole_socket_table_release(wormhole_socket_t *s)
+{
+	unsigned int index = s->id & WORMHOLE_SOCKET_SLOT_MASK;
+	struct wormhole_socket_slot *slot;
+
+	if (index >= wormhole_socket_table_size)
+		return;
+
+	slot = &wormhole_socket_table[index];
+	if (slot->sock != s)
+		return;
+
+	slot->sock = NULL;
+	slot->next_free = wormhole_socket_table_free;
+	wormhole_socket_table_free = index;
+}
+
 wormhole_socket_t *
 wormhole_socket_find(unsigned int id)
 {
+	unsigned int index = id & WORMHOLE_SOCKET_SLOT_MASK;
 	wormhole_socket_t *s;
-	for (s = wormhole_sockets; s; s = s->next) {
-		if (s->id == id)
-			return s;
-	}
-	return NULL;
+
+	if (index >= wormhole_socket_table_size)
+		return NULL;
+
+	s = wormhole_socket_table[index].sock;
+	if (s == NULL || s->id != id)
+		return NULL;
+	return s;
 }
 
-static wormhole_socket_t *
+/*
+ * Free list for socket objects. Short-lived client connections come and
+ * go all the time, there is no point in going through malloc for each of
+ * them. Buffers are recycled by the buffer pool.
+ */
+#define WORMHOLE_SOCKET_CACHE_MAX	64
+
+static wormhole_socket_t *	wormhole_socket_cache;
+static unsigned int		wormhole_socket_cache_count;
+
+wormhole_socket_t *
 wormhole_socket_new(const struct wormhole_socket_ops *ops, int fd, uid_t uid, gid_t gid)
 {
-	static unsigned int __wormhole_socket_id = 1;
 	wormhole_socket_t *s;
 
-	s = calloc(1, sizeof(*s));
+	if ((s = wormhole_socket_cache) != NULL) {
+		wormhole_socket_cache = s->next;
+		wormhole_socket_cache_count--;
+	} else if ((s = malloc(sizeof(*s))) == NULL) {
+		log_error("%s: out of memory", __func__);
+		return NULL;
+	}
+
+	memset(s, 0, sizeof(*s));
+	if (!wormhole_socket_table_alloc(s)) {
+		free(s);
+		return NULL;
+	}
+
 	s->ops = ops;
-	s->id = __wormhole_socket_id++;
 	s->fd = fd;
 	s->uid = uid;
 	s->gid = gid;
@@ -112,6 +374,22 @@ wormhole_socket_new(const struct wormhole_socket_ops *ops, int fd, uid_t uid, gi
 	return s;
 }
 
+static void
+wormhole_socket_release(wormhole_socket_t *s)
+{
+	wormhole_socket_table_release(s);
+
+	if (wormhole_socket_cache_count >= WORMHOLE_SOCKET_CACHE_MAX) {
+		free(s);
+		return;
+	}
+
+	memset(s, 0xA5, sizeof(*s));
+	s->next = wormhole_socket_cache;
+	wormhole_socket_cache = s;
+	wormhole_socket_cache_count++;
+}
+
 /*
  * Listening socket
  */
@@ -234,6 +512,11 @@ wormhole_listen(const char *socket_name, struct wormhole_app_ops *app_ops)
 	}
 
 	s = wormhole_socket_new(&__wormhole_passive_socket_ops, fd, 0, 0);
+	if (s == NULL) {
+		close(fd);
+		return NULL;
+	}
+
 	s->app_ops = app_ops;
 	return s;
 }
@@ -241,11 +524,13 @@ wormhole_listen(const char *socket_name, struct wormhole_app_ops *app_ops)
 static wormhole_socket_t *
 __wormhole_socket_accept(int fd, wormhole_socket_t *(*factory)(int, uid_t, gid_t))
 {
+	wormhole_socket_t *s;
 	int cfd;
 	struct ucred cred;
         socklen_t clen;
 
-	cfd = accept(fd, NULL, NULL);
+	/* Do not leak client connections to the processes we start */
+	cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
 	if (cfd < 0) {
 		log_error("failed to accept incoming connection: %m");
 		return NULL;
@@ -258,7 +543,10 @@ __wormhole_socket_accept(int fd, wormhole_socket_t *(*factory)(int, uid_t, gid_t
 		return NULL;
 	}
 
-	return factory(cfd, cred.uid, cred.gid);
+	s = factory(cfd, cred.uid, cred.gid);
+	if (s == NULL)
+		close(cfd);
+	return s;
 }
 
 wormhole_socket_t *
@@ -272,10 +560,9 @@ wormhole_accept_connection(int fd)
  */
 static int scm_rights_process(struct cmsghdr *cmsg, int *recv_fd);
 
-extern int
-wormhole_socket_recvmsg(int fd, void *buffer, size_t buf_sz, int *fdp)
+int
+wormhole_socket_recvmsgv(int fd, struct iovec *iov, unsigned int iovcnt, int *fdp)
 {
-	struct iovec iov;
 	struct msghdr msg;
 	struct cmsghdr *cmsg;
 	union {
@@ -287,13 +574,9 @@ wormhole_socket_recvmsg(int fd, void *buffer, size_t buf_sz, int *fdp)
 	if (fdp)
 		*fdp = -1;
 
-	memset(&iov, 0, sizeof(iov));
-	iov.iov_base = buffer;
-	iov.iov_len = buf_sz;
-
 	memset(&msg, 0, sizeof(msg));
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
 
 	msg.msg_control = u.buf;
 	msg.msg_controllen = sizeof(u.buf);
@@ -315,6 +598,16 @@ wormhole_socket_recvmsg(int fd, void *buffer, size_t buf_sz, int *fdp)
 	return n;
 }
 
+int
+wormhole_socket_recvmsg(int fd, void *buffer, size_t buf_sz, int *fdp)
+{
+	struct iovec iov;
+
+	iov.iov_base = buffer;
+	iov.iov_len = buf_sz;
+	return wormhole_socket_recvmsgv(fd, &iov, 1, fdp);
+}
+
 static int
 scm_rights_process(struct cmsghdr *cmsg, int *recv_fd)
 {
@@ -338,44 +631,73 @@ scm_rights_process(struct cmsghdr *cmsg, int *recv_fd)
 	return ndropped;
 }
 
+/*
+ * Receive data into the buffer chain. We offer the kernel the tailroom of the
+ * last buffer plus a fresh one, and only keep the latter if it received
+ * any data.
+ */
 static bool
-__wormhole_socket_recv(wormhole_socket_t *s, struct buf *bp, int *fdp)
+__wormhole_socket_recv(wormhole_socket_t *s, struct buf **list, int *fdp)
 {
+	struct buf *tail, *spare;
+	struct iovec iov[2];
+	unsigned int room, iovcnt = 0;
 	int n;
 
-	n = wormhole_socket_recvmsg(s->fd, buf_tail(bp), buf_tailroom(bp), fdp);
+	tail = buf_chain_tail(*list);
+	room = tail? buf_tailroom(tail) : 0;
+	if (room) {
+		iov[iovcnt].iov_base = buf_tail(tail);
+		iov[iovcnt].iov_len = room;
+		iovcnt++;
+	}
+
+	spare = buf_alloc();
+	iov[iovcnt].iov_base = buf_tail(spare);
+	iov[iovcnt].iov_len = buf_tailroom(spare);
+	iovcnt++;
+
+	n = wormhole_socket_recvmsgv(s->fd, iov, iovcnt, fdp);
 	if (n < 0) {
 		log_error("recv error on socket: %m");
+		buf_free(spare);
 		return false;
 	}
 
-	if (n == 0) {
+	if (n == 0)
 		s->recv_closed = true;
+
+	if (n <= room) {
+		if (n)
+			__buf_advance_tail(tail, n);
+		buf_free(spare);
 		return true;
 	}
 
-	__buf_advance_tail(bp, n);
+	if (room)
+		__buf_advance_tail(tail, room);
+	__buf_advance_tail(spare, n - room);
+
+	if (tail)
+		tail->next = spare;
+	else
+		*list = spare;
 	return true;
 }
 
 int
-wormhole_socket_sendmsg(int sock_fd, void *payload, unsigned int payload_len, int fd)
+wormhole_socket_sendmsgv(int sock_fd, const struct iovec *iov, unsigned int iovcnt, int fd)
 {
 	union {
 		struct cmsghdr align;
 		char buf[1024];
 	} u;
-	struct iovec iov;
 	struct msghdr msg;
 	struct cmsghdr *cmsg;
 
-	memset(&iov, 0, sizeof(iov));
-	iov.iov_base = payload;
-	iov.iov_len = payload_len;
-
 	memset(&msg, 0, sizeof(msg));
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+	msg.msg_iov = (struct iovec *) iov;
+	msg.msg_iovlen = iovcnt;
 
 	if (fd >= 0) {
 		msg.msg_control = u.buf;
@@ -392,19 +714,48 @@ wormhole_socket_sendmsg(int sock_fd, void *payload, unsigned int payload_len, in
 	return sendmsg(sock_fd, &msg, 0);
 }
 
-static bool
-__wormhole_socket_send(wormhole_socket_t *s, struct buf *bp, int fd)
+int
+wormhole_socket_sendmsg(int sock_fd, void *payload, unsigned int payload_len, int fd)
+{
+	struct iovec iov;
+
+	iov.iov_base = payload;
+	iov.iov_len = payload_len;
+	return wormhole_socket_sendmsgv(sock_fd, &iov, 1, fd);
+}
+
+/*
+ * Send (as much as possible of) a buffer chain, without flattening it first.
+ */
+int
+wormhole_socket_send_chain(int sock_fd, struct buf **list, int fd)
 {
+	struct iovec iov[WORMHOLE_SOCKET_IOV_MAX];
+	unsigned int iovcnt;
 	int sent;
 
-	sent = wormhole_socket_sendmsg(s->fd, (void *) buf_head(bp), buf_available(bp), fd);
-	if (sent < 0) {
+	iovcnt = buf_chain_iovec(*list, iov, WORMHOLE_SOCKET_IOV_MAX);
+	if (iovcnt == 0)
+		return 0;
+
+	sent = wormhole_socket_sendmsgv(sock_fd, iov, iovcnt, fd);
+	if (sent > 0) {
+		buf_consumed(list, sent);
+		buf_chain_trim(list);
+	}
+
+	return sent;
+}
+
+static bool
+__wormhole_socket_send(wormhole_socket_t *s, struct buf **list, int fd)
+{
+	if (wormhole_socket_send_chain(s->fd, list, fd) < 0) {
 		log_error("sendmsg failed: %m");
 		/* mark socket as dead */
 		return false;
 	}
 
-	__buf_advance_head(bp, sent);
 	return true;
 }
 
@@ -429,21 +780,29 @@ __wormhole_connected_socket_process(wormhole_socket_t *s, struct pollfd *pfd)
 	if (pfd->revents & POLLHUP)
 		s->recv_closed = true;
 	if (pfd->revents & POLLIN) {
-		if (!s->recvbuf)
-			s->recvbuf = buf_alloc();
+		int fd = -1;
 
-		if (!__wormhole_socket_recv(s, s->recvbuf, &s->recvfd))
+		if (!__wormhole_socket_recv(s, &s->recvbuf, &fd))
 			return false;
 
-		/* See whether we have a complete message, and if so, process it */
-		if (s->recvbuf && buf_available(s->recvbuf))
-			s->app_ops->received(s, s->recvbuf, s->recvfd);
+		if (fd >= 0) {
+			wormhole_drop_recvfd(s);
+			s->recvfd = fd;
+		}
+
+		/* Process all complete messages we have. The received callback
+		 * returns false if there isn't a complete message yet. */
+		while (s->recvbuf && buf_chain_available(s->recvbuf)) {
+			if (!s->app_ops->received(s, s->recvbuf, s->recvfd))
+				break;
+
+			/* We consumed the fd that came with this message. */
+			wormhole_drop_recvfd(s);
 
-		/* We consumed the fd that came with this message. */
-		wormhole_drop_recvfd(s);
+			wormhole_socket_trim_recvbuf(s);
+		}
 
-		// buf_compact(s->recvbuf);
-		if (buf_available(s->recvbuf) == 0)
+		if (s->recvbuf && buf_chain_available(s->recvbuf) == 0)
 			wormhole_drop_recvbuf(s);
 	}
 
@@ -453,14 +812,14 @@ __wormhole_connected_socket_process(wormhole_socket_t *s, struct pollfd *pfd)
 			return false;
 		}
 
-		if (!__wormhole_socket_send(s, s->sendbuf, s->sendfd))
+		if (!__wormhole_socket_send(s, &s->sendbuf, s->sendfd))
 			return false;
 
 		/* As long as we sent anything, we assume the sendfd went
 		 * with it. */
 		wormhole_drop_sendfd(s);
 
-		if (buf_available(s->sendbuf) == 0)
+		if (s->sendbuf == NULL || buf_chain_available(s->sendbuf) == 0)
 			wormhole_drop_sendbuf(s);
 	}
 
@@ -507,12 +866,21 @@ wormhole_connect(const char *socket_name, struct wormhole_app_ops *app_ops)
 	}
 
 	if (r < 0) {
-		log_error("cannot connect to %s: %m", socket_name);
+		/* Not having a daemon running is not necessarily an error */
+		if (errno == ENOENT || errno == ECONNREFUSED)
+			trace("cannot connect to %s: %m", socket_name);
+		else
+			log_error("cannot connect to %s: %m", socket_name);
 		close(fd);
 		return NULL;
 	}
 
 	s = wormhole_connected_socket_new(fd, 0, 0);
+	if (s == NULL) {
+		close(fd);
+		return NULL;
+	}
+
 	s->app_ops = app_ops;
 	return s;
 }
@@ -529,13 +897,30 @@ wormhole_socket_enqueue(wormhole_socket_t *s, struct buf *bp, int fd)
 
 	if (fd >= 0)
 		s->sendfd = fd;
+
+	wormhole_socket_changed(s);
+}
+
+/*
+ * Release any buffers at the head of the receive chain that have been
+ * consumed completely, but always keep the last one.
+ */
+static void
+wormhole_socket_trim_recvbuf(wormhole_socket_t *s)
+{
+	struct buf *bp;
+
+	while ((bp = s->recvbuf) != NULL && bp->next && buf_available(bp) == 0) {
+		s->recvbuf = bp->next;
+		buf_free(bp);
+	}
 }
 
 void
 wormhole_drop_recvbuf(wormhole_socket_t *s)
 {
 	if (s->recvbuf) {
-		buf_free(s->recvbuf);
+		buf_chain_free(s->recvbuf);
 		s->recvbuf = NULL;
 	}
 }
@@ -553,7 +938,7 @@ void
 wormhole_drop_sendbuf(wormhole_socket_t *s)
 {
 	if (s->sendbuf) {
-		buf_free(s->sendbuf);
+		buf_chain_free(s->sendbuf);
 		s->sendbuf = NULL;
 	}
 }
@@ -573,11 +958,16 @@ wormhole_socket_fail(wormhole_socket_t *s)
 	log_error("Failure on socket %d, will close", s->id);
 	s->recv_closed = true;
 	s->send_closed = true;
+
+	wormhole_socket_changed(s);
 }
 
 void
 wormhole_socket_free(wormhole_socket_t *s)
 {
+	if (s->app_ops && s->app_ops->closed)
+		s->app_ops->closed(s);
+
 	wormhole_uninstall_socket(s);
 
 	if (s->fd >= 0)
@@ -588,5 +978,5 @@ wormhole_socket_free(wormhole_socket_t *s)
 
 	wormhole_drop_recvfd(s);
 	wormhole_drop_sendfd(s);
-	free(s);
+	wormhole_socket_release(s);
 }
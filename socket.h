@@ -42,8 +42,15 @@ struct wormhole_socket {
 	struct wormhole_app_ops {
 		void	(*new_socket)(wormhole_socket_t *);
 		bool	(*received)(wormhole_socket_t *, struct buf *, int);
+		void	(*closed)(wormhole_socket_t *);
 	} *app_ops;
 
+	/* Event engine state */
+	wormhole_socket_t **changed_prevp;
+	wormhole_socket_t *changed_next;
+	bool		poll_registered;
+	unsigned int	poll_events;
+
 	/* FIXME: add idle timeout */
 	time_t		timeout;
 
@@ -60,14 +67,13 @@ struct wormhole_socket {
 	int		sendfd;
 };
 
-#define WORMHOLE_SOCKET_MAX	1024
-
 extern wormhole_socket_t * wormhole_sockets;
 extern unsigned int		wormhole_socket_count;
 
 extern wormhole_socket_t *	wormhole_listen(const char *path, struct wormhole_app_ops *app_ops);
 extern wormhole_socket_t *	wormhole_connect(const char *path, struct wormhole_app_ops *app_ops);
 
+extern wormhole_socket_t *	wormhole_socket_new(const struct wormhole_socket_ops *ops, int fd, uid_t uid, gid_t gid);
 extern wormhole_socket_t *	wormhole_accept_connection(int fd);
 extern wormhole_socket_t *	wormhole_socket_find(unsigned int id);
 extern void			wormhole_socket_fail(wormhole_socket_t *);
@@ -83,8 +89,18 @@ extern void			wormhole_socket_enqueue(wormhole_socket_t *s, struct buf *bp, int
 
 extern void			wormhole_install_socket(wormhole_socket_t *);
 extern void			wormhole_uninstall_socket(wormhole_socket_t *);
+extern void			wormhole_socket_changed(wormhole_socket_t *);
+extern void			wormhole_sockets_poll(int timeout);
+
+/* Max number of buffers we hand to sendmsg in one go */
+#define WORMHOLE_SOCKET_IOV_MAX	16
+
+struct iovec;
 
 extern int			wormhole_socket_recvmsg(int fd, void *buffer, size_t buf_sz, int *fdp);
+extern int			wormhole_socket_recvmsgv(int fd, struct iovec *iov, unsigned int iovcnt, int *fdp);
 extern int			wormhole_socket_sendmsg(int sock_fd, void *payload, unsigned int payload_len, int fd);
+extern int			wormhole_socket_sendmsgv(int sock_fd, const struct iovec *iov, unsigned int iovcnt, int fd);
+extern int			wormhole_socket_send_chain(int sock_fd, struct buf **list, int fd);
 
 #endif // _WORMHOLE_SOCKET_H
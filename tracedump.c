@@ -0,0 +1,415 @@
+/*
+ * wormhole-tracedump - decode binary trace buffers into a timeline
+ *
+ *   Copyright (C) 2020-2021 Olaf Kirch <okir@suse.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Trace files are written by wormhole, wormholed and wormhole-digger when
+ * WORMHOLE_TRACE_DIR is set, one per process. Events from several files
+ * are merged by time stamp (they all use CLOCK_MONOTONIC), and spans are
+ * printed with their duration, nested per process.
+ */
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <fcntl.h>
+
+#include "tracing.h"
+
+struct tracedump_event {
+	uint64_t		ts_nsec;
+	uint64_t		duration;
+	uint32_t		pid;
+	uint32_t		arg;
+	uint16_t		id;
+	uint8_t			type;
+	bool			matched;
+	unsigned int		depth;
+	const char *		comm;
+	char			str[sizeof(((struct trace_ring_slot *) 0)->str)];
+};
+
+struct tracedump_state {
+	unsigned int		count;
+	unsigned int		size;
+	struct tracedump_event *event;
+};
+
+struct option wormhole_options[] = {
+	{ "help",		no_argument,		NULL,	'h' },
+	{ "summary",		no_argument,		NULL,	's' },
+	{ NULL }
+};
+
+static bool		opt_summary = false;
+
+static bool		tracedump_load_path(struct tracedump_state *, const char *);
+static void		tracedump_match_spans(struct tracedump_state *);
+static void		tracedump_print_timeline(const struct tracedump_state *);
+static void		tracedump_print_summary(const struct tracedump_state *);
+static void		usage(int exval);
+
+int
+main(int argc, char **argv)
+{
+	struct tracedump_state state = { 0 };
+	int c;
+
+	while ((c = getopt_long(argc, argv, "hs", wormhole_options, NULL)) != EOF) {
+		switch (c) {
+		case 'h':
+			usage(0);
+
+		case 's':
+			opt_summary = true;
+			break;
+
+		default:
+			log_error("Error parsing command line");
+			usage(2);
+		}
+	}
+
+	if (optind >= argc)
+		usage(2);
+
+	for (; optind < argc; ++optind) {
+		if (!tracedump_load_path(&state, argv[optind]))
+			return 1;
+	}
+
+	tracedump_match_spans(&state);
+
+	if (opt_summary)
+		tracedump_print_summary(&state);
+	else
+		tracedump_print_timeline(&state);
+	return 0;
+}
+
+void
+usage(int exval)
+{
+	FILE *f = exval? stderr : stdout;
+
+	fprintf(f,
+		"Usage:\n"
+		"wormhole-tracedump [options] file-or-directory ...\n"
+		"  --help, -h\n"
+		"     Display this help message\n"
+		"  --summary, -s\n"
+		"     Print count and duration of each span type instead of the timeline\n"
+		"\n"
+		"Trace files are created when running wormhole programs with\n"
+		"WORMHOLE_TRACE_DIR set to an existing directory.\n"
+	);
+	exit(exval);
+}
+
+static struct tracedump_event *
+tracedump_add_event(struct tracedump_state *state)
+{
+	if (state->count >= state->size) {
+		state->size = state->size? 2 * state->size : 1024;
+		state->event = realloc(state->event, state->size * sizeof(state->event[0]));
+		if (state->event == NULL)
+			log_fatal("Out of memory");
+	}
+
+	return memset(&state->event[state->count++], 0, sizeof(state->event[0]));
+}
+
+static bool
+tracedump_load_file(struct tracedump_state *state, const char *path)
+{
+	const struct trace_ring *ring;
+	struct stat stb;
+	uint64_t head, n;
+	unsigned int nslots, dropped = 0;
+	const char *comm;
+	void *data;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		log_error("Unable to open %s: %m", path);
+		return false;
+	}
+
+	if (fstat(fd, &stb) < 0 || stb.st_size < sizeof(ring->hdr)) {
+		log_error("%s: not a trace file", path);
+		close(fd);
+		return false;
+	}
+
+	data = malloc(stb.st_size);
+	if (data == NULL || read(fd, data, stb.st_size) != stb.st_size) {
+		log_error("%s: unable to read file: %m", path);
+		free(data);
+		close(fd);
+		return false;
+	}
+	close(fd);
+
+	ring = data;
+	nslots = ring->hdr.nslots;
+	if (ring->hdr.magic != TRACE_RING_MAGIC
+	 || ring->hdr.version != TRACE_RING_VERSION
+	 || nslots == 0 || (nslots & (nslots - 1))
+	 || stb.st_size != sizeof(ring->hdr) + nslots * sizeof(ring->slot[0])) {
+		log_error("%s: not a trace file, or unsupported format", path);
+		free(data);
+		return false;
+	}
+
+	comm = strndup(ring->hdr.comm, sizeof(ring->hdr.comm));
+
+	head = ring->hdr.head;
+	n = (head > nslots)? head - nslots : 0;
+	if (n)
+		log_warning("%s: ring buffer wrapped, lost the first %llu events", path, (unsigned long long) n);
+
+	for (; n < head; ++n) {
+		const struct trace_ring_slot *slot = &ring->slot[n & (nslots - 1)];
+		struct tracedump_event *ev;
+
+		/* Slot was being written when the file was read, or never completed */
+		if (slot->seq != (uint32_t) (n + 1)) {
+			dropped++;
+			continue;
+		}
+
+		ev = tracedump_add_event(state);
+		ev->ts_nsec = slot->ts_nsec;
+		ev->pid = slot->pid;
+		ev->arg = slot->arg;
+		ev->id = slot->id;
+		ev->type = slot->type;
+		ev->comm = comm;
+		memcpy(ev->str, slot->str, sizeof(ev->str));
+		ev->str[sizeof(ev->str) - 1] = '\0';
+	}
+
+	if (dropped)
+		log_warning("%s: skipped %u incomplete events", path, dropped);
+
+	free(data);
+	return true;
+}
+
+static bool
+tracedump_load_path(struct tracedump_state *state, const char *path)
+{
+	char file_path[PATH_MAX];
+	struct dirent *d;
+	struct stat stb;
+	bool ok = true;
+	DIR *dir;
+
+	if (stat(path, &stb) < 0) {
+		log_error("%s: %m", path);
+		return false;
+	}
+
+	if (!S_ISDIR(stb.st_mode))
+		return tracedump_load_file(state, path);
+
+	if (!(dir = opendir(path))) {
+		log_error("Unable to open directory %s: %m", path);
+		return false;
+	}
+
+	while (ok && (d = readdir(dir)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+
+		if ((size_t) snprintf(file_path, sizeof(file_path), "%s/%s", path, d->d_name) >= sizeof(file_path))
+			continue;
+		if (stat(file_path, &stb) < 0 || !S_ISREG(stb.st_mode))
+			continue;
+
+		ok = tracedump_load_file(state, file_path);
+	}
+
+	closedir(dir);
+	return ok;
+}
+
+static int
+tracedump_event_compare(const void *a, const void *b)
+{
+	const struct tracedump_event *ea = a, *eb = b;
+
+	if (ea->ts_nsec < eb->ts_nsec)
+		return -1;
+	if (ea->ts_nsec > eb->ts_nsec)
+		return 1;
+	/* Keep begin before end for zero length spans */
+	return (int) ea->type - (int) eb->type;
+}
+
+/*
+ * Sort events by time and pair up span begin/end events. A span is
+ * identified by pid, event id and argument; requests in wormholed
+ * interleave, and use the transaction ID as their argument.
+ */
+static void
+tracedump_match_spans(struct tracedump_state *state)
+{
+	unsigned int *open, nopen = 0;
+	unsigned int i, j;
+
+	qsort(state->event, state->count, sizeof(state->event[0]), tracedump_event_compare);
+
+	open = calloc(state->count + 1, sizeof(open[0]));
+	for (i = 0; i < state->count; ++i) {
+		struct tracedump_event *ev = &state->event[i];
+
+		if (ev->type == TRACE_TYPE_SPAN_END) {
+			for (j = nopen; j-- > 0; ) {
+				struct tracedump_event *begin = &state->event[open[j]];
+
+				if (begin->pid == ev->pid && begin->id == ev->id && begin->arg == ev->arg) {
+					begin->duration = ev->ts_nsec - begin->ts_nsec;
+					begin->matched = ev->matched = true;
+					ev->depth = begin->depth;
+					memmove(open + j, open + j + 1, (nopen - j - 1) * sizeof(open[0]));
+					nopen--;
+					break;
+				}
+			}
+			continue;
+		}
+
+		for (j = 0; j < nopen; ++j) {
+			if (state->event[open[j]].pid == ev->pid)
+				ev->depth++;
+		}
+
+		if (ev->type == TRACE_TYPE_SPAN_BEGIN)
+			open[nopen++] = i;
+	}
+
+	free(open);
+}
+
+static const char *
+tracedump_event_name(unsigned int id)
+{
+	static char namebuf[32];
+	const char *name;
+
+	if ((name = tracing_event_name(id)) == NULL) {
+		snprintf(namebuf, sizeof(namebuf), "event-%u", id);
+		name = namebuf;
+	}
+	return name;
+}
+
+/*
+ * Span ends are folded into the line of their begin event; only ends
+ * without a begin (eg because the ring wrapped) are shown by themselves.
+ */
+static void
+tracedump_print_timeline(const struct tracedump_state *state)
+{
+	uint64_t t0;
+	unsigned int i;
+
+	if (state->count == 0)
+		return;
+
+	t0 = state->event[0].ts_nsec;
+	for (i = 0; i < state->count; ++i) {
+		const struct tracedump_event *ev = &state->event[i];
+		const char *name = tracedump_event_name(ev->id);
+
+		if (ev->type == TRACE_TYPE_SPAN_END && ev->matched)
+			continue;
+
+		printf("%12.3f ms %7u %-16s %*s", (ev->ts_nsec - t0) / 1e6, ev->pid, ev->comm, 2 * ev->depth, "");
+
+		switch (ev->type) {
+		case TRACE_TYPE_SPAN_BEGIN:
+			printf("%s %s", name, ev->str);
+			if (ev->matched)
+				printf(" [%.3f ms]\n", ev->duration / 1e6);
+			else
+				printf(" [unfinished]\n");
+			break;
+
+		case TRACE_TYPE_SPAN_END:
+			printf("end of %s %s\n", name, ev->str);
+			break;
+
+		default:
+			printf("%s %s arg=%u\n", name, ev->str, ev->arg);
+			break;
+		}
+	}
+}
+
+static void
+tracedump_print_summary(const struct tracedump_state *state)
+{
+	struct {
+		unsigned int	count;
+		uint64_t	total, min, max;
+	} sum[__TRACE_EV_MAX + 1];
+	unsigned int i;
+
+	memset(sum, 0, sizeof(sum));
+	for (i = 0; i < state->count; ++i) {
+		const struct tracedump_event *ev = &state->event[i];
+		unsigned int id = ev->id;
+
+		if (ev->type != TRACE_TYPE_SPAN_BEGIN || !ev->matched)
+			continue;
+
+		/* Lump unknown event ids together */
+		if (id > __TRACE_EV_MAX)
+			id = __TRACE_EV_MAX;
+
+		if (sum[id].count == 0 || ev->duration < sum[id].min)
+			sum[id].min = ev->duration;
+		if (ev->duration > sum[id].max)
+			sum[id].max = ev->duration;
+		sum[id].total += ev->duration;
+		sum[id].count++;
+	}
+
+	printf("%-20s %8s %12s %12s %12s %12s\n", "span", "count", "total ms", "avg ms", "min ms", "max ms");
+	for (i = 0; i <= __TRACE_EV_MAX; ++i) {
+		if (sum[i].count == 0)
+			continue;
+
+		printf("%-20s %8u %12.3f %12.3f %12.3f %12.3f\n",
+				(i < __TRACE_EV_MAX)? tracedump_event_name(i) : "other",
+				sum[i].count,
+				sum[i].total / 1e6,
+				sum[i].total / 1e6 / sum[i].count,
+				sum[i].min / 1e6,
+				sum[i].max / 1e6);
+	}
+}
@@ -245,3 +245,134 @@ logging_notify_raw_tty(bool on)
 	trace("%s(%d)\n", __func__, on);
 	logging_raw_tty = on;
 }
+
+/*
+ * Binary event tracing
+ */
+#include <sys/mman.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+struct trace_ring *	__trace_ring;
+static pid_t		__trace_pid;
+
+static const char *	__tracing_event_names[__TRACE_EV_MAX] = {
+	[TRACE_EV_NONE]		= "none",
+	[TRACE_EV_REQUEST]	= "request",
+	[TRACE_EV_ENV_SETUP]	= "env-setup",
+	[TRACE_EV_LAYER_PREPARE] = "layer-prepare",
+	[TRACE_EV_MOUNT_PLAN_BUILD] = "mount-plan-build",
+	[TRACE_EV_MOUNT]	= "mount",
+	[TRACE_EV_LDCONFIG]	= "ldconfig",
+	[TRACE_EV_PODMAN]	= "podman",
+};
+
+static void
+__tracing_events_atfork_child(void)
+{
+	__trace_pid = getpid();
+}
+
+const char *
+tracing_event_name(unsigned int id)
+{
+	if (id < __TRACE_EV_MAX && __tracing_event_names[id])
+		return __tracing_event_names[id];
+	return NULL;
+}
+
+/*
+ * The ring lives in a shared file mapping, so that the data survives
+ * the process crashing, and forked children write to the same ring.
+ * Each slot records the pid of its writer.
+ */
+bool
+tracing_events_init(void)
+{
+	struct trace_ring *ring;
+	const char *dir;
+	char path[PATH_MAX];
+	size_t size;
+	int fd;
+
+	if (__trace_ring != NULL)
+		return true;
+
+	if ((dir = getenv("WORMHOLE_TRACE_DIR")) == NULL || *dir == '\0')
+		return true;
+
+	snprintf(path, sizeof(path), "%s/%s.%d", dir, program_invocation_short_name, (int) getpid());
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		log_error("Unable to create trace file %s: %m", path);
+		return false;
+	}
+
+	size = sizeof(struct trace_ring_header) + TRACE_RING_SLOTS * sizeof(struct trace_ring_slot);
+	if (ftruncate(fd, size) < 0) {
+		log_error("Unable to size trace file %s: %m", path);
+		close(fd);
+		return false;
+	}
+
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (ring == MAP_FAILED) {
+		log_error("Unable to map trace file %s: %m", path);
+		return false;
+	}
+
+	ring->hdr.nslots = TRACE_RING_SLOTS;
+	ring->hdr.pid = getpid();
+	strncpy(ring->hdr.comm, program_invocation_short_name, sizeof(ring->hdr.comm) - 1);
+	ring->hdr.version = TRACE_RING_VERSION;
+	__atomic_store_n(&ring->hdr.magic, TRACE_RING_MAGIC, __ATOMIC_RELEASE);
+
+	__trace_pid = getpid();
+	pthread_atfork(NULL, NULL, __tracing_events_atfork_child);
+
+	__trace_ring = ring;
+	return true;
+}
+
+/*
+ * Lock free: writers claim a slot by bumping the head, and publish it
+ * by storing the sequence number last. A reader that finds a stale seq
+ * knows the slot was being (over)written and skips it.
+ */
+void
+__trace_event_record(unsigned int type, unsigned int id, unsigned int arg, const char *str)
+{
+	struct trace_ring *ring = __trace_ring;
+	struct trace_ring_slot *slot;
+	struct timespec ts;
+	uint64_t n;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	n = __atomic_fetch_add(&ring->hdr.head, 1, __ATOMIC_RELAXED);
+	slot = &ring->slot[n & (ring->hdr.nslots - 1)];
+
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->ts_nsec = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	slot->pid = __trace_pid;
+	slot->id = id;
+	slot->type = type;
+	slot->arg = arg;
+	slot->str[0] = '\0';
+	if (str) {
+		size_t len = strlen(str);
+
+		/* For long paths, the tail is the interesting part */
+		if (len >= sizeof(slot->str))
+			str += len - (sizeof(slot->str) - 1);
+		strcpy(slot->str, str);
+	}
+
+	__atomic_store_n(&slot->seq, (uint32_t) (n + 1), __ATOMIC_RELEASE);
+}
@@ -21,6 +21,7 @@
 #define _TRACING_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 
 extern void		(*__tracing_hook)(const char *fmt, ...);
@@ -56,6 +57,81 @@ extern void		log_error(const char *fmt, ...);
 extern void		log_fatal(const char *fmt, ...);
 extern void		logging_notify_raw_tty(bool);
 
+/*
+ * Binary event tracing. When WORMHOLE_TRACE_DIR is set in the environment,
+ * tracing_events_init() maps a ring buffer file into the process, and the
+ * macros below record fixed size events into it. Recording an event does
+ * not format anything, and costs a pointer check when disabled.
+ * Use wormhole-tracedump to decode the files.
+ */
+enum {
+	TRACE_EV_NONE = 0,
+	TRACE_EV_REQUEST,
+	TRACE_EV_ENV_SETUP,
+	TRACE_EV_LAYER_PREPARE,
+	TRACE_EV_MOUNT_PLAN_BUILD,
+	TRACE_EV_MOUNT,
+	TRACE_EV_LDCONFIG,
+	TRACE_EV_PODMAN,
+
+	__TRACE_EV_MAX
+};
+
+enum {
+	TRACE_TYPE_POINT = 0,
+	TRACE_TYPE_SPAN_BEGIN,
+	TRACE_TYPE_SPAN_END,
+};
+
+#define TRACE_RING_MAGIC	0x57485452	/* WHTR */
+#define TRACE_RING_VERSION	1
+#define TRACE_RING_SLOTS	16384		/* must be a power of 2 */
+
+struct trace_ring_header {
+	uint32_t		magic;
+	uint32_t		version;
+	uint32_t		nslots;
+	uint32_t		pid;
+	uint64_t		head;		/* number of events ever recorded */
+	char			comm[40];
+};
+
+/* A slot is valid if its seq equals the (truncated) event number + 1 */
+struct trace_ring_slot {
+	uint64_t		ts_nsec;	/* CLOCK_MONOTONIC */
+	uint32_t		seq;
+	uint32_t		pid;
+	uint16_t		id;
+	uint8_t			type;
+	uint8_t			__pad;
+	uint32_t		arg;
+	char			str[40];
+};
+
+struct trace_ring {
+	struct trace_ring_header hdr;
+	struct trace_ring_slot	slot[];
+};
+
+extern struct trace_ring *	__trace_ring;
+extern void			__trace_event_record(unsigned int type, unsigned int id, unsigned int arg, const char *str);
+
+#define trace_event(id, arg, str) do { \
+		if (__trace_ring) \
+			__trace_event_record(TRACE_TYPE_POINT, id, arg, str); \
+	} while (0)
+#define trace_span_begin(id, arg, str) do { \
+		if (__trace_ring) \
+			__trace_event_record(TRACE_TYPE_SPAN_BEGIN, id, arg, str); \
+	} while (0)
+#define trace_span_end(id, arg, str) do { \
+		if (__trace_ring) \
+			__trace_event_record(TRACE_TYPE_SPAN_END, id, arg, str); \
+	} while (0)
+
+extern bool		tracing_events_init(void);
+extern const char *	tracing_event_name(unsigned int id);
+
 static inline void
 progress_indicate(char c)
 {
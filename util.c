@@ -22,6 +22,9 @@
 #include <sys/wait.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/nsfs.h>
 #include <dirent.h>
 #include <sched.h>
 #include <stdio.h>
@@ -31,7 +34,10 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <grp.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "tracing.h"
 #include "util.h"
@@ -192,6 +198,32 @@ procutil_fork_with_socket(int *fdp)
 	return pid;
 }
 
+/*
+ * Close all file descriptors except stdio and the one given. For use
+ * before exec'ing a long lived process, which should not hold on to
+ * whatever its parent had open.
+ */
+void
+procutil_close_fds_except(int keep_fd)
+{
+	struct dirent *d;
+	DIR *dir;
+	int fd;
+
+	if ((dir = opendir("/proc/self/fd")) == NULL)
+		return;
+
+	while ((d = readdir(dir)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+
+		fd = atoi(d->d_name);
+		if (fd > 2 && fd != keep_fd && fd != dirfd(dir))
+			close(fd);
+	}
+	closedir(dir);
+}
+
 void
 procutil_command_init(struct procutil_command *cmd, char **argv)
 {
@@ -357,6 +389,67 @@ wormhole_create_user_namespace(void)
 	return true;
 }
 
+/*
+ * Join the mount namespace referenced by nsfd. If that namespace is owned by a
+ * user namespace other than ours (which is the case for namespaces that the
+ * daemon set up on behalf of an unprivileged user), join that one first.
+ */
+bool
+wormhole_enter_namespace(int nsfd)
+{
+	struct stat stb1, stb2;
+	int userns_fd;
+
+	userns_fd = ioctl(nsfd, NS_GET_USERNS);
+	if (userns_fd >= 0) {
+		if (fstat(userns_fd, &stb1) < 0 || stat("/proc/self/ns/user", &stb2) < 0) {
+			log_error("Unable to stat user namespace: %m");
+			close(userns_fd);
+			return false;
+		}
+
+		if (stb1.st_dev != stb2.st_dev || stb1.st_ino != stb2.st_ino) {
+			trace("Joining user namespace of mount namespace");
+			if (setns(userns_fd, CLONE_NEWUSER) < 0) {
+				log_error("setns(CLONE_NEWUSER): %m");
+				close(userns_fd);
+				return false;
+			}
+		}
+
+		close(userns_fd);
+	} else if (errno != EPERM) {
+		/* EPERM means the owning namespace is not a descendant of ours */
+		trace("ioctl(NS_GET_USERNS): %m");
+	}
+
+	if (setns(nsfd, CLONE_NEWNS) < 0) {
+		log_error("setns(CLONE_NEWNS): %m");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Permanently drop all privileges, and become the given user.
+ */
+bool
+procutil_drop_privileges(uid_t uid, gid_t gid)
+{
+	if (setgroups(0, NULL) < 0 && getuid() == 0) {
+		log_error("setgroups: %m");
+		return false;
+	}
+
+	if (setresgid(gid, gid, gid) < 0 || setresuid(uid, uid, uid) < 0) {
+		log_error("Unable to change to uid %d/gid %d: %m", uid, gid);
+		return false;
+	}
+
+	return true;
+}
+
 /*
  * Reap exited children
  */
@@ -623,22 +716,138 @@ fsutil_dir_is_empty(const char *path)
 
 typedef int	__fsutil_ftw_internal_cb_fn_t(const char *dir_path, int dir_fd, const struct dirent *d, int flags, void *closure);
 
+/*
+ * We read directories with getdents64 rather than readdir, using large
+ * buffers; this saves a lot of syscalls on big directories.
+ */
+#define FSUTIL_GETDENTS_BUFSZ		(64 * 1024)
+
+struct __fsutil_dirent64 {
+	uint64_t		d_ino;
+	int64_t			d_off;
+	unsigned short		d_reclen;
+	unsigned char		d_type;
+	char			d_name[];
+};
+
+struct __fsutil_dirbuf {
+	char *			data;
+	long			len, pos;
+};
+
+/*
+ * Return the next directory entry, converted to a struct dirent.
+ * Returns false at the end of the directory, or on error (with errno set).
+ */
 static bool
-__fsutil_ftw(const char *dir_path, int dirfd, struct stat *dir_stat, __fsutil_ftw_internal_cb_fn_t *callback, void *closure, int flags)
+__fsutil_readdir64(int dirfd, struct __fsutil_dirbuf *db, struct dirent *d)
 {
-	DIR *dir;
-	struct dirent *d;
+	const struct __fsutil_dirent64 *de;
+
+	while (true) {
+		if (db->pos >= db->len) {
+			if (db->data == NULL)
+				db->data = malloc(FSUTIL_GETDENTS_BUFSZ);
+
+			errno = 0;
+			db->len = syscall(SYS_getdents64, dirfd, db->data, FSUTIL_GETDENTS_BUFSZ);
+			db->pos = 0;
+			if (db->len <= 0) {
+				db->len = 0;
+				return false;
+			}
+		}
+
+		de = (const struct __fsutil_dirent64 *) (db->data + db->pos);
+		db->pos += de->d_reclen;
+
+		if (de->d_name[0] == '.' && (de->d_name[1] == '\0' || (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+			continue;
+
+		d->d_ino = de->d_ino;
+		d->d_off = de->d_off;
+		d->d_reclen = sizeof(*d);
+		d->d_type = de->d_type;
+		snprintf(d->d_name, sizeof(d->d_name), "%s", de->d_name);
+		return true;
+	}
+}
+
+static int
+__fsutil_ftw_open_child(const char *dir_path, int dirfd, const char *name, int flags)
+{
+	int childfd;
+
+	childfd = openat(dirfd, name, O_RDONLY|O_NOCTTY|O_NONBLOCK|O_NOFOLLOW|O_DIRECTORY|O_CLOEXEC);
+	if (childfd < 0 && errno == EACCES && (flags & FSUTIL_FTW_OVERRIDE_OPEN_ERROR)) {
+		(void) fchmodat(dirfd, name, 0700, 0);
+		childfd = openat(dirfd, name, O_RDONLY|O_NOCTTY|O_NONBLOCK|O_NOFOLLOW|O_DIRECTORY|O_CLOEXEC);
+	}
+	if (childfd < 0 && !(flags & FSUTIL_FTW_IGNORE_OPEN_ERROR))
+		log_error("can't open %s/%s: %m", dir_path, name);
+	return childfd;
+}
+
+/*
+ * With FSUTIL_FTW_ONE_FILESYSTEM, check whether the subdirectory is on
+ * the same file system.
+ * Returns 1 if we should descend, 0 if not, and -1 on error.
+ */
+static int
+__fsutil_ftw_check_dev(const char *dir_path, int dirfd, const char *name, dev_t dev, int flags)
+{
+	struct stat child_stb;
+
+	if (!(flags & FSUTIL_FTW_ONE_FILESYSTEM))
+		return 1;
+
+	if (fstatat(dirfd, name, &child_stb, AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW) < 0) {
+		log_error("can't stat %s/%s: %m", dir_path, name);
+		return -1;
+	}
+
+	if (child_stb.st_dev != dev) {
+		trace("Skipping %s/%s: different filesystem", dir_path, name);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * The sequential walker. path holds the path of the directory we're in,
+ * and we append to it as we descend. We keep one getdents buffer per level.
+ */
+struct __fsutil_ftw_state {
+	char			path[PATH_MAX];
+	unsigned int		depth;
+	unsigned int		nbufs;
+	struct __fsutil_dirbuf *bufs;
+
+	__fsutil_ftw_internal_cb_fn_t *callback;
+	void *			closure;
+	int			flags;
+};
+
+static bool
+__fsutil_ftw(struct __fsutil_ftw_state *st, size_t path_len, int dirfd, dev_t dev)
+{
+	__fsutil_ftw_internal_cb_fn_t *callback = st->callback;
+	void *closure = st->closure;
+	int flags = st->flags;
+	unsigned int depth = st->depth;
 	bool cb_pre = false, cb_post = false;
+	struct dirent d;
 	bool ok = true;
 
-	/* trace3("%s(%s)", __func__, dir_path); */
+	/* trace3("%s(%s)", __func__, st->path); */
 
-	dir = fdopendir(dup(dirfd));
-	if (dir == NULL) {
-		log_error("cannot dup directory fd: %m");
-		close(dirfd);
-		return false;
+	if (depth >= st->nbufs) {
+		st->nbufs += 16;
+		st->bufs = realloc(st->bufs, st->nbufs * sizeof(st->bufs[0]));
+		memset(st->bufs + depth, 0, (st->nbufs - depth) * sizeof(st->bufs[0]));
 	}
+	st->bufs[depth].len = st->bufs[depth].pos = 0;
 
 	if (flags & FSUTIL_FTW_DEPTH_FIRST)
 		cb_post = true;
@@ -647,63 +856,59 @@ __fsutil_ftw(const char *dir_path, int dirfd, struct stat *dir_stat, __fsutil_ft
 	else
 		cb_pre = true;
 
-	// __make_path_push();
-	while (ok && (d = readdir(dir)) != NULL) {
+	/* Descending may realloc the array, so do not hold on to a pointer */
+	while (ok && __fsutil_readdir64(dirfd, &st->bufs[depth], &d)) {
 		int cbflags = 0;
 
-		if (d->d_name[0] == '.' && (d->d_name[1] == '\0' || d->d_name[1] == '.'))
-			continue;
-
-		if (d->d_type == DT_DIR) {
-			struct stat child_stb, *child_stat = NULL;
-			char child_path[PATH_MAX];
+		if (d.d_type == DT_DIR) {
+			size_t name_len = strlen(d.d_name);
 			int childfd, rv;
 
-			if (flags & FSUTIL_FTW_ONE_FILESYSTEM) {
-				if (fstatat(dirfd, d->d_name, &child_stb, AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW) < 0) {
-					log_error("can't stat %s/%s: %m", dir_path, d->d_name);
+			if ((rv = __fsutil_ftw_check_dev(st->path, dirfd, d.d_name, dev, flags)) <= 0) {
+				if (rv < 0)
 					ok = false;
-					continue;
-				}
-
-				if (child_stb.st_dev != dir_stat->st_dev) {
-					trace("Skipping %s/%s: different filesystem", dir_path, d->d_name);
-					continue;
-				}
-
-				child_stat = &child_stb;
+				continue;
 			}
 
-			childfd = openat(dirfd, d->d_name, O_RDONLY|O_NOCTTY|O_NONBLOCK|O_NOFOLLOW|O_DIRECTORY);
-			if (childfd < 0 && errno == EACCES && (flags & FSUTIL_FTW_OVERRIDE_OPEN_ERROR)) {
-				(void) fchmodat(dirfd, d->d_name, 0700, 0);
-				childfd = openat(dirfd, d->d_name, O_RDONLY|O_NOCTTY|O_NONBLOCK|O_NOFOLLOW|O_DIRECTORY);
-			}
+			childfd = __fsutil_ftw_open_child(st->path, dirfd, d.d_name, flags);
 			if (childfd < 0) {
-				if (!(flags & FSUTIL_FTW_IGNORE_OPEN_ERROR)) {
-					log_error("can't open %s/%s: %m", dir_path, d->d_name);
+				if (!(flags & FSUTIL_FTW_IGNORE_OPEN_ERROR))
 					ok = false;
-				}
 				continue;
 			}
 
-			snprintf(child_path, sizeof(child_path), "%s/%s", dir_path, d->d_name);
+			if (path_len + name_len + 2 > sizeof(st->path)) {
+				log_error("%s/%s: path name too long", st->path, d.d_name);
+				close(childfd);
+				ok = false;
+				continue;
+			}
 
 			if (cb_pre) {
-				rv = callback(dir_path, dirfd, d, cbflags | FSUTIL_FTW_PRE_DESCENT, closure);
+				rv = callback(st->path, dirfd, &d, cbflags | FSUTIL_FTW_PRE_DESCENT, closure);
 				if (rv == FTW_ERROR || rv == FTW_ABORT)
 					ok = false;
 
-				if (rv != FTW_CONTINUE)
+				if (rv != FTW_CONTINUE) {
+					close(childfd);
 					continue;
+				}
 			}
 
 			/* Descend into the directory */
-			if (ok)
-				ok = __fsutil_ftw(child_path, childfd, child_stat, callback, closure, flags);
+			if (ok) {
+				st->path[path_len] = '/';
+				memcpy(st->path + path_len + 1, d.d_name, name_len + 1);
+
+				st->depth++;
+				ok = __fsutil_ftw(st, path_len + 1 + name_len, childfd, dev);
+				st->depth--;
+
+				st->path[path_len] = '\0';
+			}
 
 			if (cb_post) {
-				rv = callback(dir_path, dirfd, d, cbflags | FSUTIL_FTW_POST_DESCENT, closure);
+				rv = callback(st->path, dirfd, &d, cbflags | FSUTIL_FTW_POST_DESCENT, closure);
 				if (rv == FTW_ERROR || rv == FTW_ABORT)
 					ok = false;
 
@@ -713,12 +918,386 @@ __fsutil_ftw(const char *dir_path, int dirfd, struct stat *dir_stat, __fsutil_ft
 
 			close(childfd);
 		} else {
-			ok = callback(dir_path, dirfd, d, cbflags, closure);
+			ok = callback(st->path, dirfd, &d, cbflags, closure);
 		}
 	}
-	// __make_path_pop();
 
-	closedir(dir);
+	if (ok && errno) {
+		log_error("%s: cannot read directory: %m", st->path);
+		ok = false;
+	}
+
+	close(dirfd);
+	return ok;
+}
+
+/*
+ * Parallel walker.
+ *
+ * Every directory is a job. Each worker thread has a deque of jobs; it
+ * takes work from the tail of its own deque, and steals from the head of
+ * other workers' deques when it runs dry.
+ * The PRE_DESCENT callback for a directory is invoked before any of its
+ * descendants are visited, and the POST_DESCENT callback after all of them
+ * have been visited; apart from that, there is no ordering, and callbacks
+ * are invoked concurrently from several threads.
+ */
+#define FSUTIL_FTW_MAX_THREADS		16
+
+struct __fsutil_ftw_job {
+	struct __fsutil_ftw_job *parent;
+	char *			path;
+	int			fd;
+	bool			opened;
+
+	/* 1 while we're listing the directory, plus the number of
+	 * subdirectories still being processed */
+	int			pending;
+
+	struct dirent		d;	/* our entry in the parent dir */
+};
+
+struct __fsutil_ftw_worker {
+	struct __fsutil_ftw_parallel *walk;
+	unsigned int		index;
+	pthread_t		thread;
+
+	pthread_mutex_t		lock;
+	unsigned int		head, tail, size;
+	struct __fsutil_ftw_job **jobs;
+
+	struct __fsutil_dirbuf	dirbuf;
+};
+
+struct __fsutil_ftw_parallel {
+	unsigned int		nworkers;
+	struct __fsutil_ftw_worker *workers;
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	unsigned int		queued;
+	bool			done;
+	bool			failed;
+
+	dev_t			dev;
+	__fsutil_ftw_internal_cb_fn_t *callback;
+	void *			closure;
+	int			flags;
+};
+
+static void
+__fsutil_ftw_push(struct __fsutil_ftw_worker *w, struct __fsutil_ftw_job *job)
+{
+	struct __fsutil_ftw_parallel *walk = w->walk;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->tail >= w->size) {
+		if (w->head) {
+			memmove(w->jobs, w->jobs + w->head, (w->tail - w->head) * sizeof(w->jobs[0]));
+			w->tail -= w->head;
+			w->head = 0;
+		}
+		if (w->tail >= w->size) {
+			w->size = w->size? 2 * w->size : 256;
+			w->jobs = realloc(w->jobs, w->size * sizeof(w->jobs[0]));
+		}
+	}
+	w->jobs[w->tail++] = job;
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_mutex_lock(&walk->lock);
+	walk->queued++;
+	pthread_cond_signal(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+}
+
+static struct __fsutil_ftw_job *
+__fsutil_ftw_take(struct __fsutil_ftw_worker *w, bool steal)
+{
+	struct __fsutil_ftw_job *job = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->head < w->tail) {
+		if (steal)
+			job = w->jobs[w->head++];
+		else
+			job = w->jobs[--(w->tail)];
+		if (w->head == w->tail)
+			w->head = w->tail = 0;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return job;
+}
+
+static struct __fsutil_ftw_job *
+__fsutil_ftw_get_job(struct __fsutil_ftw_worker *w)
+{
+	struct __fsutil_ftw_parallel *walk = w->walk;
+	struct __fsutil_ftw_job *job;
+	unsigned int k;
+
+	while (true) {
+		job = __fsutil_ftw_take(w, false);
+		for (k = 1; job == NULL && k < walk->nworkers; ++k)
+			job = __fsutil_ftw_take(&walk->workers[(w->index + k) % walk->nworkers], true);
+
+		pthread_mutex_lock(&walk->lock);
+		if (job) {
+			walk->queued--;
+			pthread_mutex_unlock(&walk->lock);
+			return job;
+		}
+
+		while (walk->queued == 0 && !walk->done)
+			pthread_cond_wait(&walk->cond, &walk->lock);
+
+		if (walk->done) {
+			pthread_mutex_unlock(&walk->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&walk->lock);
+	}
+}
+
+static inline void
+__fsutil_ftw_fail(struct __fsutil_ftw_parallel *walk)
+{
+	__atomic_store_n(&walk->failed, true, __ATOMIC_RELAXED);
+}
+
+static inline bool
+__fsutil_ftw_failed(struct __fsutil_ftw_parallel *walk)
+{
+	return __atomic_load_n(&walk->failed, __ATOMIC_RELAXED);
+}
+
+/*
+ * Drop a reference to the job. When the last one goes away, the directory
+ * and all its descendants are done.
+ */
+static void
+__fsutil_ftw_release(struct __fsutil_ftw_parallel *walk, struct __fsutil_ftw_job *job)
+{
+	while (job && __atomic_sub_fetch(&job->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		struct __fsutil_ftw_job *parent = job->parent;
+
+		if (parent == NULL) {
+			pthread_mutex_lock(&walk->lock);
+			walk->done = true;
+			pthread_cond_broadcast(&walk->cond);
+			pthread_mutex_unlock(&walk->lock);
+		} else {
+			bool cb_post = walk->flags & (FSUTIL_FTW_DEPTH_FIRST | FSUTIL_FTW_PRE_POST_CALLBACK);
+
+			if (job->opened && cb_post && !__fsutil_ftw_failed(walk)) {
+				int rv = walk->callback(parent->path, parent->fd, &job->d, FSUTIL_FTW_POST_DESCENT, walk->closure);
+
+				if (rv == FTW_ERROR || rv == FTW_ABORT)
+					__fsutil_ftw_fail(walk);
+			}
+
+			if (job->fd >= 0)
+				close(job->fd);
+			free(job->path);
+			free(job);
+		}
+
+		job = parent;
+	}
+}
+
+static void
+__fsutil_ftw_process(struct __fsutil_ftw_worker *w, struct __fsutil_ftw_job *job)
+{
+	struct __fsutil_ftw_parallel *walk = w->walk;
+	int flags = walk->flags;
+	bool cb_pre = !(flags & FSUTIL_FTW_DEPTH_FIRST);
+	struct dirent d;
+	int rv;
+
+	if (__fsutil_ftw_failed(walk))
+		goto out;
+
+	if (job->fd < 0) {
+		job->fd = __fsutil_ftw_open_child(job->parent->path, job->parent->fd, job->d.d_name, flags);
+		if (job->fd < 0) {
+			if (!(flags & FSUTIL_FTW_IGNORE_OPEN_ERROR))
+				__fsutil_ftw_fail(walk);
+			goto out;
+		}
+	}
+	job->opened = true;
+
+	w->dirbuf.len = w->dirbuf.pos = 0;
+	while (!__fsutil_ftw_failed(walk) && __fsutil_readdir64(job->fd, &w->dirbuf, &d)) {
+		struct __fsutil_ftw_job *child;
+
+		if (d.d_type != DT_DIR) {
+			if (!walk->callback(job->path, job->fd, &d, 0, walk->closure))
+				__fsutil_ftw_fail(walk);
+			continue;
+		}
+
+		if ((rv = __fsutil_ftw_check_dev(job->path, job->fd, d.d_name, walk->dev, flags)) <= 0) {
+			if (rv < 0)
+				__fsutil_ftw_fail(walk);
+			continue;
+		}
+
+		if (cb_pre) {
+			rv = walk->callback(job->path, job->fd, &d, FSUTIL_FTW_PRE_DESCENT, walk->closure);
+			if (rv == FTW_ERROR || rv == FTW_ABORT)
+				__fsutil_ftw_fail(walk);
+			if (rv != FTW_CONTINUE)
+				continue;
+		}
+
+		child = calloc(1, sizeof(*child));
+		child->parent = job;
+		child->fd = -1;
+		child->pending = 1;
+		child->d = d;
+		if (asprintf(&child->path, "%s/%s", job->path, d.d_name) < 0)
+			log_fatal("%s: out of memory", __func__);
+
+		__atomic_add_fetch(&job->pending, 1, __ATOMIC_RELAXED);
+		__fsutil_ftw_push(w, child);
+	}
+
+	if (errno && !__fsutil_ftw_failed(walk)) {
+		log_error("%s: cannot read directory: %m", job->path);
+		__fsutil_ftw_fail(walk);
+	}
+
+out:
+	__fsutil_ftw_release(walk, job);
+}
+
+static void *
+__fsutil_ftw_worker_main(void *p)
+{
+	struct __fsutil_ftw_worker *w = p;
+	struct __fsutil_ftw_job *job;
+
+	while ((job = __fsutil_ftw_get_job(w)) != NULL)
+		__fsutil_ftw_process(w, job);
+
+	return NULL;
+}
+
+static unsigned int
+__fsutil_ftw_num_threads(void)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (ncpus < 1)
+		return 1;
+	if (ncpus > FSUTIL_FTW_MAX_THREADS)
+		return FSUTIL_FTW_MAX_THREADS;
+	return ncpus;
+}
+
+static bool
+__fsutil_ftw_parallel(const char *dir_path, int dirfd, dev_t dev, __fsutil_ftw_internal_cb_fn_t *callback, void *closure, int flags)
+{
+	struct __fsutil_ftw_parallel walk;
+	struct __fsutil_ftw_job *root;
+	unsigned int i, nstarted;
+
+	memset(&walk, 0, sizeof(walk));
+	walk.nworkers = __fsutil_ftw_num_threads();
+	walk.workers = calloc(walk.nworkers, sizeof(walk.workers[0]));
+	walk.dev = dev;
+	walk.callback = callback;
+	walk.closure = closure;
+	walk.flags = flags;
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+
+	for (i = 0; i < walk.nworkers; ++i) {
+		walk.workers[i].walk = &walk;
+		walk.workers[i].index = i;
+		pthread_mutex_init(&walk.workers[i].lock, NULL);
+	}
+
+	root = calloc(1, sizeof(*root));
+	root->path = strdup(dir_path);
+	root->fd = dirfd;
+	root->pending = 1;
+	__fsutil_ftw_push(&walk.workers[0], root);
+
+	/* The calling thread is worker 0 */
+	for (nstarted = 1; nstarted < walk.nworkers; ++nstarted) {
+		struct __fsutil_ftw_worker *w = &walk.workers[nstarted];
+
+		if (pthread_create(&w->thread, NULL, __fsutil_ftw_worker_main, w) != 0)
+			break;
+	}
+
+	trace3("%s(%s): using %u threads", __func__, dir_path, nstarted);
+	__fsutil_ftw_worker_main(&walk.workers[0]);
+
+	for (i = 1; i < nstarted; ++i)
+		pthread_join(walk.workers[i].thread, NULL);
+
+	/* The root's fd belongs to our caller */
+	free(root->path);
+	free(root);
+
+	for (i = 0; i < walk.nworkers; ++i) {
+		struct __fsutil_ftw_worker *w = &walk.workers[i];
+
+		pthread_mutex_destroy(&w->lock);
+		free(w->jobs);
+		free(w->dirbuf.data);
+	}
+	free(walk.workers);
+	pthread_mutex_destroy(&walk.lock);
+	pthread_cond_destroy(&walk.cond);
+
+	return !walk.failed;
+}
+
+/*
+ * Walk the directory hierarchy below dirfd. The fd remains owned by
+ * the caller.
+ */
+static bool
+__fsutil_ftw_fd(const char *dir_path, int dirfd, struct stat *dir_stat, __fsutil_ftw_internal_cb_fn_t *callback, void *closure, int flags)
+{
+	struct __fsutil_ftw_state *st;
+	dev_t dev = dir_stat? dir_stat->st_dev : 0;
+	unsigned int i;
+	bool ok;
+	int fd;
+
+	if ((flags & FSUTIL_FTW_PARALLEL) && __fsutil_ftw_num_threads() > 1)
+		return __fsutil_ftw_parallel(dir_path, dirfd, dev, callback, closure, flags);
+
+	if (strlen(dir_path) >= PATH_MAX) {
+		log_error("%s: path name too long", dir_path);
+		return false;
+	}
+
+	/* __fsutil_ftw consumes the fd */
+	if ((fd = dup(dirfd)) < 0) {
+		log_error("cannot dup directory fd: %m");
+		return false;
+	}
+
+	st = calloc(1, sizeof(*st));
+	strcpy(st->path, dir_path);
+	st->callback = callback;
+	st->closure = closure;
+	st->flags = flags;
+
+	ok = __fsutil_ftw(st, strlen(dir_path), fd, dev);
+
+	for (i = 0; i < st->nbufs; ++i)
+		free(st->bufs[i].data);
+	free(st->bufs);
+	free(st);
+
 	return ok;
 }
 
@@ -766,7 +1345,7 @@ fsutil_ftw(const char *dir_path, fsutil_ftw_cb_fn_t *callback, void *closure, in
 	ctx.user_callback = callback;
 	ctx.user_closure = closure;
 
-	ok = __fsutil_ftw(dir_path, dirfd, dir_stat, __fsutil_ftw_callback, &ctx, flags);
+	ok = __fsutil_ftw_fd(dir_path, dirfd, dir_stat, __fsutil_ftw_callback, &ctx, flags);
 
 out:
 	close(dirfd);
@@ -823,8 +1402,9 @@ fsutil_remove_recursively(const char *dir_path)
 		return false;
 	}
 
-	ok = __fsutil_ftw(dir_path, dirfd, &stb, __fsutil_remove_callback, NULL,
-			FSUTIL_FTW_ONE_FILESYSTEM | FSUTIL_FTW_DEPTH_FIRST | FSUTIL_FTW_OVERRIDE_OPEN_ERROR);
+	ok = __fsutil_ftw_fd(dir_path, dirfd, &stb, __fsutil_remove_callback, NULL,
+			FSUTIL_FTW_ONE_FILESYSTEM | FSUTIL_FTW_DEPTH_FIRST | FSUTIL_FTW_OVERRIDE_OPEN_ERROR |
+			FSUTIL_FTW_PARALLEL);
 
 	close(dirfd);
 
@@ -836,13 +1416,202 @@ fsutil_remove_recursively(const char *dir_path)
 	return ok;
 }
 
-bool
-fsutil_create_empty(const char *path)
+/*
+ * Deferred removal of directory trees.
+ * Callers move things to a trash directory, which is a cheap rename(2),
+ * and later have a child process remove the whole lot while they go on
+ * with their business. The trash lives in the parent directory of the
+ * path given to fsutil_trash_init, so that it is usually on the same
+ * file system as the things being thrown away. When renaming is not
+ * possible (cross-device, busy mount points), we remove synchronously.
+ *
+ * We use a process rather than threads because the caller may want to
+ * create a user namespace later, which is not permitted to multithreaded
+ * processes.
+ */
+void
+fsutil_trash_init(struct fsutil_trash *trash, const char *near_path)
 {
-	int fd;
+	memset(trash, 0, sizeof(*trash));
+	trash->parent = strdup(pathutil_dirname(near_path));
+}
 
-	if ((fd = open(path, O_WRONLY|O_CREAT, 0644)) < 0)
-		return false;
+static const char *
+__fsutil_trash_path(struct fsutil_trash *trash)
+{
+	if (trash->path == NULL) {
+		char dirtemplate[PATH_MAX];
+
+		snprintf(dirtemplate, sizeof(dirtemplate), "%s/.wormhole-trash.XXXXXX", trash->parent);
+		if (mkdtemp(dirtemplate) == NULL) {
+			trace("Unable to create trash directory in %s: %m", trash->parent);
+			return NULL;
+		}
+
+		trash->path = strdup(dirtemplate);
+		trash->count = 0;
+	}
+
+	return trash->path;
+}
+
+bool
+fsutil_trash_add(struct fsutil_trash *trash, const char *path)
+{
+	char namebuf[PATH_MAX];
+	const char *trash_path;
+	struct stat stb;
+
+	if (lstat(path, &stb) < 0) {
+		if (errno == ENOENT)
+			return true;
+		log_error("%s: cannot stat %s: %m", __func__, path);
+		return false;
+	}
+
+	if ((trash_path = __fsutil_trash_path(trash)) != NULL) {
+		snprintf(namebuf, sizeof(namebuf), "%s/%u", trash_path, trash->count);
+		if (rename(path, namebuf) == 0) {
+			trace2("Moved %s to %s", path, namebuf);
+			trash->count++;
+			return true;
+		}
+
+		trace2("Cannot move %s to trash (%m), removing it right away", path);
+	}
+
+	return fsutil_remove_recursively(path);
+}
+
+bool
+fsutil_trash_empty(struct fsutil_trash *trash)
+{
+	bool ok = true;
+	pid_t pid;
+
+	if (trash->path == NULL)
+		return true;
+
+	/* Don't let several removal processes pile up */
+	if (!fsutil_trash_wait(trash))
+		ok = false;
+
+	if (trash->count == 0) {
+		if (rmdir(trash->path) < 0) {
+			log_error("Cannot remove %s: %m", trash->path);
+			ok = false;
+		}
+	} else if ((pid = fork()) < 0) {
+		log_error("%s: fork failed: %m", __func__);
+		if (!fsutil_remove_recursively(trash->path))
+			ok = false;
+	} else if (pid == 0) {
+		_exit(fsutil_remove_recursively(trash->path)? 0 : 1);
+	} else {
+		trace2("Removing %s in process %d", trash->path, pid);
+		trash->pid = pid;
+	}
+
+	free(trash->path);
+	trash->path = NULL;
+	trash->count = 0;
+	return ok;
+}
+
+bool
+fsutil_trash_wait(struct fsutil_trash *trash)
+{
+	int status;
+
+	if (trash->pid == 0)
+		return true;
+
+	while (waitpid(trash->pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			log_error("%s: wait failed: %m", __func__);
+			trash->pid = 0;
+			return false;
+		}
+	}
+
+	trash->pid = 0;
+	if (!procutil_child_status_okay(status)) {
+		log_error("Background removal of trash in %s %s", trash->parent,
+				procutil_child_status_describe(status));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Removals still running after their trash object was destroyed
+ */
+struct fsutil_trash_pending {
+	struct fsutil_trash_pending *next;
+	char *		parent;
+	pid_t		pid;
+};
+
+static struct fsutil_trash_pending *fsutil_trash_pending;
+
+/*
+ * Empty the trash, but do not wait for the removal to complete.
+ * We remember the child process, so that fsutil_trash_reap() can
+ * collect it later.
+ */
+void
+fsutil_trash_destroy(struct fsutil_trash *trash)
+{
+	(void) fsutil_trash_empty(trash);
+
+	if (trash->pid) {
+		struct fsutil_trash_pending *p;
+
+		p = calloc(1, sizeof(*p));
+		p->pid = trash->pid;
+		p->parent = trash->parent;
+		trash->parent = NULL;
+
+		p->next = fsutil_trash_pending;
+		fsutil_trash_pending = p;
+	}
+
+	free(trash->parent);
+	memset(trash, 0, sizeof(*trash));
+}
+
+/*
+ * Wait for all removals started by fsutil_trash_destroy(). Returns false
+ * if any of them failed.
+ */
+bool
+fsutil_trash_reap(void)
+{
+	struct fsutil_trash_pending *p;
+	bool ok = true;
+
+	while ((p = fsutil_trash_pending) != NULL) {
+		struct fsutil_trash trash = { .parent = p->parent, .pid = p->pid };
+
+		fsutil_trash_pending = p->next;
+		if (!fsutil_trash_wait(&trash))
+			ok = false;
+
+		free(p->parent);
+		free(p);
+	}
+
+	return ok;
+}
+
+bool
+fsutil_create_empty(const char *path)
+{
+	int fd;
+
+	if ((fd = open(path, O_WRONLY|O_CREAT, 0644)) < 0)
+		return false;
 	close(fd);
 	return true;
 }
@@ -1004,6 +1773,330 @@ fsutil_lazy_umount(const char *path)
 	return true;
 }
 
+/*
+ * The new mount API (open_tree, fsopen, move_mount and friends) lets us
+ * assemble a tree of mounts that is not attached anywhere yet. Mounting
+ * things there does not cause any propagation, and the whole tree can be
+ * attached with a single move_mount() at the end.
+ *
+ * Older C libraries do not provide wrappers for these calls, so we go
+ * through syscall().
+ */
+#ifndef FSOPEN_CLOEXEC
+# define FSOPEN_CLOEXEC			0x00000001
+# define FSMOUNT_CLOEXEC		0x00000001
+# define OPEN_TREE_CLONE		1
+# define OPEN_TREE_CLOEXEC		O_CLOEXEC
+# define MOVE_MOUNT_F_EMPTY_PATH	0x00000004
+# define MOVE_MOUNT_T_EMPTY_PATH	0x00000040
+# define MOUNT_ATTR_RDONLY		0x00000001
+# define MOUNT_ATTR_NOATIME		0x00000010
+# define FSCONFIG_SET_FLAG		0
+# define FSCONFIG_SET_STRING		1
+# define FSCONFIG_CMD_CREATE		6
+#endif
+
+#ifndef AT_RECURSIVE
+# define AT_RECURSIVE			0x8000
+#endif
+
+#ifndef SYS_open_tree
+# define SYS_open_tree			428
+# define SYS_move_mount			429
+# define SYS_fsopen			430
+# define SYS_fsconfig			431
+# define SYS_fsmount			432
+#endif
+
+static const char *
+__fsutil_mount_tree_relative(const char *path)
+{
+	while (*path == '/')
+		++path;
+	return path;
+}
+
+/*
+ * Attach a detached mount to a path inside a detached tree.
+ * This consumes the mount fd.
+ */
+static bool
+__fsutil_mount_tree_attach(int tree_fd, int mnt_fd, const char *target)
+{
+	const char *rel_path = __fsutil_mount_tree_relative(target);
+	unsigned int flags = MOVE_MOUNT_F_EMPTY_PATH;
+	int r;
+
+	if (*rel_path == '\0')
+		flags |= MOVE_MOUNT_T_EMPTY_PATH;
+
+	r = syscall(SYS_move_mount, mnt_fd, "", tree_fd, rel_path, flags);
+	close(mnt_fd);
+
+	if (r < 0) {
+		log_error("Unable to attach mount at %s: %m", target);
+		return false;
+	}
+
+	return true;
+}
+
+static int
+__fsutil_fsopen(const char *fstype, const char *source)
+{
+	int fd;
+
+	if ((fd = syscall(SYS_fsopen, fstype, FSOPEN_CLOEXEC)) < 0) {
+		log_error("fsopen(%s): %m", fstype);
+		return -1;
+	}
+
+	if (source && syscall(SYS_fsconfig, fd, FSCONFIG_SET_STRING, "source", source, 0) < 0) {
+		log_error("%s: unable to set source: %m", fstype);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static bool
+__fsutil_fsconfig_string(int fs_fd, const char *fstype, const char *key, const char *value)
+{
+	int r;
+
+	if (value == NULL)
+		r = syscall(SYS_fsconfig, fs_fd, FSCONFIG_SET_FLAG, key, NULL, 0);
+	else
+		r = syscall(SYS_fsconfig, fs_fd, FSCONFIG_SET_STRING, key, value, 0);
+
+	if (r < 0) {
+		log_error("%s: unable to set option %s: %m", fstype, key);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Create the file system and return a detached mount for it.
+ * This consumes the fs fd.
+ */
+static int
+__fsutil_fsmount(int fs_fd, const char *fstype, unsigned int attrs)
+{
+	int mnt_fd = -1;
+
+	if (syscall(SYS_fsconfig, fs_fd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) < 0)
+		log_error("Unable to create %s file system: %m", fstype);
+	else if ((mnt_fd = syscall(SYS_fsmount, fs_fd, FSMOUNT_CLOEXEC, attrs)) < 0)
+		log_error("Unable to mount %s file system: %m", fstype);
+
+	close(fs_fd);
+	return mnt_fd;
+}
+
+/*
+ * Check whether the kernel supports what we need. Apart from the system
+ * calls themselves, we need to be able to mount on a detached tree, which
+ * only works with more recent kernels.
+ */
+bool
+fsutil_mount_tree_supported(void)
+{
+	static int supported = -1;
+	int tree_fd, fs_fd, mnt_fd;
+
+	if (supported >= 0)
+		return supported;
+
+	supported = false;
+	if ((tree_fd = syscall(SYS_open_tree, AT_FDCWD, "/", OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC)) < 0) {
+		trace("open_tree not supported: %m");
+		return false;
+	}
+
+	if ((fs_fd = syscall(SYS_fsopen, "tmpfs", FSOPEN_CLOEXEC)) >= 0) {
+		if (syscall(SYS_fsconfig, fs_fd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) >= 0
+		 && (mnt_fd = syscall(SYS_fsmount, fs_fd, FSMOUNT_CLOEXEC, 0)) >= 0) {
+			if (syscall(SYS_move_mount, mnt_fd, "", tree_fd, "",
+						MOVE_MOUNT_F_EMPTY_PATH | MOVE_MOUNT_T_EMPTY_PATH) >= 0)
+				supported = true;
+			else
+				trace("Cannot mount on detached trees: %m");
+			close(mnt_fd);
+		}
+		close(fs_fd);
+	}
+
+	close(tree_fd);
+	return supported;
+}
+
+/*
+ * Create a detached copy of the mount tree at path
+ */
+int
+fsutil_mount_tree_clone(const char *path)
+{
+	int fd;
+
+	fd = syscall(SYS_open_tree, AT_FDCWD, path, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE);
+	if (fd < 0)
+		log_error("Unable to clone mount tree at %s: %m", path);
+	return fd;
+}
+
+/*
+ * Return a path name through which we can access path inside a
+ * detached tree. Returns a static buffer.
+ */
+const char *
+fsutil_mount_tree_path(int tree_fd, const char *path)
+{
+	static char pathbuf[PATH_MAX];
+
+	snprintf(pathbuf, sizeof(pathbuf), "/proc/self/fd/%d/%s", tree_fd,
+			__fsutil_mount_tree_relative(path));
+	return pathbuf;
+}
+
+/*
+ * Attach the detached tree on top of target. This consumes the tree fd.
+ */
+bool
+fsutil_mount_tree_attach(int tree_fd, const char *target)
+{
+	if (syscall(SYS_move_mount, tree_fd, "", AT_FDCWD, target, MOVE_MOUNT_F_EMPTY_PATH) < 0) {
+		log_error("Unable to attach mount tree at %s: %m", target);
+		close(tree_fd);
+		return false;
+	}
+
+	close(tree_fd);
+	return true;
+}
+
+bool
+fsutil_mount_tree_bind(int tree_fd, const char *source, const char *target)
+{
+	int mnt_fd;
+
+	mnt_fd = syscall(SYS_open_tree, AT_FDCWD, source, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE);
+	if (mnt_fd < 0) {
+		log_error("Unable to clone %s: %m", source);
+		return false;
+	}
+
+	if (!__fsutil_mount_tree_attach(tree_fd, mnt_fd, target))
+		return false;
+
+	trace2("bind mounted %s to %s", source, target);
+	return true;
+}
+
+/*
+ * Note, the lower and upper directories must be given as path names
+ * that are accessible from here; for things inside the tree, use
+ * fsutil_mount_tree_path().
+ */
+bool
+fsutil_mount_tree_overlay(int tree_fd, const char *lowerdir, const char *upperdir, const char *workdir, const char *target)
+{
+	unsigned int attrs = MOUNT_ATTR_NOATIME;
+	int fs_fd, mnt_fd;
+
+	if ((fs_fd = __fsutil_fsopen("overlay", "wormhole")) < 0)
+		return false;
+
+	if (!__fsutil_fsconfig_string(fs_fd, "overlay", "lowerdir", lowerdir))
+		goto failed;
+
+	if (upperdir == NULL) {
+		attrs |= MOUNT_ATTR_RDONLY;
+	} else {
+		if (!__fsutil_fsconfig_string(fs_fd, "overlay", "upperdir", upperdir)
+		 || !__fsutil_fsconfig_string(fs_fd, "overlay", "workdir", workdir))
+			goto failed;
+	}
+
+	if ((mnt_fd = __fsutil_fsmount(fs_fd, "overlay", attrs)) < 0)
+		return false;
+
+	if (!__fsutil_mount_tree_attach(tree_fd, mnt_fd, target))
+		return false;
+
+	trace2("mounted overlay of %s and %s to %s", lowerdir, upperdir, target);
+	return true;
+
+failed:
+	close(fs_fd);
+	return false;
+}
+
+/*
+ * Create a detached file system. The options string is a comma separated
+ * list of key=value or key items, as for mount(2).
+ * Returns the mount fd.
+ */
+static int
+__fsutil_mount_detached_fs(const char *fstype, const char *options)
+{
+	char *copy = NULL, *opt, *next;
+	int fs_fd;
+
+	if ((fs_fd = __fsutil_fsopen(fstype, fstype)) < 0)
+		return -1;
+
+	if (options)
+		copy = strdup(options);
+
+	for (opt = copy; opt && *opt; opt = next) {
+		char *value;
+
+		if ((next = strchr(opt, ',')) != NULL)
+			*next++ = '\0';
+
+		if ((value = strchr(opt, '=')) != NULL)
+			*value++ = '\0';
+
+		if (!__fsutil_fsconfig_string(fs_fd, fstype, opt, value)) {
+			close(fs_fd);
+			free(copy);
+			return -1;
+		}
+	}
+
+	free(copy);
+	return __fsutil_fsmount(fs_fd, fstype, 0);
+}
+
+bool
+fsutil_mount_tree_virtual_fs(int tree_fd, const char *where, const char *fstype, const char *options)
+{
+	int mnt_fd;
+
+	trace("Mounting %s at %s\n", fstype, where);
+	if ((mnt_fd = __fsutil_mount_detached_fs(fstype, options)) < 0)
+		return false;
+
+	if (!__fsutil_mount_tree_attach(tree_fd, mnt_fd, where))
+		return false;
+
+	trace2("mounted %s to %s", fstype, where);
+	return true;
+}
+
+/*
+ * Create a tmpfs that is not attached anywhere. Its contents can be
+ * accessed via fsutil_mount_tree_path().
+ */
+int
+fsutil_mount_detached_tmpfs(void)
+{
+	return __fsutil_mount_detached_fs("tmpfs", "mode=0755");
+}
+
 bool
 fsutil_make_fs_private(const char *dir)
 {
@@ -1083,3 +2176,46 @@ strutil_array_destroy(struct strutil_array *array)
 
 	memset(array, 0, sizeof(*array));
 }
+
+/*
+ * Time keeping
+ */
+unsigned long long
+timeutil_monotonic_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static const unsigned long long	timeutil_histogram_limits[TIMEUTIL_HISTOGRAM_BUCKETS - 1] = {
+	100, 1000, 10000, 100000, 1000000, 10000000,
+};
+
+static const char *		timeutil_histogram_names[TIMEUTIL_HISTOGRAM_BUCKETS] = {
+	"le_100us", "le_1ms", "le_10ms", "le_100ms", "le_1s", "le_10s", "inf",
+};
+
+void
+timeutil_histogram_add(struct timeutil_histogram *h, unsigned long long usec)
+{
+	unsigned int i;
+
+	for (i = 0; i < TIMEUTIL_HISTOGRAM_BUCKETS - 1; ++i) {
+		if (usec <= timeutil_histogram_limits[i])
+			break;
+	}
+
+	h->bucket[i]++;
+	h->count++;
+	h->sum_usec += usec;
+}
+
+const char *
+timeutil_histogram_bucket_name(unsigned int index)
+{
+	if (index >= TIMEUTIL_HISTOGRAM_BUCKETS)
+		return NULL;
+	return timeutil_histogram_names[index];
+}
@@ -30,6 +30,17 @@ struct fsutil_tempdir {
 	bool		mounted;
 };
 
+/*
+ * A trash directory is a place next to some path where we can
+ * rename things to, and have them removed in the background.
+ */
+struct fsutil_trash {
+	char *		parent;
+	char *		path;
+	unsigned int	count;
+	pid_t		pid;
+};
+
 extern const char *		pathutil_const_basename(const char *path);
 extern const char *		pathutil_dirname(const char *path);
 
@@ -42,6 +53,7 @@ struct procutil_command {
 extern const char *		procutil_concat_argv(int argc, char **argv);
 extern char *			procutil_command_path(const char *argv0);
 extern pid_t			procutil_fork_with_socket(int *fdp);
+extern void			procutil_close_fds_except(int keep_fd);
 extern void			procutil_install_sigchild_handler(void);
 extern pid_t			procutil_get_exited_child(int *status);
 extern bool			procutil_child_status_okay(int status);
@@ -53,6 +65,8 @@ extern bool			procutil_command_exec(struct procutil_command *cmd, const char *ar
 
 extern bool			wormhole_create_namespace(void);
 extern bool			wormhole_create_user_namespace(void);
+extern bool			wormhole_enter_namespace(int nsfd);
+extern bool			procutil_drop_privileges(uid_t uid, gid_t gid);
 
 extern void			fsutil_tempdir_init(struct fsutil_tempdir *td);
 extern char *			fsutil_tempdir_path(struct fsutil_tempdir *td);
@@ -70,12 +84,22 @@ extern bool			fsutil_exists_nofollow(const char *path);
 extern bool			fsutil_is_executable(const char *path);
 extern bool			fsutil_remove_recursively(const char *dir_path);
 
+extern void			fsutil_trash_init(struct fsutil_trash *trash, const char *near_path);
+extern bool			fsutil_trash_add(struct fsutil_trash *trash, const char *path);
+extern bool			fsutil_trash_empty(struct fsutil_trash *trash);
+extern bool			fsutil_trash_wait(struct fsutil_trash *trash);
+extern void			fsutil_trash_destroy(struct fsutil_trash *trash);
+extern bool			fsutil_trash_reap(void);
+
 /* ftw input flags */
 #define FSUTIL_FTW_IGNORE_OPEN_ERROR	0x0001
 #define FSUTIL_FTW_DEPTH_FIRST		0x0002
 #define FSUTIL_FTW_PRE_POST_CALLBACK	0x0004
 #define FSUTIL_FTW_ONE_FILESYSTEM	0x0008
 #define FSUTIL_FTW_OVERRIDE_OPEN_ERROR	0x0010
+/* Walk the tree with several threads. The callback must be thread safe, and
+ * apart from PRE_DESCENT and POST_DESCENT, there's no particular ordering. */
+#define FSUTIL_FTW_PARALLEL		0x0040
 
 /* ftw callback flags */
 #define FSUTIL_FTW_PRE_DESCENT		0x0010
@@ -102,6 +126,20 @@ extern bool			fsutil_mount_virtual_fs(const char *where,
 					const char *fstype,
 					const char *options);
 extern bool			fsutil_lazy_umount(const char *path);
+extern bool			fsutil_mount_tree_supported(void);
+extern int			fsutil_mount_tree_clone(const char *path);
+extern const char *		fsutil_mount_tree_path(int tree_fd, const char *path);
+extern bool			fsutil_mount_tree_attach(int tree_fd, const char *target);
+extern bool			fsutil_mount_tree_bind(int tree_fd, const char *source,
+					const char *target);
+extern bool			fsutil_mount_tree_overlay(int tree_fd, const char *lowerdir,
+					const char *upperdir,
+					const char *workdir,
+					const char *target);
+extern bool			fsutil_mount_tree_virtual_fs(int tree_fd, const char *where,
+					const char *fstype,
+					const char *options);
+extern int			fsutil_mount_detached_tmpfs(void);
 extern bool			fsutil_make_fs_private(const char *dir);
 extern bool			fsutil_same_file(const char *path1, const char *path2);
 
@@ -128,4 +166,20 @@ enum {
 
 extern int			fsutil_inode_compare(const char *path1, const char *path2);
 
+/*
+ * Latency histogram with logarithmic buckets: <= 100us, 1ms, 10ms, 100ms,
+ * 1s, 10s, and everything above.
+ */
+#define TIMEUTIL_HISTOGRAM_BUCKETS	7
+
+struct timeutil_histogram {
+	unsigned int		count;
+	unsigned long long	sum_usec;
+	unsigned int		bucket[TIMEUTIL_HISTOGRAM_BUCKETS];
+};
+
+extern unsigned long long	timeutil_monotonic_usec(void);
+extern void			timeutil_histogram_add(struct timeutil_histogram *, unsigned long long usec);
+extern const char *		timeutil_histogram_bucket_name(unsigned int index);
+
 #endif // _WORMHOLE_UTIL_H
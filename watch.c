@@ -0,0 +1,288 @@
+/*
+ * wormhole - watch config files and directories for changes
+ *
+ *   Copyright (C) 2020-2021 Olaf Kirch <okir@suse.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "watch.h"
+#include "socket.h"
+#include "tracing.h"
+#include "util.h"
+
+/*
+ * The daemon uses inotify to find out when config files or the registry
+ * directories change, rather than checking each of them on every request.
+ *
+ * Files are usually replaced by renaming a new copy over them, which an
+ * inotify watch on the file itself would not survive. So for files, we
+ * watch the parent directory and look at the names reported.
+ *
+ * As long as the watch socket is active, wormhole_watch_enabled() returns
+ * true, and callers may trust their cached data until they're told
+ * otherwise.
+ */
+#define WORMHOLE_WATCH_EVENTS	(IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_ATTRIB | \
+				 IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct wormhole_watch {
+	struct wormhole_watch *	next;
+
+	int			wd;
+	char *			path;
+
+	/* For files, the name within the watched directory. NULL if
+	 * we're interested in anything that happens in the directory. */
+	char *			name;
+
+	bool			pending;
+	bool			dead;
+	wormhole_watch_fn_t *	fn;
+	void *			closure;
+};
+
+static wormhole_socket_t *	wormhole_watch_sock;
+static struct wormhole_watch *	wormhole_watches;
+static unsigned int		wormhole_watch_changes;
+
+bool
+wormhole_watch_enabled(void)
+{
+	return wormhole_watch_sock != NULL;
+}
+
+/*
+ * This changes whenever we report a change to anyone. Callers can use it
+ * to tell whether anything they derived from watched files may be stale.
+ */
+unsigned int
+wormhole_watch_generation(void)
+{
+	return wormhole_watch_changes;
+}
+
+bool
+wormhole_watch_path(const char *path, wormhole_watch_fn_t *fn, void *closure)
+{
+	struct wormhole_watch *w;
+	const char *dir_path, *name = NULL;
+	struct stat stb;
+	int wd;
+
+	if (wormhole_watch_sock == NULL)
+		return false;
+
+	for (w = wormhole_watches; w; w = w->next) {
+		if (w->fn == fn && w->closure == closure && strutil_equal(w->path, path))
+			return true;
+	}
+
+	if (stat(path, &stb) == 0 && S_ISDIR(stb.st_mode)) {
+		dir_path = path;
+	} else {
+		dir_path = pathutil_dirname(path);
+		name = pathutil_const_basename(path);
+	}
+
+	if ((wd = inotify_add_watch(wormhole_watch_sock->fd, dir_path, WORMHOLE_WATCH_EVENTS)) < 0) {
+		log_error("Unable to watch %s: %m", dir_path);
+		return false;
+	}
+
+	trace("Watching %s", path);
+
+	w = calloc(1, sizeof(*w));
+	w->wd = wd;
+	w->path = strdup(path);
+	if (name)
+		w->name = strdup(name);
+	w->fn = fn;
+	w->closure = closure;
+
+	w->next = wormhole_watches;
+	wormhole_watches = w;
+	return true;
+}
+
+/*
+ * Free a watch that has been unlinked from the list already. Watches on
+ * the same directory share one inotify watch descriptor; we remove it
+ * once the last of them is gone (unless the kernel dropped it already).
+ */
+static void
+wormhole_watch_free(struct wormhole_watch *w)
+{
+	struct wormhole_watch *other;
+
+	for (other = wormhole_watches; other; other = other->next) {
+		if (other->wd == w->wd && !other->dead)
+			break;
+	}
+
+	if (other == NULL && !w->dead && wormhole_watch_sock != NULL) {
+		trace("No longer watching %s", w->path);
+		inotify_rm_watch(wormhole_watch_sock->fd, w->wd);
+	}
+
+	free(w->path);
+	free(w->name);
+	free(w);
+}
+
+/*
+ * Stop watching on behalf of this caller
+ */
+void
+wormhole_watch_cancel(wormhole_watch_fn_t *fn, void *closure)
+{
+	struct wormhole_watch **pos, *w;
+
+	for (pos = &wormhole_watches; (w = *pos) != NULL; ) {
+		if (w->fn == fn && w->closure == closure) {
+			*pos = w->next;
+			wormhole_watch_free(w);
+		} else {
+			pos = &w->next;
+		}
+	}
+}
+
+static void
+wormhole_watch_mark(const struct inotify_event *ev)
+{
+	struct wormhole_watch *w;
+
+	for (w = wormhole_watches; w; w = w->next) {
+		if (ev->mask & IN_Q_OVERFLOW) {
+			/* We lost events; assume everything changed */
+			w->pending = true;
+		} else if (w->wd == ev->wd) {
+			if (w->name == NULL || (ev->len && !strcmp(w->name, ev->name))
+			 || (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)))
+				w->pending = true;
+
+			/* The kernel dropped this watch (eg because the directory
+			 * was removed). Tell the owner one last time, and forget
+			 * about it. It's up to the owner to add a new watch. */
+			if (ev->mask & IN_IGNORED)
+				w->dead = true;
+		}
+	}
+}
+
+static void
+wormhole_watch_dispatch(void)
+{
+	struct wormhole_watch **pos, *w;
+
+	/* A callback may add or cancel watches, so start over after each call */
+again:
+	for (pos = &wormhole_watches; (w = *pos) != NULL; pos = &w->next) {
+		if (!w->pending)
+			continue;
+
+		w->pending = false;
+		wormhole_watch_changes++;
+		trace("%s changed", w->path);
+
+		if (!w->dead) {
+			w->fn(w->path, w->closure);
+		} else {
+			*pos = w->next;
+			w->fn(w->path, w->closure);
+			wormhole_watch_free(w);
+		}
+		goto again;
+	}
+}
+
+static bool
+__wormhole_watch_poll(wormhole_socket_t *s, struct pollfd *pfd)
+{
+	pfd->events = POLLIN;
+	return true;
+}
+
+static bool
+__wormhole_watch_process(wormhole_socket_t *s, struct pollfd *pfd)
+{
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+
+	if (!(pfd->revents & POLLIN))
+		return true;
+
+	while ((n = read(s->fd, buffer, sizeof(buffer))) > 0) {
+		char *pos = buffer, *end = buffer + n;
+
+		while (pos < end) {
+			const struct inotify_event *ev = (const struct inotify_event *) pos;
+
+			wormhole_watch_mark(ev);
+			pos += sizeof(*ev) + ev->len;
+		}
+	}
+
+	if (n < 0 && errno != EAGAIN && errno != EINTR) {
+		log_error("inotify: %m");
+		wormhole_watch_sock = NULL;
+		return false;
+	}
+
+	/* Handle all events we received in one batch, so that a flurry of
+	 * changes (like a package update) results in a single reload each. */
+	wormhole_watch_dispatch();
+	return true;
+}
+
+static struct wormhole_socket_ops __wormhole_watch_ops = {
+	.poll		= __wormhole_watch_poll,
+	.process	= __wormhole_watch_process,
+};
+
+/*
+ * Set up the inotify fd. The caller is expected to install the socket
+ * returned in its event loop.
+ */
+wormhole_socket_t *
+wormhole_watch_init(void)
+{
+	int fd;
+
+	if (wormhole_watch_sock != NULL)
+		return wormhole_watch_sock;
+
+	if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		log_error("Unable to create inotify fd: %m");
+		return NULL;
+	}
+
+	if (!(wormhole_watch_sock = wormhole_socket_new(&__wormhole_watch_ops, fd, 0, 0))) {
+		close(fd);
+		return NULL;
+	}
+
+	return wormhole_watch_sock;
+}
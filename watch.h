@@ -0,0 +1,36 @@
+/*
+ * wormhole - watch config files and directories for changes
+ *
+ *   Copyright (C) 2020-2021 Olaf Kirch <okir@suse.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _WORMHOLE_WATCH_H
+#define _WORMHOLE_WATCH_H
+
+#include <stdbool.h>
+
+struct wormhole_socket;
+
+typedef void		wormhole_watch_fn_t(const char *path, void *closure);
+
+extern struct wormhole_socket *	wormhole_watch_init(void);
+extern bool			wormhole_watch_enabled(void);
+extern bool			wormhole_watch_path(const char *path, wormhole_watch_fn_t *fn, void *closure);
+extern void			wormhole_watch_cancel(wormhole_watch_fn_t *fn, void *closure);
+extern unsigned int		wormhole_watch_generation(void);
+
+#endif // _WORMHOLE_WATCH_H
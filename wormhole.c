@@ -25,44 +25,130 @@
 #include <sched.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <limits.h>
 
 #include "wormhole.h"
+#include "protocol.h"
 #include "profiles.h"
 #include "config.h"
 #include "util.h"
 #include "tracing.h"
 
-static wormhole_profile_t *	find_profile(const char *argv0);
+static wormhole_profile_t *	find_profile(const char *command_name);
 static void			run_command(wormhole_profile_t *profile, int argc, char **argv);
+static int			run_command_via_daemon(const char *command_name, int argc, char **argv);
 
 int
 main(int argc, char **argv)
 {
 	wormhole_profile_t *profile;
+	char *command_name;
 
 	/* Someone trying to invoke us without argv0 doesn't deserve
 	 * an error message. */
 	if (argc == 0)
 		return 2;
 
+	tracing_events_init();
+
+	command_name = procutil_command_path(argv[0]);
+	if (command_name == NULL)
+		log_fatal("Cannot determine command name from argv[0] (%s)", argv[0]);
+
+	/* Load the config before anything else, so that debug settings
+	 * apply to talking to the daemon, too. */
 	wormhole_common_load_config(NULL);
 
-	profile = find_profile(argv[0]);
+	/* Try the daemon first; it may have the environment set up already.
+	 * We fall back to setting things up ourselves if the daemon is
+	 * not running, or if the profile comes from a config file the daemon
+	 * does not read (such as ~/.wormhole). If the daemon knows the profile
+	 * and says no, we do not second-guess it. */
+	switch (run_command_via_daemon(command_name, argc, argv)) {
+	case WORMHOLE_CLIENT_UNAVAILABLE:
+		trace("wormholed not available, setting up environment locally");
+		break;
+
+	case WORMHOLE_CLIENT_NO_PROFILE:
+		trace("wormholed does not know %s, setting up environment locally", command_name);
+		break;
+
+	case WORMHOLE_CLIENT_FAILED:
+		log_fatal("wormholed was unable to provide an environment for %s", command_name);
+
+	default:
+		/* The callback only returns if it failed to execute the command */
+		return 22;
+	}
+
+	profile = find_profile(command_name);
 	run_command(profile, argc, argv);
 
 	return 22;
 }
 
+struct daemon_closure {
+	int		argc;
+	char **		argv;
+};
+
+static bool
+daemon_response_callback(struct wormhole_message_namespace_response *msg, int nsfd, void *closure)
+{
+	struct daemon_closure *cb = closure;
+	struct procutil_command cmd;
+	char cwd[PATH_MAX];
+	bool have_cwd;
+
+	/* Apply any environment variables sent to us by the server. */
+	if (msg->environment_vars != NULL) {
+		char **env = msg->environment_vars;
+		unsigned int i;
+
+		for (i = 0; env[i]; ++i)
+			putenv(env[i]);
+	}
+
+	if (msg->server_socket)
+		setenv("WORMHOLE_SOCKET", msg->server_socket, 1);
+
+	have_cwd = (getcwd(cwd, sizeof(cwd)) != NULL);
+
+	if (!wormhole_enter_namespace(nsfd))
+		return false;
+
+	/* Unshare the namespace so that any nonsense that happens in the subprocess we spawn
+	 * stays local to that execution context. */
+	if (unshare(CLONE_NEWNS) < 0) {
+		log_error("unshare: %m");
+		return false;
+	}
+
+	/* We no longer need this fd and should not pass it on to the executed command */
+	close(nsfd);
+
+	procutil_command_init(&cmd, cb->argv);
+	cmd.root_directory = msg->root_directory;
+	if (have_cwd)
+		cmd.working_directory = cwd;
+
+	procutil_command_exec(&cmd, msg->command);
+	return false;
+}
+
+static int
+run_command_via_daemon(const char *command_name, int argc, char **argv)
+{
+	struct daemon_closure closure = { argc, argv };
+
+	return wormhole_client_namespace_request(command_name, daemon_response_callback, &closure);
+}
+
 static wormhole_profile_t *
-find_profile(const char *argv0)
+find_profile(const char *command_name)
 {
-	char *command_name;
 	wormhole_profile_t *profile;
 
-	command_name = procutil_command_path(argv0);
-	if (command_name == NULL)
-		log_fatal("Cannot determine command name from argv[0] (%s)", argv0);
-
 	profile = wormhole_profile_find(command_name);
 	if (profile == NULL)
 		log_fatal("no profile for %s", command_name);
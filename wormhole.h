@@ -29,6 +29,10 @@
 
 #define WORMHOLE_CAPABILITY_PATH	"/var/lib/wormhole/capability"
 #define WORMHOLE_COMMAND_REGISTRY_PATH	"/var/lib/wormhole/command"
+#define WORMHOLE_LDCACHE_PATH		"/var/lib/wormhole/ldcache"
+#define WORMHOLE_USER_LDCACHE_PATH	"~/.cache/wormhole/ldcache"
+#define WORMHOLE_DEDUP_PATH		"/var/lib/wormhole/dedup"
+#define WORMHOLE_USER_DEDUP_PATH	"~/.cache/wormhole/dedup"
 
 extern void		wormhole_common_load_config(const char *opt_config_path);
 
@@ -38,12 +42,24 @@ extern void		wormhole_common_load_config(const char *opt_config_path);
  */
 
 struct wormhole_message_namespace_response;
+struct wormhole_message_stats_response;
 typedef bool		wormhole_namespace_response_callback_fn_t(struct wormhole_message_namespace_response *msg, int nsfd, void *closure);
+typedef bool		wormhole_stats_response_callback_fn_t(struct wormhole_message_stats_response *msg, void *closure);
 
 extern int		wormhole_client(int argc, char **argv);
 
-extern bool		wormhole_client_namespace_request(const char *query_string,
+/* Return values of wormhole_client_namespace_request() */
+enum {
+	WORMHOLE_CLIENT_OK = 0,
+	WORMHOLE_CLIENT_UNAVAILABLE,	/* unable to contact the daemon */
+	WORMHOLE_CLIENT_FAILED,
+	WORMHOLE_CLIENT_NO_PROFILE,	/* the daemon does not know the profile */
+};
+
+extern int		wormhole_client_namespace_request(const char *query_string,
 					wormhole_namespace_response_callback_fn_t *callback, void *closure);
+extern int		wormhole_client_stats_request(const char *socket_path,
+					wormhole_stats_response_callback_fn_t *callback, void *closure);
 
 #endif // _WORMHOLE_H
 
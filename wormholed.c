@@ -18,7 +18,6 @@
  *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
-#include <sys/poll.h>
 #include <syslog.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -27,6 +26,10 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include "tracing.h"
 #include "wormhole.h"
@@ -37,6 +40,8 @@
 #include "protocol.h"
 #include "buffer.h"
 #include "server.h"
+#include "watch.h"
+#include "cgroup.h"
 #include "util.h"
 
 typedef struct wormhole_request wormhole_request_t;
@@ -46,15 +51,195 @@ struct wormhole_request {
 	int		version;
 	int		opcode;
 
+	unsigned int	xid;
+
 	struct wormhole_message_parsed *message;
 
 	unsigned int	socket_id;
 	uid_t		client_uid;
+	gid_t		client_gid;
+	bool		accounted;
+	bool		rejected;
 	bool		reply_sent;
+
+	/* The profile this request refers to, once we've looked it up,
+	 * and the environment we're serving it from */
+	wormhole_profile_t *profile;
+	wormhole_environment_t *env;
+
+	/* Set while we're waiting for the environment to be set up */
+	wormhole_environment_t *waiting_for;
+
+	/* For the latency statistics */
+	unsigned long long received;
+	bool		cold;
+	bool		setup_deferred;
+
+	/* In the sub-daemon: the environment the client lives in, and
+	 * the helper process doing the namespace work for it */
+	struct wormhole_sub_env *sub_env;
+	pid_t		helper_pid;
+	unsigned int	helper_sock_id;
+	bool		helper_failed;
+	struct buf *	helper_reply;
+	int		helper_reply_fd;
+};
+
+/*
+ * Statistics, as reported via WORMHOLE_OPCODE_STATS_REQUEST
+ */
+struct wormhole_daemon_stats {
+	unsigned int	requests_received;
+	unsigned int	requests_rejected;
+	unsigned int	requests_failed;
+	unsigned int	envs_evicted;
+	unsigned int	setups_deferred;
+
+	/* Latency of namespace requests that could be served right away,
+	 * and of those that had to wait for the environment to be set up. */
+	struct timeutil_histogram latency_hit;
+	struct timeutil_histogram latency_cold;
+};
+
+struct wormhole_stats_list {
+	unsigned int	count;
+	struct wormhole_stat *data;
+};
+
+/*
+ * Per-user accounting of outstanding requests. As we process requests out
+ * of order, a single user could otherwise swamp us with requests for
+ * environments that take a long time to set up.
+ */
+struct wormhole_uid_usage {
+	struct wormhole_uid_usage *next;
+	uid_t		uid;
+	unsigned int	outstanding;
+};
+
+#define WORMHOLE_MAX_REQUESTS_PER_USER	16
+
+/*
+ * Environments we have set up and can hand out to clients right away.
+ * Each of these pins a mount namespace (and possibly container mounts)
+ * plus a sub-daemon process, so we do not want to keep them forever.
+ * The list is kept in LRU order, most recently used first.
+ */
+struct wormhole_resident_env {
+	struct wormhole_resident_env *next;
+	wormhole_environment_t *env;
+	time_t			last_used;
+
+	/* The config this was set up from has changed */
+	bool			stale;
+};
+
+#define WORMHOLE_RESIDENT_TTL		1800
+#define WORMHOLE_RESIDENT_MAX		64
+
+/* When memory is tight (PSI "some" avg10, in percent), evict the biggest
+ * idle environment rather than the least recently used one. Without a
+ * cache limit, drop one every so often while the pressure lasts. */
+#define WORMHOLE_EVICT_MEMORY_PRESSURE	10.0
+#define WORMHOLE_EVICT_PRESSURE_INTERVAL 10
+#define WORMHOLE_EVICT_PRESSURE_MIN_IDLE 60
+
+/*
+ * Environments waiting to be set up by --prewarm
+ */
+struct wormhole_prewarm {
+	struct wormhole_prewarm *next;
+
+	/* The setup code wants a profile; it only looks at the environment */
+	wormhole_profile_t	profile;
+};
+
+#define WORMHOLE_PREWARM_CONCURRENCY	4
+
+/* Number of pre-forked setup workers, which is also the maximum number
+ * of setups running at the same time */
+#define WORMHOLE_SETUP_WORKERS		4
+
+/* Do not start another setup while those in progress are stalled this
+ * much (the worst of cpu, memory and io pressure, in percent). Deferred
+ * setups are retried after WORMHOLE_SETUP_RETRY_MSEC. */
+#define WORMHOLE_SETUP_PRESSURE_MAX	40.0
+#define WORMHOLE_SETUP_RETRY_MSEC	500
+
+/*
+ * A single sub-daemon process serves all resident environments. It
+ * listens on one socket per environment, so that the socket name we
+ * return in the namespace response does not change, and keeps a
+ * namespace fd for each. The namespace sensitive work of a request is
+ * done by a short-lived helper process that setns()es into the client's
+ * environment.
+ *
+ * The socket a request arrives on is also how we know which environment
+ * it comes from. With a single listening socket, we would have to find
+ * out from the client's pid (/proc/<pid>/ns/mnt), which is racy, as the
+ * pid may have been reused by the time we look. Listening sockets cost
+ * an fd and a socket table slot each, which is cheap compared to the
+ * process per environment we had before.
+ *
+ * The main daemon hands environments to the sub-daemon over a control
+ * socket. Each record is a NUL terminated string: '+' followed by the
+ * socket name, with the nsfd attached, or '-' and the socket name to
+ * drop an environment. A '+' record may name the environment's cgroup
+ * after a tab; helpers join it, so that their work is accounted to the
+ * environment, and killed along with it.
+ *
+ * Once a helper has answered a request, we keep its response and the
+ * namespace fd, so that further requests for the same profile from the
+ * same user can be answered right away.
+ */
+struct wormhole_nested_cache {
+	struct wormhole_nested_cache *next;
+
+	char *			profile;
+	uid_t			uid;
+	gid_t			gid;
+
+	char *			command;
+	char **			environment_vars;
+	char *			server_socket;
+	char *			root_directory;
+	int			nsfd;
 };
 
+struct wormhole_sub_env {
+	struct wormhole_sub_env *next;
+	struct wormhole_sub_env *parent;	/* for nested environments */
+
+	char *			socket_name;
+	char *			cgroup;
+	int			nsfd;		/* -1 once dropped */
+	unsigned int		sock_id;	/* of the listening socket */
+
+	struct wormhole_nested_cache *cache;
+
+	/* Connections accepted on our socket inherit these, which tells
+	 * us which environment a request came from. */
+	struct wormhole_app_ops	app_ops;
+};
+
+#define WORMHOLE_SUB_DAEMON_RECORD_MAX	1024
+
+/* Do not restart a sub-daemon that died sooner than this (in seconds) */
+#define WORMHOLE_SUB_DAEMON_MIN_LIFETIME 10
+
 enum {
-	OPT_NO_CONFIG
+	OPT_NO_CONFIG = 256,
+	OPT_MAX_REQUESTS_PER_USER,
+	OPT_PREWARM,
+	OPT_PREWARM_CONCURRENCY,
+	OPT_CACHE_TTL,
+	OPT_CACHE_MAX,
+	OPT_STATS,
+	OPT_NO_WATCH,
+	OPT_SUB_DAEMON,
+	OPT_NO_CGROUPS,
+	OPT_SETUP_WORKERS,
+	OPT_SETUP_WORKER,
 };
 
 struct option wormhole_options[] = {
@@ -64,6 +249,17 @@ struct option wormhole_options[] = {
 	{ "debug",	no_argument,		NULL,	'd' },
 
 	{ "no-config",	no_argument,		NULL,	OPT_NO_CONFIG },
+	{ "max-requests-per-user", required_argument, NULL, OPT_MAX_REQUESTS_PER_USER },
+	{ "prewarm",	no_argument,		NULL,	OPT_PREWARM },
+	{ "prewarm-concurrency", required_argument, NULL, OPT_PREWARM_CONCURRENCY },
+	{ "cache-ttl",	required_argument,	NULL,	OPT_CACHE_TTL },
+	{ "cache-max",	required_argument,	NULL,	OPT_CACHE_MAX },
+	{ "stats",	no_argument,		NULL,	OPT_STATS },
+	{ "no-watch",	no_argument,		NULL,	OPT_NO_WATCH },
+	{ "sub-daemon",	required_argument,	NULL,	OPT_SUB_DAEMON },
+	{ "no-cgroups",	no_argument,		NULL,	OPT_NO_CGROUPS },
+	{ "setup-workers", required_argument,	NULL,	OPT_SETUP_WORKERS },
+	{ "setup-worker", required_argument,	NULL,	OPT_SETUP_WORKER },
 	{ NULL }
 };
 
@@ -72,21 +268,67 @@ static const char *		opt_runtime = "default";
 static const char *		opt_socket_name = WORMHOLE_SOCKET_PATH;
 static bool			opt_foreground = false;
 static bool			opt_no_config = false;
+static unsigned int		opt_max_requests_per_user = WORMHOLE_MAX_REQUESTS_PER_USER;
+static bool			opt_prewarm = false;
+static bool			opt_stats = false;
+static bool			opt_no_watch = false;
+static bool			opt_no_cgroups = false;
+static unsigned int		opt_prewarm_concurrency = WORMHOLE_PREWARM_CONCURRENCY;
+static unsigned int		opt_cache_ttl = WORMHOLE_RESIDENT_TTL;
+static unsigned int		opt_cache_max = WORMHOLE_RESIDENT_MAX;
+static int			opt_sub_daemon_fd = -1;
+static unsigned int		opt_setup_workers = WORMHOLE_SETUP_WORKERS;
+static int			opt_setup_worker_fd = -1;
 
 static int			wormhole_daemon(const char *socket_path);
+static int			wormhole_sub_daemon_main(int control_fd);
 static void			wormhole_reap_children(void);
+static void			wormhole_environment_setup_complete(wormhole_environment_t *);
 
 static bool			wormhole_message_consume(wormhole_socket_t *s, struct buf *bp, int fd);
 
 static wormhole_request_t *	wormhole_request_list;
+static wormhole_request_t **	wormhole_request_tail = &wormhole_request_list;
+static struct wormhole_uid_usage *wormhole_uid_usage_list;
+static struct wormhole_resident_env *wormhole_resident_envs;
+static unsigned int		wormhole_resident_count;
+static struct wormhole_daemon_stats wormhole_daemon_stats;
+static struct wormhole_prewarm *wormhole_prewarm_queue;
+static unsigned int		wormhole_prewarm_active;
+static struct wormhole_config *	wormhole_global_config;
+static struct wormhole_sub_env *wormhole_sub_envs;
+static bool			wormhole_setup_deferred;
+
+static struct {
+	pid_t			pid;
+	int			fd;
+	time_t			started;
+	char *			cgroup;
+} wormhole_sub_daemon = { .fd = -1 };
 
 static wormhole_request_t *	wormhole_request_new(struct wormhole_message_parsed *pmsg);
 static void			wormhole_request_free(wormhole_request_t *);
+static bool			wormhole_request_admit(wormhole_request_t *);
 
 static void			wormhole_enqueue_request_incoming(wormhole_request_t *req);
 static void			wormhole_process_pending_requests(void);
 static void			wormhole_process_request(wormhole_request_t *req);
 static bool			wormhole_start_sub_daemon(wormhole_environment_t *);
+static void			wormhole_stop_sub_daemon(wormhole_environment_t *);
+static void			wormhole_sub_daemon_exited(int status);
+static void			wormhole_process_nested_request(wormhole_request_t *req);
+static struct wormhole_sub_env *wormhole_sub_env_for_socket(const wormhole_socket_t *);
+static int			wormhole_show_stats(const char *socket_path);
+
+static wormhole_environment_t *	wormhole_resident_env_find(const char *name, uid_t owner_uid);
+static void			wormhole_resident_env_add(wormhole_environment_t *);
+static void			wormhole_resident_env_touch(wormhole_environment_t *);
+static int			wormhole_resident_env_expire(void);
+static void			wormhole_prewarm_init(void);
+static void			wormhole_prewarm_continue(void);
+static void			wormhole_config_changed(const struct wormhole_config *);
+static void			wormhole_global_config_watch(struct wormhole_config *);
+static void			wormhole_global_config_changed(const char *path, void *closure);
 
 int
 main(int argc, char **argv)
@@ -115,28 +357,127 @@ main(int argc, char **argv)
 			opt_no_config = true;
 			break;
 
+		case OPT_MAX_REQUESTS_PER_USER:
+			opt_max_requests_per_user = strtoul(optarg, NULL, 0);
+			if (opt_max_requests_per_user == 0)
+				log_fatal("Invalid argument to --max-requests-per-user");
+			break;
+
+		case OPT_PREWARM:
+			opt_prewarm = true;
+			break;
+
+		case OPT_STATS:
+			opt_stats = true;
+			break;
+
+		case OPT_NO_WATCH:
+			opt_no_watch = true;
+			break;
+
+		case OPT_CACHE_TTL:
+			opt_cache_ttl = strtoul(optarg, NULL, 0);
+			break;
+
+		case OPT_CACHE_MAX:
+			opt_cache_max = strtoul(optarg, NULL, 0);
+			break;
+
+		case OPT_PREWARM_CONCURRENCY:
+			opt_prewarm_concurrency = strtoul(optarg, NULL, 0);
+			if (opt_prewarm_concurrency == 0)
+				log_fatal("Invalid argument to --prewarm-concurrency");
+			break;
+
+		case OPT_SUB_DAEMON:
+			opt_sub_daemon_fd = strtoul(optarg, NULL, 0);
+			break;
+
+		case OPT_NO_CGROUPS:
+			opt_no_cgroups = true;
+			break;
+
+		case OPT_SETUP_WORKERS:
+			opt_setup_workers = strtoul(optarg, NULL, 0);
+			if (opt_setup_workers == 0)
+				log_fatal("Invalid argument to --setup-workers");
+			break;
+
+		case OPT_SETUP_WORKER:
+			opt_setup_worker_fd = strtoul(optarg, NULL, 0);
+			break;
+
 		default:
 			log_error("Usage message goes here.");
 			return 2;
 		}
 	}
 
+	if (opt_stats)
+		return wormhole_show_stats(opt_socket_name);
+
+	tracing_events_init();
+
 	if (!wormhole_select_runtime(opt_runtime))
 		log_fatal("Unable to set up requested container runtime");
 
+	if (opt_sub_daemon_fd >= 0)
+		return wormhole_sub_daemon_main(opt_sub_daemon_fd);
+
+	/* If this fails, we fall back to checking files for changes
+	 * when we use them. */
+	if (!opt_no_watch && !wormhole_watch_init())
+		log_warning("Unable to watch config files for changes");
+	wormhole_config_notify_changes(wormhole_config_changed);
+
 	if (opt_no_config) {
 		log_info("Not loading any config file\n");
 	} else {
-		if (!(config = wormhole_config_load(WORMHOLE_CONFIG_PATH)))
+		/* Watch the file before loading it, using a placeholder until
+		 * we have the config object (see wormhole_config_get()). */
+		wormhole_watch_path(WORMHOLE_CONFIG_PATH, wormhole_global_config_changed, NULL);
+
+		if (!(config = wormhole_config_load_cached(WORMHOLE_CONFIG_PATH)))
 			log_fatal("Unable to load configuration file");
 
 		if (!wormhole_profiles_configure(config))
 			log_fatal("Bad configuration, cannot continue.");
+
+		wormhole_global_config = config;
+		wormhole_global_config_watch(config);
+		wormhole_watch_cancel(wormhole_global_config_changed, NULL);
 	}
 
+	if (opt_setup_worker_fd >= 0)
+		return wormhole_setup_worker_main(opt_setup_worker_fd);
+
 	return wormhole_daemon(opt_socket_name);
 }
 
+/*
+ * Setup workers are started the same way as the sub-daemon, but they
+ * need the global config.
+ */
+static bool
+wormhole_start_setup_workers(void)
+{
+	static const char *argv[16];
+	unsigned int argc = 0, i;
+
+	argv[argc++] = opt_server_path;
+	argv[argc++] = "--foreground";
+	argv[argc++] = "--no-watch";
+	argv[argc++] = "--runtime";
+	argv[argc++] = opt_runtime;
+	if (opt_no_config)
+		argv[argc++] = "--no-config";
+	for (i = 0; i < tracing_level && i < 4; ++i)
+		argv[argc++] = "--debug";
+	argv[argc] = NULL;
+
+	return wormhole_environment_async_pool_init(opt_setup_workers, (char **) argv);
+}
+
 int
 wormhole_daemon(const char *socket_path)
 {
@@ -153,6 +494,9 @@ wormhole_daemon(const char *socket_path)
 	}
 	wormhole_install_socket(srv_sock);
 
+	if (wormhole_watch_enabled())
+		wormhole_install_socket(wormhole_watch_init());
+
 	log_info("wormhole daemon: listening on %s", socket_path);
 
 	if (!opt_foreground) {
@@ -166,44 +510,37 @@ wormhole_daemon(const char *socket_path)
 
 	procutil_install_sigchild_handler();
 
-	while (wormhole_sockets) {
-		struct pollfd poll_array[WORMHOLE_SOCKET_MAX];
-		wormhole_socket_t *sock_array[WORMHOLE_SOCKET_MAX];
-		wormhole_socket_t **pos, *s;
-		int i, nfd = 0;
+	/* The sub-daemon or a client may go away while we talk to them */
+	signal(SIGPIPE, SIG_IGN);
 
-		wormhole_reap_children();
+	/* If this fails, everything runs in our own cgroup */
+	if (!opt_no_cgroups)
+		wormhole_cgroup_init();
 
-		wormhole_process_pending_requests();
+	/* We try to start missing workers when we need them */
+	if (!wormhole_start_setup_workers())
+		log_error("Unable to start setup workers");
 
-		for (pos = &wormhole_sockets; (s = *pos) != NULL; ) {
-			assert(nfd < WORMHOLE_SOCKET_MAX);
+	/* This needs to happen after we've forked into the background.
+	 * Otherwise, the setup processes would not be our children. */
+	if (opt_prewarm)
+		wormhole_prewarm_init();
 
-			if (!s->ops->poll(s, poll_array + nfd)) {
-				/* remove socket from linked list and free it. */
-				wormhole_socket_free(s);
-				continue;
-			}
+	while (wormhole_sockets) {
+		int timeout;
 
-			poll_array[nfd].fd = s->fd;
-			sock_array[nfd] = s;
-			nfd += 1;
+		wormhole_setup_deferred = false;
 
-			pos = &s->next;
-		}
+		wormhole_reap_children();
+		wormhole_prewarm_continue();
 
-		if (poll(poll_array, nfd, -1) < 0) {
-			if (errno != EINTR)
-				log_error("poll: %m");
-			continue;
-		}
+		wormhole_process_pending_requests();
 
-		for (i = 0; i < nfd; ++i) {
-			s = sock_array[i];
-			if (!s->ops->process(s, poll_array + i)) {
-				wormhole_socket_free(s);
-			}
-		}
+		timeout = wormhole_resident_env_expire();
+		if (wormhole_setup_deferred && (timeout < 0 || timeout > WORMHOLE_SETUP_RETRY_MSEC))
+			timeout = WORMHOLE_SETUP_RETRY_MSEC;
+
+		wormhole_sockets_poll(timeout);
 	}
 
 	return 0;
@@ -212,281 +549,1719 @@ wormhole_daemon(const char *socket_path)
 static void
 wormhole_reap_children(void)
 {
+	wormhole_environment_t *env;
 	pid_t pid;
 	int st;
 
 	while ((pid = procutil_get_exited_child(&st)) > 0) {
-		wormhole_environment_t *env;
+		if (pid == wormhole_sub_daemon.pid)
+			wormhole_sub_daemon_exited(st);
+		else
+			wormhole_environment_async_child_exited(pid, st);
+	}
 
-		env = wormhole_environment_async_complete(pid, st);
-		if (env == NULL || env->failed)
-			continue;
+	while ((env = wormhole_environment_async_complete()) != NULL) {
+		wormhole_environment_setup_complete(env);
 
-		if (!env->sub_daemon.pid) {
-			if (!wormhole_start_sub_daemon(env)) {
-				trace("Environment \"%s\": failed to start subspace daemon", env->name);
-				env->failed = true;
-			}
-		}
+		/* Only now answer the requests waiting for this environment,
+		 * so that they get the same response as later ones. */
+		wormhole_environment_async_finish(env);
 	}
 }
 
-bool
-wormhole_message_consume(wormhole_socket_t *s, struct buf *bp, int fd)
+static void
+wormhole_environment_setup_complete(wormhole_environment_t *env)
 {
-	struct wormhole_message_parsed *pmsg;
-	wormhole_request_t *req;
-
-	if (!wormhole_message_complete(bp))
-		return false;
-
-	if (!(pmsg = wormhole_message_parse(bp, s->uid))) {
-		log_error("Bad message from uid %d", s->uid);
-		/* Mark socket for closing */
-		wormhole_socket_fail(s);
-		return false;
+	/* Do not leave behind whatever a failed setup started */
+	if (env->failed) {
+		if (env->cgroup)
+			wormhole_cgroup_kill(env->cgroup);
+		return;
 	}
 
-	req = wormhole_request_new(pmsg);
-	if (req) {
-		req->socket_id = s->id;
-		req->client_uid = s->uid;
-		wormhole_enqueue_request_incoming(req);
+	wormhole_resident_env_add(env);
 
-		trace("received message opcode=%d, uid=%d", req->opcode, req->client_uid);
+	/* Environments owned by an unprivileged user live in that
+	 * user's namespace; we do not run a subspace daemon for them. */
+	if (env->owner_uid != 0) {
+		trace("Environment \"%s\" owned by uid %d, not starting subspace daemon",
+				env->name, env->owner_uid);
+		return;
 	}
 
-	return true;
+	if (!env->sub_daemon.pid) {
+		if (!wormhole_start_sub_daemon(env)) {
+			trace("Environment \"%s\": failed to start subspace daemon", env->name);
+			env->failed = true;
+		}
+	}
 }
 
-wormhole_request_t *
-wormhole_request_new(struct wormhole_message_parsed *pmsg)
+/*
+ * Keep track of the environments we have set up
+ */
+static wormhole_environment_t *
+wormhole_resident_env_find(const char *name, uid_t owner_uid)
 {
-	wormhole_request_t *r;
+	struct wormhole_resident_env *r;
 
-	r = calloc(1, sizeof(*r));
-	r->opcode = pmsg->hdr.opcode;
-	r->version = pmsg->hdr.version;
-	r->message = pmsg;
+	for (r = wormhole_resident_envs; r; r = r->next) {
+		wormhole_environment_t *env = r->env;
 
-	return r;
-}
+		if (strutil_equal(env->name, name) && env->owner_uid == owner_uid)
+			return env;
+	}
 
-void
-wormhole_request_free(wormhole_request_t *req)
-{
-	wormhole_message_free_parsed(req->message);
-	memset(req, 0xA5, sizeof(*req));
-	free(req);
+	return NULL;
 }
 
-static void
-wormhole_request_list_insert(wormhole_request_t **list, wormhole_request_t *req)
+static time_t
+wormhole_now(void)
 {
-	req->next = *list;
-	*list = req;
-}
+	struct timespec ts;
 
-void
-wormhole_enqueue_request_incoming(wormhole_request_t *req)
-{
-	wormhole_request_list_insert(&wormhole_request_list, req);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
 }
 
+/*
+ * Check whether any request we're currently processing refers to this
+ * environment. We must not tear it down underneath them.
+ */
 static bool
-__wormhole_respond(wormhole_request_t *req, struct buf *bp, int fd)
+wormhole_resident_env_busy(const wormhole_environment_t *env)
 {
-	wormhole_socket_t *s;
-	bool ok = false;
+	wormhole_request_t *req;
 
-	s = wormhole_socket_find(req->socket_id);
-	if (s != NULL) {
-		wormhole_socket_enqueue(s, bp, fd);
-		ok = true;
-	} else {
-		/* Client disconnected while we were processing the
-		 * request. Pretend we sent the reply. */
-		buf_free(bp);
-		if (fd >= 0)
-			close(fd);
+	for (req = wormhole_request_list; req; req = req->next) {
+		if (req->waiting_for == env)
+			return true;
+		if (req->env == env)
+			return true;
 	}
 
-	req->reply_sent = true;
-	return ok;
+	return false;
 }
 
 static void
-wormhole_respond(wormhole_request_t *req, int status)
+wormhole_resident_env_evict(struct wormhole_resident_env **pos, const char *reason)
 {
-	__wormhole_respond(req, wormhole_message_build_status(status), -1);
-}
+	struct wormhole_resident_env *r = *pos;
+	wormhole_environment_t *env = r->env;
 
-static void
-wormhole_process_namespace_request(wormhole_request_t *req)
-{
-	const char *name;
-	wormhole_environment_t *env;
-	wormhole_profile_t *profile;
-	wormhole_socket_t *setup_sock;
-	int nsfd;
+	log_info("Evicting environment \"%s\" (%s)", env->name, reason);
 
-	name = req->message->payload.namespace_request.profile;
-	trace("Processing request for profile \"%s\" from uid %d", name, req->client_uid);
+	wormhole_stop_sub_daemon(env);
 
-	profile = wormhole_profile_find(name);
-	if (profile == NULL) {
-		log_error("no profile for %s", name);
-		wormhole_respond(req, WORMHOLE_STATUS_ERROR);
-		return;
-	}
+	/* Get rid of any processes the setup left running */
+	if (env->cgroup)
+		wormhole_cgroup_kill(env->cgroup);
 
-	env = profile->environment;
+	/* Close the nsfd, so that the next request will set up the
+	 * environment from scratch. */
+	wormhole_environment_reset(env);
 
-	nsfd = wormhole_profile_namespace_fd(profile);
-	if (nsfd >= 0) {
-		struct buf *msg;
+	*pos = r->next;
+	free(r);
 
-		if (env == NULL) {
-			msg = wormhole_message_build_namespace_response(WORMHOLE_STATUS_OK, wormhole_profile_command(profile), NULL, NULL);
-		} else {
-			msg = wormhole_message_build_namespace_response(WORMHOLE_STATUS_OK, wormhole_profile_command(profile),
-					NULL, env->sub_daemon.socket_name);
-		}
+	assert(wormhole_resident_count);
+	wormhole_resident_count--;
+	wormhole_daemon_stats.envs_evicted++;
+}
 
-		__wormhole_respond(req, msg, nsfd);
-		log_info("served request for a \"%s\" namespace", profile->name);
-		return;
-	}
+static bool
+wormhole_memory_pressure_high(void)
+{
+	struct wormhole_cgroup_stats st;
 
-	if (!(env = profile->environment)) {
-		/* For profiles that do not reference an environment, the call to
-		 * wormhole_profile_namespace_fd() should have returned a valid file
-		 * descriptor, namely an fd for our host namespace.
-		 * If we get here nevertheless, something is very wrong. */
-		log_error("Profile %s: no environment associated", profile->name);
-		wormhole_respond(req, WORMHOLE_STATUS_ERROR);
-		return;
-	}
+	return wormhole_cgroup_get_stats(NULL, &st) && st.memory_pressure >= WORMHOLE_EVICT_MEMORY_PRESSURE;
+}
 
-	/* If the setup command exited with an error status, return a failure indication
-	 * to the client. */
-	if (env->failed) {
-		log_info("request for namespace \"%s\": failed", profile->name);
-		wormhole_respond(req, WORMHOLE_STATUS_ERROR);
-		return;
-	}
+static uint64_t
+wormhole_resident_env_memory(const wormhole_environment_t *env)
+{
+	struct wormhole_cgroup_stats st;
 
-	/* Check if an async setup is already in progress */
-	if (wormhole_environment_async_check(env)) {
-		trace("setup for \"%s\" is in process, delaying", env->name);
-		return;
-	}
+	if (env->cgroup == NULL)
+		return 0;
 
-	/* The profile setup starts a process in the background,
-	 * connected via a socketpair. When it completes, it passes
-	 * a namespace fd back to the daemon process.
-	 */
-	setup_sock = wormhole_environment_async_setup(env, profile);
-	if (setup_sock == NULL) {
-		log_error("Profile %s: unable to create setup process", profile->name);
-		wormhole_respond(req, WORMHOLE_STATUS_ERROR);
-		env->failed = true;
-	} else {
-		wormhole_install_socket(setup_sock);
-	}
+	wormhole_cgroup_get_stats(env->cgroup, &st);
+	return st.memory_current;
 }
 
-void
-wormhole_process_request(wormhole_request_t *req)
+/*
+ * Find an environment to evict. Usually, that's the least recently
+ * used one that is not busy. If by_size is set, it's the one using the
+ * most memory, provided it has been idle for at least min_idle seconds.
+ */
+static struct wormhole_resident_env **
+wormhole_resident_env_victim(bool by_size, time_t min_idle)
 {
-	switch (req->opcode) {
-	case WORMHOLE_OPCODE_NAMESPACE_REQUEST:
-		wormhole_process_namespace_request(req);
-		break;
+	struct wormhole_resident_env **pos, *r, **victim = NULL;
+	uint64_t size, victim_size = 0;
+	time_t now = wormhole_now();
 
-	default:
-		log_error("Unknown opcode %d from uid %d", req->opcode, req->client_uid);
-		wormhole_respond(req, WORMHOLE_STATUS_ERROR);
-		break;
+	for (pos = &wormhole_resident_envs; (r = *pos) != NULL; pos = &r->next) {
+		if (wormhole_resident_env_busy(r->env) || now - r->last_used < min_idle)
+			continue;
+
+		/* The list is sorted by last use, so on a tie, we pick the older one */
+		size = by_size? wormhole_resident_env_memory(r->env) : 0;
+		if (victim == NULL || size >= victim_size) {
+			victim = pos;
+			victim_size = size;
+		}
 	}
+
+	return victim;
 }
 
-void
-wormhole_process_pending_requests(void)
+/*
+ * Evict environments that have not been used for a while.
+ * Returns the poll timeout until the next one is due, in milliseconds.
+ */
+static int
+wormhole_resident_env_expire(void)
 {
-	wormhole_request_t **pos, *req;
-
-	for (pos = &wormhole_request_list; (req = *pos) != NULL; ) {
-		/* See if we can complete the request. */
+	static time_t last_pressure_check;
+	struct wormhole_resident_env **pos, *r;
+	time_t now, next_expiry = 0;
+
+	now = wormhole_now();
+
+	/* The cache size limit takes care of memory pressure only when the
+	 * cache is full, so check every now and then. */
+	if (wormhole_resident_envs && wormhole_cgroup_enabled()) {
+		if (now >= last_pressure_check + WORMHOLE_EVICT_PRESSURE_INTERVAL) {
+			last_pressure_check = now;
+			if (wormhole_memory_pressure_high()
+			 && (pos = wormhole_resident_env_victim(true, WORMHOLE_EVICT_PRESSURE_MIN_IDLE)) != NULL)
+				wormhole_resident_env_evict(pos, "memory pressure");
+		}
+		next_expiry = last_pressure_check + WORMHOLE_EVICT_PRESSURE_INTERVAL;
+	}
+
+	for (pos = &wormhole_resident_envs; (r = *pos) != NULL; ) {
+		time_t expires = r->last_used + opt_cache_ttl;
+
+		if (r->stale) {
+			if (!wormhole_resident_env_busy(r->env)) {
+				wormhole_resident_env_evict(pos, "config changed");
+				continue;
+			}
+			expires = now;
+		} else if (opt_cache_ttl == 0) {
+			pos = &r->next;
+			continue;
+		}
+
+		if (expires <= now && !wormhole_resident_env_busy(r->env)) {
+			wormhole_resident_env_evict(pos, "idle");
+			continue;
+		}
+
+		/* Busy environments are checked again a second later */
+		if (expires <= now)
+			expires = now + 1;
+		if (next_expiry == 0 || expires < next_expiry)
+			next_expiry = expires;
+		pos = &r->next;
+	}
+
+	if (next_expiry == 0)
+		return -1;
+
+	return (next_expiry - now) * 1000;
+}
+
+/*
+ * Make room for a new entry by evicting the least recently used
+ * environment(s), or the biggest ones if we're short on memory.
+ */
+static void
+wormhole_resident_env_shrink(void)
+{
+	struct wormhole_resident_env **victim;
+	bool by_size;
+
+	by_size = wormhole_memory_pressure_high();
+	while (wormhole_resident_count >= opt_cache_max) {
+		/* Everything is in use; we have to go over the limit */
+		if (!(victim = wormhole_resident_env_victim(by_size, 0)))
+			break;
+
+		wormhole_resident_env_evict(victim, by_size? "cache full, memory pressure" : "cache full");
+	}
+}
+
+static void
+wormhole_resident_env_add(wormhole_environment_t *env)
+{
+	struct wormhole_resident_env *r;
+
+	for (r = wormhole_resident_envs; r; r = r->next) {
+		if (r->env == env)
+			return;
+	}
+
+	if (opt_cache_max)
+		wormhole_resident_env_shrink();
+
+	r = calloc(1, sizeof(*r));
+	r->env = env;
+	r->last_used = wormhole_now();
+	r->next = wormhole_resident_envs;
+	wormhole_resident_envs = r;
+	wormhole_resident_count++;
+}
+
+/*
+ * A config file changed. Get rid of the environments we set up from it;
+ * new requests will get fresh environment objects anyway. We just mark
+ * them here, and wormhole_resident_env_expire() tears them down once
+ * they are no longer busy.
+ */
+static void
+wormhole_resident_env_invalidate(const struct wormhole_config *cfg)
+{
+	struct wormhole_resident_env *r;
+
+	for (r = wormhole_resident_envs; r; r = r->next) {
+		const struct wormhole_environment_config *env_cfg;
+
+		for (env_cfg = cfg->environments; env_cfg; env_cfg = env_cfg->next) {
+			if (r->env->config == env_cfg)
+				r->stale = true;
+		}
+	}
+}
+
+/*
+ * Mark the environment as used, and move it to the head of the LRU list
+ */
+static void
+wormhole_resident_env_touch(wormhole_environment_t *env)
+{
+	struct wormhole_resident_env **pos, *r;
+
+	for (pos = &wormhole_resident_envs; (r = *pos) != NULL; pos = &r->next) {
+		if (r->env == env) {
+			r->last_used = wormhole_now();
+
+			*pos = r->next;
+			r->next = wormhole_resident_envs;
+			wormhole_resident_envs = r;
+			return;
+		}
+	}
+}
+
+/*
+ * Handle config changes.
+ * Config files of individual commands are reloaded on demand by
+ * wormhole_config_get(), which calls us when it notices a change.
+ * The global config file is something we have to reload ourselves.
+ */
+static void
+wormhole_config_changed(const struct wormhole_config *cfg)
+{
+	log_info("Configuration file %s changed", cfg->path);
+	wormhole_resident_env_invalidate(cfg);
+}
+
+static void
+wormhole_global_config_changed(const char *path, void *closure)
+{
+	struct wormhole_config *old_config = closure, *config;
+
+	if (old_config != wormhole_global_config)
+		return;
+
+	/* On failure, we keep the old config, and continue to watch it, so
+	 * that we'll try again once the admin fixes the file. */
+	if (!(config = wormhole_config_load_cached(path))) {
+		log_error("Unable to reload %s, keeping old configuration", path);
+		return;
+	}
+
+	if (!wormhole_profiles_configure(config)) {
+		log_error("Bad configuration in %s, keeping old configuration", path);
+		return;
+	}
+
+	/* The old config may still be referenced by profiles and environments
+	 * in use, so we do not free it. */
+	wormhole_watch_cancel(wormhole_global_config_changed, old_config);
+	wormhole_global_config = config;
+	wormhole_global_config_watch(config);
+
+	/* The setup workers loaded the config when they started */
+	wormhole_environment_async_pool_restart();
+
+	wormhole_config_changed(old_config);
+}
+
+static void
+wormhole_global_config_watch(struct wormhole_config *config)
+{
+	unsigned int i;
+
+	if (!wormhole_watch_enabled())
+		return;
+
+	wormhole_watch_path(config->path, wormhole_global_config_changed, config);
+	for (i = 0; i < config->included_files.count; ++i)
+		wormhole_watch_path(config->included_files.data[i], wormhole_global_config_changed, config);
+}
+
+/*
+ * Prewarming: set up all environments we know about upfront, so that the
+ * first client does not have to wait for them. We do not want to fork
+ * off dozens of setup processes (each possibly starting a container) at
+ * once, so we limit the number of setups running in parallel.
+ */
+static void
+wormhole_prewarm_add(wormhole_environment_t *env, const wormhole_profile_t *profile)
+{
+	struct wormhole_prewarm **pos, *pw;
+
+	for (pos = &wormhole_prewarm_queue; (pw = *pos) != NULL; pos = &pw->next) {
+		if (strutil_equal(pw->profile.environment->name, env->name))
+			return;
+	}
+
+	pw = calloc(1, sizeof(*pw));
+	pw->profile.name = env->name;
+	pw->profile.environment = env;
+
+	/* The setup worker uses this to look up the profile in its own config */
+	pw->profile.config = profile? profile->config : NULL;
+	*pos = pw;
+}
+
+/*
+ * Check that the requirements of all environments we're about to set up
+ * can be satisfied. We do this in one batch rather than one environment
+ * at a time, so that we consult the capability registry just once.
+ */
+static void
+wormhole_prewarm_check_requires(void)
+{
+	struct strutil_array requires;
+	struct wormhole_prewarm *pw;
+	unsigned int i;
+	char **paths;
+
+	strutil_array_init(&requires);
+	for (pw = wormhole_prewarm_queue; pw; pw = pw->next)
+		strutil_array_append_array(&requires, &pw->profile.environment->requires);
+
+	if (requires.count == 0)
+		return;
+
+	paths = calloc(requires.count, sizeof(paths[0]));
+	if (wormhole_capability_get_best_matches(&requires, paths) < requires.count) {
+		for (i = 0; i < requires.count; ++i) {
+			if (paths[i] == NULL)
+				log_warning("Unable to satisfy requirement %s", requires.data[i]);
+		}
+	}
+
+	for (i = 0; i < requires.count; ++i)
+		free(paths[i]);
+	free(paths);
+	strutil_array_destroy(&requires);
+}
+
+static void
+wormhole_prewarm_init(void)
+{
+	struct strutil_array commands;
+	wormhole_environment_t *env;
+	unsigned int i;
+
+	for (env = wormhole_environment_list(); env; env = env->next)
+		wormhole_prewarm_add(env, NULL);
+
+	strutil_array_init(&commands);
+	if (wormhole_command_registry_list(&commands)) {
+		for (i = 0; i < commands.count; ++i) {
+			wormhole_profile_t *profile;
+
+			profile = wormhole_profile_find(commands.data[i]);
+			if (profile == NULL || profile->environment == NULL)
+				continue;
+
+			wormhole_prewarm_add(profile->environment, profile);
+		}
+	}
+	strutil_array_destroy(&commands);
+
+	wormhole_prewarm_check_requires();
+}
+
+static void
+wormhole_prewarm_complete(wormhole_environment_t *env, void *closure)
+{
+	assert(wormhole_prewarm_active);
+	wormhole_prewarm_active--;
+
+	if (env->failed)
+		log_warning("Prewarming environment \"%s\" failed", env->name);
+	else
+		log_info("Prewarmed environment \"%s\"", env->name);
+}
+
+/*
+ * Heavy setups (pulling an image, running ldconfig) that run in parallel
+ * slow each other down. If the ones in progress are stalled already,
+ * starting another one just makes all of them finish later.
+ */
+static bool
+wormhole_setup_may_start(void)
+{
+	struct wormhole_async_setup_stats setup;
+	struct wormhole_cgroup_stats st;
+	double pressure;
+
+	/* All workers are busy. One of them will tell us when it's done,
+	 * so there's no need to poll. */
+	if (!wormhole_environment_async_available())
+		return false;
+
+	wormhole_environment_async_get_stats(&setup);
+	if (setup.in_progress == 0)
+		return true;
+
+	if (!wormhole_cgroup_get_stats(NULL, &st))
+		return true;
+
+	pressure = st.cpu_pressure;
+	if (st.memory_pressure > pressure)
+		pressure = st.memory_pressure;
+	if (st.io_pressure > pressure)
+		pressure = st.io_pressure;
+
+	if (pressure < WORMHOLE_SETUP_PRESSURE_MAX)
+		return true;
+
+	wormhole_setup_deferred = true;
+	return false;
+}
+
+static void
+wormhole_prewarm_continue(void)
+{
+	struct wormhole_prewarm *pw;
+
+	while (wormhole_prewarm_active < opt_prewarm_concurrency && (pw = wormhole_prewarm_queue) != NULL
+	    && wormhole_setup_may_start()) {
+		wormhole_environment_t *env = pw->profile.environment;
+		wormhole_socket_t *setup_sock;
+
+		wormhole_prewarm_queue = pw->next;
+
+		/* A client may have beaten us to it */
+		if (wormhole_resident_env_find(env->name, 0) || wormhole_environment_async_check(env)) {
+			trace("Not prewarming environment \"%s\": already set up", env->name);
+		} else
+		if (!(setup_sock = wormhole_environment_async_setup(env, &pw->profile))) {
+			log_error("Unable to prewarm environment \"%s\"", env->name);
+			env->failed = true;
+		} else {
+			trace("Prewarming environment \"%s\"", env->name);
+			wormhole_install_socket(setup_sock);
+			if (wormhole_environment_async_wait(env, wormhole_prewarm_complete, NULL))
+				wormhole_prewarm_active++;
+		}
+
+		/* Only the setup process looks at the profile, so we can free it */
+		free(pw);
+	}
+}
+
+bool
+wormhole_message_consume(wormhole_socket_t *s, struct buf *bp, int fd)
+{
+	struct wormhole_message_parsed *pmsg;
+	wormhole_request_t *req;
+
+	if (!wormhole_message_complete(bp))
+		return false;
+
+	if (!(pmsg = wormhole_message_parse(bp, s->uid))) {
+		log_error("Bad message from uid %d", s->uid);
+		/* Mark socket for closing */
+		wormhole_socket_fail(s);
+		return false;
+	}
+
+	req = wormhole_request_new(pmsg);
+	if (req) {
+		req->sub_env = wormhole_sub_env_for_socket(s);
+		req->socket_id = s->id;
+		req->client_uid = s->uid;
+		req->client_gid = s->gid;
+		req->received = timeutil_monotonic_usec();
+		wormhole_daemon_stats.requests_received++;
+		trace_span_begin(TRACE_EV_REQUEST, req->xid, NULL);
+
+		if (!wormhole_request_admit(req)) {
+			log_warning("uid %d exceeds the limit of %u outstanding requests, rejecting request",
+					req->client_uid, opt_max_requests_per_user);
+			req->rejected = true;
+			wormhole_daemon_stats.requests_rejected++;
+		}
+
+		wormhole_enqueue_request_incoming(req);
+
+		trace("received message opcode=%d, xid=%u, uid=%d", req->opcode, req->xid, req->client_uid);
+	}
+
+	return true;
+}
+
+wormhole_request_t *
+wormhole_request_new(struct wormhole_message_parsed *pmsg)
+{
+	wormhole_request_t *r;
+
+	r = calloc(1, sizeof(*r));
+	r->opcode = pmsg->hdr.opcode;
+	r->version = pmsg->hdr.version;
+	r->xid = pmsg->hdr.xid;
+	r->message = pmsg;
+	r->helper_reply_fd = -1;
+
+	return r;
+}
+
+static struct wormhole_uid_usage *
+wormhole_uid_usage_get(uid_t uid, bool create)
+{
+	struct wormhole_uid_usage *usage;
+
+	for (usage = wormhole_uid_usage_list; usage; usage = usage->next) {
+		if (usage->uid == uid)
+			return usage;
+	}
+
+	if (create) {
+		usage = calloc(1, sizeof(*usage));
+		usage->uid = uid;
+		usage->next = wormhole_uid_usage_list;
+		wormhole_uid_usage_list = usage;
+	}
+
+	return usage;
+}
+
+static bool
+wormhole_request_admit(wormhole_request_t *req)
+{
+	struct wormhole_uid_usage *usage;
+
+	usage = wormhole_uid_usage_get(req->client_uid, true);
+	if (usage->outstanding >= opt_max_requests_per_user)
+		return false;
+
+	usage->outstanding++;
+	req->accounted = true;
+	return true;
+}
+
+static void
+wormhole_request_unaccount(wormhole_request_t *req)
+{
+	struct wormhole_uid_usage *usage;
+
+	if (!req->accounted)
+		return;
+
+	if ((usage = wormhole_uid_usage_get(req->client_uid, false)) != NULL) {
+		assert(usage->outstanding);
+		usage->outstanding--;
+	}
+
+	req->accounted = false;
+}
+
+void
+wormhole_request_free(wormhole_request_t *req)
+{
+	if (req->waiting_for)
+		wormhole_environment_async_cancel_wait(req->waiting_for, req);
+
+	trace_span_end(TRACE_EV_REQUEST, req->xid, req->rejected? "rejected" : NULL);
+
+	/* A helper that is still running will find the request gone */
+	if (req->helper_reply)
+		buf_chain_free(req->helper_reply);
+	if (req->helper_reply_fd >= 0)
+		close(req->helper_reply_fd);
+
+	wormhole_request_unaccount(req);
+	wormhole_message_free_parsed(req->message);
+	memset(req, 0xA5, sizeof(*req));
+	free(req);
+}
+
+void
+wormhole_enqueue_request_incoming(wormhole_request_t *req)
+{
+	/* Append to the tail, so that we process requests in FIFO order */
+	req->next = NULL;
+	*wormhole_request_tail = req;
+	wormhole_request_tail = &req->next;
+}
+
+static bool
+__wormhole_respond(wormhole_request_t *req, struct buf *bp, int fd)
+{
+	wormhole_socket_t *s;
+	bool ok = false;
+
+	s = wormhole_socket_find(req->socket_id);
+	if (s != NULL) {
+		wormhole_message_set_xid(bp, req->xid);
+		wormhole_socket_enqueue(s, bp, fd);
+		ok = true;
+	} else {
+		/* Client disconnected while we were processing the
+		 * request. Pretend we sent the reply. */
+		buf_free(bp);
+		if (fd >= 0)
+			close(fd);
+	}
+
+	req->reply_sent = true;
+	return ok;
+}
+
+static void
+wormhole_respond(wormhole_request_t *req, int status)
+{
+	if (status != WORMHOLE_STATUS_OK)
+		wormhole_daemon_stats.requests_failed++;
+
+	__wormhole_respond(req, wormhole_message_build_status(status), -1);
+}
+
+/*
+ * Called when the environment a request has been waiting for has been
+ * set up (or has failed to set up).
+ */
+static void
+wormhole_namespace_request_wakeup(wormhole_environment_t *env, void *closure)
+{
+	wormhole_request_t *req = closure;
+	wormhole_socket_t *s;
+
+	req->waiting_for = NULL;
+
+	/* Use the environment that was actually set up. Usually, this is the
+	 * same object, but setup contexts are matched by name (eg when the
+	 * config file was reloaded while the setup was running).
+	 * The profile is shared with other requests, so do not touch it. */
+	req->env = env;
+
+	/* If we cannot send the reply right now, leave the request for
+	 * wormhole_process_pending_requests() */
+	s = wormhole_socket_find(req->socket_id);
+	if (s && s->sendbuf == NULL)
 		wormhole_process_request(req);
+}
+
+static void
+wormhole_namespace_request_wait(wormhole_request_t *req, wormhole_environment_t *env)
+{
+	if (wormhole_environment_async_wait(env, wormhole_namespace_request_wakeup, req)) {
+		req->waiting_for = env;
+		req->cold = true;
+	}
+}
+
+/*
+ * Get the namespace fd for the environment this request is being served
+ * from, or for our host namespace if the profile has no environment.
+ */
+static int
+wormhole_request_namespace_fd(const wormhole_request_t *req)
+{
+	wormhole_environment_t *env = req->env;
+	int fd;
+
+	if (env == NULL)
+		return wormhole_profile_namespace_fd(req->profile);
+
+	if (env->failed || env->nsfd < 0)
+		return -1;
+
+	trace("Profile %s: returning namespace fd for environment \"%s\"", req->profile->name, env->name);
+	if ((fd = dup(env->nsfd)) < 0)
+		log_error("Unable to dup() namespace fd: %m");
+	return fd;
+}
+
+static void
+wormhole_process_namespace_request(wormhole_request_t *req)
+{
+	const char *name;
+	wormhole_environment_t *env;
+	wormhole_profile_t *profile;
+	wormhole_socket_t *setup_sock;
+	int nsfd;
+
+	/* Look up the profile only once; requests may be processed several
+	 * times while we wait for the environment to be set up. */
+	if ((profile = req->profile) == NULL) {
+		name = req->message->payload.namespace_request.profile;
+		trace("Processing request for profile \"%s\" from uid %d", name, req->client_uid);
+
+		/* Unprivileged users get an environment that is set up inside
+		 * a user namespace of their own. */
+		profile = wormhole_profile_find_for_user(name, req->client_uid, req->client_gid);
+		if (profile == NULL) {
+			log_error("no profile for %s", name);
+			wormhole_respond(req, WORMHOLE_STATUS_NO_PROFILE);
+			return;
+		}
+
+		req->profile = profile;
+		req->env = profile->environment;
+	}
+
+	env = req->env;
+
+	nsfd = wormhole_request_namespace_fd(req);
+	if (nsfd >= 0) {
+		struct buf *msg;
+
+		if (env == NULL) {
+			msg = wormhole_message_build_namespace_response(WORMHOLE_STATUS_OK, wormhole_profile_command(profile),
+					NULL, NULL, NULL);
+		} else {
+			msg = wormhole_message_build_namespace_response(WORMHOLE_STATUS_OK, wormhole_profile_command(profile),
+					NULL, env->sub_daemon.socket_name, env->root_directory);
+		}
+
+		__wormhole_respond(req, msg, nsfd);
+		log_info("served request for a \"%s\" namespace", profile->name);
+
+		if (env)
+			wormhole_resident_env_touch(env);
+
+		timeutil_histogram_add(req->cold? &wormhole_daemon_stats.latency_cold : &wormhole_daemon_stats.latency_hit,
+				timeutil_monotonic_usec() - req->received);
+		return;
+	}
+
+	if (env == NULL) {
+		/* For profiles that do not reference an environment, the call to
+		 * wormhole_request_namespace_fd() should have returned a valid file
+		 * descriptor, namely an fd for our host namespace.
+		 * If we get here nevertheless, something is very wrong. */
+		log_error("Profile %s: no environment associated", profile->name);
+		wormhole_respond(req, WORMHOLE_STATUS_ERROR);
+		return;
+	}
+
+	/* If the setup command exited with an error status, return a failure indication
+	 * to the client. */
+	if (env->failed) {
+		log_info("request for namespace \"%s\": failed", profile->name);
+		wormhole_respond(req, WORMHOLE_STATUS_ERROR);
+		return;
+	}
+
+	/* Check if an async setup is already in progress */
+	if (wormhole_environment_async_check(env)) {
+		trace("setup for \"%s\" is in process, delaying", env->name);
+		wormhole_namespace_request_wait(req, env);
+		return;
+	}
+
+	/* We'll be called again once the pressure is off */
+	if (!wormhole_setup_may_start()) {
+		if (!req->setup_deferred) {
+			trace("setup for \"%s\" deferred, system under pressure", env->name);
+			wormhole_daemon_stats.setups_deferred++;
+			req->setup_deferred = true;
+		}
+		return;
+	}
+
+	/* The profile setup starts a process in the background,
+	 * connected via a socketpair. When it completes, it passes
+	 * a namespace fd back to the daemon process.
+	 */
+	setup_sock = wormhole_environment_async_setup(env, profile);
+	if (setup_sock == NULL) {
+		log_error("Profile %s: unable to create setup process", profile->name);
+		wormhole_respond(req, WORMHOLE_STATUS_ERROR);
+		env->failed = true;
+	} else {
+		wormhole_install_socket(setup_sock);
+		wormhole_namespace_request_wait(req, env);
+	}
+}
+
+static void
+wormhole_stats_add(struct wormhole_stats_list *list, const char *name, unsigned long long value)
+{
+	struct wormhole_stat *st;
+
+	if ((list->count % 32) == 0)
+		list->data = realloc(list->data, (list->count + 32) * sizeof(list->data[0]));
+
+	st = &list->data[list->count++];
+	st->name = strdup(name);
+	st->value = (value > UINT32_MAX)? UINT32_MAX : value;
+}
+
+static void
+wormhole_stats_add_histogram(struct wormhole_stats_list *list, const char *prefix, const struct timeutil_histogram *h)
+{
+	char namebuf[128];
+	unsigned int i;
+
+	snprintf(namebuf, sizeof(namebuf), "%s.count", prefix);
+	wormhole_stats_add(list, namebuf, h->count);
+	snprintf(namebuf, sizeof(namebuf), "%s.sum_ms", prefix);
+	wormhole_stats_add(list, namebuf, h->sum_usec / 1000);
+
+	for (i = 0; i < TIMEUTIL_HISTOGRAM_BUCKETS; ++i) {
+		snprintf(namebuf, sizeof(namebuf), "%s.%s", prefix, timeutil_histogram_bucket_name(i));
+		wormhole_stats_add(list, namebuf, h->bucket[i]);
+	}
+}
+
+/*
+ * Per environment values are named env.<name>[@<uid>].<what>. We skip
+ * names that do not fit; a truncated one might look like a different
+ * environment's.
+ */
+static void
+wormhole_stats_add_env(struct wormhole_stats_list *list, const wormhole_environment_t *env,
+		const char *what, unsigned long long value)
+{
+	char namebuf[256];
+	int len;
+
+	if (env->owner_uid)
+		len = snprintf(namebuf, sizeof(namebuf), "env.%s@%d.%s", env->name, env->owner_uid, what);
+	else
+		len = snprintf(namebuf, sizeof(namebuf), "env.%s.%s", env->name, what);
+
+	if (len < 0 || len >= sizeof(namebuf)) {
+		trace("Environment name \"%s\" too long, not reporting %s", env->name, what);
+		return;
+	}
+
+	wormhole_stats_add(list, namebuf, value);
+}
+
+static void
+wormhole_stats_destroy(struct wormhole_stats_list *list)
+{
+	unsigned int i;
+
+	for (i = 0; i < list->count; ++i)
+		free(list->data[i].name);
+	free(list->data);
+}
+
+static void
+wormhole_process_stats_request(wormhole_request_t *req)
+{
+	struct wormhole_daemon_stats *ds = &wormhole_daemon_stats;
+	struct wormhole_stats_list list = { 0 };
+	struct wormhole_async_setup_stats setup;
+	struct wormhole_cgroup_stats cg;
+	struct buf_pool_stats pool;
+	struct wormhole_resident_env *r;
+	wormhole_request_t *pending;
+	unsigned int depth = 0;
+	time_t now = wormhole_now();
+	struct buf *msg;
+
+	for (pending = wormhole_request_list; pending; pending = pending->next)
+		depth++;
+
+	wormhole_stats_add(&list, "requests.received", ds->requests_received);
+	wormhole_stats_add(&list, "requests.rejected", ds->requests_rejected);
+	wormhole_stats_add(&list, "requests.failed", ds->requests_failed);
+	wormhole_stats_add(&list, "requests.pending", depth);
+	wormhole_stats_add_histogram(&list, "latency.hit", &ds->latency_hit);
+	wormhole_stats_add_histogram(&list, "latency.cold", &ds->latency_cold);
+
+	wormhole_stats_add(&list, "sockets.active", wormhole_socket_count);
+
+	buf_pool_get_stats(&pool);
+	wormhole_stats_add(&list, "bufpool.hits", pool.hits);
+	wormhole_stats_add(&list, "bufpool.misses", pool.misses);
+	wormhole_stats_add(&list, "bufpool.released", pool.released);
+	wormhole_stats_add(&list, "bufpool.cached", pool.cached);
+
+	wormhole_environment_async_get_stats(&setup);
+	wormhole_stats_add(&list, "setup.started", setup.started);
+	wormhole_stats_add(&list, "setup.failed", setup.failed);
+	wormhole_stats_add(&list, "setup.in_progress", setup.in_progress);
+	wormhole_stats_add(&list, "setup.deferred", ds->setups_deferred);
+	wormhole_stats_add(&list, "setup.workers", setup.workers);
+	wormhole_stats_add(&list, "setup.worker_deaths", setup.worker_deaths);
+	wormhole_stats_add_histogram(&list, "setup.duration", &setup.duration);
+
+	wormhole_stats_add(&list, "envs.resident", wormhole_resident_count);
+	wormhole_stats_add(&list, "envs.evicted", ds->envs_evicted);
+
+	if (wormhole_cgroup_get_stats(NULL, &cg)) {
+		wormhole_stats_add(&list, "pressure.cpu_pct", cg.cpu_pressure);
+		wormhole_stats_add(&list, "pressure.memory_pct", cg.memory_pressure);
+		wormhole_stats_add(&list, "pressure.io_pct", cg.io_pressure);
+	}
+
+	for (r = wormhole_resident_envs; r; r = r->next) {
+		wormhole_environment_t *env = r->env;
+
+		wormhole_stats_add_env(&list, env, "setup_ms", env->setup_usec / 1000);
+		wormhole_stats_add_env(&list, env, "idle_s", now - r->last_used);
+		if (env->cgroup)
+			wormhole_stats_add_env(&list, env, "memory_kb", wormhole_resident_env_memory(env) / 1024);
+	}
+
+	msg = wormhole_message_build_stats_response(WORMHOLE_STATUS_OK, list.data, list.count);
+	wormhole_stats_destroy(&list);
+
+	if (msg == NULL) {
+		log_error("Unable to build stats response");
+		wormhole_respond(req, WORMHOLE_STATUS_ERROR);
+		return;
+	}
+
+	__wormhole_respond(req, msg, -1);
+}
+
+void
+wormhole_process_request(wormhole_request_t *req)
+{
+	if (req->rejected) {
+		wormhole_respond(req, WORMHOLE_STATUS_ERROR);
+		return;
+	}
+
+	switch (req->opcode) {
+	case WORMHOLE_OPCODE_NAMESPACE_REQUEST:
+		if (req->sub_env)
+			wormhole_process_nested_request(req);
+		else
+			wormhole_process_namespace_request(req);
+		break;
+
+	case WORMHOLE_OPCODE_STATS_REQUEST:
+		wormhole_process_stats_request(req);
+		break;
+
+	default:
+		log_error("Unknown opcode %d from uid %d", req->opcode, req->client_uid);
+		wormhole_respond(req, WORMHOLE_STATUS_ERROR);
+		break;
+	}
+}
+
+void
+wormhole_process_pending_requests(void)
+{
+	wormhole_request_t **pos, *req;
+
+	for (pos = &wormhole_request_list; (req = *pos) != NULL; ) {
+		wormhole_socket_t *s;
+
+		/* Answered from a wakeup callback */
+		if (req->reply_sent) {
+			*pos = req->next;
+			wormhole_request_free(req);
+			continue;
+		}
+
+		s = wormhole_socket_find(req->socket_id);
+		if (s == NULL) {
+			/* The client went away, no point in doing anything */
+			trace("Dropping request xid=%u from uid %d: client disconnected",
+					req->xid, req->client_uid);
+			*pos = req->next;
+			wormhole_request_free(req);
+			continue;
+		}
+
+		/* We can queue only one reply per socket at a time. If the client
+		 * sent several requests over the same connection, the others have
+		 * to wait until the previous reply is out.
+		 * Requests waiting for an environment to be set up will be
+		 * completed by wormhole_namespace_request_wakeup(). */
+		if (s->sendbuf == NULL && req->waiting_for == NULL && req->helper_sock_id == 0) {
+			/* See if we can complete the request. */
+			wormhole_process_request(req);
+
+			if (req->reply_sent) {
+				*pos = req->next;
+				wormhole_request_free(req);
+				continue;
+			}
+		}
+
+		/* The request cannot complete yet, eg because its environment
+		 * is still being set up. The transaction ID allows us to reply
+		 * out of order, so just move on to the next one. */
+		pos = &req->next;
+	}
+
+	wormhole_request_tail = pos;
+}
+
+/*
+ * Main daemon side of the sub-daemon
+ */
+static bool
+wormhole_sub_daemon_spawn(void)
+{
+	const char *argv[16];
+	char fdbuf[16];
+	int argc, fd;
+	pid_t pid;
+
+	if (wormhole_sub_daemon.cgroup == NULL && wormhole_cgroup_enabled())
+		wormhole_sub_daemon.cgroup = wormhole_cgroup_create("sub-daemon");
+
+	pid = procutil_fork_with_socket(&fd);
+	if (pid < 0) {
+		log_error("Failed to start sub-daemon process");
+		return false;
+	}
+
+	if (pid > 0) {
+		/* Never block on the sub-daemon, and do not leak the
+		 * control socket to the commands we run. */
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+
+		wormhole_sub_daemon.pid = pid;
+		wormhole_sub_daemon.fd = fd;
+		wormhole_sub_daemon.started = wormhole_now();
+		trace("Started sub-daemon process %d", pid);
+		return true;
+	}
+
+	/* The sub-daemon serves all environments, so it has a cgroup
+	 * of its own. Its helpers join the cgroup of the environment
+	 * they work for. */
+	if (wormhole_sub_daemon.cgroup)
+		wormhole_cgroup_attach(wormhole_sub_daemon.cgroup);
+
+	snprintf(fdbuf, sizeof(fdbuf), "%d", fd);
+
+	argc = 0;
+	argv[argc++] = opt_server_path;
+	argv[argc++] = "--sub-daemon";
+	argv[argc++] = fdbuf;
+	argv[argc++] = "--foreground";
+	argv[argc++] = "--no-config";
+	argv[argc++] = "--no-watch";
+	argv[argc++] = "--runtime";
+	argv[argc++] = opt_runtime;
+	argv[argc] = NULL;
+
+	execv(opt_server_path, (char **) argv);
+	log_error("Failed to start %s: %m", opt_server_path);
+
+	exit(22);
+}
+
+static bool
+wormhole_sub_daemon_send(char op, const char *socket_name, const char *cgroup, int nsfd)
+{
+	char record[WORMHOLE_SUB_DAEMON_RECORD_MAX];
+	int len;
+
+	if (cgroup)
+		len = snprintf(record, sizeof(record), "%c%s\t%s", op, socket_name, cgroup) + 1;
+	else
+		len = snprintf(record, sizeof(record), "%c%s", op, socket_name) + 1;
+	if (len > sizeof(record)) {
+		log_error("Socket name %s too long", socket_name);
+		return false;
+	}
 
-		if (req->reply_sent) {
-			*pos = req->next;
-			wormhole_request_free(req);
+	if (wormhole_socket_sendmsg(wormhole_sub_daemon.fd, record, len, nsfd) != len) {
+		log_error("Unable to talk to sub-daemon: %m");
+		return false;
+	}
+
+	return true;
+}
+
+bool
+wormhole_start_sub_daemon(wormhole_environment_t *env)
+{
+	char namebuf[128];
+
+	snprintf(namebuf, sizeof(namebuf), "@wormhole/%s", env->name);
+
+	if (wormhole_sub_daemon.pid == 0 && !wormhole_sub_daemon_spawn())
+		return false;
+
+	trace("Environment \"%s\": serving nested requests on %s", env->name, namebuf);
+	if (!wormhole_sub_daemon_send('+', namebuf, env->cgroup, env->nsfd))
+		return false;
+
+	strutil_set(&env->sub_daemon.socket_name, namebuf);
+	env->sub_daemon.pid = wormhole_sub_daemon.pid;
+	return true;
+}
+
+static void
+wormhole_stop_sub_daemon(wormhole_environment_t *env)
+{
+	/* If the sub-daemon was restarted since, it does not know this env */
+	if (env->sub_daemon.pid > 0 && env->sub_daemon.pid == wormhole_sub_daemon.pid)
+		wormhole_sub_daemon_send('-', env->sub_daemon.socket_name, NULL, -1);
+
+	env->sub_daemon.pid = 0;
+	strutil_set(&env->sub_daemon.socket_name, NULL);
+}
+
+/*
+ * The sub-daemon died. Start a new one and hand it all resident
+ * environments again, unless it did not even survive its first seconds.
+ */
+static void
+wormhole_sub_daemon_exited(int status)
+{
+	struct wormhole_resident_env *r;
+	bool restart;
+
+	restart = (wormhole_now() - wormhole_sub_daemon.started >= WORMHOLE_SUB_DAEMON_MIN_LIFETIME);
+	log_warning("Sub-daemon process %d %s%s", wormhole_sub_daemon.pid,
+			procutil_child_status_describe(status),
+			restart? ", restarting" : "");
+
+	close(wormhole_sub_daemon.fd);
+	wormhole_sub_daemon.fd = -1;
+	wormhole_sub_daemon.pid = 0;
+
+	for (r = wormhole_resident_envs; r; r = r->next) {
+		wormhole_environment_t *env = r->env;
+
+		if (env->sub_daemon.pid == 0)
 			continue;
+
+		env->sub_daemon.pid = 0;
+		strutil_set(&env->sub_daemon.socket_name, NULL);
+
+		if (restart && !wormhole_start_sub_daemon(env))
+			restart = false;
+	}
+}
+
+/*
+ * Sub-daemon side
+ */
+static struct wormhole_sub_env *
+wormhole_sub_env_find(const char *socket_name)
+{
+	struct wormhole_sub_env *sub;
+
+	for (sub = wormhole_sub_envs; sub; sub = sub->next) {
+		if (!strcmp(sub->socket_name, socket_name))
+			return sub;
+	}
+	return NULL;
+}
+
+static struct wormhole_sub_env *
+wormhole_sub_env_for_socket(const wormhole_socket_t *s)
+{
+	struct wormhole_sub_env *sub;
+
+	for (sub = wormhole_sub_envs; sub; sub = sub->next) {
+		if (s->app_ops == &sub->app_ops)
+			return sub;
+	}
+	return NULL;
+}
+
+static char **
+wormhole_nested_cache_copy_vars(char **vars)
+{
+	unsigned int i, count = 0;
+	char **result;
+
+	while (vars && vars[count])
+		count++;
+
+	result = calloc(count + 1, sizeof(result[0]));
+	for (i = 0; i < count; ++i)
+		result[i] = strdup(vars[i]);
+	return result;
+}
+
+static struct wormhole_nested_cache *
+wormhole_nested_cache_find(const struct wormhole_sub_env *sub, const char *profile, uid_t uid, gid_t gid)
+{
+	struct wormhole_nested_cache *c;
+
+	for (c = sub->cache; c; c = c->next) {
+		if (c->uid == uid && c->gid == gid && !strcmp(c->profile, profile))
+			return c;
+	}
+	return NULL;
+}
+
+static void
+wormhole_nested_cache_add(struct wormhole_sub_env *sub, const wormhole_request_t *req,
+			const struct wormhole_message_namespace_response *msg, int nsfd)
+{
+	const char *profile = req->message->payload.namespace_request.profile;
+	struct wormhole_nested_cache *c;
+
+	if (wormhole_nested_cache_find(sub, profile, req->client_uid, req->client_gid))
+		return;
+
+	c = calloc(1, sizeof(*c));
+	c->profile = strdup(profile);
+	c->uid = req->client_uid;
+	c->gid = req->client_gid;
+	strutil_set(&c->command, msg->command);
+	strutil_set(&c->server_socket, msg->server_socket);
+	strutil_set(&c->root_directory, msg->root_directory);
+	c->environment_vars = wormhole_nested_cache_copy_vars(msg->environment_vars);
+	c->nsfd = nsfd;
+
+	c->next = sub->cache;
+	sub->cache = c;
+}
+
+static void
+wormhole_nested_cache_flush(struct wormhole_sub_env *sub)
+{
+	struct wormhole_nested_cache *c;
+	unsigned int i;
+
+	while ((c = sub->cache) != NULL) {
+		sub->cache = c->next;
+
+		close(c->nsfd);
+		for (i = 0; c->environment_vars[i]; ++i)
+			free(c->environment_vars[i]);
+		free(c->environment_vars);
+		strutil_set(&c->profile, NULL);
+		strutil_set(&c->command, NULL);
+		strutil_set(&c->server_socket, NULL);
+		strutil_set(&c->root_directory, NULL);
+		free(c);
+	}
+}
+
+/*
+ * Start serving an environment, or update its nsfd. This consumes the fd.
+ */
+static bool
+wormhole_sub_env_add(const char *socket_name, struct wormhole_sub_env *parent, const char *cgroup, int nsfd)
+{
+	struct wormhole_sub_env *sub;
+	wormhole_socket_t *s;
+
+	if (!(sub = wormhole_sub_env_find(socket_name))) {
+		sub = calloc(1, sizeof(*sub));
+		sub->socket_name = strdup(socket_name);
+		sub->nsfd = -1;
+		sub->app_ops.new_socket = wormhole_install_socket;
+		sub->app_ops.received = wormhole_message_consume;
+
+		sub->next = wormhole_sub_envs;
+		wormhole_sub_envs = sub;
+	}
+
+	/* Whatever we set up inside the old namespace is gone */
+	wormhole_nested_cache_flush(sub);
+
+	if (sub->nsfd >= 0)
+		close(sub->nsfd);
+	sub->nsfd = nsfd;
+	sub->parent = parent;
+	strutil_set(&sub->cgroup, cgroup);
+
+	if (sub->sock_id == 0 || wormhole_socket_find(sub->sock_id) == NULL) {
+		if (!(s = wormhole_listen(socket_name, &sub->app_ops))) {
+			log_error("Cannot set up server socket %s", socket_name);
+			close(sub->nsfd);
+			sub->nsfd = -1;
+			return false;
 		}
 
-		/* This is not a good idea. The protocol currently isn't able
-		 * to deal with out of order responses for lack of a
-		 * transaction ID. What's worse, we run into DoS problems
-		 * if we let users do this. */
-#ifdef bad_idea
-		pos = &req->next;
-#else
-		break;
-#endif
+		wormhole_install_socket(s);
+		sub->sock_id = s->id;
 	}
+
+	trace("Serving environment socket %s", socket_name);
+	return true;
 }
 
-/* We should encapsulate the setns stuff somewhere */
-#include <sched.h>
+/*
+ * Stop serving an environment, and any environments nested inside it.
+ * We keep the object around, as connections accepted earlier still
+ * refer to it; their requests will fail.
+ */
+static void
+wormhole_sub_env_drop(struct wormhole_sub_env *sub)
+{
+	struct wormhole_sub_env *child;
+	wormhole_socket_t *s;
 
-bool
-wormhole_start_sub_daemon(wormhole_environment_t *env)
+	trace("No longer serving environment socket %s", sub->socket_name);
+	wormhole_nested_cache_flush(sub);
+	if (sub->nsfd >= 0)
+		close(sub->nsfd);
+	sub->nsfd = -1;
+
+	if (sub->sock_id && (s = wormhole_socket_find(sub->sock_id)) != NULL)
+		wormhole_socket_free(s);
+	sub->sock_id = 0;
+
+	for (child = wormhole_sub_envs; child; child = child->next) {
+		if (child->parent == sub) {
+			child->parent = NULL;
+			wormhole_sub_env_drop(child);
+		}
+	}
+}
+
+/*
+ * Records from the main daemon. Several of them may arrive in one go,
+ * but the kernel never merges two messages that carry a file descriptor.
+ */
+static bool
+wormhole_sub_daemon_control(wormhole_socket_t *s, struct buf *bp, int fd)
 {
-	const char *argv[16];
-	int argc;
-	char namebuf[128];
+	char record[WORMHOLE_SUB_DAEMON_RECORD_MAX];
+	struct wormhole_sub_env *sub;
+	bool consumed = false;
+	unsigned long len;
+	char *end, *cgroup;
+
+	while ((len = buf_get(bp, record, sizeof(record))) != 0) {
+		if ((end = memchr(record, '\0', len)) == NULL) {
+			if (len == sizeof(record)) {
+				log_error("%s: bad record from main daemon", __func__);
+				wormhole_socket_fail(s);
+			}
+			break;
+		}
+
+		buf_chain_advance(bp, end - record + 1);
+		consumed = true;
+
+		switch (record[0]) {
+		case '+':
+			if (fd < 0) {
+				log_error("%s: no namespace fd for %s", __func__, record + 1);
+				break;
+			}
+
+			if ((cgroup = strchr(record, '\t')) != NULL)
+				*cgroup++ = '\0';
+
+			/* Our caller closes the fd it passed us */
+			wormhole_sub_env_add(record + 1, NULL, cgroup, dup(fd));
+			fd = -1;
+			break;
+
+		case '-':
+			if ((sub = wormhole_sub_env_find(record + 1)) != NULL)
+				wormhole_sub_env_drop(sub);
+			break;
+
+		default:
+			log_error("%s: bad record from main daemon", __func__);
+		}
+	}
+
+	return consumed;
+}
+
+static wormhole_request_t *
+wormhole_request_for_helper(pid_t pid, unsigned int sock_id)
+{
+	wormhole_request_t *req;
+
+	for (req = wormhole_request_list; req; req = req->next) {
+		if (pid && req->helper_pid == pid)
+			return req;
+		if (sock_id && req->helper_sock_id == sock_id)
+			return req;
+	}
+	return NULL;
+}
+
+/*
+ * The helper sends us a complete namespace response, with the nsfd to
+ * pass on to the client. If the response names a socket for nested
+ * requests, we serve that environment, too.
+ */
+static bool
+wormhole_nested_response_received(wormhole_socket_t *s, struct buf *bp, int fd)
+{
+	struct wormhole_message_namespace_response *msg;
+	struct wormhole_message_parsed *pmsg;
+	wormhole_request_t *req;
+	wormhole_socket_t *client;
+
+	if (!wormhole_message_complete(bp))
+		return false;
+
+	pmsg = wormhole_message_parse(bp, 0);
+
+	req = wormhole_request_for_helper(0, s->id);
+	if (req == NULL) {
+		/* The client went away, or the helper was declared dead */
+		goto out;
+	}
+
+	req->helper_sock_id = 0;
+	if (pmsg == NULL || pmsg->hdr.opcode != WORMHOLE_OPCODE_NAMESPACE_RESPONSE
+	 || pmsg->payload.namespace_response.status != WORMHOLE_STATUS_OK || fd < 0) {
+		req->helper_failed = true;
+	} else {
+		msg = &pmsg->payload.namespace_response;
+
+		if (msg->server_socket && req->sub_env->nsfd >= 0)
+			wormhole_sub_env_add(msg->server_socket, req->sub_env, req->sub_env->cgroup, dup(fd));
+
+		/* Unless the environment was dropped in the meantime */
+		if (req->sub_env->nsfd >= 0)
+			wormhole_nested_cache_add(req->sub_env, req, msg, dup(fd));
+
+		req->helper_reply = wormhole_message_build_namespace_response(WORMHOLE_STATUS_OK,
+				msg->command, (const char **) msg->environment_vars,
+				msg->server_socket, msg->root_directory);
+		req->helper_reply_fd = dup(fd);
+	}
+
+	/* If we cannot send the reply right now, leave the request for
+	 * wormhole_process_pending_requests() */
+	client = wormhole_socket_find(req->socket_id);
+	if (client && client->sendbuf == NULL)
+		wormhole_process_request(req);
+
+out:
+	if (pmsg)
+		wormhole_message_free_parsed(pmsg);
+	return true;
+}
+
+/*
+ * Runs in the helper process: join the client's environment, look up
+ * the profile there, and set up the nested environment, if there is one.
+ */
+static void
+wormhole_nested_helper(wormhole_request_t *req, int sock_fd)
+{
+	const char *name = req->message->payload.namespace_request.profile;
+	wormhole_environment_t *env;
+	wormhole_profile_t *profile;
+	char namebuf[128], *socket_name = NULL;
+	struct buf *msg;
+	int nsfd;
+
+	/* Nested environments are accounted to the outermost one */
+	if (req->sub_env->cgroup)
+		wormhole_cgroup_attach(req->sub_env->cgroup);
+
+	if (setns(req->sub_env->nsfd, CLONE_NEWNS) < 0)
+		log_fatal("setns: %m");
+
+	if (!(profile = wormhole_profile_find_for_user(name, req->client_uid, req->client_gid)))
+		log_fatal("no profile for %s", name);
+
+	if ((env = profile->environment) != NULL) {
+		bool userns = false;
+
+		/* Same as the async setup code */
+		if (env->owner_uid != 0) {
+			if (!procutil_drop_privileges(env->owner_uid, env->owner_gid))
+				log_fatal("Failed to set up environment for %s", profile->name);
+			userns = true;
+		} else {
+			snprintf(namebuf, sizeof(namebuf), "@wormhole/%s", env->name);
+			socket_name = namebuf;
+		}
+
+		if (wormhole_profile_setup(profile, userns) < 0)
+			log_fatal("Failed to set up environment for %s", profile->name);
+	}
+
+	nsfd = open("/proc/self/ns/mnt", O_RDONLY);
+	if (nsfd < 0)
+		log_fatal("Cannot open /proc/self/ns/mnt: %m");
+
+	msg = wormhole_message_build_namespace_response(WORMHOLE_STATUS_OK, wormhole_profile_command(profile),
+			NULL, socket_name, env? env->root_directory : NULL);
+	if (msg == NULL)
+		log_fatal("Unable to build namespace response");
+
+	while (msg) {
+		if (wormhole_socket_send_chain(sock_fd, &msg, nsfd) < 0)
+			log_fatal("Unable to send namespace response: %m");
+		nsfd = -1;
+	}
+
+	exit(0);
+}
+
+static void
+wormhole_process_nested_request(wormhole_request_t *req)
+{
+	static struct wormhole_app_ops helper_ops = {
+		.received = wormhole_nested_response_received,
+	};
+	const char *name = req->message->payload.namespace_request.profile;
+	struct wormhole_nested_cache *c;
+	wormhole_socket_t *sock;
+	int sock_fd;
 	pid_t pid;
 
-	snprintf(namebuf, sizeof(namebuf), "@wormhole/%s", env->name);
-	env->sub_daemon.socket_name = strdup(namebuf);
+	if (req->helper_reply) {
+		__wormhole_respond(req, req->helper_reply, req->helper_reply_fd);
+		req->helper_reply = NULL;
+		req->helper_reply_fd = -1;
+		log_info("served nested request for \"%s\"", name);
+		return;
+	}
+
+	if (req->helper_failed || req->sub_env->nsfd < 0) {
+		wormhole_respond(req, WORMHOLE_STATUS_ERROR);
+		return;
+	}
+
+	if ((c = wormhole_nested_cache_find(req->sub_env, name, req->client_uid, req->client_gid)) != NULL) {
+		struct buf *msg;
+
+		msg = wormhole_message_build_namespace_response(WORMHOLE_STATUS_OK, c->command,
+				(const char **) c->environment_vars, c->server_socket, c->root_directory);
+		if (msg == NULL) {
+			wormhole_respond(req, WORMHOLE_STATUS_ERROR);
+			return;
+		}
 
-	trace("Starting daemon process %s", namebuf);
+		__wormhole_respond(req, msg, dup(c->nsfd));
+		log_info("served nested request for \"%s\" from cache", name);
+		return;
+	}
 
-	pid = fork();
+	pid = procutil_fork_with_socket(&sock_fd);
 	if (pid < 0) {
-		log_error("Failed to start daemon process %s: fork: %m", namebuf);
-		return false;
+		wormhole_respond(req, WORMHOLE_STATUS_ERROR);
+		return;
 	}
 
-	if (pid > 0) {
-		env->sub_daemon.pid = pid;
-		return true;
+	if (pid == 0)
+		wormhole_nested_helper(req, sock_fd);
+
+	if (!(sock = wormhole_connected_socket_new(sock_fd, 0, 0))) {
+		/* The helper will fail to send its response */
+		close(sock_fd);
+		req->helper_failed = true;
+		return;
 	}
 
-	/* Change to the namespace */
-	if (setns(env->nsfd, CLONE_NEWNS) < 0) {
-                log_error("setns: %m");
-                exit(2);
-        }
+	sock->app_ops = &helper_ops;
+	wormhole_install_socket(sock);
 
-	/* FIXME: we should probably create a separate cgroup for
-	 * each wormhole environment. This would help with a clean
-	 * shutdown. */
+	req->helper_pid = pid;
+	req->helper_sock_id = sock->id;
+	req->cold = true;
+}
 
-	argc = 0;
-	argv[argc++] = opt_server_path;
-	argv[argc++] = "--name";
-	argv[argc++] = namebuf;
-	argv[argc++] = "--foreground";
-	argv[argc++] = "--no-config";
-	argv[argc++] = "--runtime";
-	argv[argc++] = opt_runtime;
-	argv[argc] = NULL;
+static void
+wormhole_reap_helpers(void)
+{
+	wormhole_request_t *req;
+	pid_t pid;
+	int st;
 
-	execv(opt_server_path, (char **) argv);
-	log_error("Failed to start %s: %m", opt_server_path);
+	while ((pid = procutil_get_exited_child(&st)) > 0) {
+		if (!(req = wormhole_request_for_helper(pid, 0)))
+			continue;
 
-	exit(22);
+		req->helper_pid = 0;
+
+		/* A helper that succeeded has sent its response before exiting,
+		 * even if we have not seen it yet. */
+		if (!procutil_child_status_okay(st) && req->helper_sock_id) {
+			log_error("Helper for request xid=%u %s", req->xid, procutil_child_status_describe(st));
+			req->helper_sock_id = 0;
+			req->helper_failed = true;
+		}
+	}
+}
+
+/*
+ * wormholed --sub-daemon <fd>: serve the environments the main daemon
+ * hands us until it goes away.
+ */
+static int
+wormhole_sub_daemon_main(int control_fd)
+{
+	static struct wormhole_app_ops control_ops = {
+		.received = wormhole_sub_daemon_control,
+	};
+	wormhole_socket_t *control_sock;
+	unsigned int control_id;
+
+	if (!(control_sock = wormhole_connected_socket_new(control_fd, 0, 0)))
+		return 1;
+	control_sock->app_ops = &control_ops;
+	wormhole_install_socket(control_sock);
+	control_id = control_sock->id;
+
+	procutil_install_sigchild_handler();
+	signal(SIGPIPE, SIG_IGN);
+
+	while (wormhole_socket_find(control_id) != NULL) {
+		wormhole_reap_helpers();
+		wormhole_process_pending_requests();
+
+		wormhole_sockets_poll(-1);
+	}
+
+	trace("Main daemon went away, exiting");
+	return 0;
+}
+
+/*
+ * wormholed --stats: ask the running daemon for its statistics
+ */
+static bool
+wormhole_print_stats(struct wormhole_message_stats_response *msg, void *closure)
+{
+	unsigned int i;
+
+	for (i = 0; i < msg->count; ++i)
+		printf("%-40s %u\n", msg->stats[i].name, msg->stats[i].value);
+	return true;
+}
+
+static int
+wormhole_show_stats(const char *socket_path)
+{
+	switch (wormhole_client_stats_request(socket_path, wormhole_print_stats, NULL)) {
+	case WORMHOLE_CLIENT_OK:
+		return 0;
+
+	case WORMHOLE_CLIENT_UNAVAILABLE:
+		log_error("Unable to connect to wormhole daemon at %s", socket_path);
+		break;
+	}
+
+	return 1;
 }